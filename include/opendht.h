@@ -19,6 +19,7 @@
 #pragma once
 
 #include "opendht/dhtrunner.h"
+#include "opendht/sharded_dhtrunner.h"
 #ifdef OPENDHT_PROXY_SERVER
 #include "opendht/dht_proxy_server.h"
 #endif
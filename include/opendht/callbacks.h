@@ -24,6 +24,7 @@
 #include "value.h"
 
 #include <vector>
+#include <map>
 #include <memory>
 #include <functional>
 
@@ -50,6 +51,15 @@ struct OPENDHT_PUBLIC NodeStats {
              cached_nodes {0},
              incoming_nodes {0};
     unsigned table_depth {0};
+    unsigned tx_queue {0},
+             tx_queue_peak {0};
+    /* Smoothed round-trip time of the nodes having an estimation, in ms */
+    unsigned rtt_nodes {0},
+             rtt_min {0},
+             rtt_median {0},
+             rtt_p90 {0},
+             rtt_max {0},
+             rttvar_median {0};
     unsigned getKnownNodes() const { return good_nodes + dubious_nodes; }
     unsigned long getNetworkSizeEstimation() const { return 8 * std::exp2(table_depth); }
     std::string toString() const;
@@ -63,7 +73,8 @@ struct OPENDHT_PUBLIC NodeStats {
     explicit NodeStats(const Json::Value& v);
 #endif
 
-    MSGPACK_DEFINE_MAP(good_nodes, dubious_nodes, cached_nodes, incoming_nodes, table_depth)
+    MSGPACK_DEFINE_MAP(good_nodes, dubious_nodes, cached_nodes, incoming_nodes, table_depth, tx_queue, tx_queue_peak,
+                       rtt_nodes, rtt_min, rtt_median, rtt_p90, rtt_max, rttvar_median)
 };
 
 struct OPENDHT_PUBLIC NodeInfo {
@@ -84,6 +95,96 @@ struct OPENDHT_PUBLIC NodeInfo {
     MSGPACK_DEFINE_MAP(id, node_id, ipv4, ipv6)
 };
 
+/**
+ * Traffic of a message type: requests sent and received, their replies,
+ * and the latency of our requests, from the first attempt to the reply.
+ */
+struct OPENDHT_PUBLIC MessageTypeStats {
+    uint64_t requests_in {0},
+             replies_in {0},
+             errors_in {0},
+             bytes_in {0};
+    uint64_t requests_out {0},
+             retransmits {0},
+             replies_out {0},
+             bytes_out {0};
+    /* Incoming messages dropped by the rate limiter */
+    uint64_t rate_limited {0};
+    /* Requests expired without reply */
+    uint64_t timeouts {0};
+    /* Latency in microseconds, estimated from latency_histogram */
+    uint64_t latency_count {0},
+             latency_p50 {0},
+             latency_p90 {0},
+             latency_p99 {0},
+             latency_max {0};
+    /* Non-empty histogram buckets: {highest latency of the bucket in us -> count} */
+    std::map<uint64_t, uint64_t> latency_histogram {};
+
+    /** Add the traffic of other, computing the latency percentiles again */
+    void add(const MessageTypeStats& other);
+    /** Compute the latency percentiles from the histogram */
+    void updateLatency();
+
+#ifdef OPENDHT_JSONCPP
+    Json::Value toJson() const;
+    MessageTypeStats() {};
+    explicit MessageTypeStats(const Json::Value& v);
+#endif
+
+    MSGPACK_DEFINE_MAP(requests_in, replies_in, errors_in, bytes_in,
+                       requests_out, retransmits, replies_out, bytes_out,
+                       rate_limited, timeouts,
+                       latency_count, latency_p50, latency_p90, latency_p99, latency_max, latency_histogram)
+};
+
+/**
+ * Traffic of the node since it started, by message type ("ping", "get"...).
+ */
+struct OPENDHT_PUBLIC TrafficStats {
+    std::map<std::string, MessageTypeStats> messages {};
+
+    void add(const TrafficStats& other);
+    std::string toString() const;
+
+#ifdef OPENDHT_JSONCPP
+    Json::Value toJson() const;
+    TrafficStats() {};
+    explicit TrafficStats(const Json::Value& v);
+#endif
+
+    MSGPACK_DEFINE_MAP(messages)
+};
+
+static constexpr size_t DEFAULT_MAX_REQ_PER_SEC {1600};
+
+/**
+ * How a search walks the nodes close to its target.
+ *
+ * With alpha 0 (default), a search keeps up to 4 'get' requests in flight
+ * among the 14 nodes of the search. Otherwise, alpha requests are kept in
+ * flight, plus one for each request that timed out once and is still
+ * awaiting a retry, up to max_alpha.
+ */
+struct OPENDHT_PUBLIC LookupOptions {
+    /** Number of concurrent requests, 0 for the default lookup */
+    unsigned alpha {0};
+
+    /** Max. number of concurrent requests when peers time out, 0 for 2*alpha */
+    unsigned max_alpha {0};
+
+    /**
+     * Only query the 8 closest nodes not known to be unreachable, so that
+     * the lookup completes as soon as they replied.
+     */
+    bool early_termination {true};
+
+    /** Max. number of concurrent requests */
+    unsigned maxRequests() const {
+        return std::max(alpha, max_alpha ? max_alpha : 2 * alpha);
+    }
+};
+
 /**
  * Dht configuration.
  */
@@ -106,6 +207,39 @@ struct OPENDHT_PUBLIC Config {
 
     /** If set, the dht will load its state from this file on start and save its state in this file on shutdown */
     std::string persist_path {};
+
+    /**
+     * Outgoing datagrams are queued and sent in batches of up to this size
+     * (sendmmsg), at the latest at the end of each periodic() call without
+     * a packet. 0 or 1 sends every datagram immediately.
+     */
+    unsigned tx_batch_size {0};
+
+    /** Max. time an outgoing datagram can wait in the transmit queue */
+    duration tx_max_delay {std::chrono::milliseconds(10)};
+
+    /**
+     * Max. number of requests per second accepted from all peers, and from
+     * a single IP address. 0 disables the limit.
+     */
+    size_t max_req_per_sec {DEFAULT_MAX_REQ_PER_SEC};
+    size_t max_peer_req_per_sec {DEFAULT_MAX_REQ_PER_SEC / 8};
+
+    /**
+     * Use a compact message encoding, with integer keys, with peers
+     * supporting it. Negotiated per peer through the user agent.
+     */
+    bool compact_encoding {false};
+
+    /** Default lookup options of searches, see LookupOptions */
+    LookupOptions lookup {};
+
+    /**
+     * Index, from 1, of this node among nodes sharing the same socket,
+     * tagging its transaction ids so that replies can be routed to it.
+     * 0 if the socket is not shared.
+     */
+    uint8_t shard {0};
 };
 
 /**
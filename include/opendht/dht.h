@@ -123,6 +123,7 @@ public:
     time_point periodic(const uint8_t *buf, size_t buflen, const sockaddr* from, socklen_t fromlen) override {
         return periodic(buf, buflen, SockAddr(from, fromlen));
     }
+    time_point periodic(net::DecodedPacket&& pkt) override;
 
     /**
      * Get a value by searching on all available protocols (IPv4, IPv6),
@@ -144,6 +145,11 @@ public:
     virtual void get(const InfoHash& key, GetCallbackSimple cb, DoneCallbackSimple donecb, Value::Filter&& f={}, Where&& w = {}) override {
         get(key, bindGetCb(cb), bindDoneCb(donecb), std::forward<Value::Filter>(f), std::forward<Where>(w));
     }
+    /**
+     * Same as get, walking the network with the provided lookup options
+     * instead of Config::lookup.
+     */
+    void get(const InfoHash& key, GetCallback cb, DoneCallback donecb, Value::Filter&& f, Where&& w, const LookupOptions& lookup);
     /**
      * Similar to Dht::get, but sends a Query to filter data remotely.
      * @param key the key for which to query data for.
@@ -241,6 +247,11 @@ public:
     size_t listen(const InfoHash& key, GetCallbackSimple cb, Value::Filter f={}, Where w={}) override {
         return listen(key, bindGetCb(cb), std::forward<Value::Filter>(f), std::forward<Where>(w));
     }
+    /**
+     * Same as listen, walking the network with the provided lookup options
+     * instead of Config::lookup.
+     */
+    size_t listen(const InfoHash&, ValueCallback, Value::Filter, Where, const LookupOptions& lookup);
 
     bool cancelListen(const InfoHash&, size_t token) override;
 
@@ -281,6 +292,9 @@ public:
     std::vector<unsigned> getNodeMessageStats(bool in = false) override {
         return network_engine.getNodeMessageStats(in);
     }
+    TrafficStats getTrafficStats() const override {
+        return network_engine.getTrafficStats();
+    }
 
     /**
      * Set the in-memory storage limit in bytes
@@ -289,6 +303,10 @@ public:
         max_store_size = limit;
     }
 
+    void setRateLimit(size_t max_req_per_sec, size_t max_peer_req_per_sec) override {
+        network_engine.setRateLimit(max_req_per_sec, max_peer_req_per_sec);
+    }
+
     /**
      * Returns the total memory usage of stored values and the number
      * of stored values.
@@ -322,6 +340,13 @@ private:
     /* Concurrent search nodes requested count */
     static constexpr unsigned MAX_REQUESTED_SEARCH_NODES {4};
 
+    /* Number of closest candidate nodes among which the one expected to
+     * reply first is queried */
+    static constexpr unsigned SEARCH_RTT_CANDIDATES {3};
+
+    /* Maximum number of nodes pinged at once to refresh a bucket */
+    static constexpr unsigned BUCKET_REFRESH_PINGS {4};
+
     /* Number of listening nodes */
     static constexpr unsigned LISTEN_NODES {4};
 
@@ -403,6 +428,7 @@ private:
     //       be put in bootstrap mode.
     const bool is_bootstrap {false};
     const bool maintain_storage {false};
+    const LookupOptions lookup_options {};
 
     void rotateSecrets();
 
@@ -461,11 +487,24 @@ private:
     /**
      * Low-level method that will perform a search on the DHT for the specified
      * infohash (id), using the specified IP version (IPv4 or IPv6).
+     *
+     * An existing search keeps its lookup options unless new ones are
+     * provided. A new search uses Config::lookup by default.
+     */
+    Sp<Search> search(const InfoHash& id, sa_family_t af, GetCallback = {}, QueryCallback = {}, DoneCallback = {}, Value::Filter = {},
+            const Sp<Query>& q = {}, const LookupOptions* lookup = nullptr);
+
+    /**
+     * Common implementation of get and listen: lookup is null for the
+     * operations which don't provide lookup options.
      */
-    Sp<Search> search(const InfoHash& id, sa_family_t af, GetCallback = {}, QueryCallback = {}, DoneCallback = {}, Value::Filter = {}, const Sp<Query>& q = {});
+    void startGet(const InfoHash& id, GetCallback cb, DoneCallback donecb, Value::Filter&& f, Where&& w,
+            const LookupOptions* lookup);
+    size_t startListen(const InfoHash& id, ValueCallback cb, Value::Filter f, Where w, const LookupOptions* lookup);
 
     void announce(const InfoHash& id, sa_family_t af, Sp<Value> value, DoneCallback callback, time_point created=time_point::max(), bool permanent = false);
-    size_t listenTo(const InfoHash& id, sa_family_t af, ValueCallback cb, Value::Filter f = {}, const Sp<Query>& q = {});
+    size_t listenTo(const InfoHash& id, sa_family_t af, ValueCallback cb, Value::Filter f = {}, const Sp<Query>& q = {},
+            const LookupOptions* lookup = nullptr);
 
     /**
      * Refill the search with good nodes if possible.
@@ -25,6 +25,7 @@ namespace dht {
 
 namespace net {
     class DatagramSocket;
+    struct DecodedPacket;
 }
 
 class OPENDHT_PUBLIC DhtInterface {
@@ -80,6 +81,15 @@ public:
 
     virtual time_point periodic(const uint8_t *buf, size_t buflen, SockAddr) = 0;
     virtual time_point periodic(const uint8_t *buf, size_t buflen, const sockaddr* from, socklen_t fromlen) = 0;
+    /**
+     * Same as periodic(buf, buflen, from) for a packet already decoded
+     * with net::NetworkEngine::decode.
+     * By default the packet is ignored: implementations which don't
+     * override this can't be used with DhtRunner::Config::decode_threads.
+     */
+    virtual time_point periodic(net::DecodedPacket&&) {
+        return periodic(nullptr, 0, SockAddr{});
+    }
 
     /**
      * Get a value by searching on all available protocols (IPv4, IPv6),
@@ -203,12 +213,21 @@ public:
 
     virtual void dumpTables() const = 0;
     virtual std::vector<unsigned> getNodeMessageStats(bool in = false) = 0;
+    /** Traffic by message type. Empty by default. */
+    virtual TrafficStats getTrafficStats() const { return {}; }
 
     /**
      * Set the in-memory storage limit in bytes
      */
     virtual void setStorageLimit(size_t limit = DEFAULT_STORAGE_LIMIT) = 0;
 
+    /**
+     * Set the max. number of requests per second accepted from all peers,
+     * and from a single IP address. 0 disables the limit.
+     * Does nothing by default.
+     */
+    virtual void setRateLimit(size_t /*max_req_per_sec*/, size_t /*max_peer_req_per_sec*/) {}
+
     /**
      * Returns the total memory usage of stored values and the number
      * of stored values.
@@ -201,6 +201,7 @@ public:
     time_point periodic(const uint8_t* buf, size_t buflen, const sockaddr* from, socklen_t fromlen) override {
         return periodic(buf, buflen, SockAddr(from, fromlen));
     }
+    using DhtInterface::periodic;
 
     /**
      * Similar to Dht::get, but sends a Query to filter data remotely.
@@ -262,7 +263,9 @@ public:
     std::string getSearchLog(const InfoHash&, sa_family_t) const override { return {}; }
     void dumpTables() const override {}
     std::vector<unsigned> getNodeMessageStats(bool) override { return {}; }
+    TrafficStats getTrafficStats() const override { return {}; }
     void setStorageLimit(size_t) override {}
+    void setRateLimit(size_t, size_t) override {}
     void connectivityChanged(sa_family_t) override {
         restartListeners();
     }
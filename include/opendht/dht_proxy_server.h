@@ -96,6 +96,8 @@ public:
         double requestRate;
         /** Node Info **/
         NodeInfo nodeInfo;
+        /** Traffic of the node by message type */
+        TrafficStats traffic;
 
         std::string toString() const {
             std::ostringstream ss;
@@ -124,6 +126,7 @@ public:
             result["pushListenersCount"] = static_cast<Json::UInt64>(pushListenersCount);
             result["requestRate"] = requestRate;
             result["nodeInfo"] = nodeInfo.toJson();
+            result["traffic"] = traffic.toJson();
             return result;
         }
 #endif
@@ -332,6 +335,7 @@ private:
     mutable std::mutex statsMutex_;
     mutable ServerStats stats_;
     mutable NodeInfo nodeInfo_ {};
+    mutable TrafficStats traffic_ {};
     std::unique_ptr<asio::steady_timer> printStatsTimer_;
 
     // Thread-safe access to listeners map.
@@ -27,6 +27,7 @@
 #include "sockaddr.h"
 #include "log_enable.h"
 #include "network_utils.h"
+#include "mpsc_queue.h"
 
 #include <thread>
 #include <mutex>
@@ -39,6 +40,12 @@
 
 namespace dht {
 
+namespace net {
+struct DecodedPacket;
+}
+class ThreadPool;
+class Executor;
+
 struct Node;
 class SecureDht;
 class PeerDiscovery;
@@ -65,6 +72,17 @@ public:
         bool peer_publish {false};
         std::shared_ptr<dht::crypto::Certificate> server_ca;
         dht::crypto::Identity client_identity;
+        /**
+         * Max. number of datagrams read by the default socket with a single
+         * system call (recvmmsg). 0 disables batching.
+         */
+        unsigned rx_batch {0};
+        /**
+         * Number of threads decoding received packets, which are then only
+         * applied by the dht thread. Order is kept for each source address.
+         * 0 decodes packets on the dht thread.
+         */
+        unsigned decode_threads {0};
     };
 
     struct Context {
@@ -324,6 +342,12 @@ public:
 
     void setStorageLimit(size_t limit = DEFAULT_STORAGE_LIMIT);
 
+    /**
+     * Set the max. number of requests per second accepted from all peers,
+     * and from a single IP address. 0 disables the limit.
+     */
+    void setRateLimit(size_t max_req_per_sec, size_t max_peer_req_per_sec);
+
     std::vector<NodeExport> exportNodes() const;
 
     std::vector<ValuesExport> exportValues() const;
@@ -345,10 +369,17 @@ public:
     }
 
     NodeStats getNodesStats(sa_family_t af) const;
+
+    /** Occupancy and exhaustion counters of the receive buffer pool */
+    net::PacketPool::Stats getPacketPoolStats() const {
+        return packet_pool_ ? packet_pool_->getStats() : net::PacketPool::Stats {};
+    }
     unsigned getNodesStats(sa_family_t af, unsigned *good_return, unsigned *dubious_return, unsigned *cached_return, unsigned *incoming_return) const;
     NodeInfo getNodeInfo() const;
 
     std::vector<unsigned> getNodeMessageStats(bool in = false) const;
+    /** Traffic by message type since the node started */
+    TrafficStats getTrafficStats() const;
     std::string getStorageLog() const;
     std::string getStorageLog(const InfoHash&) const;
     std::string getRoutingTablesLog(sa_family_t af) const;
@@ -494,9 +525,31 @@ private:
 
     mutable std::mutex dht_mtx {};
     std::thread dht_thread {};
+
+    /**
+     * Wakes up the dht thread. cv is waited on with wake_mtx, which is
+     * only taken by producers when the dht thread is actually sleeping.
+     */
     std::condition_variable cv {};
-    std::mutex sock_mtx {};
-    std::queue<std::unique_ptr<net::ReceivedPacket>> rcv {};
+    std::mutex wake_mtx {};
+    std::atomic_bool sleeping {false};
+    void notify();
+
+    /** Received packets, pushed by the socket thread(s) */
+    MpscQueue<net::ReceivedPacket> rcv;
+    std::shared_ptr<net::PacketPool> packet_pool_ {};
+
+    /**
+     * Decoding stage, if enabled: packets are split by source address
+     * among serial decoders, which push decoded packets to decoded_.
+     */
+    std::unique_ptr<ThreadPool> decode_pool_;
+    std::vector<std::shared_ptr<Executor>> decoders_;
+    /* packets of a batch for each decoder, reused (receive thread only) */
+    std::vector<net::PacketList> decoder_packets_;
+    std::unique_ptr<MpscQueue<net::DecodedPacket>> decoded_;
+    void dispatchPackets(net::PacketList&& pkts);
+    void decodePackets(net::PacketList&& pkts);
 
     /** true if currently actively boostraping */
     std::atomic_bool bootstraping {false};
@@ -507,9 +560,34 @@ private:
     std::mutex bootstrap_mtx {};
     std::condition_variable bootstrap_cv {};
 
-    std::queue<std::function<void(SecureDht&)>> pending_ops_prio {};
-    std::queue<std::function<void(SecureDht&)>> pending_ops {};
-    std::mutex storage_mtx {};
+    using Op = std::function<void(SecureDht&)>;
+    /**
+     * Pending operations: a lock-free ring, backed by a locked queue
+     * used only while the ring is full so that no operation is lost.
+     */
+    struct OpQueue {
+        OpQueue();
+        /** Producer side, thread-safe */
+        void push(Op&& op);
+        /** Consumer side: run queued operations in FIFO order */
+        size_t run(SecureDht& dht);
+        bool empty() const {
+            return ring.empty() and not overflowing;
+        }
+        void clear();
+    private:
+        MpscQueue<Op> ring;
+        std::queue<Op> overflow {};
+        std::atomic_bool overflowing {false};
+        std::mutex overflow_mtx {};
+    };
+    OpQueue pending_ops_prio {};
+    OpQueue pending_ops {};
+
+    void pushOp(Op&& op, bool prio = false) {
+        (prio ? pending_ops_prio : pending_ops).push(std::move(op));
+        notify();
+    }
 
     std::atomic_bool running {false};
 
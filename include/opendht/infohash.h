@@ -130,16 +130,10 @@ public:
      * Result will allways be lower than 8*N
      */
     inline int lowbit() const {
-        int i, j;
-        for(i = N-1; i >= 0; i--)
-            if(data_[i] != 0)
-                break;
+        int i = lastSetByte(data_.data());
         if(i < 0)
             return -1;
-        for(j = 7; j >= 0; j--)
-            if((data_[i] & (0x80 >> j)) != 0)
-                break;
-        return 8 * i + j;
+        return 8 * i + 7 - lowestBit(data_[i]);
     }
 
     /**
@@ -154,43 +148,22 @@ public:
     static inline unsigned
     commonBits(const Hash& id1, const Hash& id2)
     {
-        unsigned i, j;
-        uint8_t x;
-        for(i = 0; i < N; i++) {
-            if(id1.data_[i] != id2.data_[i])
-                break;
-        }
-
+        unsigned i = firstDiff(id1.data_.data(), id2.data_.data());
         if(i == N)
             return 8*N;
-
-        x = id1.data_[i] ^ id2.data_[i];
-
-        j = 0;
-        while((x & 0x80) == 0) {
-            x <<= 1;
-            j++;
-        }
-
-        return 8 * i + j;
+        return 8 * i + leadingZeros(id1.data_[i] ^ id2.data_[i]);
     }
 
     /** Determine whether id1 or id2 is closer to this */
     int
     xorCmp(const Hash& id1, const Hash& id2) const
     {
-        for(unsigned i = 0; i < N; i++) {
-            uint8_t xor1, xor2;
-            if(id1.data_[i] == id2.data_[i])
-                continue;
-            xor1 = id1.data_[i] ^ data_[i];
-            xor2 = id2.data_[i] ^ data_[i];
-            if(xor1 < xor2)
-                return -1;
-            else
-                return 1;
-        }
-        return 0;
+        unsigned i = firstDiff(id1.data_.data(), id2.data_.data());
+        if(i == N)
+            return 0;
+        uint8_t xor1 = id1.data_[i] ^ data_[i];
+        uint8_t xor2 = id2.data_[i] ^ data_[i];
+        return xor1 < xor2 ? -1 : 1;
     }
 
     bool
@@ -262,6 +235,113 @@ public:
 private:
     T data_;
     void fromString(const char*);
+
+    /*
+     * Word-wise helpers for the bit operations above: ids are scanned
+     * 8 bytes at a time, the last word overlapping the previous one
+     * when N is not a multiple of 8.
+     */
+    static inline uint64_t load64(const uint8_t* p) {
+        uint64_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    /* Offset of the first non-zero byte (in memory order) of x != 0 */
+    static inline unsigned firstByte(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        return __builtin_clzll(x) / 8;
+#else
+        return __builtin_ctzll(x) / 8;
+#endif
+#else
+        unsigned i = 0;
+        while (not reinterpret_cast<const uint8_t*>(&x)[i]) i++;
+        return i;
+#endif
+    }
+
+    /* Offset of the last non-zero byte (in memory order) of x != 0 */
+    static inline unsigned lastByte(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        return 7 - __builtin_ctzll(x) / 8;
+#else
+        return 7 - __builtin_clzll(x) / 8;
+#endif
+#else
+        unsigned i = 7;
+        while (not reinterpret_cast<const uint8_t*>(&x)[i]) i--;
+        return i;
+#endif
+    }
+
+    /* Number of leading zero bits of x != 0 */
+    static inline unsigned leadingZeros(uint8_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_clz(x) - 8 * (sizeof(unsigned) - 1);
+#else
+        unsigned j = 0;
+        while ((x & 0x80) == 0) {
+            x <<= 1;
+            j++;
+        }
+        return j;
+#endif
+    }
+
+    /* Position of the lowest set bit of x != 0 */
+    static inline unsigned lowestBit(uint8_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_ctz(x);
+#else
+        unsigned j = 0;
+        while ((x & 1) == 0) {
+            x >>= 1;
+            j++;
+        }
+        return j;
+#endif
+    }
+
+    /* Index of the first byte differing between a and b, or N */
+    static inline unsigned firstDiff(const uint8_t* a, const uint8_t* b) {
+        if (N < sizeof(uint64_t)) {
+            for (unsigned i = 0; i < N; i++)
+                if (a[i] != b[i])
+                    return i;
+            return N;
+        }
+        unsigned i = 0;
+        for (; i + sizeof(uint64_t) <= N; i += sizeof(uint64_t))
+            if (auto x = load64(a + i) ^ load64(b + i))
+                return i + firstByte(x);
+        if (i != N) {
+            i = N - sizeof(uint64_t);
+            if (auto x = load64(a + i) ^ load64(b + i))
+                return i + firstByte(x);
+        }
+        return N;
+    }
+
+    /* Index of the last non-zero byte of a, or -1 */
+    static inline int lastSetByte(const uint8_t* a) {
+        if (N < sizeof(uint64_t)) {
+            for (int i = N-1; i >= 0; i--)
+                if (a[i])
+                    return i;
+            return -1;
+        }
+        unsigned i = N;
+        for (; i >= sizeof(uint64_t); i -= sizeof(uint64_t))
+            if (auto x = load64(a + i - sizeof(uint64_t)))
+                return i - sizeof(uint64_t) + lastByte(x);
+        if (i != 0)
+            if (auto x = load64(a))
+                return lastByte(x);
+        return -1;
+    }
 };
 
 #define HASH_LEN 20u
@@ -269,6 +349,14 @@ using InfoHash = Hash<HASH_LEN>;
 using h256 = Hash<32>;
 using PkId = h256;
 
+/**
+ * Find the k ids closest to target in the XOR metric.
+ * out is set to the indexes of these ids in [ids, ids+count), closest first.
+ * Distances are computed in batches, using AVX2 or SSE2 when the CPU
+ * supports them.
+ */
+OPENDHT_PUBLIC void closestIds(const InfoHash& target, const InfoHash* ids, size_t count, size_t k, std::vector<unsigned>& out);
+
 template <size_t N>
 std::ostream& operator<< (std::ostream& s, const Hash<N>& h)
 {
@@ -0,0 +1,144 @@
+/*
+ *  Copyright (C) 2019 Savoir-faire Linux Inc.
+ *  Author : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+
+namespace dht {
+
+/**
+ * Bounded lock-free multi-producer, single-consumer ring queue.
+ *
+ * Producers reserve a cell with a CAS on the enqueue position and publish
+ * it through the cell sequence number; the consumer never takes a lock.
+ * push() fails instead of blocking when the ring is full.
+ * Only one thread may call pop(), drain() or clear() at a time.
+ */
+template <typename T>
+class MpscQueue {
+public:
+    /** Capacity is rounded up to the next power of two. */
+    explicit MpscQueue(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity)
+            size <<= 1;
+        mask_ = size - 1;
+        cells_.reset(new Cell[size]);
+        for (size_t i = 0; i < size; i++)
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    /** Return false if the queue is full, in which case v is left untouched. */
+    bool push(T&& v) {
+        Cell* cell;
+        size_t pos = enqueue_.pos.load(std::memory_order_relaxed);
+        for (;;) {
+            cell = &cells_[pos & mask_];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            auto dif = (intptr_t)seq - (intptr_t)pos;
+            if (dif == 0) {
+                if (enqueue_.pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = enqueue_.pos.load(std::memory_order_relaxed);
+            }
+        }
+        cell->data = std::move(v);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /** Consumer side: return false if no published item is available. */
+    bool pop(T& v) {
+        size_t pos = dequeue_.pos.load(std::memory_order_relaxed);
+        Cell& cell = cells_[pos & mask_];
+        if (cell.sequence.load(std::memory_order_acquire) != pos + 1)
+            return false;
+        v = std::move(cell.data);
+        cell.data = T {};
+        cell.sequence.store(pos + mask_ + 1, std::memory_order_release);
+        dequeue_.pos.store(pos + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    /**
+     * Consumer side: call f on at most max items, in FIFO order.
+     * Items pushed by f itself are only seen if max allows it.
+     * Return the number of items consumed.
+     */
+    template <typename F>
+    size_t drain(F&& f, size_t max) {
+        size_t n = 0;
+        T v {};
+        while (n < max and pop(v)) {
+            n++;
+            f(v);
+        }
+        return n;
+    }
+
+    /** Consumer side: discard every published item. */
+    void clear() {
+        T v {};
+        while (pop(v));
+    }
+
+    /** Exact on the consumer thread, approximate elsewhere. */
+    bool empty() const {
+        size_t pos = dequeue_.pos.load(std::memory_order_relaxed);
+        return cells_[pos & mask_].sequence.load(std::memory_order_acquire) != pos + 1;
+    }
+
+    /** Approximate number of queued items. */
+    size_t size() const {
+        auto e = enqueue_.pos.load(std::memory_order_relaxed);
+        auto d = dequeue_.pos.load(std::memory_order_relaxed);
+        return e > d ? e - d : 0;
+    }
+
+    size_t capacity() const { return mask_ + 1; }
+
+private:
+    static constexpr size_t CACHE_LINE {64};
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T data {};
+    };
+
+    /** Keeps producer and consumer positions on separate cache lines */
+    struct Position {
+        std::atomic<size_t> pos {0};
+        char pad[CACHE_LINE - sizeof(std::atomic<size_t>)];
+    };
+
+    std::unique_ptr<Cell[]> cells_;
+    size_t mask_;
+    Position enqueue_ {};
+    Position dequeue_ {};
+};
+
+}
@@ -27,8 +27,11 @@
 #include "utils.h"
 #include "rng.h"
 #include "rate_limiter.h"
+#include "callbacks.h"
 #include "log_enable.h"
 #include "network_utils.h"
+#include "tid_map.h"
+#include "pool_allocator.h"
 
 #include <vector>
 #include <string>
@@ -36,6 +39,8 @@
 #include <algorithm>
 #include <memory>
 #include <queue>
+#include <deque>
+#include <map>
 
 namespace dht {
 namespace net {
@@ -43,6 +48,7 @@ namespace net {
 struct Request;
 struct Socket;
 struct TransId;
+class TrafficCounters;
 
 #ifndef MSG_CONFIRM
 #define MSG_CONFIRM 0
@@ -82,6 +88,22 @@ private:
 
 struct ParsedMessage;
 
+/**
+ * A received packet decoded by NetworkEngine::decode, possibly out of the
+ * dht thread, and ready to be applied by NetworkEngine::processMessage.
+ */
+struct OPENDHT_PUBLIC DecodedPacket {
+    std::unique_ptr<ParsedMessage> msg;
+    SockAddr from;
+    time_point received;
+
+    DecodedPacket();
+    DecodedPacket(std::unique_ptr<ParsedMessage>&& msg, SockAddr&& from, time_point received);
+    DecodedPacket(DecodedPacket&&) noexcept;
+    DecodedPacket& operator=(DecodedPacket&&) noexcept;
+    ~DecodedPacket();
+};
+
 /**
  * Answer for a request.
  */
@@ -94,6 +116,9 @@ struct RequestAnswer {
     std::vector<Sp<FieldValueIndex>> fields {};
     std::vector<Sp<Node>> nodes4 {};
     std::vector<Sp<Node>> nodes6 {};
+    /* closest nodes already packed for replies, sent instead of nodes4/nodes6 when set */
+    Sp<const Blob> packed_nodes4 {};
+    Sp<const Blob> packed_nodes6 {};
     RequestAnswer() {}
     RequestAnswer(ParsedMessage&& msg);
 };
@@ -116,7 +141,7 @@ struct RequestAnswer {
  * @param onAnnounce     callback for "announce" request.
  * @param onRefresh      callback for "refresh" request.
  */
-class NetworkEngine final
+class OPENDHT_PUBLIC NetworkEngine final
 {
 private:
     /**
@@ -276,7 +301,9 @@ public:
      */
     Sp<Request>
         sendPing(SockAddr&& sa, RequestCb&& on_done, RequestExpiredCb&& on_expired) {
-            return sendPing(std::make_shared<Node>(zeroes, std::move(sa)),
+            auto n = std::make_shared<Node>(zeroes, std::move(sa));
+            n->setTidTag(cache.getTidTag());
+            return sendPing(std::move(n),
                     std::forward<RequestCb>(on_done),
                     std::forward<RequestExpiredCb>(on_expired));
         }
@@ -399,9 +426,40 @@ public:
      */
     void processMessage(const uint8_t *buf, size_t buflen, SockAddr addr);
 
+    /**
+     * Applies a message decoded with decode().
+     * Filtering by address and network is done here, on the dht thread.
+     */
+    void processMessage(DecodedPacket&& pkt);
+
+    /**
+     * Decodes a message without touching the engine state, so that it can
+     * be called from any thread, concurrently.
+     * Throws if the packet can't be parsed.
+     */
+    static DecodedPacket decode(const uint8_t *buf, size_t buflen, SockAddr from, time_point received = {});
+
+    /**
+     * Finds the shard a packet is for, without decoding it: replies,
+     * errors, value data and value updates carry one of our transaction
+     * ids, tagged with the shard of the engine which created it.
+     *
+     * @return the shard, or 0 for requests and untagged or invalid packets.
+     */
+    static uint8_t getShard(const uint8_t *buf, size_t buflen);
+
+    /**
+     * Finds the target of a request without decoding it: the key of get,
+     * put, listen and refresh requests, or the id searched by find requests.
+     *
+     * @return false for other packets, or if the packet can't be parsed.
+     */
+    static bool getTarget(const uint8_t *buf, size_t buflen, InfoHash& target);
+
     Sp<Node> insertNode(const InfoHash& myid, const SockAddr& addr) {
         auto n = cache.getNode(myid, addr, scheduler.time(), 0);
-        onNewNode(n, 0);
+        if (n)
+            onNewNode(n, 0);
         return n;
     }
 
@@ -412,20 +470,95 @@ public:
         return stats;
     }
 
+    /** Traffic since the engine started, by message type */
+    TrafficStats getTrafficStats() const;
+
     void blacklistNode(const Sp<Node>& n);
 
+    /**
+     * Pack the closest nodes of id, sorting them, as sent in replies
+     * to find and get requests. The capacity of out is reused.
+     */
+    static void packNodes(sa_family_t af, const InfoHash& id, std::vector<Sp<Node>>& nodes, Blob& out);
+
+    /**
+     * Queue outgoing replies and value updates and send them in batches.
+     * Requests are always sent immediately, so that send errors can expire
+     * the node.
+     *
+     * @param batch      Queued datagrams for a family are sent when this
+     *                   many are waiting (0 or 1: send immediately).
+     * @param max_delay  Max. time a datagram can stay in the queue.
+     */
+    void setTxQueue(size_t batch, duration max_delay) {
+        tx_batch = batch;
+        tx_max_delay = max_delay;
+    }
+
+    /**
+     * Enables the compact message encoding, using integer keys, with
+     * peers advertising it in their user agent. Other peers get the
+     * default encoding. Both are always accepted.
+     */
+    void setCompactEncoding(bool enable) {
+        compact_encoding = enable;
+    }
+
+    /**
+     * Sets the index, from 1, of this engine among engines sharing the
+     * same socket. It is the tag of our transaction ids, so that replies
+     * can be routed with getShard(). 0 if the socket is not shared.
+     */
+    void setShard(uint8_t shard) {
+        cache.setTidTag(shard);
+    }
+
+    /**
+     * Sets the max. number of requests per second accepted from all peers,
+     * and from a single IP address. 0 disables the limit.
+     */
+    void setRateLimit(size_t max_req_per_sec, size_t max_peer_req_per_sec) {
+        rate_quota = {max_req_per_sec};
+        address_rate_limiter.setQuota({max_peer_req_per_sec});
+    }
+
+    /** Sends all queued datagrams */
+    void flush();
+
+    size_t getTxQueueSize(sa_family_t af) const {
+        return (af == AF_INET6 ? tx_queue6 : tx_queue4).packets.size();
+    }
+    size_t getTxQueuePeak(sa_family_t af) const {
+        return (af == AF_INET6 ? tx_queue6 : tx_queue4).peak;
+    }
+
     std::vector<Sp<Node>> getCachedNodes(const InfoHash& id, sa_family_t sa_f, size_t count) {
         return cache.getCachedNodes(id, sa_f, count);
     }
 
+    /** Forget some of the known nodes not used anymore, see NodeCache::compact */
+    void compactNodeCache() {
+        cache.compact();
+    }
+
 private:
 
     struct PartialMessage;
 
+    /* values recently sent in fragments */
+    struct SentParts {
+        Tid tid;
+        SockAddr to;
+        time_point time;
+        std::vector<Blob> values;
+        size_t size;
+        unsigned resent {0};
+    };
+
     /***************
      *  Constants  *
      ***************/
-    static constexpr size_t MAX_REQUESTS_PER_SEC {1600};
+    static constexpr size_t MAX_REQUESTS_PER_SEC {DEFAULT_MAX_REQ_PER_SEC};
     /* the length of a node info buffer in ipv4 format */
     static const constexpr size_t NODE4_INFO_BUF_LEN {HASH_LEN + sizeof(in_addr) + sizeof(in_port_t)};
     /* the length of a node info buffer in ipv6 format */
@@ -437,6 +570,21 @@ private:
     static constexpr std::chrono::seconds RX_MAX_PACKET_TIME {10};
     /* Max. time between packet fragments */
     static constexpr std::chrono::seconds RX_TIMEOUT {3};
+    /* Time without new fragment after which missing ones are requested again */
+    static constexpr std::chrono::seconds RX_PART_RETRY {1};
+    /* Max. memory used to reassemble fragmented packets from a single host,
+       when more than one is received at once */
+    static constexpr size_t RX_PEER_MAX_SIZE {256 * 1024};
+    /* Max. memory used to reassemble fragmented packets */
+    static constexpr size_t RX_MAX_SIZE {16 * 1024 * 1024};
+    /* Max. total size of the values of a single fragmented packet */
+    static constexpr size_t RX_MSG_MAX_SIZE {1024 * 1024};
+    /* Max. memory used to keep fragmented values sent, to send parts again */
+    static constexpr size_t TX_PARTS_MAX_SIZE {1024 * 1024};
+    /* Max. number of fragments requested again, or sent again, at once */
+    static constexpr size_t MAX_PARTS_RETRY {64};
+    /* Max. number of times fragments of a packet are sent again */
+    static constexpr unsigned TX_PARTS_MAX_RESEND {3};
     /* The maximum number of nodes that we snub.  There is probably little
         reason to increase this value. */
     static constexpr unsigned BLACKLISTED_MAX {10};
@@ -445,7 +593,23 @@ private:
     static constexpr size_t MAX_PACKET_VALUE_SIZE {600};
 
     static const std::string my_v;
+    /* user agent advertising the compact encoding */
+    static const std::string my_v_compact;
+
+    const std::string& userAgent() const {
+        return compact_encoding ? my_v_compact : my_v;
+    }
+    static bool isCompactUserAgent(const std::string& ua) {
+        return ua == my_v_compact;
+    }
+    bool compactTo(const Node& node) const {
+        return compact_encoding and node.isCompact();
+    }
 
+    /** Checks the address of an incoming message */
+    bool acceptFrom(const SockAddr& from) const;
+    /** Applies a parsed message, from the network check on */
+    void processParsed(std::unique_ptr<ParsedMessage>&& msg, const SockAddr& from);
     void process(std::unique_ptr<ParsedMessage>&&, const SockAddr& from);
 
     bool rateLimit(const SockAddr& addr);
@@ -455,6 +619,10 @@ private:
 
     void requestStep(Sp<Request> req);
 
+    /** Allocates a request from the request pool */
+    template <typename... Args>
+    Sp<Request> makeRequest(Args&&... args);
+
     /**
      * Sends a request to a node. Request::MAX_ATTEMPT_COUNT attempts will
      * be made before the request expires.
@@ -471,18 +639,43 @@ private:
     };
 
 
+    struct TxQueue {
+        std::vector<OutgoingPacket> packets {};
+        /* sent packets, kept to reuse their memory */
+        std::vector<OutgoingPacket> spare {};
+        size_t peak {0};
+    };
+
+    /** The encoder buffer, cleared. Must not be used across sends. */
+    TxBuffer& txBuffer() {
+        tx_buffer.clear();
+        return tx_buffer;
+    }
+
     // basic wrapper for socket sendto function
     int send(const SockAddr& addr, const char *buf, size_t len, bool confirmed = false);
-
-    void sendValueParts(const TransId& tid, const std::vector<Blob>& svals, const SockAddr& addr);
-    std::vector<Blob> packValueHeader(msgpack::sbuffer&, const std::vector<Sp<Value>>&);
+    /* send replies and value updates, queued if batching is enabled: errors are only logged */
+    void sendQueued(const SockAddr& addr, const char *buf, size_t len);
+    void flush(TxQueue& queue);
+
+    /* send values in fragments of MTU bytes, kept for a while to be sent again */
+    void sendValueParts(const TransId& tid, std::vector<Blob>&& svals, const SockAddr& addr);
+    void sendValuePart(const TransId& tid, unsigned index, const Blob& value, size_t start, const SockAddr& addr);
+    /* ask the sender of a fragmented packet for the missing fragments */
+    void sendMissingParts(Tid tid, const PartialMessage& pmsg);
+    void resendValueParts(Tid tid, const std::map<unsigned, std::vector<unsigned>>& parts, const SockAddr& addr);
+    /* memory used to reassemble packets from the host of addr */
+    size_t partialMessagesSize(const SockAddr& addr) const;
+    /* whether the reply msg is for a request pending or a socket open with from */
+    bool isExpected(const ParsedMessage& msg, const SockAddr& from);
+    std::vector<Blob> packValueHeader(TxBuffer&, const std::vector<Sp<Value>>&, bool compact);
     void maintainRxBuffer(Tid tid);
 
     /*************
      *  Answers  *
      *************/
     /* answer to a ping  request */
-    void sendPong(const SockAddr& addr, Tid tid);
+    void sendPong(const SockAddr& addr, Tid tid, bool compact);
     /* answer to findnodes/getvalues request */
     void sendNodesValues(const SockAddr& addr,
             Tid tid,
@@ -490,7 +683,8 @@ private:
             const Blob& nodes6,
             const std::vector<Sp<Value>>& st,
             const Query& query,
-            const Blob& token);
+            const Blob& token,
+            bool compact);
     Blob bufferNodes(sa_family_t af, const InfoHash& id, std::vector<Sp<Node>>& nodes);
 
     std::pair<Blob, Blob> bufferNodes(sa_family_t af,
@@ -498,16 +692,19 @@ private:
             want_t want,
             std::vector<Sp<Node>>& nodes,
             std::vector<Sp<Node>>& nodes6);
+    /* fill the packed nodes of the answer not provided by the callback */
+    void packAnswerNodes(sa_family_t af, const InfoHash& id, want_t want, RequestAnswer& answer);
     /* answer to a listen request */
-    void sendListenConfirmation(const SockAddr& addr, Tid tid);
+    void sendListenConfirmation(const SockAddr& addr, Tid tid, bool compact);
     /* answer to put request */
-    void sendValueAnnounced(const SockAddr& addr, Tid, Value::Id);
+    void sendValueAnnounced(const SockAddr& addr, Tid, Value::Id, bool compact);
     /* answer in case of error */
     void sendError(const SockAddr& addr,
             Tid tid,
             uint16_t code,
             const std::string& message,
-            bool include_id=false);
+            bool include_id=false,
+            bool compact=false);
 
     void deserializeNodes(ParsedMessage& msg, const SockAddr& from);
 
@@ -520,19 +717,37 @@ private:
     NodeCache cache {};
 
     // global limiting should be triggered by at least 8 different IPs
-    using IpLimiter = RateLimiter<MAX_REQUESTS_PER_SEC/8>;
-    using IpLimiterMap = std::map<SockAddr, IpLimiter, SockAddr::ipCmp>;
-    IpLimiterMap address_rate_limiter {};
-    RateLimiter<MAX_REQUESTS_PER_SEC> rate_limiter {};
-    size_t limiter_maintenance {0};
+    IpRateLimiter address_rate_limiter {TokenBucket::Quota(MAX_REQUESTS_PER_SEC/8)};
+    TokenBucket rate_limiter {};
+    TokenBucket::Quota rate_quota {MAX_REQUESTS_PER_SEC};
 
     // requests handling
-    std::map<Tid, Sp<Request>> requests {};
-    std::map<Tid, PartialMessage> partial_messages;
+    TidMap<Sp<Request>> requests {};
+    TidMap<PartialMessage> partial_messages;
+    size_t partial_messages_size {0};
+    std::deque<SentParts> sent_parts;
+    size_t sent_parts_size {0};
+    std::shared_ptr<BlockPool> request_pool {std::make_shared<BlockPool>()};
 
     MessageStats in_stats {}, out_stats {};
+    std::unique_ptr<TrafficCounters> traffic;
+    /* bytes of the replies sent, to account them to the request type */
+    uint64_t tx_reply_bytes {0};
     std::set<SockAddr> blacklist {};
 
+    // memory used to parse incoming messages
+    msgpack::zone rx_zone {};
+
+    // memory used to encode outgoing messages
+    TxBuffer tx_buffer {};
+
+    // outgoing datagrams waiting to be sent in a batch
+    TxQueue tx_queue4 {}, tx_queue6 {};
+    size_t tx_batch {0};
+    duration tx_max_delay {};
+    bool compact_encoding {false};
+    Sp<Scheduler::Job> tx_flush_job {};
+
     Scheduler& scheduler;
 
     bool logIncoming_ {false};
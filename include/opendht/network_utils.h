@@ -36,35 +36,200 @@
 #include <thread>
 #include <atomic>
 #include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
 
 namespace dht {
 namespace net {
 
 static const constexpr in_port_t DHT_DEFAULT_PORT = 4222;
 
-int bindSocket(const SockAddr& addr, SockAddr& bound);
+/**
+ * @param reusePort: allow several sockets of this process to bind the same
+ *        port (SO_REUSEPORT), the kernel load-balancing incoming packets.
+ */
+int bindSocket(const SockAddr& addr, SockAddr& bound, bool reusePort = false);
 
 bool setNonblocking(int fd, bool nonblocking = true);
 
 #ifdef _WIN32
 void udpPipe(int fds[2]);
 #endif
+class PacketPool;
+
+/**
+ * Reference-counted handle to a packet buffer. Buffers come from the slab
+ * of a PacketPool, or from the heap if the pool is exhausted or the packet
+ * is too large. Copies share the same buffer.
+ */
+class OPENDHT_PUBLIC PacketBuffer {
+public:
+    PacketBuffer() {}
+    /**
+     * Heap buffer holding data, so that packets can still be filled like
+     * the Blob ReceivedPacket::data used to be.
+     */
+    PacketBuffer(Blob&& data);
+    PacketBuffer(const Blob& data) : PacketBuffer(Blob(data)) {}
+    template <typename InputIt>
+    PacketBuffer(InputIt first, InputIt last) : PacketBuffer(Blob(first, last)) {}
+    PacketBuffer(const PacketBuffer& o);
+    PacketBuffer(PacketBuffer&& o) noexcept;
+    ~PacketBuffer() { reset(); }
+    PacketBuffer& operator=(const PacketBuffer& o);
+    PacketBuffer& operator=(PacketBuffer&& o) noexcept;
+
+    uint8_t* data() { return ptr; }
+    const uint8_t* data() const { return ptr; }
+    size_t size() const { return len; }
+    size_t capacity() const { return cap; }
+    bool empty() const { return len == 0; }
+    const uint8_t* begin() const { return ptr; }
+    const uint8_t* end() const { return ptr + len; }
+
+    /** Copy of the data, for code reading packets as a Blob */
+    operator Blob() const { return {begin(), end()}; }
+
+    /** Set the size of the data, up to capacity() */
+    void resize(size_t size) { len = std::min(size, cap); }
+
+    /** Release the buffer */
+    void reset();
+
+private:
+    friend class PacketPool;
+    std::shared_ptr<PacketPool> pool {};
+    uint32_t slot {0};
+    uint8_t* ptr {nullptr};
+    size_t len {0};
+    size_t cap {0};
+    std::shared_ptr<Blob> heap {};
+};
+
 struct ReceivedPacket {
-    Blob data;
+    PacketBuffer data;
     SockAddr from;
     time_point received;
 };
+using PacketList = std::list<ReceivedPacket>;
+
+/**
+ * Preallocated slab of fixed-size packet buffers, also keeping spare
+ * PacketList nodes, so that receiving packets requires no heap allocation
+ * in steady state. Thread-safe. Must be created with std::make_shared.
+ */
+class OPENDHT_PUBLIC PacketPool : public std::enable_shared_from_this<PacketPool> {
+public:
+    static constexpr size_t BUFFER_SIZE {2048};
+    static constexpr size_t DEFAULT_COUNT {1024};
+
+    struct Stats {
+        size_t capacity {0};
+        /** Slab buffers currently in use */
+        size_t used {0};
+        size_t peak {0};
+        /** Heap allocations because all slab buffers were in use */
+        size_t exhausted {0};
+        /** Heap allocations because the packet was larger than BUFFER_SIZE */
+        size_t oversize {0};
+    };
+
+    PacketPool(size_t count = DEFAULT_COUNT);
+
+    /** @return a buffer with capacity of at least size */
+    PacketBuffer get(size_t size = BUFFER_SIZE);
+
+    /** Appends a packet to the list, reusing a spare node if available */
+    void addPacket(PacketList& packets);
+
+    /** Release packet buffers and keep list nodes for later use */
+    void recycle(PacketList&& packets);
+
+    Stats getStats() const;
+
+private:
+    friend class PacketBuffer;
+    void ref(uint32_t slot);
+    void unref(uint32_t slot);
+
+    std::vector<uint8_t> slab;
+    std::unique_ptr<std::atomic_uint[]> refs;
+    mutable std::mutex mtx {};
+    std::vector<uint32_t> free_slots;
+    PacketList spare {};
+    Stats stats {};
+};
+
+struct OutgoingPacket {
+    Blob data;
+    SockAddr to;
+    bool replied {false};
+};
+
+/**
+ * Growable byte buffer, usable as a msgpack packer stream.
+ * clear() keeps the allocated memory: a buffer reused for every outgoing
+ * message stops allocating once it reached the size of the largest one.
+ */
+class TxBuffer {
+public:
+    void write(const char* buf, size_t len) {
+        data_.insert(data_.end(), (const uint8_t*)buf, (const uint8_t*)buf + len);
+    }
+    const char* data() const { return (const char*)data_.data(); }
+    size_t size() const { return data_.size(); }
+    size_t capacity() const { return data_.capacity(); }
+    void clear() { data_.clear(); }
+    /** Drop everything written after the first size bytes */
+    void truncate(size_t size) {
+        if (size < data_.size())
+            data_.resize(size);
+    }
+private:
+    Blob data_ {};
+};
 
 class OPENDHT_PUBLIC DatagramSocket {
 public:
-    using OnReceive = std::function<void(std::unique_ptr<ReceivedPacket>&& packet)>;
+    /** Called with one or more packets received by the same system call */
+    using OnReceive = std::function<void(PacketList&& packets)>;
+    /** Implementations must not call the receive callback once destroyed */
     virtual ~DatagramSocket() {};
 
     virtual int sendTo(const SockAddr& dest, const uint8_t* data, size_t size, bool replied) = 0;
 
+    /**
+     * Send several datagrams, in order.
+     * The default implementation calls sendTo for each packet.
+     * @return the number of packets successfully sent.
+     */
+    virtual size_t sendBatch(const std::vector<OutgoingPacket>& packets);
+
     inline void setOnReceive(OnReceive&& cb) {
         rx_callback = std::move(cb);
     }
+    inline void setOnReceive(std::nullptr_t) {
+        rx_callback = {};
+    }
+
+    /**
+     * Callback type used before batched receive: called once per packet.
+     * Still accepted by setOnReceive, at the cost of one allocation per
+     * packet; prefer OnReceive.
+     */
+    using OnReceivePacket = std::function<void(std::unique_ptr<ReceivedPacket>&& packet)>;
+    inline void setOnReceive(OnReceivePacket&& cb) {
+        if (not cb) {
+            rx_callback = {};
+            return;
+        }
+        rx_callback = [cb = std::move(cb)](PacketList&& packets) {
+            for (auto& p : packets)
+                cb(std::unique_ptr<ReceivedPacket>(new ReceivedPacket(std::move(p))));
+        };
+    }
 
     virtual const SockAddr& getBound(sa_family_t family = AF_UNSPEC) const = 0;
     virtual bool hasIPv4() const = 0;
@@ -75,24 +240,40 @@ public:
     }
 
     virtual void stop() = 0;
+
+    /** The pool used for received packets, if any */
+    const std::shared_ptr<PacketPool>& getPacketPool() const { return packet_pool; }
 protected:
 
-    inline void onReceived(std::unique_ptr<ReceivedPacket>&& packet) {
+    inline void onReceived(PacketList&& packets) {
         if (rx_callback)
-            rx_callback(std::move(packet));
+            rx_callback(std::move(packets));
     }
+    std::shared_ptr<PacketPool> packet_pool {};
 private:
     OnReceive rx_callback;
 };
 
 class OPENDHT_PUBLIC UdpSocket : public DatagramSocket {
 public:
-    UdpSocket(in_port_t port, const Logger& l = {});
-    UdpSocket(const SockAddr& bind4, const SockAddr& bind6, const Logger& l = {});
+    /** Maximum number of datagrams read by a single batched receive call */
+    static constexpr unsigned RX_BATCH_MAX {32};
+
+    /**
+     * @param rxBatch: maximum number of datagrams to read with a single
+     *        system call (recvmmsg). 0 or 1 disables batching. Ignored on
+     *        platforms without recvmmsg.
+     * @param reusePort: bind with SO_REUSEPORT, see bindSocket.
+     */
+    UdpSocket(in_port_t port, const Logger& l = {}, unsigned rxBatch = 0, bool reusePort = false);
+    UdpSocket(const SockAddr& bind4, const SockAddr& bind6, const Logger& l = {}, unsigned rxBatch = 0, bool reusePort = false);
     ~UdpSocket();
 
     int sendTo(const SockAddr& dest, const uint8_t* data, size_t size, bool replied) override;
 
+    /** Uses sendmmsg when available */
+    size_t sendBatch(const std::vector<OutgoingPacket>& packets) override;
+
     const SockAddr& getBound(sa_family_t family = AF_UNSPEC) const override {
         return (family == AF_INET6) ? bound6 : bound4;
     }
@@ -109,9 +290,98 @@ private:
     SockAddr bound4, bound6;
     std::thread rcv_thread {};
     std::atomic_bool running {false};
+    unsigned rx_batch {1};
+    std::vector<uint8_t> rx_buf {};
+    bool tx_batch {true};
+    bool reuse_port {false};
 
     void openSockets(const SockAddr& bind4, const SockAddr& bind6);
 };
 
+#ifdef __linux__
+
+/**
+ * Edge-triggered epoll event loop.
+ * A single loop thread can serve the sockets of several EpollUdpSocket,
+ * for instance bound to different interfaces or ports.
+ */
+class OPENDHT_PUBLIC EpollLoop {
+public:
+    /** Called from the loop thread when fd becomes readable */
+    using OnReadable = std::function<void()>;
+
+    EpollLoop(const Logger& l = {});
+    /**
+     * Can be called from a callback, in which case the loop thread is
+     * detached and exits once the callback returns.
+     */
+    ~EpollLoop();
+
+    void add(int fd, OnReadable&& cb);
+
+    /** After this returns, the callback for fd won't be called anymore */
+    void remove(int fd);
+
+    void stop();
+
+private:
+    /** Shared with the loop thread, that can outlive the EpollLoop */
+    struct State;
+    std::shared_ptr<State> state;
+    std::thread thread {};
+
+    static void loop(std::shared_ptr<State> state);
+};
+
+/**
+ * UDP socket waiting for packets using an EpollLoop, that can be shared
+ * with other sockets.
+ */
+class OPENDHT_PUBLIC EpollUdpSocket : public DatagramSocket {
+public:
+    /**
+     * @param loop: the event loop to use. A new one is created if empty.
+     * @param rxBatch: maximum number of datagrams to read with a single
+     *        system call (recvmmsg). 0 or 1 disables batching.
+     */
+    EpollUdpSocket(const SockAddr& bind4, const SockAddr& bind6, const Logger& l = {},
+                   std::shared_ptr<EpollLoop> loop = {}, unsigned rxBatch = 0);
+    ~EpollUdpSocket();
+
+    int sendTo(const SockAddr& dest, const uint8_t* data, size_t size, bool replied) override;
+    size_t sendBatch(const std::vector<OutgoingPacket>& packets) override;
+
+    const SockAddr& getBound(sa_family_t family = AF_UNSPEC) const override {
+        return (family == AF_INET6) ? bound6 : bound4;
+    }
+
+    bool hasIPv4() const override {
+        std::lock_guard<std::recursive_mutex> lock(mtx);
+        return s4 != -1;
+    }
+    bool hasIPv6() const override {
+        std::lock_guard<std::recursive_mutex> lock(mtx);
+        return s6 != -1;
+    }
+
+    void stop() override;
+private:
+    Logger logger;
+    std::shared_ptr<EpollLoop> loop;
+    /* protects s4 and s6, closed by stop() while other threads may send */
+    mutable std::recursive_mutex mtx {};
+    int s4 {-1};
+    int s6 {-1};
+    SockAddr bound4, bound6;
+    unsigned rx_batch {1};
+    std::vector<uint8_t> rx_buf {};
+    bool tx_batch {true};
+
+    /** Read all pending datagrams from s (edge-triggered) */
+    void onReadable(int s);
+};
+
+#endif
+
 }
 }
@@ -22,6 +22,7 @@
 #include "infohash.h" // includes socket structures
 #include "utils.h"
 #include "sockaddr.h"
+#include "tid_map.h"
 
 #include <list>
 #include <map>
@@ -35,7 +36,6 @@ struct Socket;
 struct RequestAnswer;
 } /* namespace net */
 
-using Tid = uint32_t;
 using SocketCb = std::function<void(const Sp<Node>&, net::RequestAnswer&&)>;
 struct Socket {
     Socket() {}
@@ -44,7 +44,7 @@ struct Socket {
     SocketCb on_receive {};
 };
 
-struct Node {
+struct OPENDHT_PUBLIC Node {
     const InfoHash id;
 
     Node(const InfoHash& id, const SockAddr& addr, bool client=false);
@@ -60,6 +60,9 @@ struct Node {
         return addr.toString();
     }
     bool isClient() const { return is_client; }
+    /** True if the node advertised support of the compact message encoding */
+    bool isCompact() const { return compact; }
+    void setCompact(bool c) { compact = c; }
     bool isIncoming() { return time > reply_time; }
 
     const time_point& getTime() const { return time; }
@@ -107,6 +110,35 @@ struct Node {
 
     void setExpired();
 
+    /**
+     * Updates the round-trip time estimation with a new measure, following
+     * Jacobson/Karels (RFC 6298): smoothed RTT and mean deviation.
+     * Only replies to requests sent once must be measured (Karn's rule).
+     */
+    void rttSample(duration rtt);
+
+    /**
+     * Called when a request to this node timed out and is sent again:
+     * doubles the response timeout until the next RTT measure.
+     */
+    void rttTimeout() {
+        if (rtt_backoff_ < MAX_RTT_BACKOFF)
+            rtt_backoff_++;
+    }
+
+    /** True if at least one RTT measure was made */
+    bool hasRtt() const { return srtt_ != duration::zero(); }
+    duration getSrtt() const { return srtt_; }
+    duration getRttVar() const { return rttvar_; }
+
+    /**
+     * Time to wait for a reply before sending a request again:
+     * srtt + 4*rttvar, doubled for each consecutive timeout, and bounded
+     * by [MIN_RESPONSE_TIME, MAX_RESPONSE_BACKOFF].
+     * MAX_RESPONSE_TIME until the first RTT measure.
+     */
+    duration getResponseTime() const;
+
     /**
      * Opens a socket on which a node will be able allowed to write for further
      * additionnal updates following the response to a previous request.
@@ -139,9 +171,19 @@ struct Node {
      */
     Tid getNewTid() {
         ++transaction_id;
-        return transaction_id ? ++transaction_id : transaction_id;
+        return tagTid(transaction_id ? ++transaction_id : transaction_id);
     }
 
+    /**
+     * Sets the high byte of the ids of requests and sockets opened to this
+     * node, identifying the engine among engines sharing a socket.
+     * 0 (default) leaves ids unchanged.
+     */
+    void setTidTag(uint8_t tag) { tid_tag_ = (Tid)tag << TID_TAG_SHIFT; }
+
+    /** The tag set by the engine which created the id, or 0 */
+    static uint8_t getTidTag(Tid tid) { return tid >> TID_TAG_SHIFT; }
+
     std::string toString() const;
 
     OPENDHT_PUBLIC friend std::ostream& operator<< (std::ostream& s, const Node& h);
@@ -151,24 +193,40 @@ struct Node {
     /* The time after which we consider a node to be expirable. */
     static constexpr const std::chrono::minutes NODE_EXPIRE_TIME {10};
 
-    /* Time for a request to timeout */
+    /* Time for a request to timeout, for nodes without RTT estimation */
     static constexpr const std::chrono::seconds MAX_RESPONSE_TIME {1};
 
+    /* Bounds of the adaptive request timeout */
+    static constexpr const std::chrono::milliseconds MIN_RESPONSE_TIME {250};
+    static constexpr const std::chrono::seconds MAX_RESPONSE_BACKOFF {3};
+
 private:
     /* Number of times we accept authentication errors from this node. */
     static const constexpr unsigned MAX_AUTH_ERRORS {3};
+    /* Maximum number of timeout doublings */
+    static const constexpr unsigned MAX_RTT_BACKOFF {4};
+    static const constexpr unsigned TID_TAG_SHIFT {24};
+
+    Tid tagTid(Tid tid) const {
+        return tid_tag_ ? (tid & ((Tid(1) << TID_TAG_SHIFT) - 1)) | tid_tag_ : tid;
+    }
 
     SockAddr addr;
     bool is_client {false};
+    bool compact {false};
     time_point time {time_point::min()};            /* last time eared about */
     time_point reply_time {time_point::min()};      /* time of last correct reply received */
     unsigned auth_errors {0};
     bool expired_ {false};
+    duration srtt_ {duration::zero()};              /* smoothed round-trip time */
+    duration rttvar_ {duration::zero()};            /* round-trip time mean deviation */
+    unsigned rtt_backoff_ {0};                      /* consecutive timeouts since the last RTT measure */
     Tid transaction_id;
+    Tid tid_tag_ {0};
     using TransactionDist = std::uniform_int_distribution<decltype(transaction_id)>;
 
-    std::map<Tid, Sp<net::Request>> requests_ {};
-    std::map<Tid, Sp<Socket>> sockets_;
+    TidMap<Sp<net::Request>> requests_ {};
+    TidMap<Sp<Socket>> sockets_;
 };
 
 }
@@ -20,13 +20,35 @@
 
 #include "node.h"
 
-#include <list>
+#include <array>
 #include <memory>
+#include <unordered_map>
 
 namespace dht {
 
-struct NodeCache {
+/**
+ * Nodes known by the network engine, per address family, so that a single
+ * Node object exists for each known node.
+ *
+ * The cache owns a reference to its nodes: entries whose node is not used
+ * anywhere else are dead, and act as if absent. They are removed a shard at
+ * a time by compact(), and the number of entries is bounded by max_nodes
+ * per family. Past this bound, new nodes are refused: replies to requests
+ * sent to a node not in the cache could not be matched.
+ * Entries are sharded by the first byte of the id, so that the closest
+ * cached nodes to an id are found by visiting shards in XOR order.
+ */
+struct OPENDHT_PUBLIC NodeCache {
+    /* Default maximum number of entries per address family */
+    static constexpr size_t MAX_NODES {64 * 1024};
+
+    NodeCache(size_t max_nodes = MAX_NODES) : cache_4(max_nodes), cache_6(max_nodes) {}
+
     Sp<Node> getNode(const InfoHash& id, sa_family_t family);
+    /**
+     * @return the node with this id, updating its address if confirmed,
+     *         or nullptr if it is not cached and the family is full.
+     */
     Sp<Node> getNode(const InfoHash& id, const SockAddr&, time_point now, bool confirmed, bool client=false);
     std::vector<Sp<Node>> getCachedNodes(const InfoHash& id, sa_family_t sa_f, size_t count) const;
 
@@ -37,19 +59,51 @@ struct NodeCache {
      */
     void clearBadNodes(sa_family_t family = 0);
 
+    /**
+     * Remove the dead entries of the next shard of each family.
+     * Meant to be called often: a full pass takes SHARDS calls.
+     */
+    void compact();
+
+    /** Number of entries, including dead ones not compacted yet */
+    size_t size(sa_family_t family = 0) const;
+
+    /** Tag of the transaction ids of new nodes, see Node::setTidTag */
+    void setTidTag(uint8_t tag) { cache_4.tid_tag = cache_6.tid_tag = tag; }
+    uint8_t getTidTag() const { return cache_4.tid_tag; }
+
     ~NodeCache();
 
 private:
-    class NodeMap : private std::map<InfoHash, std::weak_ptr<Node>> {
+    static constexpr size_t SHARDS {256};
+
+    /* Keyed hash of ids, so that colliding ids can't be chosen */
+    struct IdHash {
+        uint64_t key;
+        size_t operator()(const InfoHash& id) const;
+    };
+    using Shard = std::unordered_map<InfoHash, Sp<Node>, IdHash>;
+
+    class NodeMap {
     public:
+        NodeMap(size_t max_nodes);
         Sp<Node> getNode(const InfoHash& id);
         Sp<Node> getNode(const InfoHash& id, const SockAddr&, time_point now, bool confirmed, bool client);
         std::vector<Sp<Node>> getCachedNodes(const InfoHash& id, size_t count) const;
         void clearBadNodes();
         void setExpired();
-        void cleanup();
+        void compact();
+        size_t size() const { return count_; }
+        Sp<Node> makeNode(const InfoHash& id, const SockAddr& addr, bool client) const;
+        uint8_t tid_tag {0};
     private:
-        size_t cleanup_counter {0};
+        Shard& shard(const InfoHash& id) { return shards_[id[0]]; }
+        void compact(Shard&);
+
+        std::array<Shard, SHARDS> shards_;
+        size_t count_ {0};
+        size_t max_nodes_;
+        size_t compact_cursor_ {0};
     };
 
     const NodeMap& cache(sa_family_t af) const { return af == AF_INET ? cache_4 : cache_6; }
@@ -0,0 +1,110 @@
+/*
+ *  Copyright (C) 2019 Savoir-faire Linux Inc.
+ *  Author : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <memory>
+#include <new>
+#include <cstddef>
+
+namespace dht {
+
+/**
+ * Free list of memory blocks of a single size, set by the first
+ * allocation. Blocks of other sizes go to the heap.
+ * Not thread-safe: blocks must be allocated and released by one thread
+ * at a time, usually the thread owning the objects.
+ */
+class BlockPool {
+public:
+    static constexpr size_t DEFAULT_MAX_FREE {1024};
+
+    BlockPool(size_t maxFree = DEFAULT_MAX_FREE) : maxFree_(maxFree) {}
+    BlockPool(const BlockPool&) = delete;
+    BlockPool& operator=(const BlockPool&) = delete;
+    ~BlockPool() {
+        while (free_) {
+            auto b = free_;
+            free_ = b->next;
+            ::operator delete(b);
+        }
+    }
+
+    void* allocate(size_t size) {
+        if (not blockSize_ and size >= sizeof(FreeBlock))
+            blockSize_ = size;
+        if (size == blockSize_ and free_) {
+            auto b = free_;
+            free_ = b->next;
+            freeCount_--;
+            return b;
+        }
+        return ::operator new(size);
+    }
+
+    void deallocate(void* p, size_t size) {
+        if (size == blockSize_ and freeCount_ < maxFree_) {
+            auto b = static_cast<FreeBlock*>(p);
+            b->next = free_;
+            free_ = b;
+            freeCount_++;
+        } else
+            ::operator delete(p);
+    }
+
+    size_t freeCount() const { return freeCount_; }
+
+private:
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+    const size_t maxFree_;
+    size_t blockSize_ {0};
+    size_t freeCount_ {0};
+    FreeBlock* free_ {nullptr};
+};
+
+/**
+ * Allocator drawing from a BlockPool, which it keeps alive.
+ * Meant for std::allocate_shared of objects created and released at a
+ * high rate, like network requests.
+ */
+template <typename T>
+struct PoolAllocator {
+    using value_type = T;
+
+    PoolAllocator(std::shared_ptr<BlockPool> p) : pool(std::move(p)) {}
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U>& o) : pool(o.pool) {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(pool->allocate(n * sizeof(T)));
+    }
+    void deallocate(T* p, size_t n) {
+        pool->deallocate(p, n * sizeof(T));
+    }
+
+    std::shared_ptr<BlockPool> pool;
+};
+
+template <typename T, typename U>
+bool operator==(const PoolAllocator<T>& a, const PoolAllocator<U>& b) { return a.pool == b.pool; }
+template <typename T, typename U>
+bool operator!=(const PoolAllocator<T>& a, const PoolAllocator<U>& b) { return a.pool != b.pool; }
+
+}
@@ -19,10 +19,18 @@
 #pragma once
 
 #include "utils.h"
+#include "sockaddr.h"
+
 #include <queue>
+#include <vector>
 
 namespace dht {
 
+/**
+ * Rate limiter keeping the time of each request within the period.
+ * @deprecated memory and time grow with Quota: use TokenBucket or
+ *             IpRateLimiter.
+ */
 template<size_t Quota, unsigned long Period=1>
 class RateLimiter {
 public:
@@ -47,4 +55,101 @@ private:
     std::queue<time_point> records {};
 };
 
+/**
+ * Token bucket rate limiter, implemented with the generic cell rate
+ * algorithm (GCRA): the whole state is the theoretical arrival time of the
+ * next request. Up to `quota` requests are accepted in a burst, and tokens
+ * are refilled at a rate of `quota` per `period`.
+ */
+class TokenBucket {
+public:
+    struct Quota {
+        /** A quota of 0 disables the limit */
+        Quota(size_t quota = 0, duration period = std::chrono::seconds(1))
+         : interval(quota ? period / (duration::rep)quota : duration::zero()),
+           burst(quota ? interval * (duration::rep)quota : duration::zero()) {}
+        bool unlimited() const { return interval == duration::zero(); }
+        /** Time for one token to be refilled */
+        duration interval;
+        /** Time to refill the whole bucket */
+        duration burst;
+    };
+
+    /** Return false if quota is reached, take a token and return true otherwise. */
+    bool limit(const time_point& now, const Quota& quota) {
+        if (quota.unlimited())
+            return true;
+        auto tat = std::max(tat_, now);
+        if (tat + quota.interval - now > quota.burst)
+            return false;
+        tat_ = tat + quota.interval;
+        return true;
+    }
+
+    /** True if the bucket is full, in which case the limiter can be dropped */
+    bool idle(const time_point& now) const {
+        return tat_ <= now;
+    }
+
+private:
+    time_point tat_ {time_point::min()};
+};
+
+/**
+ * Token buckets for up to a fixed number of IP addresses, only considering
+ * the first 64 bits of IPv6 addresses (like SockAddr::ipCmp).
+ * Addresses are found with a hash table, and the least recently seen one
+ * is forgotten when the table is full, so that memory and time per request
+ * stay constant whatever the number of addresses.
+ */
+class OPENDHT_PUBLIC IpRateLimiter {
+public:
+    static constexpr size_t DEFAULT_CAPACITY {4096};
+
+    IpRateLimiter(TokenBucket::Quota quota = {}, size_t capacity = DEFAULT_CAPACITY);
+
+    /** Return false if quota is reached for the address, take a token and return true otherwise. */
+    bool limit(const SockAddr& addr, const time_point& now);
+
+    void setQuota(const TokenBucket::Quota& quota) { quota_ = quota; }
+    const TokenBucket::Quota& getQuota() const { return quota_; }
+
+    /** Number of tracked addresses */
+    size_t size() const { return size_; }
+    size_t capacity() const { return entries_.size(); }
+
+private:
+    static constexpr uint32_t NONE {(uint32_t)-1};
+
+    struct Key {
+        uint64_t ip {0};
+        sa_family_t family {AF_UNSPEC};
+        bool operator==(const Key& o) const { return ip == o.ip and family == o.family; }
+    };
+    struct Entry {
+        Key key {};
+        TokenBucket bucket {};
+        /* LRU list, most recently seen first */
+        uint32_t prev {NONE};
+        uint32_t next {NONE};
+    };
+
+    static Key makeKey(const SockAddr& addr);
+    size_t home(const Key& key) const;
+    /** Return the slot of key in index_, or of the free slot ending its probe sequence */
+    size_t lookup(const Key& key) const;
+    void unindex(size_t slot);
+    void unlink(uint32_t e);
+    void pushFront(uint32_t e);
+
+    TokenBucket::Quota quota_;
+    std::vector<Entry> entries_;
+    /* open addressing table of entry indexes */
+    std::vector<uint32_t> index_;
+    size_t mask_;
+    size_t size_ {0};
+    uint32_t head_ {NONE};
+    uint32_t tail_ {NONE};
+};
+
 }
@@ -28,20 +28,43 @@ namespace net {
 class NetworkEngine;
 }
 
-struct Bucket {
-    Bucket() : cached() {}
+struct OPENDHT_PUBLIC Bucket {
+    /* maximum number of replacement candidates kept per bucket */
+    static constexpr size_t REPLACEMENT_CACHE_SIZE {8};
+
+    Bucket() {}
     Bucket(sa_family_t af, const InfoHash& f = {}, time_point t = time_point::min())
-        : af(af), first(f), time(t), cached() {}
+        : af(af), first(f), time(t) {}
     sa_family_t af {0};
     InfoHash first {};
     time_point time {time_point::min()}; /* time of last reply in this bucket */
-    std::list<Sp<Node>> nodes {};
-    Sp<Node> cached;                    /* the address of a likely candidate */
+    std::vector<Sp<Node>> nodes {};
+    std::vector<Sp<Node>> cache {};     /* replacement candidates, most likely to be good first */
+    uint64_t generation {0};            /* stamp of the last change of nodes, see RoutingTable::touch */
 
     /** Return a random node in a bucket. */
     Sp<Node> randomNode();
 
-    void sendCachedPing(net::NetworkEngine& ne);
+    /**
+     * Keep a node as a replacement candidate for a full bucket.
+     * Candidates are ranked by liveness, then round-trip time, and the
+     * least likely to be good is dropped past REPLACEMENT_CACHE_SIZE.
+     */
+    void cacheNode(const Sp<Node>& node, time_point now);
+
+    /**
+     * Ping the best replacement candidate, removing it from the cache.
+     * Return false if there was no candidate left.
+     */
+    bool sendCachedPing(net::NetworkEngine& ne);
+
+    /**
+     * Ping up to max nodes at once to refresh the bucket: dubious nodes
+     * first, then replacement candidates for free or expired slots.
+     * Replies confirm nodes through RoutingTable::onNewNode.
+     * Return the number of pings sent.
+     */
+    unsigned refresh(net::NetworkEngine& ne, time_point now, unsigned max);
     void connectivityChanged() {
         time = time_point::min();
         for (auto& node : nodes)
@@ -49,9 +72,18 @@ struct Bucket {
     }
 };
 
-class RoutingTable : public std::list<Bucket> {
+/**
+ * Buckets are stored contiguously, sorted by the first id of their range,
+ * so that finding the bucket of an id is a binary search.
+ * Splitting a bucket invalidates iterators and references to buckets.
+ */
+class OPENDHT_PUBLIC RoutingTable : public std::vector<Bucket> {
 public:
-    using std::list<Bucket>::list;
+    using std::vector<Bucket>::vector;
+
+    /* how long a packed answer is used while its buckets don't change */
+    static constexpr std::chrono::seconds PACKED_NODES_TTL {5};
+    static constexpr size_t PACKED_NODES_CACHE_SIZE {128};
 
     time_point grow_time {time_point::min()};
     bool is_client {false};
@@ -60,6 +92,22 @@ public:
 
     std::vector<Sp<Node>> findClosestNodes(const InfoHash id, time_point now, size_t count = TARGET_NODES) const;
 
+    /**
+     * The TARGET_NODES closest nodes of id, packed as sent in replies.
+     * Recent answers are kept in a small cache keyed by target, and reused
+     * while none of the buckets they were taken from changed, for at most
+     * PACKED_NODES_TTL since node liveness also depends on time.
+     */
+    Sp<const Blob> findClosestNodesPacked(const InfoHash& id, time_point now);
+
+    /**
+     * Record a change of the nodes of the bucket, invalidating cached
+     * answers that used it. Must be called after every such change.
+     */
+    void touch(Bucket& b) {
+        b.generation = ++generation;
+    }
+
     RoutingTable::iterator findBucket(const InfoHash& id);
     RoutingTable::const_iterator findBucket(const InfoHash& id) const;
 
@@ -80,8 +128,10 @@ public:
 
     void connectivityChanged(const time_point& now) {
         grow_time = now;
-        for (auto& b : *this)
+        for (auto& b : *this) {
             b.connectivityChanged();
+            touch(b);
+        }
     }
 
     bool onNewNode(const Sp<Node>& node, int comfirm, const time_point& now, const InfoHash& myid, net::NetworkEngine& ne);
@@ -97,6 +147,24 @@ public:
      * Split a bucket in two equal parts.
      */
     bool split(const RoutingTable::iterator& b);
+
+private:
+    struct PackedNodes {
+        InfoHash id {};
+        time_point time {time_point::min()};
+        /* highest generation of the buckets the nodes were taken from */
+        uint64_t generation {0};
+        unsigned buckets {0};
+        Sp<Blob> nodes {};
+    };
+
+    std::vector<Sp<Node>> findClosestNodes(const InfoHash& id, time_point now, size_t count, uint64_t& generation, unsigned& buckets) const;
+
+    /** Highest generation of the first n buckets visited by findClosestNodes */
+    uint64_t generationOf(const InfoHash& id, unsigned n) const;
+
+    uint64_t generation {0};
+    std::vector<PackedNodes> packed_nodes {};
 };
 
 }
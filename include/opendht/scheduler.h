@@ -24,6 +24,7 @@
 
 #include <functional>
 #include <map>
+#include <memory>
 
 namespace dht {
 
@@ -32,15 +33,49 @@ namespace dht {
  * @brief   Job scheduler
  * @details
  * Maintains the timings upon which to execute a job.
+ * Two backends are available: a std::multimap ordered by time, and a
+ * hierarchical timing wheel (the default) with O(1) insertion and
+ * cancellation, where cancelled or rescheduled jobs are actually removed.
  */
-class Scheduler {
+class OPENDHT_PUBLIC Scheduler {
 public:
-    struct Job {
+    enum class Backend {
+        /** Jobs ordered by time in a multimap; cancelled jobs stay until due. */
+        Map,
+        /** Hierarchical timing wheel with a 1ms tick. */
+        Wheel
+    };
+
+    class TimerWheel;
+
+    struct OPENDHT_PUBLIC Job {
         Job(std::function<void()>&& f) : do_(std::move(f)) {}
         std::function<void()> do_;
-        void cancel() { do_ = {}; }
+        /** Clear the task, and remove the job from the timing wheel if scheduled. */
+        void cancel();
+    private:
+        friend class Scheduler;
+        friend class TimerWheel;
+        /* Intrusive timing wheel slot list, set while the job is scheduled */
+        TimerWheel* wheel_ {nullptr};
+        Sp<Job> self_ {};
+        Job* prev_ {nullptr};
+        Job* next_ {nullptr};
+        /* Time the job was last added for, with both backends */
+        time_point time_ {};
+        size_t slot_ {0};
     };
 
+    explicit Scheduler(Backend backend = Backend::Wheel);
+    ~Scheduler();
+
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    Backend getBackend() const {
+        return wheel_ ? Backend::Wheel : Backend::Map;
+    }
+
     /**
      * Adds another job to the queue.
      *
@@ -51,62 +86,33 @@ public:
      */
     Sp<Scheduler::Job> add(time_point t, std::function<void()>&& job_func) {
         auto job = std::make_shared<Job>(std::move(job_func));
-        if (t != time_point::max())
-            timers.emplace(std::move(t), job);
+        add(job, t);
         return job;
     }
 
-    void add(const Sp<Scheduler::Job>& job, time_point t) {
-        if (t != time_point::max())
-            timers.emplace(std::move(t), job);
-    }
+    void add(const Sp<Scheduler::Job>& job, time_point t);
 
     /**
-     * Reschedules a job.
+     * Reschedules a job. The job itself is moved, so that other
+     * references to it, for instance to cancel it, stay valid.
      *
      * @param job  The job to edit.
      * @param t  The time at which the job shall be rescheduled.
      */
-    void edit(Sp<Scheduler::Job>& job, time_point t) {
-        if (not job) {
-            return;
-        }
-        // std::function move doesn't garantee to leave the object empty.
-        // Force clearing old value.
-        auto task = std::move(job->do_);
-        job->do_ = {};
-        job = add(t, std::move(task));
-    }
+    void edit(Sp<Scheduler::Job>& job, time_point t);
 
     /**
      * Runs the jobs to do up to now.
      *
      * @return The time for the next job to run.
      */
-    time_point run() {
-        syncTime();
-        while (not timers.empty()) {
-            auto timer = timers.begin();
-            /*
-             * Running jobs scheduled before "now" prevents run+rescheduling
-             * loops before this method ends. It is garanteed by the fact that a
-             * job will at least be scheduled for "now" and not before.
-             */
-            if (timer->first > now)
-                break;
-
-            auto job = std::move(timer->second);
-            timers.erase(timer);
-
-            if (job->do_)
-                job->do_();
-        }
-        return getNextJobTime();
-    }
+    time_point run();
 
-    inline time_point getNextJobTime() const {
-        return timers.empty() ? time_point::max() : timers.begin()->first;
-    }
+    /**
+     * With the timing wheel, jobs beyond the current wheel revolution
+     * only give a lower bound of their time: the caller may wake up early.
+     */
+    time_point getNextJobTime() const;
 
     /**
      * Accessors for the common time reference used for synchronizing
@@ -118,6 +124,7 @@ public:
 private:
     time_point now {clock::now()};
     std::multimap<time_point, Sp<Job>> timers {}; /* the jobs ordered by time */
+    std::unique_ptr<TimerWheel> wheel_;
 };
 
 }
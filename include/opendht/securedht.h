@@ -168,6 +168,9 @@ public:
     void setStorageLimit(size_t limit = DEFAULT_STORAGE_LIMIT) override {
         dht_->setStorageLimit(limit);
     }
+    void setRateLimit(size_t max_req_per_sec, size_t max_peer_req_per_sec) override {
+        dht_->setRateLimit(max_req_per_sec, max_peer_req_per_sec);
+    }
     std::vector<NodeExport> exportNodes() const override {
         return dht_->exportNodes();
     }
@@ -183,6 +186,9 @@ public:
     std::vector<unsigned> getNodeMessageStats(bool in = false) override {
         return dht_->getNodeMessageStats(in);
     }
+    TrafficStats getTrafficStats() const override {
+        return dht_->getTrafficStats();
+    }
     std::string getRoutingTablesLog(sa_family_t af) const override {
         return dht_->getRoutingTablesLog(af);
     }
@@ -201,6 +207,9 @@ public:
     time_point periodic(const uint8_t *buf, size_t buflen, const sockaddr* from, socklen_t fromlen) override {
         return dht_->periodic(buf, buflen, from, fromlen);
     }
+    time_point periodic(net::DecodedPacket&& pkt) override {
+        return dht_->periodic(std::move(pkt));
+    }
     NodeStatus getStatus(sa_family_t af) const override {
         return dht_->getStatus(af);
     }
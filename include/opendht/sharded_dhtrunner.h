@@ -0,0 +1,98 @@
+/*
+ *  Copyright (C) 2019 Savoir-faire Linux Inc.
+ *  Author(s) : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "dhtrunner.h"
+
+#include <vector>
+#include <memory>
+
+namespace dht {
+
+/**
+ * Runs several DHT nodes ("shards") in the same process, behind the same
+ * UDP port (SO_REUSEPORT). Each shard has its own routing table, storage
+ * and thread, so that request handling scales with the number of cores.
+ * Shards share the node ID: a DHT message doesn't carry the ID it is sent
+ * to, so peers must get their replies from the ID they know at this address.
+ *
+ * The key space is split between shards by the first byte of keys. The
+ * kernel dispatches incoming packets to shards by source address. Requests
+ * are routed to the shard owning their target, and replies to the shard
+ * which sent the request, identified by its transaction id. Shards send
+ * from the shared port. At most 255 shards are run.
+ *
+ * Operations on a key are handled by the shard owning the key.
+ */
+class OPENDHT_PUBLIC ShardedDhtRunner {
+public:
+    ShardedDhtRunner() {}
+    ~ShardedDhtRunner();
+
+    /**
+     * Start the shards.
+     * @param shards: number of shards, 0 to use one per hardware thread.
+     * @param config: configuration used for every shard. Shards all use
+     *        the configured node ID (or the same random one), and are
+     *        always threaded.
+     */
+    void run(in_port_t port, const DhtRunner::Config& config, unsigned shards = 0, std::shared_ptr<Logger> logger = {});
+    void run(const SockAddr& local4, const SockAddr& local6, const DhtRunner::Config& config, unsigned shards = 0, std::shared_ptr<Logger> logger = {});
+
+    /** Bootstrap all shards */
+    void bootstrap(const std::string& host, const std::string& service);
+    void bootstrap(const SockAddr& addr, DoneCallbackSimple&& cb = {});
+
+    void get(InfoHash hash, GetCallback vcb, DoneCallback dcb = {}, Value::Filter f = {}, Where w = {}) {
+        getShard(hash).get(hash, std::move(vcb), std::move(dcb), std::move(f), std::move(w));
+    }
+    void put(InfoHash hash, std::shared_ptr<Value> value, DoneCallback cb = {}, time_point created = time_point::max(), bool permanent = false) {
+        getShard(hash).put(hash, std::move(value), std::move(cb), created, permanent);
+    }
+    void put(InfoHash hash, std::shared_ptr<Value> value, DoneCallbackSimple cb, time_point created = time_point::max(), bool permanent = false) {
+        put(hash, std::move(value), bindDoneCb(cb), created, permanent);
+    }
+    std::future<size_t> listen(InfoHash key, ValueCallback vcb, Value::Filter f = {}, Where w = {}) {
+        return getShard(key).listen(key, std::move(vcb), std::move(f), std::move(w));
+    }
+    void cancelListen(InfoHash h, size_t token) {
+        getShard(h).cancelListen(h, token);
+    }
+
+    /** @return the shard responsible for key */
+    DhtRunner& getShard(const InfoHash& key);
+
+    const std::vector<std::unique_ptr<DhtRunner>>& getShards() const { return shards_; }
+
+    SockAddr getBound(sa_family_t f = AF_INET) const;
+
+    /** Sum of the node stats of all shards */
+    NodeStats getNodesStats(sa_family_t af) const;
+
+    /** Sum of the traffic of all shards, with merged latency histograms */
+    TrafficStats getTrafficStats() const;
+
+    void shutdown(ShutdownCallback cb);
+    void join();
+
+private:
+    std::vector<std::unique_ptr<DhtRunner>> shards_ {};
+};
+
+}
@@ -21,32 +21,413 @@
 
 #include "def.h"
 
+#include <atomic>
+#include <chrono>
+#include <mutex>
 #include <condition_variable>
 #include <vector>
-#include <queue>
 #include <future>
 #include <functional>
+#include <exception>
+#include <type_traits>
+#include <new>
+#include <cstddef>
 
 namespace dht {
 
+/**
+ * Move-only callable wrapper used to queue tasks.
+ * Callables up to INLINE_SIZE bytes, three times the inline buffer of
+ * common std::function implementations, are stored without allocation.
+ */
+class Task {
+public:
+    static constexpr size_t INLINE_SIZE {48};
+
+    Task() noexcept {}
+    Task(std::nullptr_t) noexcept {}
+
+    template <typename F,
+              typename D = typename std::decay<F>::type,
+              typename = typename std::enable_if<not std::is_same<D, Task>::value>::type,
+              typename = decltype(std::declval<D&>()())>
+    Task(F&& f) {
+        if (isNull(f))
+            return;
+        init<D>(std::forward<F>(f), std::integral_constant<bool, fitsInline<D>()>{});
+    }
+
+    Task(Task&& o) noexcept { moveFrom(o); }
+    Task& operator=(Task&& o) noexcept {
+        if (this != &o) {
+            reset();
+            moveFrom(o);
+        }
+        return *this;
+    }
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() { reset(); }
+
+    explicit operator bool() const noexcept { return ops_; }
+    void operator()() { ops_->invoke(&buf_); }
+
+    void reset() noexcept {
+        if (ops_) {
+            ops_->destroy(&buf_);
+            ops_ = nullptr;
+        }
+    }
+
+    template <typename F>
+    static constexpr bool fitsInline() {
+        return sizeof(F) <= INLINE_SIZE
+           and alignof(F) <= alignof(std::max_align_t)
+           and std::is_nothrow_move_constructible<F>::value;
+    }
+
+private:
+    struct Ops {
+        void (*invoke)(void*);
+        void (*move)(void* dst, void* src);
+        void (*destroy)(void*);
+    };
+    template <typename F>
+    struct Inline {
+        static void invoke(void* p) { (*static_cast<F*>(p))(); }
+        static void move(void* dst, void* src) {
+            new (dst) F(std::move(*static_cast<F*>(src)));
+            static_cast<F*>(src)->~F();
+        }
+        static void destroy(void* p) { static_cast<F*>(p)->~F(); }
+        static constexpr Ops ops {invoke, move, destroy};
+    };
+    template <typename F>
+    struct Heap {
+        static void invoke(void* p) { (**static_cast<F**>(p))(); }
+        static void move(void* dst, void* src) { *static_cast<F**>(dst) = *static_cast<F**>(src); }
+        static void destroy(void* p) { delete *static_cast<F**>(p); }
+        static constexpr Ops ops {invoke, move, destroy};
+    };
+
+    template <typename F>
+    static bool isNull(const F&) { return false; }
+    template <typename R, typename... Args>
+    static bool isNull(const std::function<R(Args...)>& f) { return not f; }
+    template <typename R, typename... Args>
+    static bool isNull(R (*f)(Args...)) { return not f; }
+
+    template <typename D, typename F>
+    void init(F&& f, std::true_type) {
+        new (&buf_) D(std::forward<F>(f));
+        ops_ = &Inline<D>::ops;
+    }
+    template <typename D, typename F>
+    void init(F&& f, std::false_type) {
+        *reinterpret_cast<D**>(&buf_) = new D(std::forward<F>(f));
+        ops_ = &Heap<D>::ops;
+    }
+
+    void moveFrom(Task& o) noexcept {
+        if (o.ops_) {
+            o.ops_->move(&buf_, &o.buf_);
+            ops_ = o.ops_;
+            o.ops_ = nullptr;
+        }
+    }
+
+    typename std::aligned_storage<INLINE_SIZE, alignof(std::max_align_t)>::type buf_;
+    const Ops* ops_ {nullptr};
+};
+
+template <typename F>
+constexpr Task::Ops Task::Inline<F>::ops;
+template <typename F>
+constexpr Task::Ops Task::Heap<F>::ops;
+
+namespace detail {
+
+/**
+ * FIFO of tasks in a ring buffer that grows by doubling and never shrinks,
+ * so that queueing a task doesn't allocate once the queue reached its
+ * usual size. Tasks can also be taken from the back, to be stolen.
+ */
+class TaskQueue {
+public:
+    bool empty() const { return size_ == 0; }
+    size_t size() const { return size_; }
+
+    void push_back(Task&& task) {
+        if (size_ == ring_.size())
+            grow();
+        ring_[(head_ + size_) & (ring_.size() - 1)] = std::move(task);
+        size_++;
+    }
+    Task pop_front() {
+        Task task = std::move(ring_[head_]);
+        head_ = (head_ + 1) & (ring_.size() - 1);
+        size_--;
+        return task;
+    }
+    Task pop_back() {
+        size_--;
+        return std::move(ring_[(head_ + size_) & (ring_.size() - 1)]);
+    }
+
+private:
+    static constexpr size_t MIN_SIZE {16};
+
+    void grow() {
+        std::vector<Task> ring(ring_.empty() ? MIN_SIZE : ring_.size() * 2);
+        for (size_t i = 0; i < size_; i++)
+            ring[i] = std::move(ring_[(head_ + i) & (ring_.size() - 1)]);
+        ring_ = std::move(ring);
+        head_ = 0;
+    }
+
+    std::vector<Task> ring_ {};
+    size_t head_ {0};
+    size_t size_ {0};
+};
+
+/**
+ * Shared state of a TaskFuture, recycled through a per-type pool.
+ * Referenced once by the task and once by the future.
+ */
+template <typename T>
+struct TaskState {
+    using Value = typename std::conditional<std::is_void<T>::value, char, T>::type;
+
+    std::atomic_uint refs {0};
+    std::mutex lock {};
+    std::condition_variable cv {};
+    bool ready {false};
+    bool hasValue {false};
+    std::exception_ptr error {};
+    typename std::aligned_storage<sizeof(Value), alignof(Value)>::type value;
+
+    Value& get() { return *reinterpret_cast<Value*>(&value); }
+
+    template <typename F>
+    void fulfill(F& f) {
+        try {
+            set(f, std::is_void<T>{});
+        } catch (...) {
+            error = std::current_exception();
+        }
+        finish();
+    }
+    void fail(std::exception_ptr e) {
+        error = std::move(e);
+        finish();
+    }
+    void finish() {
+        {
+            std::lock_guard<std::mutex> l(lock);
+            ready = true;
+        }
+        cv.notify_all();
+    }
+    void wait() {
+        std::unique_lock<std::mutex> l(lock);
+        cv.wait(l, [&]{ return ready; });
+    }
+    void clear() {
+        if (hasValue)
+            get().~Value();
+        hasValue = false;
+        ready = false;
+        error = {};
+    }
+
+    static TaskState* acquire();
+    static void release(TaskState* s);
+
+private:
+    template <typename F>
+    void set(F& f, std::true_type) { f(); }
+    template <typename F>
+    void set(F& f, std::false_type) {
+        new (&value) Value(f());
+        hasValue = true;
+    }
+};
+
+template <typename T>
+class TaskStatePool {
+public:
+    static constexpr size_t MAX_FREE {1024};
+
+    static TaskStatePool& instance() {
+        // Never destroyed: states may be released during static destruction
+        static auto pool = new TaskStatePool;
+        return *pool;
+    }
+    TaskState<T>* acquire() {
+        {
+            std::lock_guard<std::mutex> l(lock_);
+            if (not free_.empty()) {
+                auto s = free_.back();
+                free_.pop_back();
+                return s;
+            }
+        }
+        return new TaskState<T>;
+    }
+    void release(TaskState<T>* s) {
+        s->clear();
+        {
+            std::lock_guard<std::mutex> l(lock_);
+            if (free_.size() < MAX_FREE) {
+                free_.emplace_back(s);
+                return;
+            }
+        }
+        delete s;
+    }
+private:
+    std::mutex lock_ {};
+    std::vector<TaskState<T>*> free_ {};
+};
+
+template <typename T>
+TaskState<T>*
+TaskState<T>::acquire()
+{
+    auto s = TaskStatePool<T>::instance().acquire();
+    s->refs = 2;
+    return s;
+}
+
+template <typename T>
+void
+TaskState<T>::release(TaskState* s)
+{
+    if (s and --s->refs == 0)
+        TaskStatePool<T>::instance().release(s);
+}
+
+/** Task side reference: reports a broken promise if the task never ran */
+template <typename T>
+struct TaskStateRef {
+    TaskState<T>* state;
+    explicit TaskStateRef(TaskState<T>* s) : state(s) {}
+    TaskStateRef(TaskStateRef&& o) noexcept : state(o.state) { o.state = nullptr; }
+    TaskStateRef(const TaskStateRef&) = delete;
+    ~TaskStateRef() {
+        if (state) {
+            if (not state->ready)
+                state->fail(std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+            TaskState<T>::release(state);
+        }
+    }
+};
+
+}
+
+/**
+ * Result of ThreadPool::submit, a lighter std::future:
+ * its shared state comes from a pool instead of being allocated.
+ */
+template <typename T>
+class TaskFuture {
+public:
+    TaskFuture() {}
+    explicit TaskFuture(detail::TaskState<T>* s) : state_(s) {}
+    TaskFuture(TaskFuture&& o) noexcept : state_(o.state_) { o.state_ = nullptr; }
+    TaskFuture& operator=(TaskFuture&& o) noexcept {
+        std::swap(state_, o.state_);
+        return *this;
+    }
+    TaskFuture(const TaskFuture&) = delete;
+    TaskFuture& operator=(const TaskFuture&) = delete;
+    ~TaskFuture() { detail::TaskState<T>::release(state_); }
+
+    bool valid() const { return state_; }
+    bool ready() const {
+        std::lock_guard<std::mutex> l(state_->lock);
+        return state_->ready;
+    }
+    void wait() const { state_->wait(); }
+    template <class Rep, class Period>
+    bool wait_for(const std::chrono::duration<Rep, Period>& d) const {
+        std::unique_lock<std::mutex> l(state_->lock);
+        return state_->cv.wait_for(l, d, [&]{ return state_->ready; });
+    }
+
+    /** Wait for the result, and rethrow the task exception if any. */
+    T get() {
+        if (not state_)
+            throw std::future_error(std::future_errc::no_state);
+        wait();
+        std::unique_ptr<detail::TaskState<T>, void(*)(detail::TaskState<T>*)> s(state_, &detail::TaskState<T>::release);
+        state_ = nullptr;
+        if (s->error)
+            std::rethrow_exception(s->error);
+        return take(*s, std::is_void<T>{});
+    }
+
+private:
+    detail::TaskState<T>* state_ {nullptr};
+
+    static void take(detail::TaskState<T>&, std::true_type) {}
+    static T take(detail::TaskState<T>& s, std::false_type) { return std::move(s.get()); }
+};
+
 class OPENDHT_PUBLIC ThreadPool {
 public:
+    enum class Mode {
+        /** One queue shared by threads started on demand */
+        Shared,
+        /** One deque per worker; idle workers steal from busy ones */
+        WorkStealing
+    };
+
+    /** Work-stealing pool for CPU-bound tasks */
     static ThreadPool& computation();
     static ThreadPool& io();
 
     ThreadPool();
     ThreadPool(size_t maxThreads);
+    /**
+     * @param pinThreads  in WorkStealing mode, bind each worker to one CPU (Linux only)
+     */
+    ThreadPool(size_t maxThreads, Mode mode, bool pinThreads = false);
     ~ThreadPool();
 
-    void run(std::function<void()>&& cb);
+    void run(Task&& cb);
+    /**
+     * Queue several tasks at once.
+     * In WorkStealing mode, tasks are spread over the workers
+     * with one lock per worker.
+     */
+    void run(std::vector<Task>&& tasks);
 
     template<class T>
     std::future<T> get(std::function<T()>&& cb) {
-        auto ret = std::make_shared<std::promise<T>>();
-        run(std::bind([=](std::function<T()>& mcb) mutable {
-                ret->set_value(mcb());
-            }, std::move(cb)));
-        return ret->get_future();
+        std::promise<T> ret;
+        auto future = ret.get_future();
+        run([cb = std::move(cb), ret = std::move(ret)]() mutable {
+            try {
+                ret.set_value(cb());
+            } catch (...) {
+                ret.set_exception(std::current_exception());
+            }
+        });
+        return future;
+    }
+
+    /**
+     * Like get(), without std::promise: the shared state is pooled,
+     * so submitting a small callable doesn't allocate.
+     */
+    template<class F, class T = decltype(std::declval<typename std::decay<F>::type&>()())>
+    TaskFuture<T> submit(F&& f) {
+        auto state = detail::TaskState<T>::acquire();
+        run([f = typename std::decay<F>::type(std::forward<F>(f)), ref = detail::TaskStateRef<T>(state)]() mutable {
+            ref.state->fulfill(f);
+        });
+        return TaskFuture<T>(state);
     }
     template<class T>
     std::shared_future<T> getShared(std::function<T()>&& cb) {
@@ -56,35 +437,61 @@ public:
     void stop();
     void join();
 
+    Mode getMode() const { return mode_; }
+
 private:
     struct ThreadState;
-    std::queue<std::function<void()>> tasks_ {};
+    detail::TaskQueue tasks_ {};
     std::vector<std::unique_ptr<ThreadState>> threads_;
     unsigned readyThreads_ {0};
     std::mutex lock_ {};
     std::condition_variable cv_ {};
 
     const unsigned maxThreads_;
-    bool running_ {true};
+    const Mode mode_ {Mode::Shared};
+    std::atomic_bool running_ {true};
+
+    /* WorkStealing mode */
+    struct Worker;
+    std::vector<std::unique_ptr<Worker>> workers_;
+    /** Queued tasks, over all workers */
+    std::atomic<size_t> pending_ {0};
+    std::atomic<unsigned> sleeping_ {0};
+    std::atomic<unsigned> nextWorker_ {0};
+
+    void push(Worker& w, Task&& task);
+    Worker& pickWorker();
+    void wakeWorkers(size_t n);
+    void work(unsigned i, bool pin);
+    bool steal(unsigned i, Task& task);
 };
 
+/**
+ * Runs tasks on a ThreadPool, at most maxConcurrent at once, in order.
+ * Must be owned by a shared_ptr. Jobs queued on the pool keep the executor
+ * alive, so that its tasks still run if it is released before the pool
+ * gets to them.
+ */
 class OPENDHT_PUBLIC Executor : public std::enable_shared_from_this<Executor> {
 public:
     Executor(ThreadPool& pool, unsigned maxConcurrent = 1)
      : threadPool_(pool), maxConcurrent_(maxConcurrent)
     {}
 
-    void run(std::function<void()>&& task);
+    void run(Task&& task);
 
 private:
     std::reference_wrapper<ThreadPool> threadPool_;
     const unsigned maxConcurrent_ {1};
     std::mutex lock_ {};
+    /* jobs queued on the pool or running */
     unsigned current_ {0};
-    std::queue<std::function<void()>> tasks_ {};
+    /* jobs queued on the pool, not running yet */
+    unsigned pending_ {0};
+    detail::TaskQueue tasks_ {};
 
-    void run_(std::function<void()>&& task);
     void schedule();
+    void runNext();
 };
 
 }
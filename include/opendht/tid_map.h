@@ -0,0 +1,252 @@
+/*
+ *  Copyright (C) 2019 Savoir-faire Linux Inc.
+ *  Author : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <vector>
+#include <utility>
+#include <iterator>
+#include <cstdint>
+#include <cstddef>
+
+namespace dht {
+
+using Tid = uint32_t;
+
+/**
+ * Open-addressing hash table keyed by transaction id.
+ *
+ * Linear probing over a power-of-two array, with Fibonacci hashing so that
+ * sequential ids spread over the table, and backward-shift deletion so
+ * that no tombstone is left behind. Lookups are O(1) and only touch a few
+ * adjacent slots. Nothing is allocated until the first insertion.
+ *
+ * Inserting or erasing invalidates iterators and element references.
+ */
+template <typename T>
+class TidMap {
+public:
+    using key_type = Tid;
+    using mapped_type = T;
+    using value_type = std::pair<Tid, T>;
+
+private:
+    struct Slot {
+        bool used {false};
+        value_type kv {};
+    };
+
+    template <typename S, typename V>
+    class Iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = TidMap::value_type;
+        using difference_type = std::ptrdiff_t;
+        using pointer = V*;
+        using reference = V&;
+
+        Iterator() {}
+        Iterator(S* s, S* e) : slot(s), end(e) { skip(); }
+        /* iterator to const_iterator */
+        template <typename S2, typename V2>
+        Iterator(const Iterator<S2, V2>& o) : slot(o.slot), end(o.end) {}
+
+        reference operator*() const { return slot->kv; }
+        pointer operator->() const { return &slot->kv; }
+        Iterator& operator++() { ++slot; skip(); return *this; }
+        Iterator operator++(int) { auto r = *this; ++*this; return r; }
+        bool operator==(const Iterator& o) const { return slot == o.slot; }
+        bool operator!=(const Iterator& o) const { return slot != o.slot; }
+    private:
+        friend class TidMap;
+        template <typename, typename> friend class Iterator;
+        void skip() { while (slot != end and not slot->used) ++slot; }
+        S* slot {nullptr};
+        S* end {nullptr};
+    };
+
+public:
+    TidMap() {}
+    TidMap(const TidMap&) = default;
+    TidMap& operator=(const TidMap&) = default;
+    /** The moved-from table is left empty */
+    TidMap(TidMap&& o) noexcept
+     : slots_(std::move(o.slots_)), size_(o.size_), mask_(o.mask_), bits_(o.bits_) {
+        o.reset();
+    }
+    TidMap& operator=(TidMap&& o) noexcept {
+        if (this != &o) {
+            slots_ = std::move(o.slots_);
+            size_ = o.size_;
+            mask_ = o.mask_;
+            bits_ = o.bits_;
+            o.reset();
+        }
+        return *this;
+    }
+
+    using iterator = Iterator<Slot, value_type>;
+    using const_iterator = Iterator<const Slot, const value_type>;
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    size_t capacity() const { return slots_.size(); }
+
+    iterator begin() { return {slots_.data(), slots_.data() + slots_.size()}; }
+    iterator end() { return {slots_.data() + slots_.size(), slots_.data() + slots_.size()}; }
+    const_iterator begin() const { return {slots_.data(), slots_.data() + slots_.size()}; }
+    const_iterator end() const { return {slots_.data() + slots_.size(), slots_.data() + slots_.size()}; }
+
+    iterator find(Tid key) {
+        auto i = lookup(key);
+        return i == NPOS ? end() : iterator(&slots_[i], slots_.data() + slots_.size());
+    }
+    const_iterator find(Tid key) const {
+        auto i = lookup(key);
+        return i == NPOS ? end() : const_iterator(&slots_[i], slots_.data() + slots_.size());
+    }
+    size_t count(Tid key) const { return lookup(key) == NPOS ? 0 : 1; }
+
+    /** Insert if the key is absent. Like std::map, v is not consumed otherwise. */
+    template <typename V>
+    std::pair<iterator, bool> emplace(Tid key, V&& v) {
+        reserve(size_ + 1);
+        size_t i = home(key);
+        for (;; i = (i + 1) & mask_) {
+            auto& s = slots_[i];
+            if (not s.used) {
+                s.used = true;
+                s.kv.first = key;
+                s.kv.second = std::forward<V>(v);
+                size_++;
+                return {iterator(&s, slots_.data() + slots_.size()), true};
+            }
+            if (s.kv.first == key)
+                return {iterator(&s, slots_.data() + slots_.size()), false};
+        }
+    }
+
+    T& operator[](Tid key) {
+        auto i = lookup(key);
+        if (i != NPOS)
+            return slots_[i].kv.second;
+        return emplace(key, T {}).first->second;
+    }
+
+    size_t erase(Tid key) {
+        auto i = lookup(key);
+        if (i == NPOS)
+            return 0;
+        remove(i);
+        return 1;
+    }
+    void erase(iterator it) {
+        remove(it.slot - slots_.data());
+    }
+
+    /** Remove all elements, keeping the allocated slots */
+    void clear() {
+        if (not size_)
+            return;
+        for (auto& s : slots_)
+            if (s.used) {
+                s.used = false;
+                s.kv.second = T {};
+            }
+        size_ = 0;
+    }
+
+    /** Make room for n elements without rehashing */
+    void reserve(size_t n) {
+        // Keep the load factor under 1/2: probe sequences stay short.
+        if (n * 2 <= slots_.size())
+            return;
+        size_t cap = MIN_CAPACITY;
+        while (cap < n * 2)
+            cap <<= 1;
+        rehash(cap);
+    }
+
+private:
+    static constexpr size_t NPOS {(size_t)-1};
+    static constexpr size_t MIN_CAPACITY {8};
+
+    size_t home(Tid key) const {
+        // Fibonacci hashing: keep the high bits of the product
+        return ((uint32_t)(key * 2654435769u) >> (32 - bits_)) & mask_;
+    }
+
+    size_t lookup(Tid key) const {
+        if (not size_)
+            return NPOS;
+        for (size_t i = home(key);; i = (i + 1) & mask_) {
+            const auto& s = slots_[i];
+            if (not s.used)
+                return NPOS;
+            if (s.kv.first == key)
+                return i;
+        }
+    }
+
+    void remove(size_t i) {
+        // Shift back following elements whose probe sequence goes through i
+        for (size_t j = (i + 1) & mask_;; j = (j + 1) & mask_) {
+            auto& s = slots_[j];
+            if (not s.used)
+                break;
+            auto h = home(s.kv.first);
+            if (((j - h) & mask_) >= ((j - i) & mask_)) {
+                slots_[i].kv = std::move(s.kv);
+                i = j;
+            }
+        }
+        slots_[i].used = false;
+        slots_[i].kv.second = T {};
+        size_--;
+    }
+
+    void reset() {
+        slots_.clear();
+        size_ = 0;
+        mask_ = 0;
+        bits_ = 0;
+    }
+
+    void rehash(size_t cap) {
+        std::vector<Slot> old(cap);
+        old.swap(slots_);
+        mask_ = cap - 1;
+        bits_ = 0;
+        while ((size_t(1) << bits_) < cap)
+            bits_++;
+        size_ = 0;
+        for (auto& s : old)
+            if (s.used)
+                emplace(s.kv.first, std::move(s.kv.second));
+    }
+
+    std::vector<Slot> slots_ {};
+    size_t size_ {0};
+    size_t mask_ {0};
+    unsigned bits_ {0};
+};
+
+template <typename T> constexpr size_t TidMap<T>::NPOS;
+template <typename T> constexpr size_t TidMap<T>::MIN_CAPACITY;
+
+}
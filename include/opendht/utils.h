@@ -153,6 +153,6 @@ unpackMsg(Blob b) {
 
 msgpack::unpacked unpackMsg(Blob b);
 
-msgpack::object* findMapValue(msgpack::object& map, const std::string& key);
+OPENDHT_PUBLIC msgpack::object* findMapValue(msgpack::object& map, const std::string& key);
 
 } // namespace dht
@@ -362,6 +362,9 @@ struct OPENDHT_PUBLIC Value
 
     /**
      * Sign the value with from and returns the encrypted version for to.
+     * The encrypted body carries the data compressed if the build allows
+     * it and it is worth it. The signature is always made on the
+     * uncompressed data, and checked after decompression.
      */
     Value encrypt(const crypto::PrivateKey& from, const crypto::PublicKey& to) {
         if (isEncrypted())
@@ -369,7 +372,8 @@ struct OPENDHT_PUBLIC Value
         setRecipient(to.getId());
         sign(from);
         Value nv {id};
-        nv.setCypher(to.encrypt(getToEncrypt()));
+        auto compressed = compress();
+        nv.setCypher(to.encrypt(compressed.empty() ? getToEncrypt() : getToEncrypt(compressed)));
         return nv;
     }
 
@@ -482,21 +486,7 @@ struct OPENDHT_PUBLIC Value
     template <typename Packer>
     void msgpack_pack_to_sign(Packer& pk) const
     {
-        bool has_owner = owner && *owner;
-        pk.pack_map((user_type.empty()?0:1) + (has_owner?(recipient ? 5 : 4):2));
-        if (has_owner) { // isSigned
-            pk.pack(std::string("seq"));   pk.pack(seq);
-            pk.pack(std::string("owner")); owner->msgpack_pack(pk);
-            if (recipient) {
-                pk.pack(std::string("to")); pk.pack(recipient);
-            }
-        }
-        pk.pack(std::string("type"));  pk.pack(type);
-        pk.pack(std::string("data"));  pk.pack_bin(data.size());
-                                       pk.pack_bin_body((const char*)data.data(), data.size());
-        if (not user_type.empty()) {
-            pk.pack(std::string("utype")); pk.pack(user_type);
-        }
+        msgpack_pack_body(pk, data, false);
     }
 
     template <typename Packer>
@@ -564,6 +554,11 @@ struct OPENDHT_PUBLIC Value
 
     Id id {INVALID_ID};
 
+    /**
+     * Codec flagged by the "z" body field when "data" is compressed.
+     */
+    enum class Compression : uint8_t { None = 0, Zstd = 1 };
+
     /**
      * Public key of the signer.
      */
@@ -604,6 +599,52 @@ struct OPENDHT_PUBLIC Value
 
 private:
     friend class SecureDht;
+
+    /* Data is only compressed when smaller by at least this much */
+    static constexpr size_t COMPRESSION_MIN_GAIN {64};
+
+    /**
+     * Compressed data for the wire, or empty if the build doesn't allow it
+     * or it is not worth it. Only used for values about to be encrypted:
+     * nodes predating compression re-pack plain values field by field and
+     * would drop the "z" flag, while cyphers are forwarded as-is.
+     */
+    Blob compress() const;
+
+    template <typename Packer>
+    void msgpack_pack_body(Packer& pk, const Blob& body, bool is_compressed) const
+    {
+        bool has_owner = owner && *owner;
+        pk.pack_map((user_type.empty()?0:1) + (is_compressed?1:0) + (has_owner?(recipient ? 5 : 4):2));
+        if (has_owner) { // isSigned
+            pk.pack(std::string("seq"));   pk.pack(seq);
+            pk.pack(std::string("owner")); owner->msgpack_pack(pk);
+            if (recipient) {
+                pk.pack(std::string("to")); pk.pack(recipient);
+            }
+        }
+        pk.pack(std::string("type"));  pk.pack(type);
+        pk.pack(std::string("data"));  pk.pack_bin(body.size());
+                                       pk.pack_bin_body((const char*)body.data(), body.size());
+        if (not user_type.empty()) {
+            pk.pack(std::string("utype")); pk.pack(user_type);
+        }
+        if (is_compressed) {
+            pk.pack(std::string("z")); pk.pack(static_cast<uint8_t>(Compression::Zstd));
+        }
+    }
+
+    /* Signed body to be encrypted, with compressed data */
+    Blob getToEncrypt(const Blob& compressed) const {
+        msgpack::sbuffer buffer;
+        msgpack::packer<msgpack::sbuffer> pk(&buffer);
+        pk.pack_map(2);
+        pk.pack(std::string("body")); msgpack_pack_body(pk, compressed, true);
+        pk.pack(std::string("sig"));  pk.pack_bin(signature.size());
+                                      pk.pack_bin_body((const char*)signature.data(), signature.size());
+        return {buffer.data(), buffer.data()+buffer.size()};
+    }
+
     /* Cache for crypto ops */
     bool signatureChecked {false};
     bool signatureValid {false};
@@ -1,5 +1,7 @@
 #include "callbacks.h"
 
+#include <algorithm>
+
 namespace dht {
 
 
@@ -76,6 +78,79 @@ NodeStats::toString() const
         ss << "Routing table depth: " << table_depth << std::endl;
         ss << "Network size estimation: " << getNetworkSizeEstimation() << " nodes" << std::endl;
     }
+    if (tx_queue_peak)
+        ss << "Transmit queue: " << tx_queue << " packets (peak " << tx_queue_peak << ")" << std::endl;
+    if (rtt_nodes)
+        ss << "Round-trip time (" << rtt_nodes << " nodes): min " << rtt_min << " ms, median " << rtt_median
+           << " ms, 90% " << rtt_p90 << " ms, max " << rtt_max << " ms, median deviation " << rttvar_median << " ms" << std::endl;
+    return ss.str();
+}
+
+void
+MessageTypeStats::add(const MessageTypeStats& o)
+{
+    requests_in += o.requests_in;
+    replies_in += o.replies_in;
+    errors_in += o.errors_in;
+    bytes_in += o.bytes_in;
+    requests_out += o.requests_out;
+    retransmits += o.retransmits;
+    replies_out += o.replies_out;
+    bytes_out += o.bytes_out;
+    rate_limited += o.rate_limited;
+    timeouts += o.timeouts;
+    latency_max = std::max(latency_max, o.latency_max);
+    for (const auto& b : o.latency_histogram)
+        latency_histogram[b.first] += b.second;
+    updateLatency();
+}
+
+void
+MessageTypeStats::updateLatency()
+{
+    latency_count = 0;
+    for (const auto& b : latency_histogram)
+        latency_count += b.second;
+    auto percentile = [&](unsigned p) -> uint64_t {
+        auto rank = (latency_count * p + 99) / 100;
+        uint64_t n = 0;
+        for (const auto& b : latency_histogram) {
+            n += b.second;
+            if (n >= rank)
+                return std::min(b.first, latency_max);
+        }
+        return latency_max;
+    };
+    latency_p50 = latency_count ? percentile(50) : 0;
+    latency_p90 = latency_count ? percentile(90) : 0;
+    latency_p99 = latency_count ? percentile(99) : 0;
+}
+
+void
+TrafficStats::add(const TrafficStats& o)
+{
+    for (const auto& m : o.messages)
+        messages[m.first].add(m.second);
+}
+
+std::string
+TrafficStats::toString() const
+{
+    std::stringstream ss;
+    for (const auto& m : messages) {
+        const auto& st = m.second;
+        ss << m.first << ": in " << st.requests_in << " requests, " << st.replies_in << " replies, "
+           << st.errors_in << " errors, " << st.bytes_in << " bytes; out " << st.requests_out << " requests ("
+           << st.retransmits << " retransmits), " << st.replies_out << " replies, " << st.bytes_out << " bytes";
+        if (st.rate_limited)
+            ss << "; " << st.rate_limited << " rate limited";
+        if (st.timeouts)
+            ss << "; " << st.timeouts << " timeouts";
+        if (st.latency_count)
+            ss << "; latency median " << st.latency_p50 << " us, 90% " << st.latency_p90
+               << " us, 99% " << st.latency_p99 << " us, max " << st.latency_max << " us";
+        ss << std::endl;
+    }
     return ss.str();
 }
 
@@ -94,6 +169,20 @@ NodeStats::toJson() const
         val["table_depth"] = static_cast<Json::LargestUInt>(table_depth);
         val["network_size_estimation"] = static_cast<Json::LargestUInt>(getNetworkSizeEstimation());
     }
+    if (tx_queue_peak) {
+        val["tx_queue"] = static_cast<Json::LargestUInt>(tx_queue);
+        val["tx_queue_peak"] = static_cast<Json::LargestUInt>(tx_queue_peak);
+    }
+    if (rtt_nodes) {
+        Json::Value rtt;
+        rtt["nodes"] = static_cast<Json::LargestUInt>(rtt_nodes);
+        rtt["min"] = static_cast<Json::LargestUInt>(rtt_min);
+        rtt["median"] = static_cast<Json::LargestUInt>(rtt_median);
+        rtt["p90"] = static_cast<Json::LargestUInt>(rtt_p90);
+        rtt["max"] = static_cast<Json::LargestUInt>(rtt_max);
+        rtt["var_median"] = static_cast<Json::LargestUInt>(rttvar_median);
+        val["rtt"] = rtt;
+    }
     return val;
 }
 
@@ -107,6 +196,19 @@ NodeStats::NodeStats(const Json::Value& val)
         incoming_nodes = static_cast<unsigned>(val["incoming"].asLargestUInt());
     if (val.isMember("table_depth"))
         table_depth = static_cast<unsigned>(val["table_depth"].asLargestUInt());
+    if (val.isMember("tx_queue"))
+        tx_queue = static_cast<unsigned>(val["tx_queue"].asLargestUInt());
+    if (val.isMember("tx_queue_peak"))
+        tx_queue_peak = static_cast<unsigned>(val["tx_queue_peak"].asLargestUInt());
+    if (val.isMember("rtt")) {
+        const auto& rtt = val["rtt"];
+        rtt_nodes = static_cast<unsigned>(rtt["nodes"].asLargestUInt());
+        rtt_min = static_cast<unsigned>(rtt["min"].asLargestUInt());
+        rtt_median = static_cast<unsigned>(rtt["median"].asLargestUInt());
+        rtt_p90 = static_cast<unsigned>(rtt["p90"].asLargestUInt());
+        rtt_max = static_cast<unsigned>(rtt["max"].asLargestUInt());
+        rttvar_median = static_cast<unsigned>(rtt["var_median"].asLargestUInt());
+    }
 }
 
 /**
@@ -133,6 +235,73 @@ NodeInfo::NodeInfo(const Json::Value& v)
     ipv6 = NodeStats(v["ipv6"]);
 }
 
+Json::Value
+MessageTypeStats::toJson() const
+{
+    Json::Value val;
+    val["requests_in"] = static_cast<Json::LargestUInt>(requests_in);
+    val["replies_in"] = static_cast<Json::LargestUInt>(replies_in);
+    val["errors_in"] = static_cast<Json::LargestUInt>(errors_in);
+    val["bytes_in"] = static_cast<Json::LargestUInt>(bytes_in);
+    val["requests_out"] = static_cast<Json::LargestUInt>(requests_out);
+    val["retransmits"] = static_cast<Json::LargestUInt>(retransmits);
+    val["replies_out"] = static_cast<Json::LargestUInt>(replies_out);
+    val["bytes_out"] = static_cast<Json::LargestUInt>(bytes_out);
+    val["rate_limited"] = static_cast<Json::LargestUInt>(rate_limited);
+    val["timeouts"] = static_cast<Json::LargestUInt>(timeouts);
+    if (latency_count) {
+        Json::Value latency;
+        latency["count"] = static_cast<Json::LargestUInt>(latency_count);
+        latency["p50"] = static_cast<Json::LargestUInt>(latency_p50);
+        latency["p90"] = static_cast<Json::LargestUInt>(latency_p90);
+        latency["p99"] = static_cast<Json::LargestUInt>(latency_p99);
+        latency["max"] = static_cast<Json::LargestUInt>(latency_max);
+        Json::Value histogram;
+        for (const auto& b : latency_histogram)
+            histogram[std::to_string(b.first)] = static_cast<Json::LargestUInt>(b.second);
+        latency["histogram"] = histogram;
+        val["latency"] = latency;
+    }
+    return val;
+}
+
+MessageTypeStats::MessageTypeStats(const Json::Value& val)
+{
+    requests_in = val["requests_in"].asLargestUInt();
+    replies_in = val["replies_in"].asLargestUInt();
+    errors_in = val["errors_in"].asLargestUInt();
+    bytes_in = val["bytes_in"].asLargestUInt();
+    requests_out = val["requests_out"].asLargestUInt();
+    retransmits = val["retransmits"].asLargestUInt();
+    replies_out = val["replies_out"].asLargestUInt();
+    bytes_out = val["bytes_out"].asLargestUInt();
+    rate_limited = val["rate_limited"].asLargestUInt();
+    timeouts = val["timeouts"].asLargestUInt();
+    if (val.isMember("latency")) {
+        const auto& latency = val["latency"];
+        latency_max = latency["max"].asLargestUInt();
+        const auto& histogram = latency["histogram"];
+        for (const auto& bound : histogram.getMemberNames())
+            latency_histogram[std::stoull(bound)] = histogram[bound].asLargestUInt();
+        updateLatency();
+    }
+}
+
+Json::Value
+TrafficStats::toJson() const
+{
+    Json::Value val(Json::objectValue);
+    for (const auto& m : messages)
+        val[m.first] = m.second.toJson();
+    return val;
+}
+
+TrafficStats::TrafficStats(const Json::Value& val)
+{
+    for (const auto& type : val.getMemberNames())
+        messages.emplace(type, MessageTypeStats(val[type]));
+}
+
 #endif
 
 
@@ -99,8 +99,8 @@ Dht::findNode(const InfoHash& id, sa_family_t af) const
 void
 Dht::sendCachedPing(Bucket& b)
 {
-    if (b.cached)
-        DHT_LOG.d(b.cached->id, "[node %s] sending ping to cached node", b.cached->toString().c_str());
+    if (not b.cache.empty())
+        DHT_LOG.d(b.cache.front()->id, "[node %s] sending ping to cached node", b.cache.front()->toString().c_str());
     b.sendCachedPing(network_engine);
 }
 
@@ -186,16 +186,15 @@ void
 Dht::expireBuckets(RoutingTable& list)
 {
     for (auto& b : list) {
-        bool changed = false;
-        b.nodes.remove_if([&changed](const Sp<Node>& n) {
-            if (n->isExpired()) {
-                changed = true;
-                return true;
-            }
-            return false;
+        auto expired = std::remove_if(b.nodes.begin(), b.nodes.end(), [](const Sp<Node>& n) {
+            return n->isExpired();
         });
-        if (changed)
+        bool changed = expired != b.nodes.end();
+        b.nodes.erase(expired, b.nodes.end());
+        if (changed) {
+            list.touch(b);
             sendCachedPing(b);
+        }
     }
 }
 
@@ -319,7 +318,7 @@ void Dht::paginate(std::weak_ptr<Search> ws, Sp<Query> query, SearchNode* n) {
 Dht::SearchNode*
 Dht::searchSendGetValues(Sp<Search> sr, SearchNode* pn, bool update)
 {
-    if (sr->done or sr->currentlySolicitedNodeCount() >= MAX_REQUESTED_SEARCH_NODES)
+    if (sr->done or not sr->canSolicit())
         return nullptr;
 
     const auto& now = scheduler.time();
@@ -337,11 +336,17 @@ Dht::searchSendGetValues(Sp<Search> sr, SearchNode* pn, bool update)
         if (pn and pn->canGet(now, up, query)) {
             n = pn;
         } else {
+            // Among the closest candidates, prefer the fastest node
+            unsigned candidates = 0, good = 0;
             for (auto& sn : sr->nodes) {
-                if (sn.canGet(now, up, query)) {
+                if (sr->closestOnly() and not sn.isBad() and ++good > TARGET_NODES)
+                    break;
+                if (not sn.canGet(now, up, query))
+                    continue;
+                if (not n or sn.node->getResponseTime() < n->node->getResponseTime())
                     n = &sn;
+                if (++candidates == SEARCH_RTT_CANDIDATES)
                     break;
-                }
             }
         }
 
@@ -668,7 +673,7 @@ Dht::searchStep(Sp<Search> sr)
             sr->setDone();
     }
 
-    while (sr->currentlySolicitedNodeCount() < MAX_REQUESTED_SEARCH_NODES and searchSendGetValues(sr));
+    while (sr->canSolicit() and searchSendGetValues(sr));
 
     if (sr->getNumberOfConsecutiveBadNodes() >= std::min(sr->nodes.size(),
                                                              static_cast<size_t>(SEARCH_MAX_BAD_NODES)))
@@ -707,7 +712,8 @@ unsigned Dht::refill(Dht::Search& sr) {
 
 /* Start a search. */
 Sp<Dht::Search>
-Dht::search(const InfoHash& id, sa_family_t af, GetCallback gcb, QueryCallback qcb, DoneCallback dcb, Value::Filter f, const Sp<Query>& q)
+Dht::search(const InfoHash& id, sa_family_t af, GetCallback gcb, QueryCallback qcb, DoneCallback dcb, Value::Filter f,
+        const Sp<Query>& q, const LookupOptions* lookup)
 {
     if (!isRunning(af)) {
         DHT_LOG.e(id, "[search %s IPv%c] unsupported protocol", id.toString().c_str(), (af == AF_INET) ? '4' : '6');
@@ -724,6 +730,8 @@ Dht::search(const InfoHash& id, sa_family_t af, GetCallback gcb, QueryCallback q
         sr = srp->second;
         sr->done = false;
         sr->expired = false;
+        if (lookup)
+            sr->lookup = *lookup;
     } else {
         if (searches4.size() + searches6.size() < MAX_SEARCHES) {
             sr = std::make_shared<Search>();
@@ -749,6 +757,7 @@ Dht::search(const InfoHash& id, sa_family_t af, GetCallback gcb, QueryCallback q
         sr->expired = false;
         sr->nodes.clear();
         sr->nodes.reserve(SEARCH_NODES+1);
+        sr->lookup = lookup ? *lookup : lookup_options;
         sr->nextSearchStep = scheduler.add(time_point::max(), std::bind(&Dht::searchStep, this, sr));
         DHT_LOG.w(id, "[search %s IPv%c] new search", id.toString().c_str(), (af == AF_INET) ? '4' : '6');
         if (search_id == 0)
@@ -815,7 +824,8 @@ Dht::announce(const InfoHash& id,
 }
 
 size_t
-Dht::listenTo(const InfoHash& id, sa_family_t af, ValueCallback cb, Value::Filter f, const Sp<Query>& q)
+Dht::listenTo(const InfoHash& id, sa_family_t af, ValueCallback cb, Value::Filter f, const Sp<Query>& q,
+        const LookupOptions* lookup)
 {
     if (!isRunning(af))
         return 0;
@@ -824,15 +834,29 @@ Dht::listenTo(const InfoHash& id, sa_family_t af, ValueCallback cb, Value::Filte
     //DHT_LOG_WARN("listenTo %s", id.toString().c_str());
     auto& srs = searches(af);
     auto srp = srs.find(id);
-    Sp<Search> sr = (srp == srs.end()) ? search(id, af) : srp->second;
+    Sp<Search> sr = (srp == srs.end()) ? search(id, af, {}, {}, {}, {}, {}, lookup) : srp->second;
     if (!sr)
         throw DhtException("Can't create search");
+    if (lookup)
+        sr->lookup = *lookup;
     DHT_LOG.e(id, "[search %s IPv%c] listen", id.toString().c_str(), (af == AF_INET) ? '4' : '6');
     return sr->listen(cb, f, q, scheduler);
 }
 
 size_t
 Dht::listen(const InfoHash& id, ValueCallback cb, Value::Filter f, Where where)
+{
+    return startListen(id, std::move(cb), std::move(f), std::move(where), nullptr);
+}
+
+size_t
+Dht::listen(const InfoHash& id, ValueCallback cb, Value::Filter f, Where where, const LookupOptions& lookup)
+{
+    return startListen(id, std::move(cb), std::move(f), std::move(where), &lookup);
+}
+
+size_t
+Dht::startListen(const InfoHash& id, ValueCallback cb, Value::Filter f, Where where, const LookupOptions* lookup)
 {
     scheduler.syncTime();
 
@@ -854,8 +878,8 @@ Dht::listen(const InfoHash& id, ValueCallback cb, Value::Filter f, Where where)
             return 0;
     }
 
-    auto token4 = Dht::listenTo(id, AF_INET, gcb, filter, query);
-    auto token6 = token4 == 0 ? 0 : Dht::listenTo(id, AF_INET6, gcb, filter, query);
+    auto token4 = Dht::listenTo(id, AF_INET, gcb, filter, query, lookup);
+    auto token6 = token4 == 0 ? 0 : Dht::listenTo(id, AF_INET6, gcb, filter, query, lookup);
     if (token6 == 0 && st != store.end()) {
         st->second.cancelListen(tokenlocal);
         return 0;
@@ -983,6 +1007,20 @@ bool callbackWrapper(Cb get_cb, DoneCallback done_cb, const std::vector<Sp<T>>&
 
 void
 Dht::get(const InfoHash& id, GetCallback getcb, DoneCallback donecb, Value::Filter&& filter, Where&& where)
+{
+    startGet(id, std::move(getcb), std::move(donecb), std::move(filter), std::move(where), nullptr);
+}
+
+void
+Dht::get(const InfoHash& id, GetCallback getcb, DoneCallback donecb, Value::Filter&& filter, Where&& where,
+        const LookupOptions& lookup)
+{
+    startGet(id, std::move(getcb), std::move(donecb), std::move(filter), std::move(where), &lookup);
+}
+
+void
+Dht::startGet(const InfoHash& id, GetCallback getcb, DoneCallback donecb, Value::Filter&& filter, Where&& where,
+        const LookupOptions* lookup)
 {
     scheduler.syncTime();
 
@@ -1014,12 +1052,12 @@ Dht::get(const InfoHash& id, GetCallback getcb, DoneCallback donecb, Value::Filt
         //DHT_LOG_WARN("DHT done IPv4");
         op->status4 = {true, ok};
         doneCallbackWrapper(donecb, nodes, *op);
-    }, f, q);
+    }, f, q, lookup);
     Dht::search(id, AF_INET6, gcb, {}, [=](bool ok, const std::vector<Sp<Node>>& nodes) {
         //DHT_LOG_WARN("DHT done IPv6");
         op->status6 = {true, ok};
         doneCallbackWrapper(donecb, nodes, *op);
-    }, f, q);
+    }, f, q, lookup);
 }
 
 void Dht::query(const InfoHash& id, QueryCallback cb, DoneCallback done_cb, Query&& q)
@@ -1426,6 +1464,7 @@ Dht::getNodesStats(sa_family_t af) const
     NodeStats stats {};
     const auto& now = scheduler.time();
     const auto& bcks = buckets(af);
+    std::vector<duration> srtt, rttvar;
     for (const auto& b : bcks) {
         for (auto& n : b.nodes) {
             if (n->isGood(now)) {
@@ -1434,11 +1473,31 @@ Dht::getNodesStats(sa_family_t af) const
                     stats.incoming_nodes++;
             } else if (not n->isExpired())
                 stats.dubious_nodes++;
+            if (n->hasRtt() and not n->isExpired()) {
+                srtt.emplace_back(n->getSrtt());
+                rttvar.emplace_back(n->getRttVar());
+            }
         }
-        if (b.cached)
-            stats.cached_nodes++;
+        stats.cached_nodes += b.cache.size();
+    }
+    if (not srtt.empty()) {
+        auto ms = [](duration d) {
+            return static_cast<unsigned>(std::chrono::duration_cast<std::chrono::milliseconds>(d).count());
+        };
+        auto at = [&](std::vector<duration>& v, size_t i) {
+            std::nth_element(v.begin(), v.begin() + i, v.end());
+            return ms(v[i]);
+        };
+        stats.rtt_nodes = srtt.size();
+        stats.rtt_min = ms(*std::min_element(srtt.begin(), srtt.end()));
+        stats.rtt_max = ms(*std::max_element(srtt.begin(), srtt.end()));
+        stats.rtt_median = at(srtt, srtt.size() / 2);
+        stats.rtt_p90 = at(srtt, (srtt.size() * 9) / 10);
+        stats.rttvar_median = at(rttvar, rttvar.size() / 2);
     }
     stats.table_depth = bcks.depth(bcks.findBucket(myid));
+    stats.tx_queue = network_engine.getTxQueueSize(af);
+    stats.tx_queue_peak = network_engine.getTxQueuePeak(af);
     return stats;
 }
 
@@ -1448,8 +1507,8 @@ Dht::dumpBucket(const Bucket& b, std::ostream& out) const
     const auto& now = scheduler.time();
     using namespace std::chrono;
     out << b.first << " count " << b.nodes.size() << " age " << duration_cast<seconds>(now - b.time).count() << " sec";
-    if (b.cached)
-        out << " (cached)";
+    if (not b.cache.empty())
+        out << " (" << b.cache.size() << " cached)";
     out  << std::endl;
     for (auto& n : b.nodes) {
         out << "    Node " << n->toString();
@@ -1705,9 +1764,14 @@ Dht::Dht(std::unique_ptr<net::DatagramSocket>&& sock, const Config& config, cons
             std::bind(&Dht::onRefresh, this, _1, _2, _3, _4)),
     persistPath(config.persist_path),
     is_bootstrap(config.is_bootstrap),
-    maintain_storage(config.maintain_storage)
+    maintain_storage(config.maintain_storage),
+    lookup_options(config.lookup)
 {
     scheduler.syncTime();
+    network_engine.setTxQueue(config.tx_batch_size, config.tx_max_delay);
+    network_engine.setRateLimit(config.max_req_per_sec, config.max_peer_req_per_sec);
+    network_engine.setCompactEncoding(config.compact_encoding);
+    network_engine.setShard(config.shard);
     auto s = network_engine.getSocket();
     if (not s or (not s->hasIPv4() and not s->hasIPv6()))
         throw DhtException("Opened socket required");
@@ -1784,9 +1848,21 @@ Dht::bucketMaintenance(RoutingTable& list)
     std::bernoulli_distribution rand_trial(1./8.);
     std::bernoulli_distribution rand_trial_38(1./38.);
 
+    const auto& now = scheduler.time();
     bool sent {false};
     for (auto b = list.begin(); b != list.end(); ++b) {
-        if (b->time < scheduler.time() - std::chrono::minutes(10) || b->nodes.empty()) {
+        bool stale = b->time < now - std::chrono::minutes(10);
+        /* Confirm dubious nodes and fill free slots from replacement
+           candidates with a few pings, rather than a node lookup. */
+        unsigned pinged {0};
+        if (stale or b->nodes.size() < TARGET_NODES)
+            pinged = b->refresh(network_engine, now, BUCKET_REFRESH_PINGS);
+        if (pinged) {
+            DHT_LOG.d(b->first, "[bucket %s] sent %u refresh pings", b->first.toString().c_str(), pinged);
+            sent = true;
+            continue;
+        }
+        if (stale || b->nodes.empty()) {
             /* This bucket hasn't seen any positive confirmation for a long
                time. Pick a random id in this bucket's range, and send a request
                to a random node. */
@@ -1911,7 +1987,25 @@ Dht::periodic(const uint8_t *buf, size_t buflen, SockAddr from)
             DHT_LOG.e("Can't process message: %s", e.what());
         }
     }
-    return scheduler.run();
+    auto wakeup = scheduler.run();
+    network_engine.compactNodeCache();
+    if (not buflen)
+        network_engine.flush();
+    return wakeup;
+}
+
+time_point
+Dht::periodic(net::DecodedPacket&& pkt)
+{
+    scheduler.syncTime();
+    try {
+        network_engine.processMessage(std::move(pkt));
+    } catch (const std::exception& e) {
+        DHT_LOG.e("Can't process message: %s", e.what());
+    }
+    auto wakeup = scheduler.run();
+    network_engine.compactNodeCache();
+    return wakeup;
 }
 
 void
@@ -2132,15 +2226,17 @@ Dht::onFindNode(Sp<Node> node, const InfoHash& target, want_t want)
     const auto& now = scheduler.time();
     net::RequestAnswer answer;
     answer.ntoken = makeToken(node->getAddr(), false);
+    if (want < 0)
+        want = node->getFamily() == AF_INET ? WANT4 : WANT6;
     if (want & WANT4)
-        answer.nodes4 = buckets4.findClosestNodes(target, now, TARGET_NODES);
+        answer.packed_nodes4 = buckets4.findClosestNodesPacked(target, now);
     if (want & WANT6)
-        answer.nodes6 = buckets6.findClosestNodes(target, now, TARGET_NODES);
+        answer.packed_nodes6 = buckets6.findClosestNodesPacked(target, now);
     return answer;
 }
 
 net::RequestAnswer
-Dht::onGetValues(Sp<Node> node, const InfoHash& hash, want_t, const Query& query)
+Dht::onGetValues(Sp<Node> node, const InfoHash& hash, want_t want, const Query& query)
 {
     if (not hash) {
         DHT_LOG.w("[node %s] Eek! Got get_values with no info_hash", node->toString().c_str());
@@ -2153,8 +2249,12 @@ Dht::onGetValues(Sp<Node> node, const InfoHash& hash, want_t, const Query& query
     net::RequestAnswer answer {};
     auto st = store.find(hash);
     answer.ntoken = makeToken(node->getAddr(), false);
-    answer.nodes4 = buckets4.findClosestNodes(hash, now, TARGET_NODES);
-    answer.nodes6 = buckets6.findClosestNodes(hash, now, TARGET_NODES);
+    if (want < 0)
+        want = node->getFamily() == AF_INET ? WANT4 : WANT6;
+    if (want & WANT4)
+        answer.packed_nodes4 = buckets4.findClosestNodesPacked(hash, now);
+    if (want & WANT6)
+        answer.packed_nodes6 = buckets6.findClosestNodesPacked(hash, now);
     if (st != store.end() && not st->second.empty()) {
         answer.values = st->second.get(query.where.getFilter());
         DHT_LOG.d(hash, "[node %s] sending %u values", node->toString().c_str(), answer.values.size());
@@ -367,6 +367,7 @@ DhtProxyServer::updateStats() const
     stats_.putCount = puts_.size();
     stats_.listenCount = listeners_->size();
     stats_.nodeInfo = nodeInfo_;
+    stats_.traffic = traffic_;
 }
 
 void
@@ -385,8 +386,10 @@ DhtProxyServer::handlePrintStats(const asio::error_code &ec)
         updateStats();
         // Refresh stats cache
         auto newInfo = dht_->getNodeInfo();
+        auto newTraffic = dht_->getTrafficStats();
         std::lock_guard<std::mutex> lck(statsMutex_);
         nodeInfo_ = std::move(newInfo);
+        traffic_ = std::move(newTraffic);
         auto json = nodeInfo_.toJson();
         auto str = Json::writeString(jsonBuilder_, json);
         if (logger_)
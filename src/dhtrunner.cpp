@@ -22,6 +22,8 @@
 #include "securedht.h"
 #include "peer_discovery.h"
 #include "network_utils.h"
+#include "network_engine.h"
+#include "thread_pool.h"
 
 #ifdef OPENDHT_PROXY_CLIENT
 #include "dht_proxy_client.h"
@@ -37,9 +39,21 @@ namespace dht {
 
 constexpr std::chrono::seconds DhtRunner::BOOTSTRAP_PERIOD;
 static constexpr size_t RX_QUEUE_MAX_SIZE = 1024 * 16;
+static constexpr size_t OPS_QUEUE_SIZE = 1024;
 static constexpr std::chrono::milliseconds RX_QUEUE_MAX_DELAY(500);
 static const std::string PEER_DISCOVERY_DHT_SERVICE = "dht";
 
+/** FNV-1a hash of the socket address, used to pick a decoder */
+static size_t
+hashAddr(const SockAddr& addr)
+{
+    uint64_t h = 14695981039346656037ull;
+    auto p = (const uint8_t*)addr.get();
+    for (socklen_t i = 0; i < addr.getLength(); i++)
+        h = (h ^ p[i]) * 1099511628211ull;
+    return h;
+}
+
 struct DhtRunner::Listener {
     size_t tokenClassicDht {0};
     size_t tokenProxyDht {0};
@@ -60,6 +74,7 @@ DhtRunner::DhtRunner() : dht_()
 #ifdef OPENDHT_PROXY_CLIENT
 , dht_via_proxy_()
 #endif //OPENDHT_PROXY_CLIENT
+, rcv(RX_QUEUE_MAX_SIZE)
 {
 #ifdef _WIN32
     WSADATA wsd;
@@ -102,7 +117,7 @@ DhtRunner::run(const SockAddr& local4, const SockAddr& local6, const Config& con
 {
     if (not running) {
         if (not context.sock)
-            context.sock.reset(new net::UdpSocket(local4, local6, context.logger ? *context.logger : Logger{}));
+            context.sock.reset(new net::UdpSocket(local4, local6, context.logger ? *context.logger : Logger{}, config.rx_batch));
         run(config, std::move(context));
     }
 }
@@ -117,16 +132,30 @@ DhtRunner::run(const Config& config, Context&& context)
     if (context.logger)
         logger_ = context.logger;
 
-    context.sock->setOnReceive([&] (std::unique_ptr<net::ReceivedPacket>&& pkt) {
-        {
-            std::lock_guard<std::mutex> lck(sock_mtx);
-            if (rcv.size() >= RX_QUEUE_MAX_SIZE) {
-                std::cerr << "Dropping packet: queue is full!" << std::endl;
-                rcv.pop();
-            }
-            rcv.emplace(std::move(pkt));
+    packet_pool_ = context.sock->getPacketPool();
+    if (config.decode_threads) {
+        decode_pool_.reset(new ThreadPool(config.decode_threads));
+        decoders_.reserve(config.decode_threads);
+        for (unsigned i = 0; i < config.decode_threads; i++)
+            decoders_.emplace_back(std::make_shared<Executor>(*decode_pool_));
+        decoder_packets_.resize(config.decode_threads);
+        decoded_.reset(new MpscQueue<net::DecodedPacket>(RX_QUEUE_MAX_SIZE));
+    }
+    context.sock->setOnReceive([&] (net::PacketList&& pkts) {
+        if (not decoders_.empty()) {
+            dispatchPackets(std::move(pkts));
+            return;
         }
-        cv.notify_all();
+        size_t dropped = 0;
+        for (auto& pkt : pkts)
+            if (not rcv.push(std::move(pkt)))
+                dropped++;
+        if (dropped)
+            std::cerr << "Dropping " << dropped << " packets: queue is full!" << std::endl;
+        // Give list nodes (and buffers of dropped packets) back to the socket
+        if (packet_pool_)
+            packet_pool_->recycle(std::move(pkts));
+        notify();
     });
 
     auto dht = std::unique_ptr<DhtInterface>(new Dht(std::move(context.sock), SecureDht::getConfig(config.dht_config), context.logger ? *context.logger : Logger{}));
@@ -153,31 +182,32 @@ DhtRunner::run(const Config& config, Context&& context)
         return;
     dht_thread = std::thread([this]() {
         while (running) {
-            std::unique_lock<std::mutex> lk(dht_mtx);
-            time_point wakeup = loop_();
+            time_point wakeup;
+            {
+                std::lock_guard<std::mutex> lck(dht_mtx);
+                wakeup = loop_();
+            }
 
             auto hasJobToDo = [this]() {
                 if (not running)
                     return true;
-                {
-                    std::lock_guard<std::mutex> lck(sock_mtx);
-                    if (not rcv.empty())
-                        return true;
-                }
-                {
-                    std::lock_guard<std::mutex> lck(storage_mtx);
-                    if (not pending_ops_prio.empty())
-                        return true;
-                    auto s = getStatus();
-                    if (not pending_ops.empty() and (s == NodeStatus::Connected or (s == NodeStatus::Disconnected and not bootstraping)))
-                        return true;
-                }
-                return false;
+                if (not rcv.empty() or not pending_ops_prio.empty())
+                    return true;
+                if (decoded_ and not decoded_->empty())
+                    return true;
+                auto s = getStatus();
+                return not pending_ops.empty() and (s == NodeStatus::Connected or (s == NodeStatus::Disconnected and not bootstraping));
             };
+            std::unique_lock<std::mutex> lk(wake_mtx);
+            sleeping = true;
+            // Pairs with the fence in notify(): either the producer sees
+            // sleeping, or we see its item in hasJobToDo.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
             if (wakeup == time_point::max())
                 cv.wait(lk, hasJobToDo);
             else
                 cv.wait_until(lk, wakeup, hasJobToDo);
+            sleeping = false;
         }
     });
 
@@ -223,16 +253,78 @@ DhtRunner::shutdown(ShutdownCallback cb) {
         cb();
         return;
     }
-    std::lock_guard<std::mutex> lck(storage_mtx);
-    pending_ops_prio.emplace([=](SecureDht&) mutable {
+    pushOp([=](SecureDht&) mutable {
 #ifdef OPENDHT_PROXY_CLIENT
         if (dht_via_proxy_)
             dht_via_proxy_->shutdown(cb);
 #endif
         if (dht_)
             dht_->shutdown(cb);
-    });
-    cv.notify_all();
+    }, true);
+}
+
+void
+DhtRunner::notify()
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (not sleeping)
+        return;
+    {
+        std::lock_guard<std::mutex> lck(wake_mtx);
+    }
+    cv.notify_one();
+}
+
+/**
+ * Packets from the same source always go to the same serial decoder,
+ * which keeps their order up to the decoded queue.
+ */
+void
+DhtRunner::dispatchPackets(net::PacketList&& pkts)
+{
+    auto n = decoders_.size();
+    auto& shards = decoder_packets_;
+    while (not pkts.empty()) {
+        auto& pkt = pkts.front();
+        auto& shard = shards[hashAddr(pkt.from) % n];
+        shard.splice(shard.end(), pkts, pkts.begin());
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (shards[i].empty())
+            continue;
+        // Moving leaves the list empty for the next batch
+        decoders_[i]->run([this, pkts = std::move(shards[i])]() mutable {
+            decodePackets(std::move(pkts));
+        });
+    }
+}
+
+void
+DhtRunner::decodePackets(net::PacketList&& pkts)
+{
+    size_t dropped = 0;
+    auto now = clock::now();
+    for (auto& pkt : pkts) {
+        if (now - pkt.received > RX_QUEUE_MAX_DELAY) {
+            dropped++;
+            continue;
+        }
+        try {
+            auto msg = net::NetworkEngine::decode(pkt.data.data(), pkt.data.size(), std::move(pkt.from), pkt.received);
+            if (not decoded_->push(std::move(msg)))
+                dropped++;
+        } catch (const std::exception& e) {
+            if (logger_)
+                logger_->w("Can't parse message of size %zu: %s", pkt.data.size(), e.what());
+        }
+        // Give the buffer back as soon as possible
+        pkt.data.reset();
+    }
+    if (dropped)
+        std::cerr << "Dropping " << dropped << " packets: queue is full or delay is too high" << std::endl;
+    if (packet_pool_)
+        packet_pool_->recycle(std::move(pkts));
+    notify();
 }
 
 void
@@ -244,7 +336,7 @@ DhtRunner::join()
     {
         std::lock_guard<std::mutex> lck(dht_mtx);
         running = false;
-        cv.notify_all();
+        notify();
         bootstrap_cv.notify_all();
         if (dht_)
             if (auto sock = dht_->getSocket())
@@ -262,16 +354,25 @@ DhtRunner::join()
     }
 
     {
-        std::lock_guard<std::mutex> lck(storage_mtx);
-        pending_ops = decltype(pending_ops)();
-        pending_ops_prio = decltype(pending_ops_prio)();
-    }
-    {
+        // Destroys the socket, waiting for its receive thread: packets are
+        // no longer dispatched to the decoders.
         std::lock_guard<std::mutex> lck(dht_mtx);
         resetDht();
         status4 = NodeStatus::Disconnected;
         status6 = NodeStatus::Disconnected;
     }
+
+    if (decode_pool_) {
+        decode_pool_->join();
+        decoders_.clear();
+        decoder_packets_.clear();
+        decode_pool_.reset();
+    }
+
+    pending_ops.clear();
+    pending_ops_prio.clear();
+    rcv.clear();
+    decoded_.reset();
 }
 
 SockAddr
@@ -323,6 +424,14 @@ DhtRunner::setStorageLimit(size_t limit) {
     return dht_->setStorageLimit(limit);
 }
 
+void
+DhtRunner::setRateLimit(size_t max_req_per_sec, size_t max_peer_req_per_sec) {
+    std::lock_guard<std::mutex> lck(dht_mtx);
+    if (!dht_)
+        throw std::runtime_error("dht is not running");
+    dht_->setRateLimit(max_req_per_sec, max_peer_req_per_sec);
+}
+
 std::vector<NodeExport>
 DhtRunner::exportNodes() const {
     std::lock_guard<std::mutex> lck(dht_mtx);
@@ -421,6 +530,13 @@ DhtRunner::getNodeMessageStats(bool in) const
     return activeDht()->getNodeMessageStats(in);
 }
 
+TrafficStats
+DhtRunner::getTrafficStats() const
+{
+    std::lock_guard<std::mutex> lck(dht_mtx);
+    return activeDht()->getTrafficStats();
+}
+
 std::string
 DhtRunner::getStorageLog() const
 {
@@ -491,51 +607,35 @@ DhtRunner::loop_()
     if (not dht)
         return {};
 
-    decltype(pending_ops) ops {};
-    {
-        std::lock_guard<std::mutex> lck(storage_mtx);
-        auto s = getStatus();
-        ops = (pending_ops_prio.empty() && (s == NodeStatus::Connected or (s == NodeStatus::Disconnected and not bootstraping))) ?
-               std::move(pending_ops) : std::move(pending_ops_prio);
-    }
-    while (not ops.empty()) {
-        ops.front()(*dht);
-        ops.pop();
-    }
+    auto s = getStatus();
+    if (pending_ops_prio.empty() && (s == NodeStatus::Connected or (s == NodeStatus::Disconnected and not bootstraping)))
+        pending_ops.run(*dht);
+    else
+        pending_ops_prio.run(*dht);
 
     time_point wakeup {};
-    decltype(rcv) received {};
-    {
-        std::lock_guard<std::mutex> lck(sock_mtx);
-        // move to stack
-        received = std::move(rcv);
-    }
 
-    // Discard old packets
+    // Handle packets in one batch, discarding old ones.
+    // Buffers go back to the pool as packets are consumed.
     size_t dropped {0};
-    if (not received.empty()) {
-        auto now = clock::now();
-        while (not received.empty() and now - received.front()->received > RX_QUEUE_MAX_DELAY) {
-            received.pop();
+    rcv.drain([&](net::ReceivedPacket& pck) {
+        if (clock::now() - pck.received > RX_QUEUE_MAX_DELAY)
             dropped++;
-        }
-    }
-
-    // Handle packets
-    if (not received.empty()) {
-        while (not received.empty()) {
-            auto& pck = received.front();
-            if (clock::now() - pck->received > RX_QUEUE_MAX_DELAY)
+        else
+            dht->periodic(pck.data.data(), pck.data.size(), std::move(pck.from));
+    }, rcv.capacity());
+    if (decoded_) {
+        decoded_->drain([&](net::DecodedPacket& pkt) {
+            if (clock::now() - pkt.received > RX_QUEUE_MAX_DELAY)
                 dropped++;
             else
-                wakeup = dht->periodic(pck->data.data(), pck->data.size(), std::move(pck->from));
-            received.pop();
-        }
-    } else {
-        // Or just run the scheduler
-        wakeup = dht->periodic(nullptr, 0, nullptr, 0);
+                dht->periodic(std::move(pkt));
+        }, decoded_->capacity());
     }
 
+    // Run the scheduler and flush outgoing packets
+    wakeup = dht->periodic(nullptr, 0, nullptr, 0);
+
     if (dropped)
         std::cerr << "Dropped " << dropped << " packets with high delay" << std::endl;
 
@@ -560,16 +660,58 @@ DhtRunner::loop_()
     return wakeup;
 }
 
+DhtRunner::OpQueue::OpQueue() : ring(OPS_QUEUE_SIZE) {}
+
 void
-DhtRunner::get(InfoHash hash, GetCallback vcb, DoneCallback dcb, Value::Filter f, Where w)
+DhtRunner::OpQueue::push(Op&& op)
 {
-    {
-        std::lock_guard<std::mutex> lck(storage_mtx);
-        pending_ops.emplace([=](SecureDht& dht) mutable {
-            dht.get(hash, std::move(vcb), std::move(dcb), std::move(f), std::move(w));
-        });
+    if (not overflowing and ring.push(std::move(op)))
+        return;
+    std::lock_guard<std::mutex> lck(overflow_mtx);
+    // Once the ring overflowed, keep queuing behind it to preserve ordering
+    if (not overflowing and ring.push(std::move(op)))
+        return;
+    overflow.emplace(std::move(op));
+    overflowing = true;
+}
+
+size_t
+DhtRunner::OpQueue::run(SecureDht& dht)
+{
+    // Bounded to one ring worth, so that operations queuing operations
+    // can't keep the loop busy forever
+    auto n = ring.drain([&](Op& op) {
+        op(dht);
+    }, ring.capacity());
+    if (n < ring.capacity() and overflowing) {
+        decltype(overflow) ops;
+        {
+            std::lock_guard<std::mutex> lck(overflow_mtx);
+            ops = std::move(overflow);
+            overflow = {};
+            overflowing = false;
+        }
+        for (; not ops.empty(); ops.pop(), n++)
+            ops.front()(dht);
     }
-    cv.notify_all();
+    return n;
+}
+
+void
+DhtRunner::OpQueue::clear()
+{
+    ring.clear();
+    std::lock_guard<std::mutex> lck(overflow_mtx);
+    overflow = {};
+    overflowing = false;
+}
+
+void
+DhtRunner::get(InfoHash hash, GetCallback vcb, DoneCallback dcb, Value::Filter f, Where w)
+{
+    pushOp([=](SecureDht& dht) mutable {
+        dht.get(hash, std::move(vcb), std::move(dcb), std::move(f), std::move(w));
+    });
 }
 
 void
@@ -579,46 +721,38 @@ DhtRunner::get(const std::string& key, GetCallback vcb, DoneCallbackSimple dcb,
 }
 void
 DhtRunner::query(const InfoHash& hash, QueryCallback cb, DoneCallback done_cb, Query q) {
-    {
-        std::lock_guard<std::mutex> lck(storage_mtx);
-        pending_ops.emplace([=](SecureDht& dht) mutable {
-            dht.query(hash, std::move(cb), std::move(done_cb), std::move(q));
-        });
-    }
-    cv.notify_all();
+    pushOp([=](SecureDht& dht) mutable {
+        dht.query(hash, std::move(cb), std::move(done_cb), std::move(q));
+    });
 }
 
 std::future<size_t>
 DhtRunner::listen(InfoHash hash, ValueCallback vcb, Value::Filter f, Where w)
 {
     auto ret_token = std::make_shared<std::promise<size_t>>();
-    {
-        std::lock_guard<std::mutex> lck(storage_mtx);
-        pending_ops.emplace([=](SecureDht& dht) mutable {
+    pushOp([=](SecureDht& dht) mutable {
 #ifdef OPENDHT_PROXY_CLIENT
-            auto tokenbGlobal = listener_token_++;
-            auto& listener = listeners_[tokenbGlobal];
-            listener.hash = hash;
-            listener.f = std::move(f);
-            listener.w = std::move(w);
-            listener.gcb = [hash,vcb,tokenbGlobal,this](const std::vector<Sp<Value>>& vals, bool expired) {
-                if (not vcb(vals, expired)) {
-                    cancelListen(hash, tokenbGlobal);
-                    return false;
-                }
-                return true;
-            };
-            if (auto token = dht.listen(hash, listener.gcb, listener.f, listener.w)) {
-                if (use_proxy)  listener.tokenProxyDht = token;
-                else            listener.tokenClassicDht = token;
+        auto tokenbGlobal = listener_token_++;
+        auto& listener = listeners_[tokenbGlobal];
+        listener.hash = hash;
+        listener.f = std::move(f);
+        listener.w = std::move(w);
+        listener.gcb = [hash,vcb,tokenbGlobal,this](const std::vector<Sp<Value>>& vals, bool expired) {
+            if (not vcb(vals, expired)) {
+                cancelListen(hash, tokenbGlobal);
+                return false;
             }
-            ret_token->set_value(tokenbGlobal);
+            return true;
+        };
+        if (auto token = dht.listen(hash, listener.gcb, listener.f, listener.w)) {
+            if (use_proxy)  listener.tokenProxyDht = token;
+            else            listener.tokenClassicDht = token;
+        }
+        ret_token->set_value(tokenbGlobal);
 #else
-            ret_token->set_value(dht.listen(hash, std::move(vcb), std::move(f), std::move(w)));
+        ret_token->set_value(dht.listen(hash, std::move(vcb), std::move(f), std::move(w)));
 #endif
-        });
-    }
-    cv.notify_all();
+    });
     return ret_token->get_future();
 }
 
@@ -631,74 +765,58 @@ DhtRunner::listen(const std::string& key, GetCallback vcb, Value::Filter f, Wher
 void
 DhtRunner::cancelListen(InfoHash h, size_t token)
 {
-    {
-        std::lock_guard<std::mutex> lck(storage_mtx);
 #ifdef OPENDHT_PROXY_CLIENT
-        pending_ops.emplace([=](SecureDht&) {
-            auto it = listeners_.find(token);
-            if (it == listeners_.end()) return;
-            if (it->second.tokenClassicDht)
-                dht_->cancelListen(h, it->second.tokenClassicDht);
-            if (it->second.tokenProxyDht and dht_via_proxy_)
-                dht_via_proxy_->cancelListen(h, it->second.tokenProxyDht);
-            listeners_.erase(it);
-        });
+    pushOp([=](SecureDht&) {
+        auto it = listeners_.find(token);
+        if (it == listeners_.end()) return;
+        if (it->second.tokenClassicDht)
+            dht_->cancelListen(h, it->second.tokenClassicDht);
+        if (it->second.tokenProxyDht and dht_via_proxy_)
+            dht_via_proxy_->cancelListen(h, it->second.tokenProxyDht);
+        listeners_.erase(it);
+    });
 #else
-        pending_ops.emplace([=](SecureDht& dht) {
-            dht.cancelListen(h, token);
-        });
+    pushOp([=](SecureDht& dht) {
+        dht.cancelListen(h, token);
+    });
 #endif // OPENDHT_PROXY_CLIENT
-    }
-    cv.notify_all();
 }
 
 void
 DhtRunner::cancelListen(InfoHash h, std::shared_future<size_t> ftoken)
 {
-    {
-        std::lock_guard<std::mutex> lck(storage_mtx);
 #ifdef OPENDHT_PROXY_CLIENT
-        pending_ops.emplace([=](SecureDht&) {
-            auto it = listeners_.find(ftoken.get());
-            if (it == listeners_.end()) return;
-            if (it->second.tokenClassicDht)
-                dht_->cancelListen(h, it->second.tokenClassicDht);
-            if (it->second.tokenProxyDht and dht_via_proxy_)
-                dht_via_proxy_->cancelListen(h, it->second.tokenProxyDht);
-            listeners_.erase(it);
-        });
+    pushOp([=](SecureDht&) {
+        auto it = listeners_.find(ftoken.get());
+        if (it == listeners_.end()) return;
+        if (it->second.tokenClassicDht)
+            dht_->cancelListen(h, it->second.tokenClassicDht);
+        if (it->second.tokenProxyDht and dht_via_proxy_)
+            dht_via_proxy_->cancelListen(h, it->second.tokenProxyDht);
+        listeners_.erase(it);
+    });
 #else
-        pending_ops.emplace([=](SecureDht& dht) {
-            dht.cancelListen(h, ftoken.get());
-        });
+    pushOp([=](SecureDht& dht) {
+        dht.cancelListen(h, ftoken.get());
+    });
 #endif // OPENDHT_PROXY_CLIENT
-    }
-    cv.notify_all();
 }
 
 void
 DhtRunner::put(InfoHash hash, Value&& value, DoneCallback cb, time_point created, bool permanent)
 {
-    {
-        std::lock_guard<std::mutex> lck(storage_mtx);
-        auto sv = std::make_shared<Value>(std::move(value));
-        pending_ops.emplace([=](SecureDht& dht) {
-            dht.put(hash, sv, cb, created, permanent);
-        });
-    }
-    cv.notify_all();
+    auto sv = std::make_shared<Value>(std::move(value));
+    pushOp([=](SecureDht& dht) {
+        dht.put(hash, sv, cb, created, permanent);
+    });
 }
 
 void
 DhtRunner::put(InfoHash hash, std::shared_ptr<Value> value, DoneCallback cb, time_point created, bool permanent)
 {
-    {
-        std::lock_guard<std::mutex> lck(storage_mtx);
-        pending_ops.emplace([=](SecureDht& dht) {
-            dht.put(hash, value, cb, created, permanent);
-        });
-    }
-    cv.notify_all();
+    pushOp([=](SecureDht& dht) {
+        dht.put(hash, value, cb, created, permanent);
+    });
 }
 
 void
@@ -710,25 +828,17 @@ DhtRunner::put(const std::string& key, Value&& value, DoneCallbackSimple cb, tim
 void
 DhtRunner::cancelPut(const InfoHash& h , const Value::Id& id)
 {
-    {
-        std::lock_guard<std::mutex> lck(storage_mtx);
-        pending_ops.emplace([=](SecureDht& dht) {
-            dht.cancelPut(h, id);
-        });
-    }
-    cv.notify_all();
+    pushOp([=](SecureDht& dht) {
+        dht.cancelPut(h, id);
+    });
 }
 
 void
 DhtRunner::putSigned(InfoHash hash, std::shared_ptr<Value> value, DoneCallback cb)
 {
-    {
-        std::lock_guard<std::mutex> lck(storage_mtx);
-        pending_ops.emplace([=](SecureDht& dht) {
-            dht.putSigned(hash, value, cb);
-        });
-    }
-    cv.notify_all();
+    pushOp([=](SecureDht& dht) {
+        dht.putSigned(hash, value, cb);
+    });
 }
 
 void
@@ -746,13 +856,9 @@ DhtRunner::putSigned(const std::string& key, Value&& value, DoneCallbackSimple c
 void
 DhtRunner::putEncrypted(InfoHash hash, InfoHash to, std::shared_ptr<Value> value, DoneCallback cb)
 {
-    {
-        std::lock_guard<std::mutex> lck(storage_mtx);
-        pending_ops.emplace([=](SecureDht& dht) {
-            dht.putEncrypted(hash, to, value, cb);
-        });
-    }
-    cv.notify_all();
+    pushOp([=](SecureDht& dht) {
+        dht.putEncrypted(hash, to, value, cb);
+    });
 }
 
 void
@@ -855,8 +961,7 @@ DhtRunner::clearBootstrap()
 void
 DhtRunner::bootstrap(std::vector<SockAddr> nodes, DoneCallbackSimple&& cb)
 {
-    std::lock_guard<std::mutex> lck(storage_mtx);
-    pending_ops_prio.emplace([=](SecureDht& dht) mutable {
+    pushOp([=](SecureDht& dht) mutable {
         auto rem = cb ? std::make_shared<std::pair<size_t, bool>>(nodes.size(), false) : nullptr;
         for (auto& node : nodes) {
             if (node.getPort() == 0)
@@ -869,66 +974,47 @@ DhtRunner::bootstrap(std::vector<SockAddr> nodes, DoneCallbackSimple&& cb)
                     cb(r.second);
             } : DoneCallbackSimple{});
         }
-    });
-    cv.notify_all();
+    }, true);
 }
 
 void
 DhtRunner::bootstrap(const SockAddr& addr, DoneCallbackSimple&& cb)
 {
-    std::lock_guard<std::mutex> lck(storage_mtx);
-    pending_ops_prio.emplace([addr, cb](SecureDht& dht) mutable {
+    pushOp([addr, cb](SecureDht& dht) mutable {
         dht.pingNode(std::move(addr), std::move(cb));
-    });
-    cv.notify_all();
+    }, true);
 }
 
 void
 DhtRunner::bootstrap(const InfoHash& id, const SockAddr& address)
 {
-    {
-        std::unique_lock<std::mutex> lck(storage_mtx);
-        pending_ops_prio.emplace([id, address](SecureDht& dht) mutable {
-            dht.insertNode(id, address);
-        });
-    }
-    cv.notify_all();
+    pushOp([id, address](SecureDht& dht) mutable {
+        dht.insertNode(id, address);
+    }, true);
 }
 
 void
 DhtRunner::bootstrap(const std::vector<NodeExport>& nodes)
 {
-    {
-        std::lock_guard<std::mutex> lck(storage_mtx);
-        pending_ops_prio.emplace([=](SecureDht& dht) {
-            for (auto& node : nodes)
-                dht.insertNode(node);
-        });
-    }
-    cv.notify_all();
+    pushOp([=](SecureDht& dht) {
+        for (auto& node : nodes)
+            dht.insertNode(node);
+    }, true);
 }
 
 void
 DhtRunner::connectivityChanged()
 {
-    {
-        std::lock_guard<std::mutex> lck(storage_mtx);
-        pending_ops_prio.emplace([=](SecureDht& dht) {
-            dht.connectivityChanged();
-        });
-    }
-    cv.notify_all();
+    pushOp([=](SecureDht& dht) {
+        dht.connectivityChanged();
+    }, true);
 }
 
 void
 DhtRunner::findCertificate(InfoHash hash, std::function<void(const std::shared_ptr<crypto::Certificate>)> cb) {
-    {
-        std::lock_guard<std::mutex> lck(storage_mtx);
-        pending_ops.emplace([=](SecureDht& dht) {
-            dht.findCertificate(hash, cb);
-        });
-    }
-    cv.notify_all();
+    pushOp([=](SecureDht& dht) {
+        dht.findCertificate(hash, cb);
+    });
 }
 
 void
@@ -983,11 +1069,7 @@ DhtRunner::enableProxy(bool proxify)
                 config_.client_identity,
                 [this]{
                     if (config_.threaded) {
-                        {
-                            std::lock_guard<std::mutex> lck(storage_mtx);
-                            pending_ops_prio.emplace([=](SecureDht&) mutable {});
-                        }
-                        cv.notify_all();
+                        pushOp([=](SecureDht&) mutable {}, true);
                     }
                 },
                 config_.proxy_server, config_.push_node_id, logger_)
@@ -1004,9 +1086,8 @@ DhtRunner::enableProxy(bool proxify)
         use_proxy = proxify;
     } else {
         use_proxy = proxify;
-        std::lock_guard<std::mutex> lck(storage_mtx);
         if (not listeners_.empty()) {
-            pending_ops.emplace([this](SecureDht& /*dht*/) mutable {
+            pushOp([this](SecureDht& /*dht*/) mutable {
                 if (not dht_)
                     return;
                 for (auto& l : listeners_) {
@@ -1058,14 +1139,10 @@ void
 DhtRunner::pushNotificationReceived(const std::map<std::string, std::string>& data)
 {
 #if defined(OPENDHT_PROXY_CLIENT) && defined(OPENDHT_PUSH_NOTIFICATIONS)
-    {
-        std::lock_guard<std::mutex> lck(storage_mtx);
-        pending_ops_prio.emplace([=](SecureDht&) {
-            if (dht_via_proxy_)
-                dht_via_proxy_->pushNotificationReceived(data);
-        });
-    }
-    cv.notify_all();
+    pushOp([=](SecureDht&) {
+        if (dht_via_proxy_)
+            dht_via_proxy_->pushNotificationReceived(data);
+    }, true);
 #else
     (void) data;
 #endif
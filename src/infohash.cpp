@@ -20,12 +20,120 @@
 
 #include <functional>
 #include <sstream>
+#include <numeric>
 #include <cstdio>
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define OPENDHT_X86_SIMD
+#include <immintrin.h>
+#endif
+
 namespace dht {
 
 const HexMap hex_map = {};
 
+namespace {
+
+static_assert(HASH_LEN >= sizeof(uint64_t), "InfoHash shorter than a distance key");
+
+/*
+ * A distance key is the first 64 bits of the XOR distance of an id to the
+ * target, read as a big endian integer: comparing keys orders ids like
+ * xorCmp does, unless their first 8 bytes are equal.
+ */
+using DistanceKeys = void(*)(const InfoHash& target, const InfoHash* ids, size_t count, uint64_t* keys);
+
+inline uint64_t
+distanceKey(const uint8_t* target, const uint8_t* id)
+{
+    uint64_t key = 0;
+    for (size_t i = 0; i < sizeof(key); i++)
+        key = (key << 8) | (uint8_t)(target[i] ^ id[i]);
+    return key;
+}
+
+void
+distanceKeysScalar(const InfoHash& target, const InfoHash* ids, size_t count, uint64_t* keys)
+{
+    for (size_t i = 0; i < count; i++)
+        keys[i] = distanceKey(target.data(), ids[i].data());
+}
+
+#ifdef OPENDHT_X86_SIMD
+inline long long
+loadKey(const InfoHash& h)
+{
+    long long v;
+    std::memcpy(&v, h.data(), sizeof(v));
+    return v;
+}
+
+void
+distanceKeysSse2(const InfoHash& target, const InfoHash* ids, size_t count, uint64_t* keys)
+{
+    const auto t = _mm_set1_epi64x(loadKey(target));
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        auto v = _mm_xor_si128(_mm_set_epi64x(loadKey(ids[i+1]), loadKey(ids[i])), t);
+        // byte swap each 64 bits lane: swap bytes in words, then reverse words
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(keys + i), v);
+    }
+    distanceKeysScalar(target, ids + i, count - i, keys + i);
+}
+
+__attribute__((target("avx2"))) void
+distanceKeysAvx2(const InfoHash& target, const InfoHash* ids, size_t count, uint64_t* keys)
+{
+    const auto t = _mm256_set1_epi64x(loadKey(target));
+    const auto bswap = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                        7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        auto v = _mm256_set_epi64x(loadKey(ids[i+3]), loadKey(ids[i+2]), loadKey(ids[i+1]), loadKey(ids[i]));
+        v = _mm256_shuffle_epi8(_mm256_xor_si256(v, t), bswap);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(keys + i), v);
+    }
+    distanceKeysScalar(target, ids + i, count - i, keys + i);
+}
+#endif
+
+DistanceKeys
+selectDistanceKeys()
+{
+#ifdef OPENDHT_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return distanceKeysAvx2;
+    return distanceKeysSse2;
+#else
+    return distanceKeysScalar;
+#endif
+}
+
+}
+
+void
+closestIds(const InfoHash& target, const InfoHash* ids, size_t count, size_t k, std::vector<unsigned>& out)
+{
+    static const DistanceKeys distanceKeys = selectDistanceKeys();
+    thread_local std::vector<uint64_t> keys;
+    keys.resize(count);
+    distanceKeys(target, ids, count, keys.data());
+
+    out.resize(count);
+    std::iota(out.begin(), out.end(), 0);
+    auto last = out.begin() + std::min(k, count);
+    std::partial_sort(out.begin(), last, out.end(), [&](unsigned a, unsigned b) {
+        if (keys[a] != keys[b])
+            return keys[a] < keys[b];
+        return target.xorCmp(ids[a], ids[b]) < 0;
+    });
+    out.erase(last, out.end());
+}
+
 void
 NodeExport::msgpack_unpack(msgpack::object o)
 {
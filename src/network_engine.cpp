@@ -22,6 +22,8 @@
 #include "default_types.h"
 #include "log_enable.h"
 #include "parsed_message.h"
+#include "value_reassembly.h"
+#include "traffic_stats.h"
 
 #include <msgpack.hpp>
 
@@ -39,14 +41,29 @@ const std::string DhtProtocolException::STORAGE_NOT_FOUND {"Access operation for
 constexpr std::chrono::seconds NetworkEngine::UDP_REPLY_TIME;
 constexpr std::chrono::seconds NetworkEngine::RX_MAX_PACKET_TIME;
 constexpr std::chrono::seconds NetworkEngine::RX_TIMEOUT;
+constexpr std::chrono::seconds NetworkEngine::RX_PART_RETRY;
+constexpr size_t NetworkEngine::RX_PEER_MAX_SIZE;
+constexpr size_t NetworkEngine::RX_MAX_SIZE;
+constexpr size_t NetworkEngine::RX_MSG_MAX_SIZE;
+constexpr size_t NetworkEngine::TX_PARTS_MAX_SIZE;
+constexpr size_t NetworkEngine::MAX_PARTS_RETRY;
+constexpr unsigned NetworkEngine::TX_PARTS_MAX_RESEND;
 
 const std::string NetworkEngine::my_v {"RNG1"};
+const std::string NetworkEngine::my_v_compact {"RNG2"};
 constexpr size_t NetworkEngine::MAX_REQUESTS_PER_SEC;
 
 static constexpr uint8_t v4prefix[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF, 0, 0, 0, 0};
 
 constexpr unsigned SEND_NODES {8};
 
+static inline const Blob&
+packedNodes(const Sp<const Blob>& nodes)
+{
+    static const Blob NO_NODES {};
+    return nodes ? *nodes : NO_NODES;
+}
+
 
 /* Transaction-ids are 4-bytes long, with the first two bytes identifying
  * the kind of request, and the remaining two a sequence number in
@@ -70,6 +87,8 @@ struct NetworkEngine::PartialMessage {
     time_point start;
     time_point last_part;
     std::unique_ptr<ParsedMessage> msg;
+    ValueReassembly parts;
+    Sp<Scheduler::Job> job;
 };
 
 std::vector<Blob>
@@ -83,7 +102,7 @@ serializeValues(const std::vector<Sp<Value>>& st)
 }
 
 void
-packToken(msgpack::packer<msgpack::sbuffer>& pk, const Blob& token)
+packToken(msgpack::packer<TxBuffer>& pk, const Blob& token)
 {
     pk.pack_bin(token.size());
     pk.pack_bin_body((char*)token.data(), token.size());
@@ -99,8 +118,15 @@ RequestAnswer::RequestAnswer(ParsedMessage&& msg)
    nodes6(std::move(msg.nodes6))
 {}
 
+DecodedPacket::DecodedPacket() = default;
+DecodedPacket::DecodedPacket(std::unique_ptr<ParsedMessage>&& m, SockAddr&& f, time_point r)
+ : msg(std::move(m)), from(std::move(f)), received(r) {}
+DecodedPacket::DecodedPacket(DecodedPacket&&) noexcept = default;
+DecodedPacket& DecodedPacket::operator=(DecodedPacket&&) noexcept = default;
+DecodedPacket::~DecodedPacket() = default;
+
 NetworkEngine::NetworkEngine(Logger& log, Scheduler& scheduler, std::unique_ptr<DatagramSocket>&& sock)
-    : myid(zeroes), dht_socket(std::move(sock)), DHT_LOG(log), scheduler(scheduler)
+    : myid(zeroes), dht_socket(std::move(sock)), DHT_LOG(log), traffic(new TrafficCounters), scheduler(scheduler)
 {}
 
 NetworkEngine::NetworkEngine(InfoHash& myid, NetId net, std::unique_ptr<DatagramSocket>&& sock, Logger& log, Scheduler& scheduler,
@@ -122,10 +148,12 @@ NetworkEngine::NetworkEngine(InfoHash& myid, NetId net, std::unique_ptr<Datagram
     onListen(std::move(onListen)),
     onAnnounce(std::move(onAnnounce)),
     onRefresh(std::move(onRefresh)),
-    myid(myid), network(net), dht_socket(std::move(sock)), DHT_LOG(log), scheduler(scheduler)
+    myid(myid), network(net), dht_socket(std::move(sock)), DHT_LOG(log),
+    traffic(new TrafficCounters), scheduler(scheduler)
 {}
 
 NetworkEngine::~NetworkEngine() {
+    flush();
     clear();
 }
 
@@ -136,18 +164,22 @@ NetworkEngine::tellListener(Sp<Node> node, Tid socket_id, const InfoHash& hash,
         const Query& query)
 {
     auto nnodes = bufferNodes(node->getFamily(), hash, want, nodes, nodes6);
+    auto sent = tx_reply_bytes;
     try {
-        sendNodesValues(node->getAddr(), socket_id, nnodes.first, nnodes.second, values, query, ntoken);
+        sendNodesValues(node->getAddr(), socket_id, nnodes.first, nnodes.second, values, query, ntoken, compactTo(*node));
     } catch (const std::overflow_error& e) {
         DHT_LOG.e("Can't send value: buffer not large enough !");
     }
+    auto& stats = (*traffic)[MessageType::ValueUpdate];
+    TrafficCounters::add(stats.requests_out);
+    TrafficCounters::add(stats.bytes_out, tx_reply_bytes - sent);
 }
 
 void
 NetworkEngine::tellListenerRefreshed(Sp<Node> n, Tid socket_id, const InfoHash&, const Blob& token, const std::vector<Value::Id>& values)
 {
-    msgpack::sbuffer buffer;
-    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    auto& buffer = txBuffer();
+    MessagePacker<TxBuffer> pk(&buffer, compactTo(*n));
     pk.pack_map(4+(network?1:0));
 
     pk.pack(KEY_U);
@@ -164,20 +196,23 @@ NetworkEngine::tellListenerRefreshed(Sp<Node> n, Tid socket_id, const InfoHash&,
 
     pk.pack(KEY_TID); pk.pack(socket_id);
     pk.pack(KEY_Y); pk.pack(KEY_R);
-    pk.pack(KEY_UA); pk.pack(my_v);
+    pk.pack(KEY_UA); pk.pack(userAgent());
     if (network) {
         pk.pack(KEY_NETID); pk.pack(network);
     }
 
     // send response
-    send(n->getAddr(), buffer.data(), buffer.size());
+    auto& stats = (*traffic)[MessageType::ValueUpdate];
+    TrafficCounters::add(stats.requests_out);
+    TrafficCounters::add(stats.bytes_out, buffer.size());
+    sendQueued(n->getAddr(), buffer.data(), buffer.size());
 }
 
 void
 NetworkEngine::tellListenerExpired(Sp<Node> n, Tid socket_id, const InfoHash&, const Blob& token, const std::vector<Value::Id>& values)
 {
-    msgpack::sbuffer buffer;
-    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    auto& buffer = txBuffer();
+    MessagePacker<TxBuffer> pk(&buffer, compactTo(*n));
     pk.pack_map(4+(network?1:0));
 
     pk.pack(KEY_U);
@@ -194,13 +229,16 @@ NetworkEngine::tellListenerExpired(Sp<Node> n, Tid socket_id, const InfoHash&, c
 
     pk.pack(KEY_TID); pk.pack(socket_id);
     pk.pack(KEY_Y); pk.pack(KEY_R);
-    pk.pack(KEY_UA); pk.pack(my_v);
+    pk.pack(KEY_UA); pk.pack(userAgent());
     if (network) {
         pk.pack(KEY_NETID); pk.pack(network);
     }
 
     // send response
-    send(n->getAddr(), buffer.data(), buffer.size());
+    auto& stats = (*traffic)[MessageType::ValueUpdate];
+    TrafficCounters::add(stats.requests_out);
+    TrafficCounters::add(stats.bytes_out, buffer.size());
+    sendQueued(n->getAddr(), buffer.data(), buffer.size());
 }
 
 
@@ -219,14 +257,22 @@ NetworkEngine::isRunning(sa_family_t af) const
     }
 }
 
+template <typename... Args>
+Sp<Request>
+NetworkEngine::makeRequest(Args&&... args)
+{
+    return std::allocate_shared<Request>(PoolAllocator<Request>(request_pool), std::forward<Args>(args)...);
+}
+
 void
 NetworkEngine::clear()
 {
-    for (auto& request : requests) {
+    // Expiring nodes may send new requests: iterate over a detached table
+    auto reqs = std::move(requests);
+    for (auto& request : reqs) {
         request.second->cancel();
         request.second->node->setExpired();
     }
-    requests.clear();
 }
 
 void
@@ -244,8 +290,10 @@ NetworkEngine::requestStep(Sp<Request> sreq)
 
     auto now = scheduler.time();
     auto& node = *req.node;
+    auto& stats = (*traffic)[req.getType()];
     if (req.isExpired(now)) {
         DHT_LOG.d(node.id, "[node %s] expired !", node.toString().c_str());
+        TrafficCounters::add(stats.timeouts);
         node.setExpired();
         if (not node.id)
             requests.erase(req.tid);
@@ -253,6 +301,8 @@ NetworkEngine::requestStep(Sp<Request> sreq)
     } else if (req.attempt_count == 1) {
         req.on_expired(req, false);
     }
+    if (req.attempt_count)
+        node.rttTimeout();
 
     auto err = send(node.getAddr(), (char*)req.msg.data(), req.msg.size(), node.getReplyTime() < now - UDP_REPLY_TIME);
     if (err == ENETUNREACH  ||
@@ -266,14 +316,23 @@ NetworkEngine::requestStep(Sp<Request> sreq)
             requests.erase(req.tid);
     } else {
         if (err != EAGAIN) {
+            TrafficCounters::add(req.attempt_count ? stats.retransmits : stats.requests_out);
+            TrafficCounters::add(stats.bytes_out, req.msg.size());
             ++req.attempt_count;
         }
         req.last_try = now;
-        std::weak_ptr<Request> wreq = sreq;
-        scheduler.add(req.last_try + Node::MAX_RESPONSE_TIME, [this,wreq] {
-            if (auto req = wreq.lock())
-                requestStep(req);
-        });
+        auto next = req.last_try + node.getResponseTime();
+        if (req.step_job) {
+            // The job is not scheduled anymore (it's running or it's the
+            // first attempt): reschedule it rather than allocating a new one.
+            scheduler.add(req.step_job, next);
+        } else {
+            std::weak_ptr<Request> wreq = sreq;
+            req.step_job = scheduler.add(next, [this,wreq] {
+                if (auto req = wreq.lock())
+                    requestStep(req);
+            });
+        }
     }
 }
 
@@ -298,20 +357,8 @@ bool
 NetworkEngine::rateLimit(const SockAddr& addr)
 {
     const auto& now = scheduler.time();
-
-    // occasional IP limiter maintenance (a few times every second at max rate)
-    if (limiter_maintenance++ == MAX_REQUESTS_PER_SEC/8) {
-        for (auto it = address_rate_limiter.begin(); it != address_rate_limiter.end();) {
-            if (it->second.maintain(now) == 0)
-                address_rate_limiter.erase(it++);
-            else
-                ++it;
-        }
-        limiter_maintenance = 0;
-    }
-
     // invoke per IP, then global rate limiter
-    return address_rate_limiter[addr].limit(now) and rate_limiter.limit(now);
+    return address_rate_limiter.limit(addr, now) and rate_limiter.limit(now, rate_quota);
 }
 
 bool
@@ -341,6 +388,12 @@ NetworkEngine::isMartian(const SockAddr& addr)
     }
 }
 
+TrafficStats
+NetworkEngine::getTrafficStats() const
+{
+    return traffic->get();
+}
+
 /* The internal blacklist is an LRU cache of nodes that have sent
    incorrect messages. */
 void
@@ -356,30 +409,160 @@ NetworkEngine::isNodeBlacklisted(const SockAddr& addr) const
     return blacklist.find(addr) != blacklist.end();
 }
 
-void
-NetworkEngine::processMessage(const uint8_t *buf, size_t buflen, SockAddr f)
+bool
+NetworkEngine::acceptFrom(const SockAddr& from) const
 {
-    auto from = f.getMappedIPv4();
     if (isMartian(from)) {
         DHT_LOG.w("Received packet from martian node %s", from.toString().c_str());
-        return;
+        return false;
     }
 
     if (isNodeBlacklisted(from)) {
         DHT_LOG.w("Received packet from blacklisted node %s", from.toString().c_str());
-        return;
+        return false;
     }
+    return true;
+}
+
+void
+NetworkEngine::processMessage(const uint8_t *buf, size_t buflen, SockAddr f)
+{
+    auto from = f.getMappedIPv4();
+    if (not acceptFrom(from))
+        return;
 
     std::unique_ptr<ParsedMessage> msg {new ParsedMessage};
     try {
-        msgpack::unpacked msg_res = msgpack::unpack((const char*)buf, buflen);
-        msg->msgpack_unpack(msg_res.get());
+        // Reuse the zone, and reference strings and binaries from the packet buffer
+        rx_zone.clear();
+        msg->unpack(buf, buflen, rx_zone);
     } catch (const std::exception& e) {
         DHT_LOG.w("Can't parse message of size %lu: %s", buflen, e.what());
         //DHT_LOG.DBG.logPrintable(buf, buflen);
         return;
     }
+    processParsed(std::move(msg), from);
+}
+
+DecodedPacket
+NetworkEngine::decode(const uint8_t *buf, size_t buflen, SockAddr from, time_point received)
+{
+    // ParsedMessage copies everything it keeps, so the zone can reference
+    // the packet buffer and be reused by the next packet of this thread.
+    thread_local msgpack::zone zone;
+    zone.clear();
+    std::unique_ptr<ParsedMessage> msg {new ParsedMessage};
+    msg->unpack(buf, buflen, zone);
+    return {std::move(msg), std::move(from), received};
+}
+
+uint8_t
+NetworkEngine::getShard(const uint8_t *buf, size_t buflen)
+{
+    MsgpackReader r((const char*)buf, buflen);
+    uint32_t n;
+    if (not r.readMapSize(n))
+        return 0;
+    Tid tid {0};
+    bool reply {false};
+    for (uint32_t i = 0; i < n; i++) {
+        // Keys are strings, or WireKey codes with the compact encoding
+        const char* str {nullptr};
+        uint32_t len {0};
+        uint64_t code {0};
+        if (r.isStr() ? not r.readStr(str, len) : not r.readUint(code))
+            return 0;
+        auto is = [&](const WireKey& k) {
+            return str ? len == k.len and std::memcmp(str, k.str, len) == 0 : code == k.code;
+        };
+        if (is(KEY_TID)) {
+            if (r.isBin()) {
+                const char* t;
+                uint32_t tlen;
+                if (not r.readBin(t, tlen) or tlen != sizeof(Tid))
+                    return 0;
+                uint32_t be;
+                std::memcpy(&be, t, sizeof(be));
+                tid = ntohl(be);
+            } else {
+                uint64_t v;
+                if (not r.readUint(v))
+                    return 0;
+                tid = (Tid)v;
+            }
+            continue;
+        }
+        if (is(KEY_A))
+            return 0;
+        if (is(KEY_R) or is(KEY_E) or is(KEY_V) or is(KEY_U))
+            reply = true;
+        if (not r.skip())
+            return 0;
+    }
+    return reply ? Node::getTidTag(tid) : 0;
+}
 
+bool
+NetworkEngine::getTarget(const uint8_t *buf, size_t buflen, InfoHash& target)
+{
+    MsgpackReader r((const char*)buf, buflen);
+    // Keys are strings, or WireKey codes with the compact encoding
+    const char* str {nullptr};
+    uint32_t len {0};
+    uint64_t code {0};
+    auto readKey = [&]() {
+        str = nullptr;
+        return r.isStr() ? r.readStr(str, len) : r.readUint(code);
+    };
+    auto is = [&](const WireKey& k) {
+        return str ? len == k.len and std::memcmp(str, k.str, len) == 0 : code == k.code;
+    };
+    uint32_t n;
+    if (not r.readMapSize(n))
+        return false;
+    for (uint32_t i = 0; i < n; i++) {
+        if (not readKey())
+            return false;
+        if (is(KEY_A)) {
+            uint32_t na;
+            if (not r.readMapSize(na))
+                return false;
+            for (uint32_t j = 0; j < na; j++) {
+                if (not readKey())
+                    return false;
+                if ((is(KEY_REQ_H) or is(KEY_REQ_TARGET)) and r.isBin()) {
+                    const char* h;
+                    uint32_t hlen;
+                    if (not r.readBin(h, hlen) or hlen != HASH_LEN)
+                        return false;
+                    target = InfoHash((const uint8_t*)h, hlen);
+                    return true;
+                }
+                if (not r.skip())
+                    return false;
+            }
+            return false;
+        }
+        if (not r.skip())
+            return false;
+    }
+    return false;
+}
+
+void
+NetworkEngine::processMessage(DecodedPacket&& pkt)
+{
+    if (not pkt.msg)
+        return;
+    auto from = pkt.from.getMappedIPv4();
+    if (not acceptFrom(from))
+        return;
+    processParsed(std::move(pkt.msg), from);
+}
+
+void
+NetworkEngine::processParsed(std::unique_ptr<ParsedMessage>&& msg, const SockAddr& from)
+{
     if (msg->network != network) {
         DHT_LOG.d("Received message from other network %u", msg->network);
         return;
@@ -389,6 +572,7 @@ NetworkEngine::processMessage(const uint8_t *buf, size_t buflen, SockAddr f)
 
     // partial value data
     if (msg->type == MessageType::ValueData) {
+        TrafficCounters::add((*traffic)[MessageType::ValueData].bytes_in, msg->size);
         auto pmsg_it = partial_messages.find(msg->tid);
         if (pmsg_it == partial_messages.end()) {
             if (logIncoming_)
@@ -396,22 +580,47 @@ NetworkEngine::processMessage(const uint8_t *buf, size_t buflen, SockAddr f)
             rateLimit(from);
             return;
         }
-        if (!pmsg_it->second.from.equals(from)) {
+        auto& pmsg = pmsg_it->second;
+        if (!pmsg.from.equals(from)) {
             DHT_LOG.d("Received partial message data from unexpected IP address");
             rateLimit(from);
             return;
         }
-        // append data block
-        if (pmsg_it->second.msg->append(*msg)) {
-            pmsg_it->second.last_part = now;
+        // write data blocks
+        bool added = false;
+        for (const auto& part : msg->value_parts)
+            added |= pmsg.parts.add(part.first, part.second.first, part.second.second.data(), part.second.second.size());
+        if (added) {
+            pmsg.last_part = now;
             // check data completion
-            if (pmsg_it->second.msg->complete()) {
-                // process the full message
-                process(std::move(pmsg_it->second.msg), from);
+            if (pmsg.parts.complete()) {
+                auto full = std::move(pmsg.msg);
+                full->complete(pmsg.parts);
+                if (pmsg.job)
+                    pmsg.job->cancel();
+                partial_messages_size -= pmsg.parts.size();
                 partial_messages.erase(pmsg_it);
-            } else
-                scheduler.add(now + RX_TIMEOUT, std::bind(&NetworkEngine::maintainRxBuffer, this, msg->tid));
+                // process the full message
+                process(std::move(full), from);
+            }
+        }
+        return;
+    }
+
+    // request for missing fragments of values we sent
+    if (msg->type == MessageType::ValueDataRequest) {
+        auto& stats = (*traffic)[MessageType::ValueDataRequest];
+        if (not rateLimit(from)) {
+            DHT_LOG.w("Dropping request due to rate limiting");
+            TrafficCounters::add(stats.rate_limited);
+            return;
         }
+        TrafficCounters::add(stats.requests_in);
+        TrafficCounters::add(stats.bytes_in, msg->size);
+        auto sent = tx_reply_bytes;
+        resendValueParts(msg->tid, msg->missing_parts, from);
+        TrafficCounters::add(stats.replies_out);
+        TrafficCounters::add(stats.bytes_out, tx_reply_bytes - sent);
         return;
     }
 
@@ -424,6 +633,7 @@ NetworkEngine::processMessage(const uint8_t *buf, size_t buflen, SockAddr f)
         /* Rate limit requests. */
         if (!rateLimit(from)) {
             DHT_LOG.w("Dropping request due to rate limiting");
+            TrafficCounters::add((*traffic)[msg->type].rate_limited);
             return;
         }
     }
@@ -433,16 +643,54 @@ NetworkEngine::processMessage(const uint8_t *buf, size_t buflen, SockAddr f)
     } else {
         // starting partial message session
         auto k = msg->tid;
-        auto& pmsg = partial_messages[k];
-        if (not pmsg.msg) {
-            pmsg.from = from;
-            pmsg.msg = std::move(msg);
-            pmsg.start = now;
-            pmsg.last_part = now;
-            scheduler.add(now + RX_MAX_PACKET_TIME, std::bind(&NetworkEngine::maintainRxBuffer, this, k));
-            scheduler.add(now + RX_TIMEOUT, std::bind(&NetworkEngine::maintainRxBuffer, this, k));
-        } else
+        if (partial_messages.find(k) != partial_messages.end()) {
             DHT_LOG.e("Partial message with given TID already exists");
+            return;
+        }
+        // Replies are not rate limited: only reserve memory for the ones
+        // we are waiting for.
+        if (msg->type <= MessageType::Reply and not isExpected(*msg, from)) {
+            DHT_LOG.d("Dropping unexpected partial message from %s", from.toString().c_str());
+            return;
+        }
+        std::vector<std::pair<unsigned, size_t>> sizes;
+        sizes.reserve(msg->value_parts.size());
+        size_t size = 0;
+        for (const auto& part : msg->value_parts) {
+            if (part.second.first == 0 or part.second.first > RX_MSG_MAX_SIZE) {
+                DHT_LOG.d("Dropping partial message from %s: invalid value size", from.toString().c_str());
+                return;
+            }
+            sizes.emplace_back(part.first, part.second.first);
+            size += part.second.first;
+        }
+        // A single message from a peer is only limited by RX_MSG_MAX_SIZE,
+        // so that replies with many large values can always be received.
+        auto peer_size = partialMessagesSize(from);
+        if (size > RX_MSG_MAX_SIZE
+         or partial_messages_size + size > RX_MAX_SIZE
+         or (peer_size and peer_size + size > RX_PEER_MAX_SIZE)) {
+            DHT_LOG.w("Dropping partial message from %s: too much data pending", from.toString().c_str());
+            return;
+        }
+        auto& pmsg = partial_messages[k];
+        pmsg.from = from;
+        pmsg.msg = std::move(msg);
+        pmsg.parts = ValueReassembly(sizes, MTU);
+        pmsg.start = now;
+        pmsg.last_part = now;
+        pmsg.job = scheduler.add(now + RX_PART_RETRY, std::bind(&NetworkEngine::maintainRxBuffer, this, k));
+        partial_messages_size += pmsg.parts.size();
+
+        // Missing fragments are requested again: don't send the whole
+        // request again while its reply is being received.
+        if (pmsg.msg->type == MessageType::Reply) {
+            if (auto node = cache.getNode(pmsg.msg->id, from.getFamily())) {
+                auto req = node->getRequest(k);
+                if (req and req->step_job)
+                    scheduler.edit(req->step_job, now + RX_TIMEOUT);
+            }
+        }
     }
 }
 
@@ -451,8 +699,21 @@ NetworkEngine::process(std::unique_ptr<ParsedMessage>&& msg, const SockAddr& fro
 {
     const auto& now = scheduler.time();
     auto node = cache.getNode(msg->id, from, now, true, msg->is_client);
+    bool cached = (bool)node;
+    if (not cached) {
+        // The cache is full: requests of this node are answered, but it is
+        // not remembered, and can't be the origin of replies we expect.
+        if (msg->type == MessageType::ValueUpdate or msg->type == MessageType::Error or msg->type == MessageType::Reply)
+            return;
+        node = std::make_shared<Node>(msg->id, from, msg->is_client);
+    }
+    node->setCompact(isCompactUserAgent(msg->ua));
+    bool compact = compactTo(*node);
 
     if (msg->type == MessageType::ValueUpdate) {
+        auto& stats = (*traffic)[MessageType::ValueUpdate];
+        TrafficCounters::add(stats.requests_in);
+        TrafficCounters::add(stats.bytes_in, msg->size);
         auto rsocket = node->getSocket(msg->tid);
         if (not rsocket)
             throw DhtProtocolException {DhtProtocolException::UNKNOWN_TID, "Can't find socket", msg->id};
@@ -464,6 +725,12 @@ NetworkEngine::process(std::unique_ptr<ParsedMessage>&& msg, const SockAddr& fro
     else if (msg->type == MessageType::Error or msg->type == MessageType::Reply) {
         auto rsocket = node->getSocket(msg->tid);
         auto req = node->getRequest(msg->tid);
+        // replies are accounted to the type of their request
+        auto received = [&](MessageType type) {
+            auto& stats = (*traffic)[type];
+            TrafficCounters::add(msg->type == MessageType::Error ? stats.errors_in : stats.replies_in);
+            TrafficCounters::add(stats.bytes_in, msg->size);
+        };
 
         /* either response for a request or data for an opened socket */
         if (not req and not rsocket) {
@@ -476,10 +743,16 @@ NetworkEngine::process(std::unique_ptr<ParsedMessage>&& msg, const SockAddr& fro
                 node->received(now, req);
                 if (not node->isClient())
                     onNewNode(node, 1);
+                received(msg->type);
                 throw DhtProtocolException {DhtProtocolException::UNKNOWN_TID, "Can't find transaction", msg->id};
             }
         }
+        received(req ? req->getType() : msg->type);
 
+        // Karn's rule: the reply to a request sent several times can't be
+        // matched with a particular attempt.
+        if (req and req->pending() and req->attempt_count == 1)
+            node->rttSample(now - req->last_try);
         node->received(now, req);
 
         if (not node->isClient())
@@ -514,6 +787,7 @@ NetworkEngine::process(std::unique_ptr<ParsedMessage>&& msg, const SockAddr& fro
                 if (r.getType() == MessageType::AnnounceValue or r.getType() == MessageType::Listen)
                     r.node->authSuccess();
                 r.reply_time = scheduler.time();
+                (*traffic)[r.getType()].latency.record(r.reply_time - r.start);
 
                 deserializeNodes(*msg, from);
                 r.setDone(std::move(*msg));
@@ -528,8 +802,12 @@ NetworkEngine::process(std::unique_ptr<ParsedMessage>&& msg, const SockAddr& fro
         }
     } else {
         node->received(now, {});
-        if (not node->isClient())
+        if (cached and not node->isClient())
             onNewNode(node, 1);
+        auto& stats = (*traffic)[msg->type];
+        TrafficCounters::add(stats.requests_in);
+        TrafficCounters::add(stats.bytes_in, msg->size);
+        auto sent = tx_reply_bytes;
         try {
             switch (msg->type) {
             case MessageType::Ping:
@@ -537,22 +815,22 @@ NetworkEngine::process(std::unique_ptr<ParsedMessage>&& msg, const SockAddr& fro
                 if (logIncoming_)
                     DHT_LOG.d(node->id, "[node %s] sending pong", node->toString().c_str());
                 onPing(node);
-                sendPong(from, msg->tid);
+                sendPong(from, msg->tid, compact);
                 break;
             case MessageType::FindNode: {
                 //DHT_LOG.d(msg->target, node->id, "[node %s] got 'find' request for %s (%d)", node->toString().c_str(), msg->target.toString().c_str(), msg->want);
                 ++in_stats.find;
                 RequestAnswer answer = onFindNode(node, msg->target, msg->want);
-                auto nnodes = bufferNodes(from.getFamily(), msg->target, msg->want, answer.nodes4, answer.nodes6);
-                sendNodesValues(from, msg->tid, nnodes.first, nnodes.second, {}, {}, answer.ntoken);
+                packAnswerNodes(from.getFamily(), msg->target, msg->want, answer);
+                sendNodesValues(from, msg->tid, packedNodes(answer.packed_nodes4), packedNodes(answer.packed_nodes6), {}, {}, answer.ntoken, compact);
                 break;
             }
             case MessageType::GetValues: {
                 //DHT_LOG.d(msg->info_hash, node->id, "[node %s] got 'get' request for %s", node->toString().c_str(), msg->info_hash.toString().c_str());
                 ++in_stats.get;
                 RequestAnswer answer = onGetValues(node, msg->info_hash, msg->want, msg->query);
-                auto nnodes = bufferNodes(from.getFamily(), msg->info_hash, msg->want, answer.nodes4, answer.nodes6);
-                sendNodesValues(from, msg->tid, nnodes.first, nnodes.second, answer.values, msg->query, answer.ntoken);
+                packAnswerNodes(from.getFamily(), msg->info_hash, msg->want, answer);
+                sendNodesValues(from, msg->tid, packedNodes(answer.packed_nodes4), packedNodes(answer.packed_nodes6), answer.values, msg->query, answer.ntoken, compact);
                 break;
             }
             case MessageType::AnnounceValue: {
@@ -565,7 +843,7 @@ NetworkEngine::process(std::unique_ptr<ParsedMessage>&& msg, const SockAddr& fro
                    This is to prevent them from backtracking, and hence
                    polluting the DHT. */
                 for (auto& v : msg->values) {
-                   sendValueAnnounced(from, msg->tid, v->id);
+                   sendValueAnnounced(from, msg->tid, v->id, compact);
                 }
                 break;
             }
@@ -574,15 +852,14 @@ NetworkEngine::process(std::unique_ptr<ParsedMessage>&& msg, const SockAddr& fro
                     DHT_LOG.d(msg->info_hash, node->id, "[node %s] got 'refresh' request for %s", node->toString().c_str(), msg->info_hash.toString().c_str());
                 onRefresh(node, msg->info_hash, msg->token, msg->value_id);
                 /* Same note as above in MessageType::AnnounceValue applies. */
-                sendValueAnnounced(from, msg->tid, msg->value_id);
+                sendValueAnnounced(from, msg->tid, msg->value_id, compact);
                 break;
             case MessageType::Listen: {
                 if (logIncoming_)
                     DHT_LOG.d(msg->info_hash, node->id, "[node %s] got 'listen' request for %s", node->toString().c_str(), msg->info_hash.toString().c_str());
                 ++in_stats.listen;
-                RequestAnswer answer = onListen(node, msg->info_hash, msg->token, msg->socket_id, std::move(msg->query));
-                auto nnodes = bufferNodes(from.getFamily(), msg->info_hash, msg->want, answer.nodes4, answer.nodes6);
-                sendListenConfirmation(from, msg->tid);
+                onListen(node, msg->info_hash, msg->token, msg->socket_id, std::move(msg->query));
+                sendListenConfirmation(from, msg->tid, compact);
                 break;
             }
             default:
@@ -591,19 +868,23 @@ NetworkEngine::process(std::unique_ptr<ParsedMessage>&& msg, const SockAddr& fro
         } catch (const std::overflow_error& e) {
             DHT_LOG.e("Can't send value: buffer not large enough !");
         } catch (DhtProtocolException& e) {
-            sendError(from, msg->tid, e.getCode(), e.getMsg().c_str(), true);
+            sendError(from, msg->tid, e.getCode(), e.getMsg().c_str(), true, compact);
+        }
+        if (tx_reply_bytes != sent) {
+            TrafficCounters::add(stats.replies_out);
+            TrafficCounters::add(stats.bytes_out, tx_reply_bytes - sent);
         }
     }
 }
 
 void
-insertAddr(msgpack::packer<msgpack::sbuffer>& pk, const SockAddr& addr)
+insertAddr(MessagePacker<TxBuffer>& pk, const SockAddr& addr)
 {
     size_t addr_len = std::min<size_t>(addr.getLength(),
                      (addr.getFamily() == AF_INET) ? sizeof(in_addr) : sizeof(in6_addr));
     void* addr_ptr = (addr.getFamily() == AF_INET) ? (void*)&addr.getIPv4().sin_addr
                                                 : (void*)&addr.getIPv6().sin6_addr;
-    pk.pack("sa");
+    pk.pack(KEY_REQ_ADDRESS);
     pk.pack_bin(addr_len);
     pk.pack_bin_body((char*)addr_ptr, addr_len);
 }
@@ -611,14 +892,72 @@ insertAddr(msgpack::packer<msgpack::sbuffer>& pk, const SockAddr& addr)
 int
 NetworkEngine::send(const SockAddr& addr, const char *buf, size_t len, bool confirmed)
 {
-    return dht_socket ? dht_socket->sendTo(addr, (const uint8_t*)buf, len, confirmed) : ENOTCONN;
+    if (not dht_socket)
+        return ENOTCONN;
+    return dht_socket->sendTo(addr, (const uint8_t*)buf, len, confirmed);
+}
+
+void
+NetworkEngine::sendQueued(const SockAddr& addr, const char *buf, size_t len)
+{
+    auto af = addr.getFamily();
+    if (tx_batch <= 1 or (af != AF_INET and af != AF_INET6)) {
+        send(addr, buf, len);
+        return;
+    }
+
+    auto& queue = af == AF_INET ? tx_queue4 : tx_queue6;
+    if (queue.spare.empty()) {
+        queue.packets.emplace_back(OutgoingPacket {Blob((const uint8_t*)buf, (const uint8_t*)buf + len), addr, false});
+    } else {
+        // Reuse the memory of a sent packet
+        queue.packets.emplace_back(std::move(queue.spare.back()));
+        queue.spare.pop_back();
+        auto& pkt = queue.packets.back();
+        pkt.data.assign((const uint8_t*)buf, (const uint8_t*)buf + len);
+        pkt.to = addr;
+        pkt.replied = false;
+    }
+    queue.peak = std::max(queue.peak, queue.packets.size());
+    if (queue.packets.size() >= tx_batch)
+        flush(queue);
+    else if (not tx_flush_job)
+        tx_flush_job = scheduler.add(scheduler.time() + tx_max_delay, [this] {
+            tx_flush_job.reset();
+            flush();
+        });
+}
+
+void
+NetworkEngine::flush()
+{
+    if (tx_flush_job) {
+        tx_flush_job->cancel();
+        tx_flush_job.reset();
+    }
+    flush(tx_queue4);
+    flush(tx_queue6);
+}
+
+void
+NetworkEngine::flush(TxQueue& queue)
+{
+    if (queue.packets.empty() or not dht_socket)
+        return;
+    auto sent = dht_socket->sendBatch(queue.packets);
+    if (sent != queue.packets.size())
+        DHT_LOG.d("Couldn't send %zu of %zu queued packets", queue.packets.size() - sent, queue.packets.size());
+    for (auto& pkt : queue.packets)
+        if (queue.spare.size() < tx_batch)
+            queue.spare.emplace_back(std::move(pkt));
+    queue.packets.clear();
 }
 
 Sp<Request>
 NetworkEngine::sendPing(Sp<Node> node, RequestCb&& on_done, RequestExpiredCb&& on_expired) {
     TransId tid (node->getNewTid());
-    msgpack::sbuffer buffer;
-    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    auto& buffer = txBuffer();
+    MessagePacker<TxBuffer> pk(&buffer, compactTo(*node));
     pk.pack_map(5+(network?1:0));
 
     pk.pack(KEY_A); pk.pack_map(1);
@@ -628,12 +967,12 @@ NetworkEngine::sendPing(Sp<Node> node, RequestCb&& on_done, RequestExpiredCb&& o
     pk.pack(KEY_TID); pk.pack_bin(tid.size());
                               pk.pack_bin_body((const char*)tid.data(), tid.size());
     pk.pack(KEY_Y); pk.pack(KEY_Q);
-    pk.pack(KEY_UA); pk.pack(my_v);
+    pk.pack(KEY_UA); pk.pack(userAgent());
     if (network) {
         pk.pack(KEY_NETID); pk.pack(network);
     }
 
-    auto req = std::make_shared<Request>(MessageType::Ping, tid.toInt(), node,
+    auto req = makeRequest(MessageType::Ping, tid.toInt(), node,
         Blob(buffer.data(), buffer.data() + buffer.size()),
         [=](const Request& req_status, ParsedMessage&&) {
             DHT_LOG.d(req_status.node->id, "[node %s] got pong !", req_status.node->toString().c_str());
@@ -653,9 +992,9 @@ NetworkEngine::sendPing(Sp<Node> node, RequestCb&& on_done, RequestExpiredCb&& o
 }
 
 void
-NetworkEngine::sendPong(const SockAddr& addr, Tid tid) {
-    msgpack::sbuffer buffer;
-    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+NetworkEngine::sendPong(const SockAddr& addr, Tid tid, bool compact) {
+    auto& buffer = txBuffer();
+    MessagePacker<TxBuffer> pk(&buffer, compact);
     pk.pack_map(4+(network?1:0));
 
     pk.pack(KEY_R); pk.pack_map(2);
@@ -666,20 +1005,21 @@ NetworkEngine::sendPong(const SockAddr& addr, Tid tid) {
     pk.pack(KEY_TID); pk.pack_bin(t.size());
                                pk.pack_bin_body((const char*)t.data(), t.size());
     pk.pack(KEY_Y); pk.pack(KEY_R);
-    pk.pack(KEY_UA); pk.pack(my_v);
+    pk.pack(KEY_UA); pk.pack(userAgent());
     if (network) {
         pk.pack(KEY_NETID); pk.pack(network);
     }
 
-    send(addr, buffer.data(), buffer.size());
+    tx_reply_bytes += buffer.size();
+    sendQueued(addr, buffer.data(), buffer.size());
 }
 
 Sp<Request>
 NetworkEngine::sendFindNode(Sp<Node> n, const InfoHash& target, want_t want,
         RequestCb&& on_done, RequestExpiredCb&& on_expired) {
     TransId tid (n->getNewTid());
-    msgpack::sbuffer buffer;
-    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    auto& buffer = txBuffer();
+    MessagePacker<TxBuffer> pk(&buffer, compactTo(*n));
     pk.pack_map(5+(network?1:0));
 
     pk.pack(KEY_A); pk.pack_map(2 + (want>0?1:0));
@@ -696,12 +1036,12 @@ NetworkEngine::sendFindNode(Sp<Node> n, const InfoHash& target, want_t want,
     pk.pack(KEY_TID); pk.pack_bin(tid.size());
                                pk.pack_bin_body((const char*)tid.data(), tid.size());
     pk.pack(KEY_Y); pk.pack(KEY_Q);
-    pk.pack(KEY_UA); pk.pack(my_v);
+    pk.pack(KEY_UA); pk.pack(userAgent());
     if (network) {
         pk.pack(KEY_NETID); pk.pack(network);
     }
 
-    auto req = std::make_shared<Request>(MessageType::FindNode, tid.toInt(), n,
+    auto req = makeRequest(MessageType::FindNode, tid.toInt(), n,
         Blob(buffer.data(), buffer.data() + buffer.size()),
         [=](const Request& req_status, ParsedMessage&& msg) { /* on done */
             if (on_done) {
@@ -724,8 +1064,8 @@ Sp<Request>
 NetworkEngine::sendGetValues(Sp<Node> n, const InfoHash& info_hash, const Query& query, want_t want,
         RequestCb&& on_done, RequestExpiredCb&& on_expired) {
     TransId tid (n->getNewTid());
-    msgpack::sbuffer buffer;
-    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    auto& buffer = txBuffer();
+    MessagePacker<TxBuffer> pk(&buffer, compactTo(*n));
     pk.pack_map(5+(network?1:0));
 
     pk.pack(KEY_A);  pk.pack_map(2 +
@@ -745,12 +1085,12 @@ NetworkEngine::sendGetValues(Sp<Node> n, const InfoHash& info_hash, const Query&
     pk.pack(KEY_TID); pk.pack_bin(tid.size());
                                pk.pack_bin_body((const char*)tid.data(), tid.size());
     pk.pack(KEY_Y); pk.pack(KEY_Q);
-    pk.pack(KEY_UA); pk.pack(my_v);
+    pk.pack(KEY_UA); pk.pack(userAgent());
     if (network) {
         pk.pack(KEY_NETID); pk.pack(network);
     }
 
-    auto req = std::make_shared<Request>(MessageType::GetValues, tid.toInt(), n,
+    auto req = makeRequest(MessageType::GetValues, tid.toInt(), n,
         Blob(buffer.data(), buffer.data() + buffer.size()),
         [=](const Request& req_status, ParsedMessage&& msg) { /* on done */
             if (on_done) {
@@ -805,8 +1145,10 @@ NetworkEngine::deserializeNodes(ParsedMessage& msg, const SockAddr& from) {
         }
         if (isMartian(addr) || isNodeBlacklisted(addr))
             continue;
-        msg.nodes4.emplace_back(cache.getNode(ni_id, addr, now, false));
-        onNewNode(msg.nodes4.back(), 0);
+        if (auto node = cache.getNode(ni_id, addr, now, false)) {
+            msg.nodes4.emplace_back(node);
+            onNewNode(node, 0);
+        }
     }
     for (unsigned i = 0, n = msg.nodes6_raw.size() / NODE6_INFO_BUF_LEN; i < n; i++) {
         const uint8_t* ni = msg.nodes6_raw.data() + i * NODE6_INFO_BUF_LEN;
@@ -821,71 +1163,164 @@ NetworkEngine::deserializeNodes(ParsedMessage& msg, const SockAddr& from) {
         }
         if (isMartian(addr) || isNodeBlacklisted(addr))
             continue;
-        msg.nodes6.emplace_back(cache.getNode(ni_id, addr, now, false));
-        onNewNode(msg.nodes6.back(), 0);
+        if (auto node = cache.getNode(ni_id, addr, now, false)) {
+            msg.nodes6.emplace_back(node);
+            onNewNode(node, 0);
+        }
     }
 }
 
 std::vector<Blob>
-NetworkEngine::packValueHeader(msgpack::sbuffer& buffer, const std::vector<Sp<Value>>& st)
+NetworkEngine::packValueHeader(TxBuffer& buffer, const std::vector<Sp<Value>>& st, bool compact)
 {
-    auto svals = serializeValues(st);
-    size_t total_size = 0;
-    for (const auto& v : svals)
-        total_size += v.size();
-
-    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    MessagePacker<TxBuffer> pk(&buffer, compact);
     pk.pack(KEY_REQ_VALUES);
-    pk.pack_array(svals.size());
-    // try to put everything in a single UDP packet
-    if (svals.size() < 50 && total_size < MAX_PACKET_VALUE_SIZE) {
-        for (const auto& b : svals)
-            buffer.write((const char*)b.data(), b.size());
-        // DHT_LOG.d("sending %lu bytes of values", total_size);
-        svals.clear();
-    } else {
-        for (const auto& b : svals)
-            pk.pack(b.size());
+    pk.pack_array(st.size());
+    // try to put everything in a single UDP packet, packing values in place
+    if (st.size() < 50) {
+        auto start = buffer.size();
+        for (const auto& v : st)
+            pk.pack(*v);
+        if (buffer.size() - start < MAX_PACKET_VALUE_SIZE) {
+            // DHT_LOG.d("sending %lu bytes of values", buffer.size() - start);
+            return {};
+        }
+        buffer.truncate(start);
     }
+    auto svals = serializeValues(st);
+    for (const auto& b : svals)
+        pk.pack(b.size());
     return svals;
 }
 
 void
-NetworkEngine::sendValueParts(const TransId& tid, const std::vector<Blob>& svals, const SockAddr& addr)
+NetworkEngine::sendValuePart(const TransId& tid, unsigned index, const Blob& v, size_t start, const SockAddr& addr)
+{
+    auto end = std::min(start + MTU, v.size());
+    auto& buffer = txBuffer();
+    MessagePacker<TxBuffer> pk(&buffer, false);
+    pk.pack_map(3+(network?1:0));
+    if (network) {
+        pk.pack(KEY_NETID); pk.pack(network);
+    }
+    pk.pack(KEY_Y); pk.pack(KEY_V);
+    pk.pack(KEY_TID); pk.pack_bin(tid.size());
+                      pk.pack_bin_body((const char*)tid.data(), tid.size());
+    pk.pack(KEY_V); pk.pack_map(1);
+        pk.pack(index); pk.pack_map(2);
+            pk.pack(std::string("o")); pk.pack(start);
+            pk.pack(std::string("d")); pk.pack_bin(end-start);
+                                       pk.pack_bin_body((const char*)v.data()+start, end-start);
+    tx_reply_bytes += buffer.size();
+    sendQueued(addr, buffer.data(), buffer.size());
+}
+
+void
+NetworkEngine::sendValueParts(const TransId& tid, std::vector<Blob>&& svals, const SockAddr& addr)
 {
-    msgpack::sbuffer buffer;
     unsigned i=0;
+    size_t size=0;
     for (const auto& v: svals) {
-        size_t start {0}, end;
+        size_t start {0};
         do {
-            end = std::min(start + MTU, v.size());
-            buffer.clear();
-            msgpack::packer<msgpack::sbuffer> pk(&buffer);
-            pk.pack_map(3+(network?1:0));
-            if (network) {
-                pk.pack(KEY_NETID); pk.pack(network);
-            }
-            pk.pack(KEY_Y); pk.pack(KEY_V);
-            pk.pack(KEY_TID); pk.pack_bin(tid.size());
-                                       pk.pack_bin_body((const char*)tid.data(), tid.size());
-            pk.pack(KEY_V); pk.pack_map(1);
-                pk.pack(i); pk.pack_map(2);
-                    pk.pack(std::string("o")); pk.pack(start);
-                    pk.pack(std::string("d")); pk.pack_bin(end-start);
-                                               pk.pack_bin_body((const char*)v.data()+start, end-start);
-            send(addr, buffer.data(), buffer.size());
-            start = end;
+            sendValuePart(tid, i, v, start, addr);
+            start = std::min(start + MTU, v.size());
         } while (start != v.size());
+        size += v.size();
         i++;
     }
+
+    // keep the values for a while, to send missing fragments again
+    const auto& now = scheduler.time();
+    sent_parts.emplace_back(SentParts {tid.toInt(), addr, now, std::move(svals), size});
+    sent_parts_size += size;
+    while (not sent_parts.empty() and (sent_parts_size > TX_PARTS_MAX_SIZE
+                                    or sent_parts.front().time + RX_MAX_PACKET_TIME < now)) {
+        sent_parts_size -= sent_parts.front().size;
+        sent_parts.pop_front();
+    }
+}
+
+void
+NetworkEngine::resendValueParts(Tid tid, const std::map<unsigned, std::vector<unsigned>>& parts, const SockAddr& addr)
+{
+    auto sent = std::find_if(sent_parts.rbegin(), sent_parts.rend(), [&](const SentParts& p) {
+        return p.tid == tid and p.to.equals(addr);
+    });
+    if (sent == sent_parts.rend() or sent->resent >= TX_PARTS_MAX_RESEND)
+        return;
+    sent->resent++;
+    TransId t (tid);
+    size_t count = 0;
+    for (const auto& part : parts) {
+        if (part.first >= sent->values.size())
+            continue;
+        const auto& v = sent->values[part.first];
+        for (auto fragment : part.second) {
+            if (count == MAX_PARTS_RETRY)
+                return;
+            if ((size_t)fragment * MTU >= v.size())
+                continue;
+            sendValuePart(t, part.first, v, (size_t)fragment * MTU, addr);
+            count++;
+        }
+    }
+}
+
+void
+NetworkEngine::sendMissingParts(Tid tid, const PartialMessage& pmsg)
+{
+    auto missing = pmsg.parts.getMissing(MAX_PARTS_RETRY);
+    TransId t (tid);
+    auto& buffer = txBuffer();
+    MessagePacker<TxBuffer> pk(&buffer, false);
+    pk.pack_map(3+(network?1:0));
+    if (network) {
+        pk.pack(KEY_NETID); pk.pack(network);
+    }
+    pk.pack(KEY_Y); pk.pack(KEY_M);
+    pk.pack(KEY_TID); pk.pack_bin(t.size());
+                      pk.pack_bin_body((const char*)t.data(), t.size());
+    pk.pack(KEY_M); pk.pack(missing);
+    sendQueued(pmsg.from, buffer.data(), buffer.size());
+}
+
+size_t
+NetworkEngine::partialMessagesSize(const SockAddr& addr) const
+{
+    SockAddr::ipCmp cmp;
+    size_t size = 0;
+    for (const auto& pmsg : partial_messages)
+        if (not cmp(pmsg.second.from, addr) and not cmp(addr, pmsg.second.from))
+            size += pmsg.second.parts.size();
+    return size;
+}
+
+bool
+NetworkEngine::isExpected(const ParsedMessage& msg, const SockAddr& from)
+{
+    if (msg.type != MessageType::Reply)
+        return false;
+    if (auto node = cache.getNode(msg.id, from.getFamily())) {
+        if (node->getAddr().equals(from)) {
+            auto req = node->getRequest(msg.tid);
+            if ((req and req->pending()) or node->getSocket(msg.tid))
+                return true;
+        }
+    }
+    // requests sent to a node of unknown id
+    auto req_it = requests.find(msg.tid);
+    return req_it != requests.end()
+        and req_it->second->pending()
+        and req_it->second->node->getAddr().equals(from);
 }
 
 void
 NetworkEngine::sendNodesValues(const SockAddr& addr, Tid tid, const Blob& nodes, const Blob& nodes6,
-        const std::vector<Sp<Value>>& st, const Query& query, const Blob& token)
+        const std::vector<Sp<Value>>& st, const Query& query, const Blob& token, bool compact)
 {
-    msgpack::sbuffer buffer;
-    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    auto& buffer = txBuffer();
+    MessagePacker<TxBuffer> pk(&buffer, compact);
     pk.pack_map(4+(network?1:0));
 
     pk.pack(KEY_R);
@@ -909,7 +1344,7 @@ NetworkEngine::sendNodesValues(const SockAddr& addr, Tid tid, const Blob& nodes,
     if (not st.empty()) { /* pack complete values */
         auto fields = query.select.getSelection();
         if (fields.empty()) {
-            svals = packValueHeader(buffer, st);
+            svals = packValueHeader(buffer, st, compact);
         } else { /* pack fields */
             pk.pack(KEY_REQ_FIELDS);
             pk.pack_map(2);
@@ -926,27 +1361,36 @@ NetworkEngine::sendNodesValues(const SockAddr& addr, Tid tid, const Blob& nodes,
     pk.pack(KEY_TID); pk.pack_bin(t.size());
                       pk.pack_bin_body((const char*)t.data(), t.size());
     pk.pack(KEY_Y); pk.pack(KEY_R);
-    pk.pack(KEY_UA); pk.pack(my_v);
+    pk.pack(KEY_UA); pk.pack(userAgent());
     if (network) {
         pk.pack(KEY_NETID); pk.pack(network);
     }
 
     // send response
-    send(addr, buffer.data(), buffer.size());
+    tx_reply_bytes += buffer.size();
+    sendQueued(addr, buffer.data(), buffer.size());
 
     // send parts
     if (not svals.empty())
-        sendValueParts(tid, svals, addr);
+        sendValueParts(tid, std::move(svals), addr);
 }
 
 Blob
 NetworkEngine::bufferNodes(sa_family_t af, const InfoHash& id, std::vector<Sp<Node>>& nodes)
+{
+    Blob bnodes;
+    packNodes(af, id, nodes, bnodes);
+    return bnodes;
+}
+
+void
+NetworkEngine::packNodes(sa_family_t af, const InfoHash& id, std::vector<Sp<Node>>& nodes, Blob& bnodes)
 {
     std::sort(nodes.begin(), nodes.end(), [&](const Sp<Node>& a, const Sp<Node>& b){
         return id.xorCmp(a->id, b->id) < 0;
     });
     size_t nnode = std::min<size_t>(SEND_NODES, nodes.size());
-    Blob bnodes;
+    bnodes.clear();
     if (af == AF_INET) {
         bnodes.resize(NODE4_INFO_BUF_LEN * nnode);
         for (size_t i=0; i<nnode; i++) {
@@ -968,7 +1412,6 @@ NetworkEngine::bufferNodes(sa_family_t af, const InfoHash& id, std::vector<Sp<No
             memcpy(dest + HASH_LEN + sizeof(in6_addr), &sin6.sin6_port, sizeof(in_port_t));
         }
     }
-    return bnodes;
 }
 
 std::pair<Blob, Blob>
@@ -989,6 +1432,22 @@ NetworkEngine::bufferNodes(sa_family_t af, const InfoHash& id, want_t want,
     return {std::move(bnodes4), std::move(bnodes6)};
 }
 
+void
+NetworkEngine::packAnswerNodes(sa_family_t af, const InfoHash& id, want_t want, RequestAnswer& answer)
+{
+    if (want < 0)
+        want = af == AF_INET ? WANT4 : WANT6;
+
+    auto pack = [&](sa_family_t family, std::vector<Sp<Node>>& nodes, Sp<const Blob>& packed) {
+        if (not (want & (family == AF_INET ? WANT4 : WANT6)))
+            packed.reset();
+        else if (not packed)
+            packed = std::make_shared<Blob>(bufferNodes(family, id, nodes));
+    };
+    pack(AF_INET, answer.nodes4, answer.packed_nodes4);
+    pack(AF_INET6, answer.nodes6, answer.packed_nodes6);
+}
+
 Sp<Request>
 NetworkEngine::sendListen(Sp<Node> n,
         const InfoHash& hash,
@@ -1015,8 +1474,8 @@ NetworkEngine::sendListen(Sp<Node> n,
     }
     TransId sid(socket);
 
-    msgpack::sbuffer buffer;
-    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    auto& buffer = txBuffer();
+    MessagePacker<TxBuffer> pk(&buffer, compactTo(*n));
     pk.pack_map(5+(network?1:0));
 
     auto has_query = query.where.getFilter() or not query.select.getSelection().empty();
@@ -1034,12 +1493,12 @@ NetworkEngine::sendListen(Sp<Node> n,
     pk.pack(KEY_TID); pk.pack_bin(tid.size());
                                pk.pack_bin_body((const char*)tid.data(), tid.size());
     pk.pack(KEY_Y); pk.pack(KEY_Q);
-    pk.pack(KEY_UA); pk.pack(my_v);
+    pk.pack(KEY_UA); pk.pack(userAgent());
     if (network) {
         pk.pack(KEY_NETID); pk.pack(network);
     }
 
-    auto req = std::make_shared<Request>(MessageType::Listen, tid.toInt(), n,
+    auto req = makeRequest(MessageType::Listen, tid.toInt(), n,
         Blob(buffer.data(), buffer.data() + buffer.size()),
         [=](const Request& req_status, ParsedMessage&& msg) { /* on done */
             if (on_done)
@@ -1057,9 +1516,9 @@ NetworkEngine::sendListen(Sp<Node> n,
 }
 
 void
-NetworkEngine::sendListenConfirmation(const SockAddr& addr, Tid tid) {
-    msgpack::sbuffer buffer;
-    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+NetworkEngine::sendListenConfirmation(const SockAddr& addr, Tid tid, bool compact) {
+    auto& buffer = txBuffer();
+    MessagePacker<TxBuffer> pk(&buffer, compact);
     pk.pack_map(4+(network?1:0));
 
     pk.pack(KEY_R); pk.pack_map(2);
@@ -1070,12 +1529,13 @@ NetworkEngine::sendListenConfirmation(const SockAddr& addr, Tid tid) {
     pk.pack(KEY_TID); pk.pack_bin(t.size());
                                pk.pack_bin_body((const char*)t.data(), t.size());
     pk.pack(KEY_Y); pk.pack(KEY_R);
-    pk.pack(KEY_UA); pk.pack(my_v);
+    pk.pack(KEY_UA); pk.pack(userAgent());
     if (network) {
         pk.pack(KEY_NETID); pk.pack(network);
     }
 
-    send(addr, buffer.data(), buffer.size());
+    tx_reply_bytes += buffer.size();
+    sendQueued(addr, buffer.data(), buffer.size());
 }
 
 Sp<Request>
@@ -1088,14 +1548,14 @@ NetworkEngine::sendAnnounceValue(Sp<Node> n,
         RequestExpiredCb&& on_expired)
 {
     TransId tid (n->getNewTid());
-    msgpack::sbuffer buffer;
-    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    auto& buffer = txBuffer();
+    MessagePacker<TxBuffer> pk(&buffer, compactTo(*n));
     pk.pack_map(5+(network?1:0));
 
     pk.pack(KEY_A); pk.pack_map((created < scheduler.time() ? 5 : 4));
       pk.pack(KEY_REQ_ID);     pk.pack(myid);
       pk.pack(KEY_REQ_H);      pk.pack(infohash);
-      auto v = packValueHeader(buffer, {value});
+      auto v = packValueHeader(buffer, {value}, pk.compact());
       if (created < scheduler.time()) {
           pk.pack(KEY_REQ_CREATION);
           pk.pack(to_time_t(created));
@@ -1106,12 +1566,12 @@ NetworkEngine::sendAnnounceValue(Sp<Node> n,
     pk.pack(KEY_TID); pk.pack_bin(tid.size());
                       pk.pack_bin_body((const char*)tid.data(), tid.size());
     pk.pack(KEY_Y);   pk.pack(KEY_Q);
-    pk.pack(KEY_UA);  pk.pack(my_v);
+    pk.pack(KEY_UA);  pk.pack(userAgent());
     if (network) {
         pk.pack(KEY_NETID); pk.pack(network);
     }
 
-    auto req = std::make_shared<Request>(MessageType::AnnounceValue, tid.toInt(), n,
+    auto req = makeRequest(MessageType::AnnounceValue, tid.toInt(), n,
         Blob(buffer.data(), buffer.data() + buffer.size()),
         [=](const Request& req_status, ParsedMessage&& msg) { /* on done */
             if (msg.value_id == Value::INVALID_ID) {
@@ -1132,7 +1592,7 @@ NetworkEngine::sendAnnounceValue(Sp<Node> n,
     );
     sendRequest(req);
     if (not v.empty())
-        sendValueParts(tid, v, n->getAddr());
+        sendValueParts(tid, std::move(v), n->getAddr());
     ++out_stats.put;
     return req;
 }
@@ -1146,8 +1606,8 @@ NetworkEngine::sendRefreshValue(Sp<Node> n,
                 RequestExpiredCb&& on_expired)
 {
     TransId tid (n->getNewTid());
-    msgpack::sbuffer buffer;
-    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    auto& buffer = txBuffer();
+    MessagePacker<TxBuffer> pk(&buffer, compactTo(*n));
     pk.pack_map(5+(network?1:0));
 
     pk.pack(KEY_A); pk.pack_map(4);
@@ -1160,12 +1620,12 @@ NetworkEngine::sendRefreshValue(Sp<Node> n,
     pk.pack(KEY_TID); pk.pack_bin(tid.size());
                                pk.pack_bin_body((const char*)tid.data(), tid.size());
     pk.pack(KEY_Y); pk.pack(KEY_Q);
-    pk.pack(KEY_UA); pk.pack(my_v);
+    pk.pack(KEY_UA); pk.pack(userAgent());
     if (network) {
         pk.pack(KEY_NETID); pk.pack(network);
     }
 
-    auto req = std::make_shared<Request>(MessageType::Refresh, tid.toInt(), n,
+    auto req = makeRequest(MessageType::Refresh, tid.toInt(), n,
         Blob(buffer.data(), buffer.data() + buffer.size()),
         [=](const Request& req_status, ParsedMessage&& msg) { /* on done */
             if (msg.value_id == Value::INVALID_ID) {
@@ -1190,9 +1650,9 @@ NetworkEngine::sendRefreshValue(Sp<Node> n,
 }
 
 void
-NetworkEngine::sendValueAnnounced(const SockAddr& addr, Tid tid, Value::Id vid) {
-    msgpack::sbuffer buffer;
-    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+NetworkEngine::sendValueAnnounced(const SockAddr& addr, Tid tid, Value::Id vid, bool compact) {
+    auto& buffer = txBuffer();
+    MessagePacker<TxBuffer> pk(&buffer, compact);
     pk.pack_map(4+(network?1:0));
 
     pk.pack(KEY_R); pk.pack_map(3);
@@ -1204,12 +1664,13 @@ NetworkEngine::sendValueAnnounced(const SockAddr& addr, Tid tid, Value::Id vid)
     pk.pack(KEY_TID); pk.pack_bin(t.size());
                                pk.pack_bin_body((const char*)t.data(), t.size());
     pk.pack(KEY_Y); pk.pack(KEY_R);
-    pk.pack(KEY_UA); pk.pack(my_v);
+    pk.pack(KEY_UA); pk.pack(userAgent());
     if (network) {
         pk.pack(KEY_NETID); pk.pack(network);
     }
 
-    send(addr, buffer.data(), buffer.size());
+    tx_reply_bytes += buffer.size();
+    sendQueued(addr, buffer.data(), buffer.size());
 }
 
 void
@@ -1217,10 +1678,11 @@ NetworkEngine::sendError(const SockAddr& addr,
         Tid tid,
         uint16_t code,
         const std::string& message,
-        bool include_id)
+        bool include_id,
+        bool compact)
 {
-    msgpack::sbuffer buffer;
-    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    auto& buffer = txBuffer();
+    MessagePacker<TxBuffer> pk(&buffer, compact);
     pk.pack_map(4 + (include_id?1:0));
 
     pk.pack(KEY_E); pk.pack_array(2);
@@ -1236,26 +1698,37 @@ NetworkEngine::sendError(const SockAddr& addr,
     pk.pack(KEY_TID); pk.pack_bin(t.size());
                                pk.pack_bin_body((const char*)t.data(), t.size());
     pk.pack(KEY_Y); pk.pack(KEY_E);
-    pk.pack(KEY_UA); pk.pack(my_v);
+    pk.pack(KEY_UA); pk.pack(userAgent());
     if (network) {
         pk.pack(KEY_NETID); pk.pack(network);
     }
 
-    send(addr, buffer.data(), buffer.size());
+    tx_reply_bytes += buffer.size();
+    sendQueued(addr, buffer.data(), buffer.size());
 }
 
 void
 NetworkEngine::maintainRxBuffer(Tid tid)
 {
     auto msg = partial_messages.find(tid);
-    if (msg != partial_messages.end()) {
-        const auto& now = scheduler.time();
-        if (msg->second.start + RX_MAX_PACKET_TIME < now
-         || msg->second.last_part + RX_TIMEOUT < now) {
-            DHT_LOG.w("Dropping expired partial message from %s", msg->second.from.toString().c_str());
-            partial_messages.erase(msg);
-        }
+    if (msg == partial_messages.end())
+        return;
+    auto& pmsg = msg->second;
+    const auto& now = scheduler.time();
+    if (pmsg.start + RX_MAX_PACKET_TIME < now
+     || pmsg.last_part + RX_TIMEOUT < now) {
+        DHT_LOG.w("Dropping expired partial message from %s", pmsg.from.toString().c_str());
+        partial_messages_size -= pmsg.parts.size();
+        partial_messages.erase(msg);
+        return;
     }
+    if (pmsg.last_part + RX_PART_RETRY <= now) {
+        // fragments were lost or are late: ask for the missing ones only
+        DHT_LOG.d("Requesting %zu missing fragments from %s", pmsg.parts.missing(), pmsg.from.toString().c_str());
+        sendMissingParts(tid, pmsg);
+        scheduler.edit(pmsg.job, now + RX_PART_RETRY);
+    } else
+        scheduler.edit(pmsg.job, pmsg.last_part + RX_PART_RETRY);
 }
 
 
@@ -29,13 +29,173 @@
 #include <fcntl.h>
 #endif
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
 #include <iostream>
+#include <array>
+#include <cstring>
 
 namespace dht {
 namespace net {
 
+constexpr unsigned UdpSocket::RX_BATCH_MAX;
+static constexpr size_t RX_BUFFER_SIZE {1024 * 64};
+static constexpr size_t TX_BATCH_MAX {64};
+
+constexpr size_t PacketPool::BUFFER_SIZE;
+constexpr size_t PacketPool::DEFAULT_COUNT;
+
+PacketBuffer::PacketBuffer(Blob&& data)
+    : heap(std::make_shared<Blob>(std::move(data)))
+{
+    ptr = heap->data();
+    len = cap = heap->size();
+}
+
+PacketBuffer::PacketBuffer(const PacketBuffer& o)
+    : pool(o.pool), slot(o.slot), ptr(o.ptr), len(o.len), cap(o.cap), heap(o.heap)
+{
+    if (pool)
+        pool->ref(slot);
+}
+
+PacketBuffer::PacketBuffer(PacketBuffer&& o) noexcept
+    : pool(std::move(o.pool)), slot(o.slot), ptr(o.ptr), len(o.len), cap(o.cap), heap(std::move(o.heap))
+{
+    o.ptr = nullptr;
+    o.len = o.cap = 0;
+}
+
+PacketBuffer&
+PacketBuffer::operator=(const PacketBuffer& o)
+{
+    if (this != &o) {
+        PacketBuffer copy(o);
+        *this = std::move(copy);
+    }
+    return *this;
+}
+
+PacketBuffer&
+PacketBuffer::operator=(PacketBuffer&& o) noexcept
+{
+    if (this != &o) {
+        reset();
+        pool = std::move(o.pool);
+        slot = o.slot;
+        ptr = o.ptr;
+        len = o.len;
+        cap = o.cap;
+        heap = std::move(o.heap);
+        o.ptr = nullptr;
+        o.len = o.cap = 0;
+    }
+    return *this;
+}
+
+void
+PacketBuffer::reset()
+{
+    if (pool) {
+        pool->unref(slot);
+        pool.reset();
+    }
+    heap.reset();
+    ptr = nullptr;
+    len = cap = 0;
+}
+
+PacketPool::PacketPool(size_t count)
+    : slab(count * BUFFER_SIZE), refs(new std::atomic_uint[count]), free_slots(count)
+{
+    for (size_t i = 0; i < count; i++) {
+        refs[i] = 0;
+        free_slots[i] = count - 1 - i;
+    }
+    stats.capacity = count;
+}
+
+PacketBuffer
+PacketPool::get(size_t size)
+{
+    PacketBuffer b;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (size <= BUFFER_SIZE and not free_slots.empty()) {
+            b.slot = free_slots.back();
+            free_slots.pop_back();
+            refs[b.slot] = 1;
+            stats.used++;
+            stats.peak = std::max(stats.peak, stats.used);
+            b.pool = shared_from_this();
+            b.ptr = slab.data() + b.slot * BUFFER_SIZE;
+            b.cap = BUFFER_SIZE;
+            b.len = size;
+            return b;
+        }
+        if (size <= BUFFER_SIZE) {
+            stats.exhausted++;
+            size = BUFFER_SIZE;
+        } else
+            stats.oversize++;
+    }
+    b.heap = std::make_shared<Blob>(size);
+    b.ptr = b.heap->data();
+    b.len = b.cap = size;
+    return b;
+}
+
+void
+PacketPool::ref(uint32_t slot)
+{
+    refs[slot]++;
+}
+
+void
+PacketPool::unref(uint32_t slot)
+{
+    if (--refs[slot] == 0) {
+        std::lock_guard<std::mutex> lock(mtx);
+        free_slots.push_back(slot);
+        stats.used--;
+    }
+}
+
+void
+PacketPool::addPacket(PacketList& packets)
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (not spare.empty()) {
+            packets.splice(packets.end(), spare, spare.begin());
+            return;
+        }
+    }
+    packets.emplace_back();
+}
+
+void
+PacketPool::recycle(PacketList&& packets)
+{
+    for (auto& p : packets)
+        p.data.reset();
+    std::lock_guard<std::mutex> lock(mtx);
+    if (spare.size() < stats.capacity)
+        spare.splice(spare.end(), packets);
+}
+
+PacketPool::Stats
+PacketPool::getStats() const
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    return stats;
+}
+
 int
-bindSocket(const SockAddr& addr, SockAddr& bound)
+bindSocket(const SockAddr& addr, SockAddr& bound, bool reusePort)
 {
     bool is_ipv6 = addr.getFamily() == AF_INET6;
     int sock = socket(is_ipv6 ? PF_INET6 : PF_INET, SOCK_DGRAM, 0);
@@ -47,6 +207,12 @@ bindSocket(const SockAddr& addr, SockAddr& bound)
 #endif
     if (is_ipv6)
         setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, (const char*)&set, sizeof(set));
+#ifdef SO_REUSEPORT
+    if (reusePort)
+        setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (const char*)&set, sizeof(set));
+#else
+    (void)reusePort;
+#endif
     net::setNonblocking(sock);
     int rc = bind(sock, addr.get(), addr.getLength());
     if (rc < 0) {
@@ -105,7 +271,163 @@ void udpPipe(int fds[2])
 }
 #endif
 
-UdpSocket::UdpSocket(in_port_t port, const Logger& l) : logger(l) {
+/**
+ * Bind the IPv4 and IPv6 sockets, trying to use the same port for both.
+ * Throws if no socket could be bound.
+ */
+static void
+bindSockets(const SockAddr& bind4, const SockAddr& bind6, int& s4, int& s6, SockAddr& bound4, SockAddr& bound6, const Logger& logger, bool reusePort = false)
+{
+    s4 = -1;
+    s6 = -1;
+
+    bound4 = {};
+    if (bind4) {
+        try {
+            s4 = bindSocket(bind4, bound4, reusePort);
+        } catch (const DhtException& e) {
+            logger.e("Can't bind inet socket: %s", e.what());
+        }
+    }
+
+    bound6 = {};
+    if (bind6) {
+        if (bind6.getPort() == 0) {
+            // Attempt to use the same port as IPv4 with IPv6
+            if (auto p4 = bound4.getPort()) {
+                auto b6 = bind6;
+                b6.setPort(p4);
+                try {
+                    s6 = bindSocket(b6, bound6, reusePort);
+                } catch (const DhtException& e) {
+                    logger.e("Can't bind inet6 socket: %s", e.what());
+                }
+            }
+        }
+        if (s6 == -1) {
+            try {
+                s6 = bindSocket(bind6, bound6, reusePort);
+            } catch (const DhtException& e) {
+                logger.e("Can't bind inet6 socket: %s", e.what());
+            }
+        }
+    }
+
+    if (s4 == -1 && s6 == -1) {
+        throw DhtException("Can't bind socket");
+    }
+}
+
+/**
+ * Read available datagrams from socket s, up to batch at once, into
+ * buffers from the pool. Datagrams larger than a pool buffer overflow
+ * into rx_buf, which must hold RX_BUFFER_SIZE bytes per batch slot.
+ * Sets batch to 1 if recvmmsg is not supported.
+ * @return the number of packets appended to the list, or -1 with errno set.
+ */
+static int
+receivePackets(int s, unsigned& batch, std::vector<uint8_t>& rx_buf, PacketPool& pool, PacketList& packets, const Logger& logger)
+{
+#ifndef _WIN32
+    constexpr unsigned N = UdpSocket::RX_BATCH_MAX;
+    std::array<PacketBuffer, N> bufs;
+    std::array<std::array<iovec, 2>, N> iovs;
+    std::array<sockaddr_storage, N> froms;
+    std::array<size_t, N> lens;
+#ifdef __linux__
+    std::array<mmsghdr, N> msgs;
+    auto hdr = [&](unsigned i) -> msghdr& { return msgs[i].msg_hdr; };
+#else
+    std::array<msghdr, 1> msgs;
+    auto hdr = [&](unsigned i) -> msghdr& { return msgs[i]; };
+    batch = 1;
+#endif
+    unsigned count = std::min(batch, N);
+    for (unsigned i = 0; i < count; i++) {
+        bufs[i] = pool.get();
+        iovs[i][0].iov_base = bufs[i].data();
+        iovs[i][0].iov_len = bufs[i].capacity();
+        iovs[i][1].iov_base = rx_buf.data() + i * RX_BUFFER_SIZE;
+        iovs[i][1].iov_len = RX_BUFFER_SIZE;
+        auto& h = hdr(i);
+        std::memset(&h, 0, sizeof(h));
+        h.msg_name = &froms[i];
+        h.msg_namelen = sizeof(sockaddr_storage);
+        h.msg_iov = iovs[i].data();
+        h.msg_iovlen = iovs[i].size();
+    }
+
+    int n = -1;
+#ifdef __linux__
+    if (count > 1) {
+        n = recvmmsg(s, msgs.data(), count, MSG_DONTWAIT, nullptr);
+        if (n == -1 and errno == ENOSYS) {
+            logger.w("recvmmsg is not available, disabling batched receive");
+            batch = count = 1;
+        }
+        for (int i = 0; i < n; i++)
+            lens[i] = msgs[i].msg_len;
+    }
+#else
+    (void)logger;
+#endif
+    if (count == 1) {
+        auto rc = recvmsg(s, &hdr(0), 0);
+        if (rc >= 0) {
+            lens[0] = rc;
+            n = 1;
+        }
+    }
+    if (n < 0)
+        return n;
+
+    auto now = clock::now();
+    int added = 0;
+    for (int i = 0; i < n; i++) {
+        const auto& h = hdr(i);
+        auto len = lens[i];
+        if (len == 0 or (h.msg_flags & MSG_TRUNC))
+            continue;
+        pool.addPacket(packets);
+        auto& pkt = packets.back();
+        auto cap = bufs[i].capacity();
+        if (len <= cap) {
+            bufs[i].resize(len);
+            pkt.data = std::move(bufs[i]);
+        } else {
+            pkt.data = pool.get(len);
+            std::memcpy(pkt.data.data(), bufs[i].data(), cap);
+            std::memcpy(pkt.data.data() + cap, iovs[i][1].iov_base, len - cap);
+        }
+        pkt.from = {froms[i], h.msg_namelen};
+        pkt.received = now;
+        added++;
+    }
+    return added;
+#else
+    (void)batch;
+    (void)logger;
+    std::array<uint8_t, RX_BUFFER_SIZE> buf;
+    sockaddr_storage from;
+    socklen_t from_len = sizeof(from);
+    int rc = recvfrom(s, (char*)buf.data(), buf.size(), 0, (sockaddr*)&from, &from_len);
+    if (rc > 0) {
+        pool.addPacket(packets);
+        auto& pkt = packets.back();
+        pkt.data = pool.get(rc);
+        std::memcpy(pkt.data.data(), buf.data(), rc);
+        pkt.from = {from, from_len};
+        pkt.received = clock::now();
+        return 1;
+    }
+    return rc;
+#endif
+}
+
+UdpSocket::UdpSocket(in_port_t port, const Logger& l, unsigned rxBatch, bool reusePort)
+    : logger(l), rx_batch(std::min(std::max(rxBatch, 1u), RX_BATCH_MAX)), reuse_port(reusePort)
+{
+    packet_pool = std::make_shared<PacketPool>();
     SockAddr bind4;
     bind4.setFamily(AF_INET);
     bind4.setPort(port);
@@ -115,8 +437,10 @@ UdpSocket::UdpSocket(in_port_t port, const Logger& l) : logger(l) {
     openSockets(bind4, bind6);
 }
 
-UdpSocket::UdpSocket(const SockAddr& bind4, const SockAddr& bind6, const Logger& l) : logger(l)
+UdpSocket::UdpSocket(const SockAddr& bind4, const SockAddr& bind6, const Logger& l, unsigned rxBatch, bool reusePort)
+    : logger(l), rx_batch(std::min(std::max(rxBatch, 1u), RX_BATCH_MAX)), reuse_port(reusePort)
 {
+    packet_pool = std::make_shared<PacketPool>();
     openSockets(bind4, bind6);
 }
 
@@ -126,21 +450,20 @@ UdpSocket::~UdpSocket() {
         rcv_thread.join();
 }
 
-int
-UdpSocket::sendTo(const SockAddr& dest, const uint8_t* data, size_t size, bool replied) {
-    if (not dest)
-        return EFAULT;
-
-    int s;
+static int
+socketFor(int s4, int s6, const SockAddr& dest)
+{
     switch (dest.getFamily()) {
-    case AF_INET:  s = s4; break;
-    case AF_INET6: s = s6; break;
-    default:       s = -1; break;
+    case AF_INET:  return s4;
+    case AF_INET6: return s6;
+    default:       return -1;
     }
+}
 
-    if (s < 0)
-        return EAFNOSUPPORT;
-
+/** @return 0 on success, or the error code */
+static int
+sendPacket(int s, const SockAddr& dest, const uint8_t* data, size_t size, bool replied)
+{
     int flags = 0;
 #ifdef MSG_CONFIRM
     if (replied)
@@ -150,8 +473,21 @@ UdpSocket::sendTo(const SockAddr& dest, const uint8_t* data, size_t size, bool r
     flags |= MSG_NOSIGNAL;
 #endif
 
-    if (sendto(s, (const char*)data, size, flags, dest.get(), dest.getLength()) == -1) {
-        int err = errno;
+    if (sendto(s, (const char*)data, size, flags, dest.get(), dest.getLength()) == -1)
+        return errno;
+    return 0;
+}
+
+int
+UdpSocket::sendTo(const SockAddr& dest, const uint8_t* data, size_t size, bool replied) {
+    if (not dest)
+        return EFAULT;
+
+    int s = socketFor(s4, s6, dest);
+    if (s < 0)
+        return EAFNOSUPPORT;
+
+    if (int err = sendPacket(s, dest, data, size, replied)) {
         logger.d("Can't send message to %s: %s", dest.toString().c_str(), strerror(err));
         if (err == EPIPE || err == ENOTCONN || err == ECONNRESET) {
             auto bind4 = std::move(bound4), bind6 = std::move(bound6);
@@ -163,6 +499,83 @@ UdpSocket::sendTo(const SockAddr& dest, const uint8_t* data, size_t size, bool r
     return 0;
 }
 
+size_t
+DatagramSocket::sendBatch(const std::vector<OutgoingPacket>& packets)
+{
+    size_t sent = 0;
+    for (const auto& p : packets)
+        if (sendTo(p.to, p.data.data(), p.data.size(), p.replied) == 0)
+            sent++;
+    return sent;
+}
+
+/**
+ * Send packets with sendmmsg, falling back to sock.sendTo on error.
+ * Clears batch if sendmmsg is not supported.
+ */
+static size_t
+sendPackets(DatagramSocket& sock, int s4, int s6, bool& batch, const std::vector<OutgoingPacket>& packets, const Logger& logger)
+{
+#ifdef __linux__
+    if (not batch)
+        return sock.DatagramSocket::sendBatch(packets);
+
+    std::array<mmsghdr, TX_BATCH_MAX> msgs;
+    std::array<iovec, TX_BATCH_MAX> iovs;
+    size_t sent = 0;
+    size_t i = 0;
+    while (i < packets.size()) {
+        const auto& first = packets[i];
+        int s = socketFor(s4, s6, first.to);
+        // Batch consecutive packets using the same socket and flags
+        size_t n = 0;
+        while (i + n < packets.size() and n < TX_BATCH_MAX) {
+            const auto& p = packets[i + n];
+            if (p.to.getFamily() != first.to.getFamily() or p.replied != first.replied)
+                break;
+            iovs[n].iov_base = (void*)p.data.data();
+            iovs[n].iov_len = p.data.size();
+            auto& hdr = msgs[n].msg_hdr;
+            std::memset(&hdr, 0, sizeof(hdr));
+            hdr.msg_name = (void*)p.to.get();
+            hdr.msg_namelen = p.to.getLength();
+            hdr.msg_iov = &iovs[n];
+            hdr.msg_iovlen = 1;
+            n++;
+        }
+
+        int flags = MSG_NOSIGNAL;
+        if (first.replied)
+            flags |= MSG_CONFIRM;
+
+        int rc = s >= 0 ? sendmmsg(s, msgs.data(), n, flags) : -1;
+        if (rc > 0) {
+            sent += rc;
+            i += rc;
+        } else {
+            if (rc == -1 and errno == ENOSYS) {
+                logger.w("sendmmsg is not available, disabling batched send");
+                batch = false;
+                return sent + sock.DatagramSocket::sendBatch({packets.begin() + i, packets.end()});
+            }
+            // Let sendTo report the error and reopen sockets if needed
+            if (sock.sendTo(first.to, first.data.data(), first.data.size(), first.replied) == 0)
+                sent++;
+            i++;
+        }
+    }
+    return sent;
+#else
+    return sock.DatagramSocket::sendBatch(packets);
+#endif
+}
+
+size_t
+UdpSocket::sendBatch(const std::vector<OutgoingPacket>& packets)
+{
+    return sendPackets(*this, s4, s6, tx_batch, packets, logger);
+}
+
 void
 UdpSocket::openSockets(const SockAddr& bind4, const SockAddr& bind6)
 {
@@ -182,46 +595,9 @@ UdpSocket::openSockets(const SockAddr& bind4, const SockAddr& bind6)
     int stop_readfd = stopfds[0];
     stopfd = stopfds[1];
 
-    s4 = -1;
-    s6 = -1;
+    bindSockets(bind4, bind6, s4, s6, bound4, bound6, logger, reuse_port);
 
-    bound4 = {};
-    if (bind4) {
-        try {
-            s4 = bindSocket(bind4, bound4);
-        } catch (const DhtException& e) {
-            logger.e("Can't bind inet socket: %s", e.what());
-        }
-    }
-
-#if 1
-    bound6 = {};
-    if (bind6) {
-        if (bind6.getPort() == 0) {
-            // Attempt to use the same port as IPv4 with IPv6
-            if (auto p4 = bound4.getPort()) {
-                auto b6 = bind6;
-                b6.setPort(p4);
-                try {
-                    s6 = bindSocket(b6, bound6);
-                } catch (const DhtException& e) {
-                    logger.e("Can't bind inet6 socket: %s", e.what());
-                }
-            }
-        }
-        if (s6 == -1) {
-            try {
-                s6 = bindSocket(bind6, bound6);
-            } catch (const DhtException& e) {
-                logger.e("Can't bind inet6 socket: %s", e.what());
-            }
-        }
-    }
-#endif
-
-    if (s4 == -1 && s6 == -1) {
-        throw DhtException("Can't bind socket");
-    }
+    rx_buf.resize(rx_batch * RX_BUFFER_SIZE);
 
     running = true;
     rcv_thread = std::thread([this, stop_readfd]() {
@@ -249,29 +625,24 @@ UdpSocket::openSockets(const SockAddr& bind4, const SockAddr& bind6)
                     break;
 
                 if (rc > 0) {
-                    std::array<uint8_t, 1024 * 64> buf;
-                    sockaddr_storage from;
-                    socklen_t from_len = sizeof(from);
+                    PacketList packets;
 
                     if (FD_ISSET(stop_readfd, &readfds)) {
+                        std::array<uint8_t, 16> buf;
                         if (recv(stop_readfd, (char*)buf.data(), buf.size(), 0) < 0) {
                             logger.e("Got stop packet error: %s", strerror(errno));
                             break;
                         }
                     }
                     else if (s4 >= 0 && FD_ISSET(s4, &readfds))
-                        rc = recvfrom(s4, (char*)buf.data(), buf.size(), 0, (sockaddr*)&from, &from_len);
+                        rc = receivePackets(s4, rx_batch, rx_buf, *packet_pool, packets, logger);
                     else if (s6 >= 0 && FD_ISSET(s6, &readfds))
-                        rc = recvfrom(s6, (char*)buf.data(), buf.size(), 0, (sockaddr*)&from, &from_len);
+                        rc = receivePackets(s6, rx_batch, rx_buf, *packet_pool, packets, logger);
                     else
                         continue;
 
-                    if (rc > 0) {
-                        auto pkt = std::unique_ptr<ReceivedPacket>(new ReceivedPacket);
-                        pkt->data = {buf.begin(), buf.begin()+rc};
-                        pkt->from = {from, from_len};
-                        pkt->received = clock::now();
-                        onReceived(std::move(pkt));
+                    if (not packets.empty()) {
+                        onReceived(std::move(packets));
                     } else if (rc == -1) {
                         logger.e("Error receiving packet: %s", strerror(errno));
                         int err = errno;
@@ -279,7 +650,7 @@ UdpSocket::openSockets(const SockAddr& bind4, const SockAddr& bind6)
                             if (s4 >= 0) {
                                 close(s4);
                                 try {
-                                    s4 = bindSocket(bound4, bound4);
+                                    s4 = bindSocket(bound4, bound4, reuse_port);
                                 } catch (const DhtException& e) {
                                     logger.e("Can't bind inet socket: %s", e.what());
                                 }
@@ -287,7 +658,7 @@ UdpSocket::openSockets(const SockAddr& bind4, const SockAddr& bind6)
                             if (s6 >= 0) {
                                 close(s6);
                                 try {
-                                    s6 = bindSocket(bound6, bound6);
+                                    s6 = bindSocket(bound6, bound6, reuse_port);
                                 } catch (const DhtException& e) {
                                     logger.e("Can't bind inet6 socket: %s", e.what());
                                 }
@@ -329,5 +700,195 @@ UdpSocket::stop()
     }
 }
 
+#ifdef __linux__
+
+struct EpollLoop::State {
+    Logger logger;
+    int epfd {-1};
+    int stopfd {-1};
+    std::recursive_mutex mtx {};
+    std::map<int, std::shared_ptr<OnReadable>> handlers {};
+    std::atomic_bool running {false};
+
+    State(const Logger& l) : logger(l) {}
+    ~State() {
+        if (stopfd != -1)
+            close(stopfd);
+        if (epfd != -1)
+            close(epfd);
+    }
+};
+
+EpollLoop::EpollLoop(const Logger& l) : state(std::make_shared<State>(l))
+{
+    state->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (state->epfd == -1)
+        throw DhtException(std::string("Can't create epoll instance: ") + strerror(errno));
+    state->stopfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (state->stopfd == -1)
+        throw DhtException(std::string("Can't create eventfd: ") + strerror(errno));
+    epoll_event ev {};
+    ev.events = EPOLLIN;
+    ev.data.fd = state->stopfd;
+    epoll_ctl(state->epfd, EPOLL_CTL_ADD, state->stopfd, &ev);
+
+    state->running = true;
+    thread = std::thread(&EpollLoop::loop, state);
+}
+
+EpollLoop::~EpollLoop()
+{
+    stop();
+    // Released from a callback: stop() couldn't join the loop thread,
+    // which keeps the state until the callback returns.
+    if (thread.joinable())
+        thread.detach();
+}
+
+void
+EpollLoop::add(int fd, OnReadable&& cb)
+{
+    std::lock_guard<std::recursive_mutex> lock(state->mtx);
+    state->handlers[fd] = std::make_shared<OnReadable>(std::move(cb));
+    epoll_event ev {};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = fd;
+    if (epoll_ctl(state->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        state->handlers.erase(fd);
+        throw DhtException(std::string("Can't add socket to epoll: ") + strerror(errno));
+    }
+}
+
+void
+EpollLoop::remove(int fd)
+{
+    std::lock_guard<std::recursive_mutex> lock(state->mtx);
+    epoll_ctl(state->epfd, EPOLL_CTL_DEL, fd, nullptr);
+    state->handlers.erase(fd);
+}
+
+void
+EpollLoop::stop()
+{
+    if (state->running.exchange(false)) {
+        uint64_t one = 1;
+        if (write(state->stopfd, &one, sizeof(one)) == -1)
+            state->logger.e("Can't write to stop fd");
+    }
+    if (thread.joinable() and thread.get_id() != std::this_thread::get_id())
+        thread.join();
+}
+
+void
+EpollLoop::loop(std::shared_ptr<State> state)
+{
+    std::array<epoll_event, 64> events;
+    while (state->running) {
+        int n = epoll_wait(state->epfd, events.data(), events.size(), -1);
+        if (n == -1) {
+            if (errno != EINTR) {
+                state->logger.e("epoll_wait error: %s", strerror(errno));
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+            }
+            continue;
+        }
+        // Holding the lock while running handlers ensures remove() is synchronous
+        std::lock_guard<std::recursive_mutex> lock(state->mtx);
+        for (int i = 0; i < n and state->running; i++) {
+            auto fd = events[i].data.fd;
+            if (fd == state->stopfd)
+                continue;
+            auto h = state->handlers.find(fd);
+            if (h == state->handlers.end())
+                continue;
+            auto handler = h->second;
+            try {
+                (*handler)();
+            } catch (const std::exception& e) {
+                state->logger.e("Error in epoll handler: %s", e.what());
+            }
+        }
+    }
+}
+
+EpollUdpSocket::EpollUdpSocket(const SockAddr& bind4, const SockAddr& bind6, const Logger& l,
+                               std::shared_ptr<EpollLoop> l_loop, unsigned rxBatch)
+    : logger(l), loop(l_loop ? std::move(l_loop) : std::make_shared<EpollLoop>(l)),
+      rx_batch(std::min(std::max(rxBatch, 1u), UdpSocket::RX_BATCH_MAX))
+{
+    bindSockets(bind4, bind6, s4, s6, bound4, bound6, logger);
+    packet_pool = std::make_shared<PacketPool>();
+    rx_buf.resize(rx_batch * RX_BUFFER_SIZE);
+    try {
+        for (int s : {s4, s6})
+            if (s >= 0)
+                loop->add(s, [this, s] { onReadable(s); });
+    } catch (...) {
+        stop();
+        throw;
+    }
+}
+
+EpollUdpSocket::~EpollUdpSocket() {
+    stop();
+}
+
+void
+EpollUdpSocket::onReadable(int s)
+{
+    while (true) {
+        PacketList packets;
+        int rc = receivePackets(s, rx_batch, rx_buf, *packet_pool, packets, logger);
+        if (not packets.empty())
+            onReceived(std::move(packets));
+        else if (rc == -1) {
+            if (errno != EAGAIN and errno != EWOULDBLOCK)
+                logger.e("Error receiving packet: %s", strerror(errno));
+            break;
+        }
+    }
+}
+
+int
+EpollUdpSocket::sendTo(const SockAddr& dest, const uint8_t* data, size_t size, bool replied) {
+    if (not dest)
+        return EFAULT;
+
+    std::lock_guard<std::recursive_mutex> lock(mtx);
+    int s = socketFor(s4, s6, dest);
+    if (s < 0)
+        return EAFNOSUPPORT;
+
+    int err = sendPacket(s, dest, data, size, replied);
+    if (err)
+        logger.d("Can't send message to %s: %s", dest.toString().c_str(), strerror(err));
+    return err;
+}
+
+size_t
+EpollUdpSocket::sendBatch(const std::vector<OutgoingPacket>& packets)
+{
+    std::lock_guard<std::recursive_mutex> lock(mtx);
+    return sendPackets(*this, s4, s6, tx_batch, packets, logger);
+}
+
+void
+EpollUdpSocket::stop()
+{
+    // Without the lock: handlers running on the loop thread may be sending
+    for (int s : {s4, s6})
+        if (s >= 0)
+            loop->remove(s);
+    std::lock_guard<std::recursive_mutex> lock(mtx);
+    for (int* s : {&s4, &s6}) {
+        if (*s >= 0) {
+            close(*s);
+            *s = -1;
+        }
+    }
+}
+
+#endif
+
 }
 }
@@ -29,6 +29,9 @@ namespace dht {
 constexpr std::chrono::minutes Node::NODE_EXPIRE_TIME;
 constexpr std::chrono::minutes Node::NODE_GOOD_TIME;
 constexpr std::chrono::seconds Node::MAX_RESPONSE_TIME;
+constexpr std::chrono::milliseconds Node::MIN_RESPONSE_TIME;
+constexpr std::chrono::seconds Node::MAX_RESPONSE_BACKOFF;
+constexpr unsigned Node::MAX_RTT_BACKOFF;
 
 Node::Node(const InfoHash& id, const SockAddr& addr, bool client)
 : id(id), addr(addr), is_client(client), sockets_()
@@ -87,9 +90,12 @@ Node::requested(const Sp<net::Request>& req)
     auto e = requests_.emplace(req->getTid(), req);
     if (not e.second and req != e.first->second) {
         // Should not happen !
-        // Try to handle this scenario as well as we can
-        e.first->second->setExpired();
-        e.first->second = req;
+        // Try to handle this scenario as well as we can.
+        // Expiring calls back and may change requests_: replace the
+        // request first and don't use the iterator afterward.
+        auto old = e.first->second;
+        requests_[req->getTid()] = req;
+        old->setExpired();
     }
 }
 
@@ -106,6 +112,32 @@ Node::received(time_point now, const Sp<net::Request>& req)
     }
 }
 
+void
+Node::rttSample(duration rtt)
+{
+    if (rtt < duration::zero())
+        return;
+    if (srtt_ == duration::zero()) {
+        srtt_ = std::max(rtt, duration(1));
+        rttvar_ = rtt / 2;
+    } else {
+        auto err = rtt > srtt_ ? rtt - srtt_ : srtt_ - rtt;
+        rttvar_ = (3 * rttvar_ + err) / 4;
+        srtt_ = std::max((7 * srtt_ + rtt) / 8, duration(1));
+    }
+    rtt_backoff_ = 0;
+}
+
+duration
+Node::getResponseTime() const
+{
+    if (not hasRtt())
+        return MAX_RESPONSE_TIME;
+    duration rto = srtt_ + 4 * rttvar_;
+    rto = std::max<duration>(rto, MIN_RESPONSE_TIME) * (1u << rtt_backoff_);
+    return std::min<duration>(rto, MAX_RESPONSE_BACKOFF);
+}
+
 Sp<net::Request>
 Node::getRequest(Tid tid)
 {
@@ -127,7 +159,9 @@ void
 Node::setExpired()
 {
     expired_ = true;
-    for (auto r : requests_) {
+    // Callbacks may add or remove requests: iterate over a detached table
+    auto requests = std::move(requests_);
+    for (auto& r : requests) {
         r.second->setExpired();
     }
     requests_.clear();
@@ -140,11 +174,12 @@ Node::openSocket(SocketCb&& cb)
     if (++transaction_id == 0)
         transaction_id = 1;
 
+    auto id = tagTid(transaction_id);
     auto sock = std::make_shared<Socket>(std::move(cb));
-    auto s = sockets_.emplace(transaction_id, std::move(sock));
+    auto s = sockets_.emplace(id, std::move(sock));
     if (not s.second)
         s.first->second = std::move(sock);
-    return transaction_id;
+    return id;
 }
 
 Sp<Socket>
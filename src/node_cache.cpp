@@ -17,11 +17,19 @@
  */
 
 #include "node_cache.h"
+#include "rng.h"
 
 namespace dht {
 
-constexpr size_t CLEANUP_MAX_NODES {1024};
-constexpr size_t CLEANUP_FREQ {1024};
+constexpr size_t NodeCache::MAX_NODES;
+constexpr size_t NodeCache::SHARDS;
+
+/* Whether a cached node is used outside of the cache */
+static inline bool
+isUsed(const Sp<Node>& n)
+{
+    return n.use_count() > 1;
+}
 
 NodeCache::~NodeCache()
 {
@@ -37,7 +45,7 @@ NodeCache::getNode(const InfoHash& id, sa_family_t family) {
 Sp<Node>
 NodeCache::getNode(const InfoHash& id, const SockAddr& addr, time_point now, bool confirm, bool client) {
     if (not id)
-        return std::make_shared<Node>(id, addr);
+        return cache_4.makeNode(id, addr, false);
     return cache(addr.getFamily()).getNode(id, addr, now, confirm, client);
 }
 
@@ -47,39 +55,6 @@ NodeCache::getCachedNodes(const InfoHash& id, sa_family_t sa_f, size_t count) co
     return cache(sa_f).getCachedNodes(id, count);
 }
 
-std::vector<Sp<Node>>
-NodeCache::NodeMap::getCachedNodes(const InfoHash& id, size_t count) const
-{
-    std::vector<Sp<Node>> nodes;
-    nodes.reserve(std::min(size(), count));
-    const_iterator it;
-    auto dec_it = [this](const_iterator& it) {
-        auto ret = it;
-        it = (it == cbegin()) ? cend() : std::prev(it);
-        return ret;
-    };
-
-    auto it_p = lower_bound(id),
-        it_n = it_p;
-    if (not empty())
-        dec_it(it_p); /* Create 2 separate iterator if we could */
-
-    while (nodes.size() < count and (it_n != cend() or it_p != cend())) {
-        /* If one of the iterator is at the end, then take the other one
-           If they are both in middle of somewhere comapre both and take
-           the closest to the id. */
-        if (it_p == cend())      it = it_n++;
-        else if (it_n == cend()) it = dec_it(it_p);
-        else                     it = id.xorCmp(it_p->first, it_n->first) < 0 ? dec_it(it_p) : it_n++;
-
-        if (auto n = it->second.lock())
-            if ( not n->isExpired() and not n->isClient() )
-                nodes.emplace_back(std::move(n));
-    }
-
-    return nodes;
-}
-
 void
 NodeCache::clearBadNodes(sa_family_t family)
 {
@@ -91,69 +66,160 @@ NodeCache::clearBadNodes(sa_family_t family)
     }
 }
 
+void
+NodeCache::compact()
+{
+    cache_4.compact();
+    cache_6.compact();
+}
+
+size_t
+NodeCache::size(sa_family_t family) const
+{
+    if (family == 0)
+        return cache_4.size() + cache_6.size();
+    return cache(family).size();
+}
+
+size_t
+NodeCache::IdHash::operator()(const InfoHash& id) const
+{
+    static_assert(HASH_LEN == 20, "id words below assume 20 bytes ids");
+    uint64_t h = key;
+    for (size_t offset : {0, 8, 12}) {
+        uint64_t w;
+        std::memcpy(&w, id.data() + offset, sizeof(w));
+        h = (h ^ w) * 0x9E3779B97F4A7C15ull;
+        h ^= h >> 32;
+    }
+    return h;
+}
+
+NodeCache::NodeMap::NodeMap(size_t max_nodes) : max_nodes_(max_nodes)
+{
+    crypto::random_device rdev;
+    std::uniform_int_distribution<uint64_t> rand_key;
+    auto key = rand_key(rdev);
+    for (auto& s : shards_)
+        s = Shard(0, IdHash {key});
+}
+
+std::vector<Sp<Node>>
+NodeCache::NodeMap::getCachedNodes(const InfoHash& id, size_t count) const
+{
+    // Entries of a shard are all closer to id than entries of the shards
+    // after it in XOR order. Shards are taken until there are enough
+    // entries, which are sorted by distance from their ids alone so that
+    // only nodes closer than the last one returned are looked at.
+    thread_local std::vector<const Sp<Node>*> found;
+    thread_local std::vector<InfoHash> ids;
+    thread_local std::vector<unsigned> closest;
+    std::vector<Sp<Node>> nodes;
+    size_t d = 0;
+    while (nodes.size() < count and d < SHARDS) {
+        found.clear();
+        ids.clear();
+        for (; d < SHARDS and found.size() < count - nodes.size(); d++) {
+            for (const auto& e : shards_[id[0] ^ d]) {
+                found.emplace_back(&e.second);
+                ids.emplace_back(e.first);
+            }
+        }
+        closestIds(id, ids.data(), ids.size(), ids.size(), closest);
+        for (auto i : closest) {
+            const auto& n = *found[i];
+            if (isUsed(n) and not n->isExpired() and not n->isClient()) {
+                nodes.emplace_back(n);
+                if (nodes.size() == count)
+                    break;
+            }
+        }
+    }
+    return nodes;
+}
+
 Sp<Node>
 NodeCache::NodeMap::getNode(const InfoHash& id)
 {
-    auto wn = find(id);
-    if (wn == end())
+    auto& s = shard(id);
+    auto wn = s.find(id);
+    if (wn == s.end())
         return {};
-    if (auto n = wn->second.lock())
-        return n;
-    erase(wn);
+    if (isUsed(wn->second))
+        return wn->second;
+    s.erase(wn);
+    count_--;
     return {};
 }
 
 Sp<Node>
 NodeCache::NodeMap::getNode(const InfoHash& id, const SockAddr& addr, time_point now, bool confirm, bool client)
 {
-    auto it = emplace(id, std::weak_ptr<Node>{});
-    auto node = it.first->second.lock();
-    if (not node) {
-        node = std::make_shared<Node>(id, addr, client);
-        it.first->second = node;
-        if (cleanup_counter++ == CLEANUP_FREQ) {
-            cleanup();
-            cleanup_counter = 0;
+    auto& s = shard(id);
+    auto it = s.find(id);
+    if (it == s.end()) {
+        if (count_ >= max_nodes_) {
+            compact(s);
+            if (count_ >= max_nodes_)
+                return {};
         }
-    } else if (confirm or node->isOld(now)) {
-        node->update(addr);
+        it = s.emplace(id, nullptr).first;
+        count_++;
+    } else if (isUsed(it->second)) {
+        auto& node = it->second;
+        if (confirm or node->isOld(now))
+            node->update(addr);
+        return node;
     }
+    it->second = makeNode(id, addr, client);
+    return it->second;
+}
+
+Sp<Node>
+NodeCache::NodeMap::makeNode(const InfoHash& id, const SockAddr& addr, bool client) const
+{
+    auto node = std::make_shared<Node>(id, addr, client);
+    node->setTidTag(tid_tag);
     return node;
 }
 
 void
 NodeCache::NodeMap::clearBadNodes() {
-    for (auto it = cbegin(); it != cend();) {
-        if (auto n = it->second.lock()) {
-            n->reset();
-            ++it;
-        } else {
-            erase(it++);
-        }
+    for (auto& s : shards_) {
+        compact(s);
+        for (auto& n : s)
+            n.second->reset();
     }
-    cleanup_counter = 0;
 }
 
 void
 NodeCache::NodeMap::setExpired() {
-    for (auto& wn : *this)
-        if (auto n = wn.second.lock())
-            n->setExpired();
-    clear();
-    cleanup_counter = 0;
+    for (auto& s : shards_) {
+        for (auto& n : s)
+            if (isUsed(n.second))
+                n.second->setExpired();
+        s.clear();
+    }
+    count_ = 0;
 }
 
 void
-NodeCache::NodeMap::cleanup()
+NodeCache::NodeMap::compact()
 {
-    auto it = lower_bound(InfoHash::getRandom());
-    for (size_t n = 0, maxNodes = std::min(size(), CLEANUP_MAX_NODES); n != maxNodes; n++) {
-        if (it == end())
-            it = begin();
-        if (it->second.expired())
-            erase(it++);
-        else
+    compact(shards_[compact_cursor_]);
+    compact_cursor_ = (compact_cursor_ + 1) % SHARDS;
+}
+
+void
+NodeCache::NodeMap::compact(Shard& s)
+{
+    for (auto it = s.begin(); it != s.end();) {
+        if (isUsed(it->second)) {
             ++it;
+        } else {
+            it = s.erase(it);
+            count_--;
+        }
     }
 }
 
@@ -19,50 +19,145 @@
 
 #include "infohash.h"
 #include "sockaddr.h"
+#include "value.h"
 #include "net.h"
+#include "node.h"
+#include "value_reassembly.h"
 
 #include <map>
+#include <cstring>
+#include <limits>
 
 namespace dht {
 namespace net {
 
-static const std::string KEY_Y {"y"};
-static const std::string KEY_R {"r"};
-static const std::string KEY_U {"u"};
-static const std::string KEY_E {"e"};
-static const std::string KEY_V {"p"};
-static const std::string KEY_TID {"t"};
-static const std::string KEY_UA {"v"};
-static const std::string KEY_NETID {"n"};
-static const std::string KEY_ISCLIENT {"s"};
-static const std::string KEY_Q {"q"};
-static const std::string KEY_A {"a"};
-
-static const std::string KEY_REQ_SID {"sid"};
-static const std::string KEY_REQ_ID {"id"};
-static const std::string KEY_REQ_H {"h"};
-static const std::string KEY_REQ_TARGET {"target"};
-static const std::string KEY_REQ_QUERY {"q"};
-static const std::string KEY_REQ_TOKEN {"token"};
-static const std::string KEY_REQ_VALUE_ID {"vid"};
-static const std::string KEY_REQ_NODES4 {"n4"};
-static const std::string KEY_REQ_NODES6 {"n6"};
-static const std::string KEY_REQ_CREATION {"c"};
-static const std::string KEY_REQ_ADDRESS {"sa"};
-static const std::string KEY_REQ_VALUES {"values"};
-static const std::string KEY_REQ_EXPIRED {"exp"};
-static const std::string KEY_REQ_REFRESHED {"re"};
-static const std::string KEY_REQ_FIELDS {"fileds"};
-static const std::string KEY_REQ_WANT {"w"};
-
-static const std::string QUERY_PING {"ping"};
-static const std::string QUERY_FIND {"find"};
-static const std::string QUERY_GET {"get"};
-static const std::string QUERY_PUT {"put"};
-static const std::string QUERY_LISTEN {"listen"};
-static const std::string QUERY_REFRESH {"refresh"};
-
-Tid unpackTid(const msgpack::object& o) {
+/**
+ * Name used in messages: a map key, or an enumerated string value.
+ * Peers supporting the compact encoding (see NetworkEngine) send the
+ * integer code instead of the string: a single byte, compared as an integer.
+ */
+struct WireKey {
+    template <size_t N>
+    constexpr WireKey(const char (&s)[N], uint8_t c) : str(s), len(N - 1), code(c) {}
+
+    const char* str;
+    uint32_t len;
+    uint8_t code;
+
+    std::string toString() const { return {str, len}; }
+
+    /* string form */
+    template <typename Packer>
+    void msgpack_pack(Packer& pk) const {
+        pk.pack_str(len);
+        pk.pack_str_body(str, len);
+    }
+};
+
+inline bool operator==(const std::string& s, const WireKey& k) {
+    return s.size() == k.len and std::memcmp(s.data(), k.str, k.len) == 0;
+}
+inline bool operator!=(const std::string& s, const WireKey& k) {
+    return not (s == k);
+}
+
+static constexpr WireKey KEY_Y {"y", 0};
+static constexpr WireKey KEY_R {"r", 1};
+static constexpr WireKey KEY_U {"u", 2};
+static constexpr WireKey KEY_E {"e", 3};
+static constexpr WireKey KEY_V {"p", 4};
+static constexpr WireKey KEY_M {"m", 5};
+static constexpr WireKey KEY_TID {"t", 6};
+static constexpr WireKey KEY_UA {"v", 7};
+static constexpr WireKey KEY_NETID {"n", 8};
+static constexpr WireKey KEY_ISCLIENT {"s", 9};
+static constexpr WireKey KEY_Q {"q", 10};
+static constexpr WireKey KEY_A {"a", 11};
+
+static constexpr WireKey KEY_REQ_SID {"sid", 12};
+static constexpr WireKey KEY_REQ_ID {"id", 13};
+static constexpr WireKey KEY_REQ_H {"h", 14};
+static constexpr WireKey KEY_REQ_TARGET {"target", 15};
+static constexpr WireKey KEY_REQ_QUERY {"q", 10};
+static constexpr WireKey KEY_REQ_TOKEN {"token", 16};
+static constexpr WireKey KEY_REQ_VALUE_ID {"vid", 17};
+static constexpr WireKey KEY_REQ_NODES4 {"n4", 18};
+static constexpr WireKey KEY_REQ_NODES6 {"n6", 19};
+static constexpr WireKey KEY_REQ_CREATION {"c", 20};
+static constexpr WireKey KEY_REQ_ADDRESS {"sa", 21};
+static constexpr WireKey KEY_REQ_VALUES {"values", 22};
+static constexpr WireKey KEY_REQ_EXPIRED {"exp", 23};
+static constexpr WireKey KEY_REQ_REFRESHED {"re", 24};
+static constexpr WireKey KEY_REQ_FIELDS {"fileds", 25};
+static constexpr WireKey KEY_REQ_WANT {"w", 26};
+
+static constexpr WireKey QUERY_PING {"ping", 27};
+static constexpr WireKey QUERY_FIND {"find", 28};
+static constexpr WireKey QUERY_GET {"get", 29};
+static constexpr WireKey QUERY_PUT {"put", 30};
+static constexpr WireKey QUERY_LISTEN {"listen", 31};
+static constexpr WireKey QUERY_REFRESH {"refresh", 32};
+
+/* Indexed by code */
+static constexpr const WireKey* WIRE_KEYS[] {
+    &KEY_Y, &KEY_R, &KEY_U, &KEY_E, &KEY_V, &KEY_M, &KEY_TID, &KEY_UA,
+    &KEY_NETID, &KEY_ISCLIENT, &KEY_Q, &KEY_A,
+    &KEY_REQ_SID, &KEY_REQ_ID, &KEY_REQ_H, &KEY_REQ_TARGET, &KEY_REQ_TOKEN,
+    &KEY_REQ_VALUE_ID, &KEY_REQ_NODES4, &KEY_REQ_NODES6, &KEY_REQ_CREATION,
+    &KEY_REQ_ADDRESS, &KEY_REQ_VALUES, &KEY_REQ_EXPIRED, &KEY_REQ_REFRESHED,
+    &KEY_REQ_FIELDS, &KEY_REQ_WANT,
+    &QUERY_PING, &QUERY_FIND, &QUERY_GET, &QUERY_PUT, &QUERY_LISTEN, &QUERY_REFRESH
+};
+
+/** @return the key with the given code, or nullptr if unknown */
+inline const WireKey*
+findWireKey(uint64_t code) {
+    return code < sizeof(WIRE_KEYS) / sizeof(WIRE_KEYS[0]) ? WIRE_KEYS[code] : nullptr;
+}
+
+/**
+ * Unpacks a name sent as a string or as a WireKey code.
+ * Unknown codes give an empty string.
+ */
+inline std::string
+unpackName(const msgpack::object& o) {
+    switch (o.type) {
+    case msgpack::type::STR:
+        return o.as<std::string>();
+    case msgpack::type::POSITIVE_INTEGER:
+        if (auto k = findWireKey(o.via.u64))
+            return k->toString();
+        return {};
+    default:
+        throw msgpack::type_error();
+    }
+}
+
+/**
+ * msgpack packer writing WireKey names as strings, or as their code with
+ * the compact encoding.
+ */
+template <typename Stream>
+class MessagePacker : public msgpack::packer<Stream> {
+public:
+    MessagePacker(Stream* s, bool compact) : msgpack::packer<Stream>(s), compact_(compact) {}
+
+    using msgpack::packer<Stream>::pack;
+    MessagePacker& pack(const WireKey& k) {
+        if (compact_)
+            this->pack_uint8(k.code);
+        else
+            k.msgpack_pack(*this);
+        return *this;
+    }
+
+    bool compact() const { return compact_; }
+private:
+    bool compact_;
+};
+
+inline Tid
+unpackTid(const msgpack::object& o) {
     switch (o.type) {
     case msgpack::type::POSITIVE_INTEGER:
         return o.as<Tid>();
@@ -105,6 +200,8 @@ struct ParsedMessage {
     /** When part of the message header: {index -> (total size, {})}
      *  When part of partial value data: {index -> (offset, part_data)} */
     std::map<unsigned, std::pair<unsigned, Blob>> value_parts;
+    /* fragments of values sent in parts requested again: {index -> fragment numbers} */
+    std::map<unsigned, std::vector<unsigned>> missing_parts;
     /* query describing a filter to apply on values. */
     Query query;
     /* states if ipv4 or ipv6 request */
@@ -114,51 +211,217 @@ struct ParsedMessage {
     /* reported address by the distant node */
     std::string ua;
     SockAddr addr;
+    /* size of the packet holding the message, excluding value fragments */
+    size_t size {0};
     void msgpack_unpack(const msgpack::object& o);
 
-    bool append(const ParsedMessage& block);
-    bool complete();
+    /**
+     * Decodes a message from a packet buffer, with msgpack objects
+     * referencing the buffer allocated from zone.
+     * Throws on invalid messages.
+     */
+    void unpack(const uint8_t* buf, size_t buflen, msgpack::zone& zone);
+
+    /**
+     * Decodes common messages directly from the packet buffer, without
+     * building a msgpack object tree for the whole message.
+     * Returns false, with the message left in an unspecified state, if
+     * the packet must be decoded with msgpack_unpack instead.
+     */
+    bool unpackFast(const char* data, size_t size, msgpack::zone& zone);
+
+    /** Decodes the values of the message sent in parts, once all received */
+    void complete(const ValueReassembly& parts);
+
+private:
+    void unpackValueData(msgpack::object& v);
+    void unpackMissingParts(msgpack::object& m);
+    void unpackAddress(const msgpack::object* sa);
+    void unpackValues(msgpack::object& values);
+    void unpackFields(msgpack::object& fields);
+    void unpackWant(const msgpack::object* want);
 };
 
-bool
-ParsedMessage::append(const ParsedMessage& block)
-{
-    bool ret(false);
-    for (const auto& ve : block.value_parts) {
-        auto part_val = value_parts.find(ve.first);
-        if (part_val == value_parts.end()
-            || part_val->second.second.size() >= part_val->second.first)
-            continue;
-        // TODO: handle out-of-order packets
-        if (ve.second.first != part_val->second.second.size()) {
-            //std::cout << "skipping out-of-order packet" << std::endl;
-            continue;
+/**
+ * Minimal msgpack reader working directly on a packet buffer.
+ * Methods return false if the next object is not of the expected type or
+ * goes past the end of the buffer, in which case the position is
+ * unspecified.
+ */
+class MsgpackReader {
+public:
+    /** Nesting level above which skip() gives up */
+    static constexpr unsigned MAX_DEPTH {32};
+
+    MsgpackReader(const char* data, size_t size)
+        : p_((const uint8_t*)data), end_((const uint8_t*)data + size) {}
+
+    bool atEnd() const { return p_ == end_; }
+    const char* position() const { return (const char*)p_; }
+
+    bool isStr() const {
+        if (atEnd()) return false;
+        auto t = *p_;
+        return (t >= 0xa0 and t <= 0xbf) or (t >= 0xd9 and t <= 0xdb);
+    }
+    bool isBin() const {
+        return not atEnd() and *p_ >= 0xc4 and *p_ <= 0xc6;
+    }
+    /** Non-negative integer type, the value may still be negative */
+    bool isUint() const {
+        if (atEnd()) return false;
+        auto t = *p_;
+        return t <= 0x7f or (t >= 0xcc and t <= 0xcf) or (t >= 0xd0 and t <= 0xd3);
+    }
+
+    bool readMapSize(uint32_t& n) {
+        if (atEnd()) return false;
+        auto t = *p_++;
+        if ((t & 0xf0) == 0x80) { n = t & 0x0f; return true; }
+        if (t == 0xde) return readBE<uint16_t>(n);
+        if (t == 0xdf) return readBE<uint32_t>(n);
+        return false;
+    }
+    bool readArraySize(uint32_t& n) {
+        if (atEnd()) return false;
+        auto t = *p_++;
+        if ((t & 0xf0) == 0x90) { n = t & 0x0f; return true; }
+        if (t == 0xdc) return readBE<uint16_t>(n);
+        if (t == 0xdd) return readBE<uint32_t>(n);
+        return false;
+    }
+    bool readStr(const char*& s, uint32_t& len) {
+        if (atEnd()) return false;
+        auto t = *p_++;
+        bool ok;
+        if ((t & 0xe0) == 0xa0) { len = t & 0x1f; ok = true; }
+        else if (t == 0xd9) ok = readBE<uint8_t>(len);
+        else if (t == 0xda) ok = readBE<uint16_t>(len);
+        else if (t == 0xdb) ok = readBE<uint32_t>(len);
+        else return false;
+        return ok and readBytes(s, len);
+    }
+    bool readBin(const char*& s, uint32_t& len) {
+        if (atEnd()) return false;
+        auto t = *p_++;
+        bool ok;
+        if (t == 0xc4) ok = readBE<uint8_t>(len);
+        else if (t == 0xc5) ok = readBE<uint16_t>(len);
+        else if (t == 0xc6) ok = readBE<uint32_t>(len);
+        else return false;
+        return ok and readBytes(s, len);
+    }
+    /** Non-negative integer, whatever its encoding */
+    bool readUint(uint64_t& v) {
+        if (atEnd()) return false;
+        auto t = *p_++;
+        if (t <= 0x7f) { v = t; return true; }
+        switch (t) {
+        case 0xcc: return readBE<uint8_t>(v);
+        case 0xcd: return readBE<uint16_t>(v);
+        case 0xce: return readBE<uint32_t>(v);
+        case 0xcf: return readBE<uint64_t>(v);
+        case 0xd0: return readBE<uint8_t>(v) and v < (1ull << 7);
+        case 0xd1: return readBE<uint16_t>(v) and v < (1ull << 15);
+        case 0xd2: return readBE<uint32_t>(v) and v < (1ull << 31);
+        case 0xd3: return readBE<uint64_t>(v) and v < (1ull << 63);
+        default: return false;
         }
-        ret = true;
-        part_val->second.second.insert(part_val->second.second.end(),
-                                       ve.second.second.begin(),
-                                       ve.second.second.end());
     }
-    return ret;
-}
+    bool readBool(bool& v) {
+        if (atEnd()) return false;
+        auto t = *p_++;
+        if (t != 0xc2 and t != 0xc3) return false;
+        v = t == 0xc3;
+        return true;
+    }
 
-bool
-ParsedMessage::complete()
-{
-    for (auto& e : value_parts) {
-        //std::cout << "part " << e.first << ": " << e.second.second.size() << "/" << e.second.first << std::endl;
-        if (e.second.first > e.second.second.size())
+    /** Skip the next object */
+    bool skip(unsigned depth = 0) {
+        if (atEnd() or depth > MAX_DEPTH) return false;
+        auto t = *p_++;
+        uint32_t n;
+        if (t <= 0x7f or t >= 0xe0) return true;
+        if (t <= 0x8f) return skipN((t & 0x0f) * 2, depth);
+        if (t <= 0x9f) return skipN(t & 0x0f, depth);
+        if (t <= 0xbf) return skipBytes(t & 0x1f);
+        switch (t) {
+        case 0xc0: case 0xc2: case 0xc3: return true;
+        case 0xc4: case 0xd9: return readBE<uint8_t>(n) and skipBytes(n);
+        case 0xc5: case 0xda: return readBE<uint16_t>(n) and skipBytes(n);
+        case 0xc6: case 0xdb: return readBE<uint32_t>(n) and skipBytes(n);
+        case 0xc7: return readBE<uint8_t>(n) and skipBytes(n + 1ull);
+        case 0xc8: return readBE<uint16_t>(n) and skipBytes(n + 1ull);
+        case 0xc9: return readBE<uint32_t>(n) and skipBytes(n + 1ull);
+        case 0xca: case 0xce: case 0xd2: return skipBytes(4);
+        case 0xcb: case 0xcf: case 0xd3: return skipBytes(8);
+        case 0xcc: case 0xd0: return skipBytes(1);
+        case 0xcd: case 0xd1: return skipBytes(2);
+        case 0xd4: return skipBytes(2);
+        case 0xd5: return skipBytes(3);
+        case 0xd6: return skipBytes(5);
+        case 0xd7: return skipBytes(9);
+        case 0xd8: return skipBytes(17);
+        case 0xdc: return readBE<uint16_t>(n) and skipN(n, depth);
+        case 0xdd: return readBE<uint32_t>(n) and skipN(n, depth);
+        case 0xde: return readBE<uint16_t>(n) and skipN(n * 2ull, depth);
+        case 0xdf: return readBE<uint32_t>(n) and skipN(n * 2ull, depth);
+        default: return false;
+        }
+    }
+
+    /** Skip the next object, returning where it is in the buffer */
+    bool span(const char*& s, size_t& len) {
+        s = position();
+        if (not skip())
             return false;
+        len = position() - s;
+        return true;
+    }
+
+private:
+    bool readBytes(const char*& s, uint32_t len) {
+        if ((size_t)(end_ - p_) < len) return false;
+        s = (const char*)p_;
+        p_ += len;
+        return true;
     }
-    for (auto& e : value_parts) {
+    bool skipBytes(uint64_t len) {
+        if ((uint64_t)(end_ - p_) < len) return false;
+        p_ += len;
+        return true;
+    }
+    bool skipN(uint64_t n, unsigned depth) {
+        for (uint64_t i = 0; i < n; i++)
+            if (not skip(depth + 1))
+                return false;
+        return true;
+    }
+    template <typename T, typename V>
+    bool readBE(V& v) {
+        if ((size_t)(end_ - p_) < sizeof(T)) return false;
+        uint64_t r = 0;
+        for (size_t i = 0; i < sizeof(T); i++)
+            r = (r << 8) | *p_++;
+        v = (V)r;
+        return true;
+    }
+
+    const uint8_t* p_;
+    const uint8_t* end_;
+};
+
+inline void
+ParsedMessage::complete(const ValueReassembly& parts)
+{
+    parts.forEachValue([&](const uint8_t* data, size_t size) {
         msgpack::unpacked msg;
-        msgpack::unpack(msg, (const char*)e.second.second.data(), e.second.second.size());
+        msgpack::unpack(msg, (const char*)data, size);
         values.emplace_back(std::make_shared<Value>(msg.get()));
-    }
-    return true;
+    });
 }
 
-void
+inline void
 ParsedMessage::msgpack_unpack(const msgpack::object& msg)
 {
     if (msg.type != msgpack::type::MAP) throw msgpack::type_error();
@@ -169,15 +432,16 @@ ParsedMessage::msgpack_unpack(const msgpack::object& msg)
         msgpack::object* u;
         msgpack::object* e;
         msgpack::object* v;
+        msgpack::object* m;
         msgpack::object* a;
         std::string q;
     } parsed {};
 
     for (unsigned i = 0; i < msg.via.map.size; i++) {
         auto& o = msg.via.map.ptr[i];
-        if (o.key.type != msgpack::type::STR)
+        if (o.key.type != msgpack::type::STR and o.key.type != msgpack::type::POSITIVE_INTEGER)
             continue;
-        auto key = o.key.as<std::string>();
+        auto key = unpackName(o.key);
         if (key == KEY_Y)
             parsed.y = &o.val;
         else if (key == KEY_R)
@@ -188,6 +452,8 @@ ParsedMessage::msgpack_unpack(const msgpack::object& msg)
             parsed.e = &o.val;
         else if (key == KEY_V)
             parsed.v = &o.val;
+        else if (key == KEY_M)
+            parsed.m = &o.val;
         else if (key == KEY_TID)
             tid = unpackTid(o.val);
         else if (key == KEY_UA)
@@ -197,7 +463,7 @@ ParsedMessage::msgpack_unpack(const msgpack::object& msg)
         else if (key == KEY_ISCLIENT)
             is_client = o.val.as<bool>();
         else if (key == KEY_Q)
-            parsed.q = o.val.as<std::string>();
+            parsed.q = unpackName(o.val);
         else if (key == KEY_A)
             parsed.a = &o.val;
     }
@@ -210,7 +476,9 @@ ParsedMessage::msgpack_unpack(const msgpack::object& msg)
         type = MessageType::ValueData;
     else if (parsed.u)
         type = MessageType::ValueUpdate;
-    else if (parsed.y and parsed.y->as<std::string>() != "q")
+    else if (parsed.m)
+        type = MessageType::ValueDataRequest;
+    else if (parsed.y and unpackName(*parsed.y) != KEY_Q)
         throw msgpack::type_error();
     else if (parsed.q == QUERY_PING)
         type = MessageType::Ping;
@@ -228,25 +496,22 @@ ParsedMessage::msgpack_unpack(const msgpack::object& msg)
         throw msgpack::type_error();
 
     if (type == MessageType::ValueData) {
-        if (parsed.v->type != msgpack::type::MAP)
-            throw msgpack::type_error();
-        for (size_t i = 0; i < parsed.v->via.map.size; ++i) {
-            auto& vdat = parsed.v->via.map.ptr[i];
-            auto o = findMapValue(vdat.val, "o");
-            auto d = findMapValue(vdat.val, "d");
-            if (not o or not d)
-                continue;
-            value_parts.emplace(vdat.key.as<unsigned>(), std::pair<size_t, Blob>(o->as<size_t>(), unpackBlob(*d)));
-        }
+        unpackValueData(*parsed.v);
+        return;
+    }
+    if (type == MessageType::ValueDataRequest) {
+        unpackMissingParts(*parsed.m);
         return;
     }
 
     if (!parsed.a && !parsed.r && !parsed.e && !parsed.u)
         throw msgpack::type_error();
     auto& req = parsed.a ? *parsed.a : (parsed.r ? *parsed.r : (parsed.u ? *parsed.u : *parsed.e));
+    if (req.type != msgpack::type::MAP)
+        throw msgpack::type_error();
 
     if (parsed.e) {
-        if (parsed.e->type != msgpack::type::ARRAY)
+        if (parsed.e->type != msgpack::type::ARRAY or parsed.e->via.array.size == 0)
             throw msgpack::type_error();
         error_code = parsed.e->via.array.ptr[0].as<uint16_t>();
     }
@@ -260,9 +525,9 @@ ParsedMessage::msgpack_unpack(const msgpack::object& msg)
 
     for (unsigned i = 0; i < req.via.map.size; i++) {
         auto& o = req.via.map.ptr[i];
-        if (o.key.type != msgpack::type::STR)
+        if (o.key.type != msgpack::type::STR and o.key.type != msgpack::type::POSITIVE_INTEGER)
             continue;
-        auto key = o.key.as<std::string>();
+        auto key = unpackName(o.key);
         if (key == KEY_REQ_SID)
             socket_id = unpackTid(o.val);
         else if (key == KEY_REQ_ID)
@@ -297,73 +562,122 @@ ParsedMessage::msgpack_unpack(const msgpack::object& msg)
             parsedReq.want = &o.val;
     }
 
-    if (parsedReq.sa) {
-        if (parsedReq.sa->type != msgpack::type::BIN)
+    unpackAddress(parsedReq.sa);
+    if (parsedReq.values)
+        unpackValues(*parsedReq.values);
+    else if (parsedReq.fields)
+        unpackFields(*parsedReq.fields);
+    unpackWant(parsedReq.want);
+}
+
+inline void
+ParsedMessage::unpackValueData(msgpack::object& v)
+{
+    if (v.type != msgpack::type::MAP)
+        throw msgpack::type_error();
+    for (size_t i = 0; i < v.via.map.size; ++i) {
+        auto& vdat = v.via.map.ptr[i];
+        auto o = findMapValue(vdat.val, "o");
+        auto d = findMapValue(vdat.val, "d");
+        if (not o or not d)
+            continue;
+        value_parts.emplace(vdat.key.as<unsigned>(), std::pair<size_t, Blob>(o->as<size_t>(), unpackBlob(*d)));
+    }
+}
+
+inline void
+ParsedMessage::unpackMissingParts(msgpack::object& m)
+{
+    if (m.type != msgpack::type::MAP)
+        throw msgpack::type_error();
+    for (size_t i = 0; i < m.via.map.size; ++i) {
+        auto& part = m.via.map.ptr[i];
+        missing_parts.emplace(part.key.as<unsigned>(), part.val.as<std::vector<unsigned>>());
+    }
+}
+
+inline void
+ParsedMessage::unpackAddress(const msgpack::object* sa)
+{
+    if (sa) {
+        if (sa->type != msgpack::type::BIN)
             throw msgpack::type_error();
-        auto l = parsedReq.sa->via.bin.size;
+        auto l = sa->via.bin.size;
         if (l == sizeof(in_addr)) {
             addr.setFamily(AF_INET);
             auto& a = addr.getIPv4();
             a.sin_port = 0;
-            std::copy_n(parsedReq.sa->via.bin.ptr, l, (char*)&a.sin_addr);
+            std::copy_n(sa->via.bin.ptr, l, (char*)&a.sin_addr);
         } else if (l == sizeof(in6_addr)) {
             addr.setFamily(AF_INET6);
             auto& a = addr.getIPv6();
             a.sin6_port = 0;
-            std::copy_n(parsedReq.sa->via.bin.ptr, l, (char*)&a.sin6_addr);
+            std::copy_n(sa->via.bin.ptr, l, (char*)&a.sin6_addr);
         }
     } else
         addr = {};
+}
 
-    if (parsedReq.values) {
-        if (parsedReq.values->type != msgpack::type::ARRAY)
-            throw msgpack::type_error();
-        for (size_t i = 0; i < parsedReq.values->via.array.size; i++) {
-            auto& packed_v = parsedReq.values->via.array.ptr[i];
-            if (packed_v.type == msgpack::type::POSITIVE_INTEGER) {
-                // Skip oversize values with a small margin for header overhead
-                if (packed_v.via.u64 > MAX_VALUE_SIZE + 32)
-                    continue;
-                value_parts.emplace(i, std::make_pair(packed_v.via.u64, Blob{}));
-            } else {
-                try {
-                    values.emplace_back(std::make_shared<Value>(parsedReq.values->via.array.ptr[i]));
-                } catch (const std::exception& e) {
-                     //DHT_LOG_WARN("Error reading value: %s", e.what());
-                }
+inline void
+ParsedMessage::unpackValues(msgpack::object& vals)
+{
+    if (vals.type != msgpack::type::ARRAY)
+        throw msgpack::type_error();
+    for (size_t i = 0; i < vals.via.array.size; i++) {
+        auto& packed_v = vals.via.array.ptr[i];
+        if (packed_v.type == msgpack::type::POSITIVE_INTEGER) {
+            // Skip oversize values with a small margin for header overhead
+            if (packed_v.via.u64 > MAX_VALUE_SIZE + 32)
+                continue;
+            value_parts.emplace(i, std::make_pair(packed_v.via.u64, Blob{}));
+        } else {
+            try {
+                values.emplace_back(std::make_shared<Value>(vals.via.array.ptr[i]));
+            } catch (const std::exception& e) {
+                 //DHT_LOG_WARN("Error reading value: %s", e.what());
             }
         }
-    } else if (parsedReq.fields) {
-        if (auto rfields = findMapValue(*parsedReq.fields, "f")) {
-            auto vfields = rfields->as<std::set<Value::Field>>();
-            if (auto rvalues = findMapValue(*parsedReq.fields, "v")) {
-                if (rvalues->type != msgpack::type::ARRAY)
-                    throw msgpack::type_error();
-                size_t val_num = rvalues->via.array.size / vfields.size();
-                for (size_t i = 0; i < val_num; ++i) {
-                    try {
-                        auto v = std::make_shared<FieldValueIndex>();
-                        v->msgpack_unpack_fields(vfields, *rvalues, i*vfields.size());
-                        fields.emplace_back(std::move(v));
-                    } catch (const std::exception& e) { }
-                }
-            }
-        } else {
+    }
+}
+
+inline void
+ParsedMessage::unpackFields(msgpack::object& fs)
+{
+    if (auto rfields = findMapValue(fs, "f")) {
+        auto vfields = rfields->as<std::set<Value::Field>>();
+        if (vfields.empty())
             throw msgpack::type_error();
+        if (auto rvalues = findMapValue(fs, "v")) {
+            if (rvalues->type != msgpack::type::ARRAY)
+                throw msgpack::type_error();
+            size_t val_num = rvalues->via.array.size / vfields.size();
+            for (size_t i = 0; i < val_num; ++i) {
+                try {
+                    auto v = std::make_shared<FieldValueIndex>();
+                    v->msgpack_unpack_fields(vfields, *rvalues, i*vfields.size());
+                    fields.emplace_back(std::move(v));
+                } catch (const std::exception& e) { }
+            }
         }
+    } else {
+        throw msgpack::type_error();
     }
+}
 
-    if (parsedReq.want) {
-        if (parsedReq.want->type != msgpack::type::ARRAY)
+inline void
+ParsedMessage::unpackWant(const msgpack::object* w)
+{
+    if (w) {
+        if (w->type != msgpack::type::ARRAY)
             throw msgpack::type_error();
         want = 0;
-        for (unsigned i=0; i<parsedReq.want->via.array.size; i++) {
-            auto& val = parsedReq.want->via.array.ptr[i];
+        for (unsigned i=0; i<w->via.array.size; i++) {
+            auto& val = w->via.array.ptr[i];
             try {
-                auto w = val.as<sa_family_t>();
-                if (w == AF_INET)
+                auto af = val.as<sa_family_t>();
+                if (af == AF_INET)
                     want |= WANT4;
-                else if(w == AF_INET6)
+                else if(af == AF_INET6)
                     want |= WANT6;
             } catch (const std::exception& e) {};
         }
@@ -372,5 +686,340 @@ ParsedMessage::msgpack_unpack(const msgpack::object& msg)
     }
 }
 
+namespace detail {
+
+inline bool
+referenceBuffer(msgpack::type::object_type, size_t, void*)
+{
+    return true;
+}
+
+/** Same as unpackTid, returning false instead of throwing */
+inline bool
+readTid(MsgpackReader& rd, Tid& tid)
+{
+    if (rd.isBin()) {
+        const char* p;
+        uint32_t len;
+        if (not rd.readBin(p, len) or len != sizeof(Tid))
+            return false;
+        uint32_t t;
+        std::memcpy(&t, p, sizeof(t));
+        tid = ntohl(t);
+        return true;
+    }
+    uint64_t v;
+    if (not rd.readUint(v) or v > std::numeric_limits<Tid>::max())
+        return false;
+    tid = v;
+    return true;
+}
+
+/** Same as unpackBlob for binaries and strings */
+inline bool
+readBlob(MsgpackReader& rd, Blob& b)
+{
+    const char* p;
+    uint32_t len;
+    if (not (rd.isBin() ? rd.readBin(p, len) : rd.readStr(p, len)))
+        return false;
+    b.assign((const uint8_t*)p, (const uint8_t*)p + len);
+    return true;
+}
+
+inline bool
+readHash(MsgpackReader& rd, InfoHash& h)
+{
+    const char* p;
+    uint32_t len;
+    if (not rd.readBin(p, len) or len != HASH_LEN)
+        return false;
+    std::copy_n((const uint8_t*)p, HASH_LEN, h.data());
+    return true;
+}
+
+inline bool
+readIds(MsgpackReader& rd, std::vector<Value::Id>& ids)
+{
+    uint32_t n;
+    if (not rd.readArraySize(n))
+        return false;
+    ids.clear();
+    for (uint32_t i = 0; i < n; i++) {
+        uint64_t v;
+        if (not rd.readUint(v))
+            return false;
+        ids.emplace_back(v);
+    }
+    return true;
+}
+
+/** Same as unpackName */
+inline bool
+readName(MsgpackReader& rd, const char*& s, uint32_t& len)
+{
+    if (rd.isStr())
+        return rd.readStr(s, len);
+    uint64_t code;
+    if (not rd.isUint() or not rd.readUint(code))
+        return false;
+    if (auto k = findWireKey(code)) {
+        s = k->str;
+        len = k->len;
+    } else {
+        s = "";
+        len = 0;
+    }
+    return true;
+}
+
+/**
+ * Reads a map key. Keys other than names are skipped, returned as an
+ * empty string.
+ */
+inline bool
+readKey(MsgpackReader& rd, const char*& k, uint32_t& len)
+{
+    if (rd.isStr() or rd.isUint())
+        return readName(rd, k, len);
+    k = "";
+    len = 0;
+    return rd.skip();
+}
+
+inline bool
+keyIs(const char* k, uint32_t len, const char* key, uint32_t keylen)
+{
+    return len == keylen and std::memcmp(k, key, len) == 0;
+}
+
+struct Span {
+    const char* p {nullptr};
+    size_t len {0};
+    explicit operator bool() const { return p; }
+};
+
+} /* namespace detail */
+
+inline bool
+ParsedMessage::unpackFast(const char* data, size_t size, msgpack::zone& zone)
+{
+    MsgpackReader rd(data, size);
+    uint32_t n;
+    if (not rd.readMapSize(n))
+        return false;
+
+    detail::Span y, r, u, e, v, m, a;
+    const char* q = nullptr;
+    uint32_t qlen = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        const char* k;
+        uint32_t klen;
+        if (not detail::readKey(rd, k, klen))
+            return false;
+        bool ok = true;
+        if (klen == 1) {
+            switch (k[0]) {
+            case 'y': ok = rd.span(y.p, y.len); break;
+            case 'r': ok = rd.span(r.p, r.len); break;
+            case 'u': ok = rd.span(u.p, u.len); break;
+            case 'e': ok = rd.span(e.p, e.len); break;
+            case 'p': ok = rd.span(v.p, v.len); break;
+            case 'm': ok = rd.span(m.p, m.len); break;
+            case 'a': ok = rd.span(a.p, a.len); break;
+            case 't': ok = detail::readTid(rd, tid); break;
+            case 'v': {
+                const char* s;
+                uint32_t l;
+                if ((ok = rd.readStr(s, l)))
+                    ua.assign(s, l);
+                break;
+            }
+            case 'n': {
+                uint64_t net;
+                ok = rd.readUint(net) and net <= std::numeric_limits<NetId>::max();
+                network = net;
+                break;
+            }
+            case 's': ok = rd.readBool(is_client); break;
+            case 'q': ok = detail::readName(rd, q, qlen); break;
+            default: ok = rd.skip();
+            }
+        } else
+            ok = rd.skip();
+        if (not ok)
+            return false;
+    }
+    if (not rd.atEnd())
+        return false;
+
+    if (e)
+        type = MessageType::Error;
+    else if (r)
+        type = MessageType::Reply;
+    else if (v)
+        type = MessageType::ValueData;
+    else if (u)
+        type = MessageType::ValueUpdate;
+    else if (m)
+        type = MessageType::ValueDataRequest;
+    else {
+        if (y) {
+            MsgpackReader ry(y.p, y.len);
+            const char* s;
+            uint32_t l;
+            if (not detail::readName(ry, s, l) or not detail::keyIs(s, l, "q", 1))
+                return false;
+        }
+        switch (qlen) {
+        case 3:
+            if (detail::keyIs(q, qlen, "get", 3)) type = MessageType::GetValues;
+            else if (detail::keyIs(q, qlen, "put", 3)) type = MessageType::AnnounceValue;
+            else return false;
+            break;
+        case 4:
+            if (detail::keyIs(q, qlen, "ping", 4)) type = MessageType::Ping;
+            else if (detail::keyIs(q, qlen, "find", 4)) type = MessageType::FindNode;
+            else return false;
+            break;
+        case 6:
+            if (detail::keyIs(q, qlen, "listen", 6)) type = MessageType::Listen;
+            else return false;
+            break;
+        case 7:
+            if (detail::keyIs(q, qlen, "refresh", 7)) type = MessageType::Refresh;
+            else return false;
+            break;
+        default:
+            return false;
+        }
+    }
+
+    auto toObject = [&](const detail::Span& sp) {
+        return msgpack::unpack(zone, sp.p, sp.len, detail::referenceBuffer);
+    };
+
+    if (type == MessageType::ValueData) {
+        auto obj = toObject(v);
+        unpackValueData(obj);
+        return true;
+    }
+    if (type == MessageType::ValueDataRequest) {
+        auto obj = toObject(m);
+        unpackMissingParts(obj);
+        return true;
+    }
+
+    if (not a and not r and not e and not u)
+        return false;
+    const auto& req = a ? a : (r ? r : (u ? u : e));
+
+    if (e) {
+        MsgpackReader re(e.p, e.len);
+        uint64_t code;
+        if (not re.readArraySize(n) or n == 0 or not re.readUint(code) or code > std::numeric_limits<uint16_t>::max())
+            return false;
+        error_code = code;
+    }
+
+    detail::Span values_s, fields_s, sa_s, want_s;
+    MsgpackReader rr(req.p, req.len);
+    if (not rr.readMapSize(n))
+        return false;
+    for (uint32_t i = 0; i < n; i++) {
+        const char* k;
+        uint32_t klen;
+        if (not detail::readKey(rr, k, klen))
+            return false;
+        bool ok = true;
+        switch (klen) {
+        case 1:
+            switch (k[0]) {
+            case 'h': ok = detail::readHash(rr, info_hash); break;
+            case 'q': {
+                detail::Span qs;
+                if ((ok = rr.span(qs.p, qs.len)))
+                    query.msgpack_unpack(toObject(qs));
+                break;
+            }
+            case 'c': {
+                uint64_t c;
+                ok = rr.readUint(c) and c <= (uint64_t)std::numeric_limits<std::time_t>::max();
+                created = from_time_t(c);
+                break;
+            }
+            case 'w': ok = rr.span(want_s.p, want_s.len); break;
+            default: ok = rr.skip();
+            }
+            break;
+        case 2:
+            if (detail::keyIs(k, klen, "id", 2)) ok = detail::readHash(rr, id);
+            else if (detail::keyIs(k, klen, "n4", 2)) ok = detail::readBlob(rr, nodes4_raw);
+            else if (detail::keyIs(k, klen, "n6", 2)) ok = detail::readBlob(rr, nodes6_raw);
+            else if (detail::keyIs(k, klen, "sa", 2)) ok = rr.span(sa_s.p, sa_s.len);
+            else if (detail::keyIs(k, klen, "re", 2)) ok = detail::readIds(rr, refreshed_values);
+            else ok = rr.skip();
+            break;
+        case 3:
+            if (detail::keyIs(k, klen, "sid", 3)) ok = detail::readTid(rr, socket_id);
+            else if (detail::keyIs(k, klen, "vid", 3)) {
+                uint64_t vid;
+                ok = rr.readUint(vid);
+                value_id = vid;
+            }
+            else if (detail::keyIs(k, klen, "exp", 3)) ok = detail::readIds(rr, expired_values);
+            else ok = rr.skip();
+            break;
+        case 5:
+            if (detail::keyIs(k, klen, "token", 5)) ok = detail::readBlob(rr, token);
+            else ok = rr.skip();
+            break;
+        case 6:
+            if (detail::keyIs(k, klen, "target", 6)) ok = detail::readHash(rr, target);
+            else if (detail::keyIs(k, klen, "values", 6)) ok = rr.span(values_s.p, values_s.len);
+            else if (detail::keyIs(k, klen, "fileds", 6)) ok = rr.span(fields_s.p, fields_s.len);
+            else ok = rr.skip();
+            break;
+        default:
+            ok = rr.skip();
+        }
+        if (not ok)
+            return false;
+    }
+
+    if (sa_s) {
+        MsgpackReader rs(sa_s.p, sa_s.len);
+        if (not rs.isBin())
+            return false;
+        auto obj = toObject(sa_s);
+        unpackAddress(&obj);
+    } else
+        addr = {};
+    if (values_s) {
+        auto obj = toObject(values_s);
+        unpackValues(obj);
+    } else if (fields_s) {
+        auto obj = toObject(fields_s);
+        unpackFields(obj);
+    }
+    if (want_s) {
+        auto obj = toObject(want_s);
+        unpackWant(&obj);
+    } else
+        want = -1;
+    return true;
+}
+
+inline void
+ParsedMessage::unpack(const uint8_t* buf, size_t buflen, msgpack::zone& zone)
+{
+    if (not unpackFast((const char*)buf, buflen, zone)) {
+        *this = ParsedMessage {};
+        msgpack_unpack(msgpack::unpack(zone, (const char*)buf, buflen, detail::referenceBuffer));
+    }
+    size = buflen;
+}
+
+
 } /* namespace net  */
 } /* namespace dht */
@@ -0,0 +1,159 @@
+/*
+ *  Copyright (C) 2019 Savoir-faire Linux Inc.
+ *  Author : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "rate_limiter.h"
+
+#include <cstring>
+#include <ciso646> // fix windows compiler bug
+
+namespace dht {
+
+constexpr size_t IpRateLimiter::DEFAULT_CAPACITY;
+constexpr uint32_t IpRateLimiter::NONE;
+
+IpRateLimiter::IpRateLimiter(TokenBucket::Quota quota, size_t capacity)
+ : quota_(quota), entries_(std::max<size_t>(capacity, 1))
+{
+    // Keep the load factor of the index under 1/2
+    size_t slots = 2;
+    while (slots < entries_.size() * 2)
+        slots <<= 1;
+    index_.assign(slots, NONE);
+    mask_ = slots - 1;
+}
+
+IpRateLimiter::Key
+IpRateLimiter::makeKey(const SockAddr& addr)
+{
+    Key key;
+    key.family = addr.getFamily();
+    switch (key.family) {
+    case AF_INET: {
+        uint32_t ip;
+        std::memcpy(&ip, &((const sockaddr_in*)addr.get())->sin_addr, sizeof(ip));
+        key.ip = ip;
+        break;
+    }
+    case AF_INET6:
+        // don't consider more than 64 bits (IPv6)
+        std::memcpy(&key.ip, &((const sockaddr_in6*)addr.get())->sin6_addr, sizeof(key.ip));
+        break;
+    default: {
+        uint64_t h = 14695981039346656037ull;
+        auto p = (const uint8_t*)addr.get();
+        for (socklen_t i = 0; i < addr.getLength(); i++)
+            h = (h ^ p[i]) * 1099511628211ull;
+        key.ip = h;
+        break;
+    }
+    }
+    return key;
+}
+
+size_t
+IpRateLimiter::home(const Key& key) const
+{
+    uint64_t h = (key.ip ^ ((uint64_t)key.family << 56)) * 0x9E3779B97F4A7C15ull;
+    return (h ^ (h >> 32)) & mask_;
+}
+
+size_t
+IpRateLimiter::lookup(const Key& key) const
+{
+    for (size_t i = home(key);; i = (i + 1) & mask_) {
+        auto e = index_[i];
+        if (e == NONE or entries_[e].key == key)
+            return i;
+    }
+}
+
+void
+IpRateLimiter::unindex(size_t i)
+{
+    // Backward-shift deletion: no tombstone is left in the index
+    for (size_t j = (i + 1) & mask_; index_[j] != NONE; j = (j + 1) & mask_) {
+        auto h = home(entries_[index_[j]].key);
+        if (((j - h) & mask_) >= ((j - i) & mask_)) {
+            index_[i] = index_[j];
+            i = j;
+        }
+    }
+    index_[i] = NONE;
+}
+
+void
+IpRateLimiter::unlink(uint32_t e)
+{
+    auto& entry = entries_[e];
+    if (entry.prev != NONE)
+        entries_[entry.prev].next = entry.next;
+    else
+        head_ = entry.next;
+    if (entry.next != NONE)
+        entries_[entry.next].prev = entry.prev;
+    else
+        tail_ = entry.prev;
+    entry.prev = entry.next = NONE;
+}
+
+void
+IpRateLimiter::pushFront(uint32_t e)
+{
+    auto& entry = entries_[e];
+    entry.prev = NONE;
+    entry.next = head_;
+    if (head_ != NONE)
+        entries_[head_].prev = e;
+    head_ = e;
+    if (tail_ == NONE)
+        tail_ = e;
+}
+
+bool
+IpRateLimiter::limit(const SockAddr& addr, const time_point& now)
+{
+    if (quota_.unlimited())
+        return true;
+    auto key = makeKey(addr);
+    auto slot = lookup(key);
+    uint32_t e = index_[slot];
+    if (e != NONE) {
+        if (head_ != e) {
+            unlink(e);
+            pushFront(e);
+        }
+    } else {
+        if (size_ < entries_.size()) {
+            e = size_++;
+        } else {
+            // Forget the least recently seen address
+            e = tail_;
+            unlink(e);
+            unindex(lookup(entries_[e].key));
+            slot = lookup(key);
+        }
+        auto& entry = entries_[e];
+        entry.key = key;
+        entry.bucket = {};
+        index_[slot] = e;
+        pushFront(e);
+    }
+    return entries_[e].bucket.limit(now, quota_);
+}
+
+}
@@ -21,6 +21,7 @@
 
 #include "net.h"
 #include "value.h"
+#include "scheduler.h"
 
 namespace dht {
 struct Node;
@@ -108,7 +109,7 @@ private:
     static const constexpr size_t MAX_ATTEMPT_COUNT {3};
 
     bool isExpired(time_point now) const {
-        return pending() and now > last_try + Node::MAX_RESPONSE_TIME and attempt_count >= Request::MAX_ATTEMPT_COUNT;
+        return pending() and now > last_try + node->getResponseTime() and attempt_count >= Request::MAX_ATTEMPT_COUNT;
     }
 
     void clear() {
@@ -130,6 +131,7 @@ private:
 
     Blob msg {};                      /* the serialized message. */
     Tid socket;   /* the socket used for further reponses. */
+    Sp<Scheduler::Job> step_job {};   /* next attempt, moved on each attempt */
 };
 
 } /* namespace net  */
@@ -22,6 +22,8 @@
 #include "rng.h"
 
 #include <memory>
+#include <cstring>
+#include <iterator>
 
 namespace dht {
 
@@ -55,13 +57,74 @@ Bucket::randomNode()
     return nodes.back();
 }
 
-void Bucket::sendCachedPing(net::NetworkEngine& ne)
+constexpr size_t Bucket::REPLACEMENT_CACHE_SIZE;
+
+/* Whether a is more likely than b to be a good node */
+static bool
+betterCandidate(const Node& a, const Node& b, time_point now)
+{
+    bool good_a = a.isGood(now), good_b = b.isGood(now);
+    if (good_a != good_b)
+        return good_a;
+    if (a.hasRtt() != b.hasRtt())
+        return a.hasRtt();
+    if (a.hasRtt() and a.getSrtt() != b.getSrtt())
+        return a.getSrtt() < b.getSrtt();
+    return a.getTime() > b.getTime();
+}
+
+void
+Bucket::cacheNode(const Sp<Node>& node, time_point now)
 {
-    if (not cached)
+    cache.erase(std::remove_if(cache.begin(), cache.end(), [&](const Sp<Node>& n) {
+        return n == node or n->isExpired();
+    }), cache.end());
+    if (node->isExpired())
         return;
-    //DHT_LOG.d(b.cached->id, "[node %s] sending ping to cached node", cached->toString().c_str());
-    ne.sendPing(cached, nullptr, nullptr);
-    cached = {};
+    // Candidates are ranked when learnt about, the most recent first
+    // among equals; ranks of the others are kept from their last update.
+    auto pos = std::find_if(cache.begin(), cache.end(), [&](const Sp<Node>& n) {
+        return not betterCandidate(*n, *node, now);
+    });
+    cache.emplace(pos, node);
+    if (cache.size() > REPLACEMENT_CACHE_SIZE)
+        cache.pop_back();
+}
+
+bool Bucket::sendCachedPing(net::NetworkEngine& ne)
+{
+    while (not cache.empty()) {
+        auto node = std::move(cache.front());
+        cache.erase(cache.begin());
+        if (not node->isExpired()) {
+            ne.sendPing(node, nullptr, nullptr);
+            return true;
+        }
+    }
+    return false;
+}
+
+unsigned
+Bucket::refresh(net::NetworkEngine& ne, time_point now, unsigned max)
+{
+    unsigned sent {0};
+    size_t live {0};
+    for (const auto& n : nodes) {
+        if (n->isExpired())
+            continue;
+        live++;
+        if (sent < max and not n->isGood(now) and not n->isPendingMessage()) {
+            ne.sendPing(n, nullptr, nullptr);
+            sent++;
+        }
+    }
+    /* Candidates replying take free or expired slots */
+    for (auto slots = TARGET_NODES - std::min<size_t>(live, TARGET_NODES); slots and sent < max; slots--) {
+        if (not sendCachedPing(ne))
+            break;
+        sent++;
+    }
+    return sent;
 }
 
 InfoHash
@@ -106,63 +169,127 @@ RoutingTable::depth(const RoutingTable::const_iterator& it) const
     return std::max(bit1, bit2)+1;
 }
 
+constexpr std::chrono::seconds RoutingTable::PACKED_NODES_TTL;
+constexpr size_t RoutingTable::PACKED_NODES_CACHE_SIZE;
+
 std::vector<Sp<Node>>
 RoutingTable::findClosestNodes(const InfoHash id, time_point now, size_t count) const
+{
+    uint64_t generation;
+    unsigned buckets;
+    return findClosestNodes(id, now, count, generation, buckets);
+}
+
+std::vector<Sp<Node>>
+RoutingTable::findClosestNodes(const InfoHash& id, time_point now, size_t count, uint64_t& generation, unsigned& buckets) const
 {
     std::vector<Sp<Node>> nodes;
-    nodes.reserve(count);
+    generation = 0;
+    buckets = 0;
     auto bucket = findBucket(id);
 
     if (bucket == end()) { return nodes; }
 
-    auto sortedBucketInsert = [&](const Bucket &b) {
-        for (auto n : b.nodes) {
-            if (not n->isGood(now))
-                continue;
-
-            auto here = std::find_if(nodes.begin(), nodes.end(),
-                [&id,&n](Sp<Node> &node) {
-                    return id.xorCmp(n->id, node->id) < 0;
-                }
-            );
-            nodes.insert(here, n);
-        }
+    // Candidates are kept by reference, without copying shared pointers,
+    // their ids gathered contiguously for the batched distance kernel.
+    thread_local std::vector<const Sp<Node>*> found;
+    thread_local std::vector<InfoHash> ids;
+    thread_local std::vector<unsigned> closest;
+    found.clear();
+    ids.clear();
+    auto bucketInsert = [&](const Bucket &b) {
+        generation = std::max(generation, b.generation);
+        buckets++;
+        for (const auto& n : b.nodes)
+            if (n->isGood(now)) {
+                found.emplace_back(&n);
+                ids.emplace_back(n->id);
+            }
     };
 
     auto itn = bucket;
     auto itp = (bucket == begin()) ? end() : std::prev(bucket);
-    while (nodes.size() < count && (itn != end() || itp != end())) {
+    while (found.size() < count && (itn != end() || itp != end())) {
         if (itn != end()) {
-            sortedBucketInsert(*itn);
+            bucketInsert(*itn);
             itn = std::next(itn);
         }
         if (itp != end()) {
-            sortedBucketInsert(*itp);
+            bucketInsert(*itp);
             itp = (itp == begin()) ? end() : std::prev(itp);
         }
     }
 
-    // shrink to the count closest nodes.
-    if (nodes.size() > count) {
-        nodes.resize(count);
-    }
+    // keep the count closest nodes.
+    closestIds(id, ids.data(), ids.size(), count, closest);
+    nodes.reserve(closest.size());
+    for (auto i : closest)
+        nodes.emplace_back(*found[i]);
     return nodes;
 }
 
+uint64_t
+RoutingTable::generationOf(const InfoHash& id, unsigned n) const
+{
+    uint64_t generation = 0;
+    auto bucket = findBucket(id);
+    if (bucket == end())
+        return generation;
+
+    // Same walk as findClosestNodes. A change in any of the first n buckets,
+    // or a split among them, brings a stamp higher than all previous ones.
+    auto itn = bucket;
+    auto itp = (bucket == begin()) ? end() : std::prev(bucket);
+    while (n && (itn != end() || itp != end())) {
+        if (itn != end()) {
+            generation = std::max(generation, itn->generation);
+            itn = std::next(itn);
+            n--;
+        }
+        if (n && itp != end()) {
+            generation = std::max(generation, itp->generation);
+            itp = (itp == begin()) ? end() : std::prev(itp);
+            n--;
+        }
+    }
+    return generation;
+}
+
+Sp<const Blob>
+RoutingTable::findClosestNodesPacked(const InfoHash& id, time_point now)
+{
+    if (empty())
+        return std::make_shared<Blob>();
+    if (packed_nodes.empty())
+        packed_nodes.resize(PACKED_NODES_CACHE_SIZE);
+
+    uint64_t prefix;
+    std::memcpy(&prefix, id.data(), sizeof(prefix));
+    auto& entry = packed_nodes[prefix % PACKED_NODES_CACHE_SIZE];
+    if (entry.nodes and entry.id == id and now < entry.time + PACKED_NODES_TTL
+     and generationOf(id, entry.buckets) == entry.generation)
+        return entry.nodes;
+
+    auto nodes = findClosestNodes(id, now, TARGET_NODES, entry.generation, entry.buckets);
+    // Reuse the buffer unless a reply still holds it
+    if (not entry.nodes or entry.nodes.use_count() > 1)
+        entry.nodes = std::make_shared<Blob>();
+    net::NetworkEngine::packNodes(front().af, id, nodes, *entry.nodes);
+    entry.id = id;
+    entry.time = now;
+    return entry.nodes;
+}
+
 RoutingTable::iterator
 RoutingTable::findBucket(const InfoHash& id)
 {
     if (empty())
         return end();
-    auto b = begin();
-    while (true) {
-        auto next = std::next(b);
-        if (next == end())
-            return b;
-        if (InfoHash::cmp(id, next->first) < 0)
-            return b;
-        b = next;
-    }
+    // the last bucket starting at or before id
+    auto b = std::upper_bound(begin(), end(), id, [](const InfoHash& id, const Bucket& b) {
+        return InfoHash::cmp(id, b.first) < 0;
+    });
+    return b == begin() ? b : std::prev(b);
 }
 
 RoutingTable::const_iterator
@@ -184,23 +311,34 @@ RoutingTable::split(const RoutingTable::iterator& b)
         return false;
     }
 
-    // Insert new bucket
-    insert(std::next(b), Bucket {b->af, new_id, b->time});
-
-    // Re-assign nodes
-    std::list<Sp<Node>> nodes {};
-    nodes.splice(nodes.begin(), b->nodes);
-    while (!nodes.empty()) {
-        auto n = nodes.begin();
-        auto b = findBucket((*n)->id);
-        if (b == end())
-            nodes.erase(n);
-        else
-            b->nodes.splice(b->nodes.begin(), nodes, n);
-    }
+    // Insert new bucket, invalidating b
+    auto nb = insert(std::next(b), Bucket {b->af, new_id, b->time});
+    auto ob = std::prev(nb);
+    touch(*ob);
+    touch(*nb);
+
+    // Move nodes and candidates of the upper half to the new bucket
+    auto moveUpper = [&](std::vector<Sp<Node>>& from, std::vector<Sp<Node>>& to) {
+        auto upper = std::stable_partition(from.begin(), from.end(), [&](const Sp<Node>& n) {
+            return InfoHash::cmp(n->id, new_id) < 0;
+        });
+        to.assign(std::make_move_iterator(upper), std::make_move_iterator(from.end()));
+        from.erase(upper, from.end());
+    };
+    moveUpper(ob->nodes, nb->nodes);
+    moveUpper(ob->cache, nb->cache);
     return true;
 }
 
+/* Forget a replacement candidate that made it into the bucket */
+static void
+uncache(Bucket& b, const Sp<Node>& node)
+{
+    auto it = std::find(b.cache.begin(), b.cache.end(), node);
+    if (it != b.cache.end())
+        b.cache.erase(it);
+}
+
 bool
 RoutingTable::onNewNode(const Sp<Node>& node, int confirm, const time_point& now, const InfoHash& myid, net::NetworkEngine& ne) {
     auto b = findBucket(node->id);
@@ -225,6 +363,8 @@ RoutingTable::onNewNode(const Sp<Node>& node, int confirm, const time_point& now
         for (auto& n : b->nodes)
             if (n->isExpired()) {
                 n = node;
+                touch(*b);
+                uncache(*b, node);
                 return true;
             }
         /* Bucket full.  Ping a dubious node */
@@ -252,11 +392,12 @@ RoutingTable::onNewNode(const Sp<Node>& node, int confirm, const time_point& now
         }
 
         /* No space for this node.  Cache it away for later. */
-        if (confirm or not b->cached)
-            b->cached = node;
+        b->cacheNode(node, now);
     } else {
         /* Create a new node. */
-        b->nodes.emplace_front(node);
+        b->nodes.emplace(b->nodes.begin(), node);
+        touch(*b);
+        uncache(*b, node);
     }
     return true;
 }
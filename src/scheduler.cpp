@@ -0,0 +1,346 @@
+/*
+ *  Copyright (C) 2019 Savoir-faire Linux Inc.
+ *  Author : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "scheduler.h"
+
+#include <array>
+#include <vector>
+#include <algorithm>
+#include <ciso646> // fix windows compiler bug
+
+namespace dht {
+
+namespace {
+
+inline unsigned
+highestBit(uint64_t v)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - __builtin_clzll(v);
+#else
+    unsigned r = 0;
+    while (v >>= 1) r++;
+    return r;
+#endif
+}
+
+inline unsigned
+lowestBit(uint64_t v)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(v);
+#else
+    unsigned r = 0;
+    while (not (v & 1)) { v >>= 1; r++; }
+    return r;
+#endif
+}
+
+}
+
+/**
+ * Hierarchical timing wheel.
+ *
+ * Time is counted in ticks since the wheel creation. Each level has 64
+ * slots, one digit of the tick in base 64: a job goes to the level of the
+ * highest digit by which its tick differs from the current tick, so that
+ * insertion and removal are O(1). When the current tick reaches the start
+ * of an occupied slot of an upper level, its jobs are moved down (cascade).
+ * Occupied slots are tracked in one bitmap per level, which lets the wheel
+ * jump directly over empty ticks.
+ */
+class Scheduler::TimerWheel {
+public:
+    static constexpr unsigned SLOT_BITS {6};
+    static constexpr size_t SLOTS {1 << SLOT_BITS};
+    /* enough levels to address any 64 bits tick */
+    static constexpr unsigned LEVELS {(64 + SLOT_BITS - 1) / SLOT_BITS};
+    /* list of due jobs, run by run() */
+    static constexpr size_t READY {LEVELS * SLOTS};
+    static constexpr std::chrono::milliseconds TICK {1};
+
+    TimerWheel(const time_point& now) : epoch_(now) {
+        heads_.fill(nullptr);
+        tails_.fill(nullptr);
+        occupied_.fill(0);
+    }
+
+    ~TimerWheel() {
+        // Jobs may cancel other jobs when released: detach everything first.
+        std::vector<Sp<Job>> jobs;
+        jobs.reserve(size_);
+        for (auto head : heads_)
+            for (auto job = head; job;) {
+                auto next = job->next_;
+                job->wheel_ = nullptr;
+                job->prev_ = job->next_ = nullptr;
+                jobs.emplace_back(std::move(job->self_));
+                job = next;
+            }
+    }
+
+    size_t size() const { return size_; }
+
+    void insert(const Sp<Job>& job, const time_point& t) {
+        job->time_ = t;
+        job->self_ = job;
+        job->wheel_ = this;
+        place(*job);
+        size_++;
+    }
+
+    /** Unlink the job, returning the reference held by the wheel. */
+    Sp<Job> remove(Job& job) {
+        unlink(job);
+        job.wheel_ = nullptr;
+        size_--;
+        return std::move(job.self_);
+    }
+
+    void run(const time_point& now) {
+        auto target = std::max(tick(now), cur_);
+        for (;;) {
+            advance(target, now);
+            if (not heads_[READY])
+                break;
+            // Jobs added for now or earlier while running go to the
+            // current slot and are picked up by the next advance.
+            while (auto j = heads_[READY]) {
+                auto job = remove(*j);
+                if (job->do_)
+                    job->do_();
+            }
+        }
+    }
+
+    time_point next() const {
+        if (heads_[READY])
+            return epoch_;
+        for (unsigned l = 0; l < LEVELS; l++) {
+            if (not occupied_[l])
+                continue;
+            auto slot = lowestBit(occupied_[l]);
+            if (l == 0) {
+                // Exact time of the earliest job of the slot
+                auto t = time_point::max();
+                for (auto job = heads_[slot]; job; job = job->next_)
+                    t = std::min(t, job->time_);
+                return t;
+            }
+            return toTime(slotStart(l, slot));
+        }
+        return time_point::max();
+    }
+
+private:
+    uint64_t tick(const time_point& t) const {
+        if (t <= epoch_)
+            return 0;
+        return std::chrono::duration_cast<std::chrono::milliseconds>(t - epoch_).count() / TICK.count();
+    }
+
+    time_point toTime(uint64_t t) const {
+        auto max_ticks = (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(time_point::max() - epoch_).count() / TICK.count();
+        return t >= max_ticks ? time_point::max() : epoch_ + (int64_t)t * TICK;
+    }
+
+    /** First tick of slot of level l, relative to the current tick */
+    uint64_t slotStart(unsigned l, uint64_t slot) const {
+        auto shift = SLOT_BITS * (l + 1);
+        uint64_t base = shift >= 64 ? 0 : (cur_ >> shift) << shift;
+        return base | (slot << (SLOT_BITS * l));
+    }
+
+    void place(Job& job) {
+        auto t = std::max(tick(job.time_), cur_);
+        auto diff = t ^ cur_;
+        unsigned l = diff ? highestBit(diff) / SLOT_BITS : 0;
+        link(job, l * SLOTS + ((t >> (SLOT_BITS * l)) & (SLOTS - 1)));
+    }
+
+    void link(Job& job, size_t slot) {
+        job.slot_ = slot;
+        job.next_ = nullptr;
+        job.prev_ = tails_[slot];
+        if (tails_[slot])
+            tails_[slot]->next_ = &job;
+        else
+            heads_[slot] = &job;
+        tails_[slot] = &job;
+        if (slot != READY)
+            occupied_[slot / SLOTS] |= 1ull << (slot % SLOTS);
+    }
+
+    void unlink(Job& job) {
+        auto slot = job.slot_;
+        if (job.prev_)
+            job.prev_->next_ = job.next_;
+        else
+            heads_[slot] = job.next_;
+        if (job.next_)
+            job.next_->prev_ = job.prev_;
+        else
+            tails_[slot] = job.prev_;
+        job.prev_ = job.next_ = nullptr;
+        if (not heads_[slot] and slot != READY)
+            occupied_[slot / SLOTS] &= ~(1ull << (slot % SLOTS));
+    }
+
+    /** Move the jobs of upper levels reaching the current tick down. */
+    void cascade() {
+        for (unsigned l = LEVELS - 1; l > 0; l--) {
+            auto slot = (cur_ >> (SLOT_BITS * l)) & (SLOTS - 1);
+            if (not (occupied_[l] & (1ull << slot)))
+                continue;
+            auto job = heads_[l * SLOTS + slot];
+            heads_[l * SLOTS + slot] = tails_[l * SLOTS + slot] = nullptr;
+            occupied_[l] &= ~(1ull << slot);
+            while (job) {
+                auto next = job->next_;
+                place(*job);
+                job = next;
+            }
+        }
+    }
+
+    /** Advance up to target, moving due jobs to the ready list. */
+    void advance(uint64_t target, const time_point& now) {
+        for (;;) {
+            auto slot = cur_ & (SLOTS - 1);
+            for (auto job = heads_[slot]; job;) {
+                auto next = job->next_;
+                if (cur_ < target or job->time_ <= now) {
+                    unlink(*job);
+                    link(*job, READY);
+                }
+                job = next;
+            }
+            if (cur_ >= target)
+                break;
+            // Jump to the next occupied slot, or to the target.
+            auto next = target;
+            for (unsigned l = 0; l < LEVELS; l++) {
+                if (occupied_[l]) {
+                    next = std::min(next, slotStart(l, lowestBit(occupied_[l])));
+                    break;
+                }
+            }
+            cur_ = next;
+            cascade();
+        }
+    }
+
+    const time_point epoch_;
+    uint64_t cur_ {0};
+    size_t size_ {0};
+    std::array<Job*, READY + 1> heads_;
+    std::array<Job*, READY + 1> tails_;
+    std::array<uint64_t, LEVELS> occupied_;
+};
+
+constexpr unsigned Scheduler::TimerWheel::SLOT_BITS;
+constexpr size_t Scheduler::TimerWheel::SLOTS;
+constexpr unsigned Scheduler::TimerWheel::LEVELS;
+constexpr size_t Scheduler::TimerWheel::READY;
+constexpr std::chrono::milliseconds Scheduler::TimerWheel::TICK;
+
+void
+Scheduler::Job::cancel()
+{
+    do_ = {};
+    if (wheel_)
+        wheel_->remove(*this);
+}
+
+Scheduler::Scheduler(Backend backend)
+{
+    if (backend == Backend::Wheel)
+        wheel_.reset(new TimerWheel(now));
+}
+
+Scheduler::~Scheduler() = default;
+
+void
+Scheduler::add(const Sp<Scheduler::Job>& job, time_point t)
+{
+    if (wheel_) {
+        if (job->wheel_)
+            job->wheel_->remove(*job);
+        if (t != time_point::max())
+            wheel_->insert(job, t);
+        return;
+    }
+    // Entries are found by the time the job was last added for.
+    auto range = timers.equal_range(job->time_);
+    for (auto it = range.first; it != range.second; ++it)
+        if (it->second == job) {
+            timers.erase(it);
+            break;
+        }
+    job->time_ = t;
+    if (t != time_point::max())
+        timers.emplace(std::move(t), job);
+}
+
+void
+Scheduler::edit(Sp<Scheduler::Job>& job, time_point t)
+{
+    if (not job) {
+        return;
+    }
+    // Move the job itself, with both backends: references to the job
+    // stay valid, and no stale entry is left behind.
+    add(job, t);
+}
+
+time_point
+Scheduler::run()
+{
+    syncTime();
+    if (wheel_) {
+        wheel_->run(now);
+        return getNextJobTime();
+    }
+    while (not timers.empty()) {
+        auto timer = timers.begin();
+        /*
+         * Running jobs scheduled before "now" prevents run+rescheduling
+         * loops before this method ends. It is garanteed by the fact that a
+         * job will at least be scheduled for "now" and not before.
+         */
+        if (timer->first > now)
+            break;
+
+        auto job = std::move(timer->second);
+        timers.erase(timer);
+
+        if (job->do_)
+            job->do_();
+    }
+    return getNextJobTime();
+}
+
+time_point
+Scheduler::getNextJobTime() const
+{
+    if (wheel_)
+        return wheel_->next();
+    return timers.empty() ? time_point::max() : timers.begin()->first;
+}
+
+}
@@ -377,6 +377,7 @@ struct Dht::Search {
     bool expired {false};              /* no node, or all nodes expired */
     bool done {false};                 /* search is over, cached for later */
     std::vector<SearchNode> nodes {};
+    LookupOptions lookup {};           /* set by the last get or listen providing options */
 
     /* pending puts */
     std::vector<Announce> announce {};
@@ -431,6 +432,33 @@ struct Dht::Search {
         return count;
     }
 
+    /**
+     * Can another 'get' request be sent now ?
+     *
+     * Requests which timed out once are still pending, but stalled: with
+     * alpha set, each of them allows another request, up to max_alpha.
+     */
+    bool canSolicit() const {
+        if (not lookup.alpha)
+            return currentlySolicitedNodeCount() < MAX_REQUESTED_SEARCH_NODES;
+        unsigned pending = 0, stalled = 0;
+        for (const auto& n : nodes) {
+            if (not n.node or n.node->isExpired() or not n.pendingGet())
+                continue;
+            pending++;
+            if (n.candidate)
+                stalled++;
+        }
+        return pending < std::min(lookup.alpha + stalled, lookup.maxRequests());
+    }
+
+    /**
+     * Are requests only sent to the TARGET_NODES closest good nodes ?
+     */
+    bool closestOnly() const {
+        return lookup.alpha and lookup.early_termination;
+    }
+
     /**
      * Can we use this search to announce ?
      */
@@ -0,0 +1,300 @@
+/*
+ *  Copyright (C) 2019 Savoir-faire Linux Inc.
+ *  Author(s) : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "sharded_dhtrunner.h"
+
+#include "network_engine.h"
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+namespace dht {
+
+/* Index of the shard owning key, by its first byte */
+static size_t
+shardIndex(const InfoHash& key, size_t shards)
+{
+    return (key[0] * shards) / 256;
+}
+
+/**
+ * Sockets of the shards, so that packets received by a shard can be handed
+ * to another one. Receive threads route with a snapshot of the list,
+ * replaced as a whole when a shard comes or goes, without locking.
+ */
+class ShardSocket;
+struct ShardRouter {
+    using Shards = std::vector<ShardSocket*>;
+
+    ShardRouter(size_t count) : shards(std::make_shared<Shards>(count, nullptr)) {}
+
+    std::shared_ptr<const Shards> get() const {
+        return std::atomic_load(&shards);
+    }
+
+    /* Sets the socket of a shard, from 1, and returns the previous snapshot */
+    std::shared_ptr<const Shards> set(uint8_t shard, ShardSocket* sock) {
+        std::lock_guard<std::mutex> lk(lock);
+        auto old = get();
+        auto s = std::make_shared<Shards>(*old);
+        (*s)[shard - 1] = sock;
+        std::atomic_store(&shards, std::shared_ptr<const Shards>(std::move(s)));
+        return old;
+    }
+private:
+    /* serializes set() */
+    std::mutex lock;
+    std::shared_ptr<const Shards> shards;
+};
+
+/**
+ * Sends and receives on the port shared by all shards. The kernel balances
+ * packets by source address, but all shards answer on the same address,
+ * with the same node id:
+ * - replies to requests sent by a shard are routed to the shard tagging
+ *   the transaction id they carry (see NetworkEngine::getShard),
+ * - requests are routed to the shard owning their target (see
+ *   NetworkEngine::getTarget), the one storing the values of that key.
+ *   Pings are handled by any shard.
+ */
+class ShardSocket : public net::DatagramSocket {
+public:
+    ShardSocket(const SockAddr& bind4, const SockAddr& bind6, const Logger& l, unsigned rxBatch,
+                std::shared_ptr<ShardRouter> router, uint8_t shard)
+        : router_(std::move(router)), shared(bind4, bind6, l, rxBatch, true), shard_(shard)
+    {
+        router_->set(shard_, this);
+        shared.setOnReceive([this](net::PacketList&& packets) {
+            route(std::move(packets));
+        });
+        packet_pool = shared.getPacketPool();
+    }
+
+    ~ShardSocket() {
+        // Wait for the receive threads still routing with a snapshot
+        // including this socket
+        auto old = router_->set(shard_, nullptr);
+        while (old.use_count() > 1)
+            std::this_thread::yield();
+        shared.stop();
+    }
+
+    int sendTo(const SockAddr& dest, const uint8_t* data, size_t size, bool replied) override {
+        return shared.sendTo(dest, data, size, replied);
+    }
+    size_t sendBatch(const std::vector<net::OutgoingPacket>& packets) override {
+        return shared.sendBatch(packets);
+    }
+
+    const SockAddr& getBound(sa_family_t family = AF_UNSPEC) const override {
+        return shared.getBound(family);
+    }
+    bool hasIPv4() const override { return shared.hasIPv4(); }
+    bool hasIPv6() const override { return shared.hasIPv6(); }
+
+    void stop() override {
+        shared.stop();
+    }
+private:
+    void route(net::PacketList&& packets) {
+        auto shards = router_->get();
+        for (auto it = packets.begin(); it != packets.end();) {
+            auto next = std::next(it);
+            auto shard = net::NetworkEngine::getShard(it->data.data(), it->data.size());
+            InfoHash target;
+            if (not shard and net::NetworkEngine::getTarget(it->data.data(), it->data.size(), target))
+                shard = (uint8_t)(shardIndex(target, shards->size()) + 1);
+            if (shard and shard != shard_ and shard <= shards->size() and (*shards)[shard - 1]) {
+                net::PacketList p;
+                p.splice(p.end(), packets, it);
+                (*shards)[shard - 1]->onReceived(std::move(p));
+            }
+            it = next;
+        }
+        if (not packets.empty())
+            onReceived(std::move(packets));
+    }
+
+    // Destroyed after shared, which joins the receive thread using it
+    std::shared_ptr<ShardRouter> router_;
+    net::UdpSocket shared;
+    uint8_t shard_;
+};
+
+ShardedDhtRunner::~ShardedDhtRunner()
+{
+    join();
+}
+
+void
+ShardedDhtRunner::run(in_port_t port, const DhtRunner::Config& config, unsigned shards, std::shared_ptr<Logger> logger)
+{
+    SockAddr sin4;
+    sin4.setFamily(AF_INET);
+    sin4.setPort(port);
+    SockAddr sin6;
+    sin6.setFamily(AF_INET6);
+    sin6.setPort(port);
+    run(sin4, sin6, config, shards, std::move(logger));
+}
+
+void
+ShardedDhtRunner::run(const SockAddr& local4, const SockAddr& local6, const DhtRunner::Config& config, unsigned shards, std::shared_ptr<Logger> logger)
+{
+    if (not shards_.empty())
+        return;
+    if (shards == 0)
+        shards = std::max(std::thread::hardware_concurrency(), 1u);
+    // Shards are numbered by a byte of the transaction ids
+    shards = std::min(shards, 255u);
+
+    // Peers match replies by node id and transaction id: all shards answer
+    // from the same address, so they share the node id.
+    const auto& baseId = config.dht_config.node_config.node_id;
+    const auto id = baseId ? baseId : InfoHash::getRandom();
+
+    auto router = std::make_shared<ShardRouter>(shards);
+    SockAddr bind4 = local4, bind6 = local6;
+    for (unsigned i = 0; i < shards; i++) {
+        auto shardConfig = config;
+        shardConfig.threaded = true;
+        shardConfig.dht_config.node_config.node_id = id;
+        shardConfig.dht_config.node_config.shard = i + 1;
+
+        DhtRunner::Context context;
+        context.logger = logger;
+        context.sock.reset(new ShardSocket(bind4, bind6, logger ? *logger : Logger{}, config.rx_batch, router, i + 1));
+        // Other shards bind the port chosen by the first one
+        if (i == 0) {
+            if (bind4) bind4.setPort(context.sock->getPort(AF_INET));
+            if (bind6) bind6.setPort(context.sock->getPort(AF_INET6));
+        }
+
+        auto runner = std::unique_ptr<DhtRunner>(new DhtRunner);
+        runner->run(shardConfig, std::move(context));
+        shards_.emplace_back(std::move(runner));
+    }
+}
+
+void
+ShardedDhtRunner::bootstrap(const std::string& host, const std::string& service)
+{
+    for (auto& shard : shards_)
+        shard->bootstrap(host, service);
+}
+
+void
+ShardedDhtRunner::bootstrap(const SockAddr& addr, DoneCallbackSimple&& cb)
+{
+    if (shards_.empty()) {
+        if (cb) cb(false);
+        return;
+    }
+    // Done when all shards are done, successful if any shard succeeded
+    auto remaining = std::make_shared<std::atomic_uint>(shards_.size());
+    auto success = std::make_shared<std::atomic_bool>(false);
+    auto done = std::make_shared<DoneCallbackSimple>(std::move(cb));
+    for (auto& shard : shards_)
+        shard->bootstrap(addr, [remaining, success, done](bool ok) {
+            if (ok)
+                *success = true;
+            if (--*remaining == 0 and *done)
+                (*done)(*success);
+        });
+}
+
+DhtRunner&
+ShardedDhtRunner::getShard(const InfoHash& key)
+{
+    if (shards_.empty())
+        throw DhtException("ShardedDhtRunner is not running");
+    return *shards_[shardIndex(key, shards_.size())];
+}
+
+SockAddr
+ShardedDhtRunner::getBound(sa_family_t f) const
+{
+    return shards_.empty() ? SockAddr() : shards_.front()->getBound(f);
+}
+
+NodeStats
+ShardedDhtRunner::getNodesStats(sa_family_t af) const
+{
+    NodeStats stats {};
+    for (const auto& shard : shards_) {
+        auto s = shard->getNodesStats(af);
+        stats.good_nodes += s.good_nodes;
+        stats.dubious_nodes += s.dubious_nodes;
+        stats.cached_nodes += s.cached_nodes;
+        stats.incoming_nodes += s.incoming_nodes;
+        stats.table_depth = std::max(stats.table_depth, s.table_depth);
+        stats.tx_queue += s.tx_queue;
+        stats.tx_queue_peak = std::max(stats.tx_queue_peak, s.tx_queue_peak);
+        if (s.rtt_nodes) {
+            // Quantiles of the union are approximated by the average of
+            // the shard quantiles, weighted by node count.
+            auto weighted = [&](unsigned a, unsigned b) {
+                return static_cast<unsigned>((uint64_t(a) * stats.rtt_nodes + uint64_t(b) * s.rtt_nodes)
+                                             / (stats.rtt_nodes + s.rtt_nodes));
+            };
+            stats.rtt_min = stats.rtt_nodes ? std::min(stats.rtt_min, s.rtt_min) : s.rtt_min;
+            stats.rtt_max = std::max(stats.rtt_max, s.rtt_max);
+            stats.rtt_median = weighted(stats.rtt_median, s.rtt_median);
+            stats.rtt_p90 = weighted(stats.rtt_p90, s.rtt_p90);
+            stats.rttvar_median = weighted(stats.rttvar_median, s.rttvar_median);
+            stats.rtt_nodes += s.rtt_nodes;
+        }
+    }
+    return stats;
+}
+
+TrafficStats
+ShardedDhtRunner::getTrafficStats() const
+{
+    TrafficStats stats {};
+    for (const auto& shard : shards_)
+        stats.add(shard->getTrafficStats());
+    return stats;
+}
+
+void
+ShardedDhtRunner::shutdown(ShutdownCallback cb)
+{
+    if (shards_.empty()) {
+        if (cb) cb();
+        return;
+    }
+    auto remaining = std::make_shared<std::atomic_uint>(shards_.size());
+    auto done = std::make_shared<ShutdownCallback>(std::move(cb));
+    for (auto& shard : shards_)
+        shard->shutdown([remaining, done] {
+            if (--*remaining == 0 and *done)
+                (*done)();
+        });
+}
+
+void
+ShardedDhtRunner::join()
+{
+    for (auto& shard : shards_)
+        shard->join();
+    shards_.clear();
+}
+
+}
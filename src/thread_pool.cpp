@@ -21,12 +21,20 @@
 
 #include <atomic>
 #include <thread>
+#include <algorithm>
 #include <iostream>
 #include <ciso646> // fix windows compiler bug
 
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 namespace dht {
 
 constexpr const size_t IO_THREADS_MAX {64};
+/** Max number of tasks taken from another worker at once */
+constexpr const size_t STEAL_BATCH_MAX {32};
 
 struct ThreadPool::ThreadState
 {
@@ -34,10 +42,20 @@ struct ThreadPool::ThreadState
     std::atomic_bool run {true};
 };
 
+struct ThreadPool::Worker
+{
+    std::thread thread {};
+    std::mutex lock {};
+    detail::TaskQueue tasks {};
+};
+
+/** Work-stealing pool and worker index of the current thread, if any */
+static thread_local std::pair<const ThreadPool*, unsigned> currentWorker {nullptr, 0};
+
 ThreadPool&
 ThreadPool::computation()
 {
-    static ThreadPool pool;
+    static ThreadPool pool(std::max<size_t>(std::thread::hardware_concurrency(), 4), Mode::WorkStealing);
     return pool;
 }
 
@@ -49,11 +67,23 @@ ThreadPool::io()
 }
 
 
-ThreadPool::ThreadPool(size_t maxThreads) : maxThreads_(maxThreads)
+ThreadPool::ThreadPool(size_t maxThreads, Mode mode, bool pinThreads)
+ : maxThreads_(std::max<size_t>(maxThreads, 1)), mode_(mode)
 {
-    threads_.reserve(maxThreads_);
+    if (mode_ == Mode::Shared) {
+        threads_.reserve(maxThreads_);
+        return;
+    }
+    workers_.reserve(maxThreads_);
+    for (unsigned i=0; i<maxThreads_; i++)
+        workers_.emplace_back(new Worker);
+    for (unsigned i=0; i<maxThreads_; i++)
+        workers_[i]->thread = std::thread(&ThreadPool::work, this, i, pinThreads);
 }
 
+ThreadPool::ThreadPool(size_t maxThreads) : ThreadPool(maxThreads, Mode::Shared)
+{}
+
 ThreadPool::ThreadPool()
  : ThreadPool(std::max<size_t>(std::thread::hardware_concurrency(), 4))
 {}
@@ -64,8 +94,15 @@ ThreadPool::~ThreadPool()
 }
 
 void
-ThreadPool::run(std::function<void()>&& cb)
+ThreadPool::run(Task&& cb)
 {
+    if (mode_ == Mode::WorkStealing) {
+        if (not running_) return;
+        push(pickWorker(), std::move(cb));
+        wakeWorkers(1);
+        return;
+    }
+
     std::unique_lock<std::mutex> l(lock_);
     if (not running_) return;
 
@@ -75,7 +112,7 @@ ThreadPool::run(std::function<void()>&& cb)
         auto& t = *threads_.back();
         t.thread = std::thread([&]() {
             while (t.run) {
-                std::function<void()> task;
+                Task task;
 
                 // pick task from queue
                 {
@@ -87,8 +124,7 @@ ThreadPool::run(std::function<void()>&& cb)
                     readyThreads_--;
                     if (not t.run)
                         break;
-                    task = std::move(tasks_.front());
-                    tasks_.pop();
+                    task = tasks_.pop_front();
                 }
 
                 // run task
@@ -104,13 +140,148 @@ ThreadPool::run(std::function<void()>&& cb)
     }
 
     // push task to queue
-    tasks_.emplace(std::move(cb));
+    tasks_.push_back(std::move(cb));
 
     // notify thread
     l.unlock();
     cv_.notify_one();
 }
 
+void
+ThreadPool::run(std::vector<Task>&& tasks)
+{
+    if (mode_ == Mode::Shared) {
+        for (auto& task : tasks)
+            run(std::move(task));
+        return;
+    }
+    if (not running_ or tasks.empty()) return;
+
+    // Spread tasks over workers, starting with the current one
+    auto n = workers_.size();
+    auto first = currentWorker.first == this ? currentWorker.second : nextWorker_++;
+    auto share = (tasks.size() + n - 1) / n;
+    auto task = tasks.begin();
+    for (unsigned i = 0; task != tasks.end(); i++) {
+        auto& w = *workers_[(first + i) % n];
+        std::lock_guard<std::mutex> l(w.lock);
+        for (size_t j = 0; j < share and task != tasks.end(); j++, task++)
+            w.tasks.push_back(std::move(*task));
+    }
+    pending_ += tasks.size();
+    wakeWorkers(tasks.size());
+}
+
+ThreadPool::Worker&
+ThreadPool::pickWorker()
+{
+    // Tasks queued from a worker stay local
+    if (currentWorker.first == this)
+        return *workers_[currentWorker.second];
+    return *workers_[nextWorker_++ % workers_.size()];
+}
+
+void
+ThreadPool::push(Worker& w, Task&& task)
+{
+    {
+        std::lock_guard<std::mutex> l(w.lock);
+        w.tasks.push_back(std::move(task));
+    }
+    pending_++;
+}
+
+void
+ThreadPool::wakeWorkers(size_t n)
+{
+    // pending_ was increased before: a worker going to sleep either
+    // sees it, or is counted in sleeping_ and waits on cv_.
+    if (not sleeping_)
+        return;
+    {
+        std::lock_guard<std::mutex> l(lock_);
+    }
+    if (n == 1)
+        cv_.notify_one();
+    else
+        cv_.notify_all();
+}
+
+bool
+ThreadPool::steal(unsigned i, Task& task)
+{
+    auto n = workers_.size();
+    std::vector<Task> stolen;
+    for (unsigned k = 1; k < n; k++) {
+        auto& victim = *workers_[(i + k) % n];
+        {
+            // The owner works from the front, steal from the back
+            std::lock_guard<std::mutex> l(victim.lock);
+            if (victim.tasks.empty())
+                continue;
+            auto count = std::min(STEAL_BATCH_MAX, (victim.tasks.size() + 1) / 2);
+            task = victim.tasks.pop_back();
+            for (size_t j = 1; j < count; j++)
+                stolen.emplace_back(victim.tasks.pop_back());
+        }
+        if (not stolen.empty()) {
+            auto& w = *workers_[i];
+            std::lock_guard<std::mutex> l(w.lock);
+            for (auto it = stolen.rbegin(); it != stolen.rend(); ++it)
+                w.tasks.push_back(std::move(*it));
+        }
+        return true;
+    }
+    return false;
+}
+
+void
+ThreadPool::work(unsigned i, bool pin)
+{
+    currentWorker = {this, i};
+#ifdef __linux__
+    if (pin) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(i % std::max(std::thread::hardware_concurrency(), 1u), &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+            std::cerr << "Can't set affinity of worker " << i << std::endl;
+    }
+#else
+    (void) pin;
+#endif
+    auto& w = *workers_[i];
+    Task task;
+    while (running_) {
+        bool found = false;
+        {
+            std::lock_guard<std::mutex> l(w.lock);
+            if (not w.tasks.empty()) {
+                task = w.tasks.pop_front();
+                found = true;
+            }
+        }
+        if (found or steal(i, task)) {
+            pending_--;
+            try {
+                if (task)
+                    task();
+            } catch (const std::exception& e) {
+                std::cerr << "Exception running task: " << e.what() << std::endl;
+            }
+            task = {};
+            continue;
+        }
+
+        std::unique_lock<std::mutex> l(lock_);
+        sleeping_++;
+        cv_.wait(l, [&](){
+            return not running_ or pending_ != 0;
+        });
+        sleeping_--;
+    }
+}
+
 void
 ThreadPool::stop()
 {
@@ -130,46 +301,53 @@ ThreadPool::join()
     for (auto& t : threads_)
         t->thread.join();
     threads_.clear();
+    for (auto& w : workers_)
+        if (w->thread.joinable())
+            w->thread.join();
 }
 
 void
-Executor::run(std::function<void()>&& task)
+Executor::run(Task&& task)
 {
     std::lock_guard<std::mutex> l(lock_);
-    if (current_ < maxConcurrent_) {
-        run_(std::move(task));
-    } else {
-        tasks_.emplace(std::move(task));
-    }
+    tasks_.push_back(std::move(task));
+    schedule();
 }
 
 void
-Executor::run_(std::function<void()>&& task)
+Executor::schedule()
 {
+    if (tasks_.size() <= pending_ or current_ >= maxConcurrent_)
+        return;
     current_++;
-    std::weak_ptr<Executor> w = shared_from_this();
-    threadPool_.get().run([w,task] {
-        try {
-            task();
-        } catch (const std::exception& e) {
-            std::cerr << "Exception running task: " << e.what() << std::endl;
-        }
-        if (auto sthis = w.lock()) {
-            auto& this_ = *sthis;
-            std::lock_guard<std::mutex> l(this_.lock_);
-            this_.current_--;
-            this_.schedule();
-        }
+    pending_++;
+    // The job only holds a reference to the executor, small enough for
+    // the task to be queued without allocation: it takes the next task
+    // from the executor queue when it runs.
+    threadPool_.get().run([sthis = shared_from_this()] {
+        sthis->runNext();
     });
 }
 
 void
-Executor::schedule()
+Executor::runNext()
 {
-    if (not tasks_.empty() and current_ < maxConcurrent_) {
-        run_(std::move(tasks_.front()));
-        tasks_.pop();
+    Task task;
+    {
+        std::lock_guard<std::mutex> l(lock_);
+        pending_--;
+        task = tasks_.pop_front();
     }
+    try {
+        if (task)
+            task();
+    } catch (const std::exception& e) {
+        std::cerr << "Exception running task: " << e.what() << std::endl;
+    }
+    task = {};
+    std::lock_guard<std::mutex> l(lock_);
+    current_--;
+    schedule();
 }
 
 }
@@ -0,0 +1,163 @@
+/*
+ *  Copyright (C) 2019 Savoir-faire Linux Inc.
+ *
+ *  Author: Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "callbacks.h"
+#include "net.h"
+#include "utils.h"
+
+#include <array>
+#include <atomic>
+
+namespace dht {
+namespace net {
+
+/**
+ * Log-linear (HDR-style) histogram of durations: each power of two of
+ * microseconds is split in SUB_COUNT buckets, for a relative error under
+ * 1/SUB_COUNT. Recording is lock-free and can race with get().
+ */
+class LatencyHistogram {
+public:
+    static constexpr unsigned SUB_BITS {3};
+    static constexpr unsigned SUB_COUNT {1u << SUB_BITS};
+    /* Longer durations, above about 67 s, are counted in the last bucket */
+    static constexpr unsigned MAX_BITS {26};
+    static constexpr size_t BUCKET_COUNT {(MAX_BITS - SUB_BITS + 1) * SUB_COUNT};
+
+    static size_t bucket(uint64_t us) {
+        if (us < SUB_COUNT)
+            return us;
+        unsigned msb = highestBit(us);
+        if (msb >= MAX_BITS)
+            return BUCKET_COUNT - 1;
+        unsigned shift = msb - SUB_BITS;
+        return (shift + 1) * SUB_COUNT + ((us >> shift) - SUB_COUNT);
+    }
+
+    /** Highest duration in us counted by bucket i */
+    static uint64_t bucketMax(size_t i) {
+        if (i < SUB_COUNT)
+            return i;
+        unsigned shift = i / SUB_COUNT - 1;
+        uint64_t low = (uint64_t)(SUB_COUNT + i % SUB_COUNT) << shift;
+        return low + ((uint64_t)1 << shift) - 1;
+    }
+
+    void record(duration d) {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+        uint64_t v = us > 0 ? us : 0;
+        buckets_[bucket(v)].fetch_add(1, std::memory_order_relaxed);
+        auto max = max_.load(std::memory_order_relaxed);
+        while (v > max and not max_.compare_exchange_weak(max, v, std::memory_order_relaxed));
+    }
+
+    void get(MessageTypeStats& stats) const {
+        stats.latency_histogram.clear();
+        for (size_t i = 0; i < BUCKET_COUNT; i++)
+            if (auto n = buckets_[i].load(std::memory_order_relaxed))
+                stats.latency_histogram.emplace(bucketMax(i), n);
+        stats.latency_max = max_.load(std::memory_order_relaxed);
+        stats.updateLatency();
+    }
+
+private:
+    static unsigned highestBit(uint64_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+        return 63 - __builtin_clzll(v);
+#else
+        unsigned r = 0;
+        while (v >>= 1) r++;
+        return r;
+#endif
+    }
+
+    std::array<std::atomic<uint64_t>, BUCKET_COUNT> buckets_ {};
+    std::atomic<uint64_t> max_ {0};
+};
+
+/**
+ * Traffic counters of the network engine, by message type.
+ * Replies and errors are counted with the type of the request they
+ * answer when it is known. Counters are only incremented on the dht
+ * thread, but can be read from any thread.
+ */
+class TrafficCounters {
+public:
+    struct Counters {
+        std::atomic<uint64_t> requests_in {0},
+                              replies_in {0},
+                              errors_in {0},
+                              bytes_in {0};
+        std::atomic<uint64_t> requests_out {0},
+                              retransmits {0},
+                              replies_out {0},
+                              bytes_out {0};
+        std::atomic<uint64_t> rate_limited {0},
+                              timeouts {0};
+        LatencyHistogram latency {};
+    };
+
+    static void add(std::atomic<uint64_t>& counter, uint64_t n = 1) {
+        counter.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    Counters& operator[](MessageType type) {
+        return counters_[static_cast<size_t>(type)];
+    }
+
+    TrafficStats get() const {
+        TrafficStats stats;
+        for (size_t i = 0; i < TYPE_COUNT; i++) {
+            const auto& c = counters_[i];
+            MessageTypeStats st;
+            st.requests_in = c.requests_in.load(std::memory_order_relaxed);
+            st.replies_in = c.replies_in.load(std::memory_order_relaxed);
+            st.errors_in = c.errors_in.load(std::memory_order_relaxed);
+            st.bytes_in = c.bytes_in.load(std::memory_order_relaxed);
+            st.requests_out = c.requests_out.load(std::memory_order_relaxed);
+            st.retransmits = c.retransmits.load(std::memory_order_relaxed);
+            st.replies_out = c.replies_out.load(std::memory_order_relaxed);
+            st.bytes_out = c.bytes_out.load(std::memory_order_relaxed);
+            st.rate_limited = c.rate_limited.load(std::memory_order_relaxed);
+            st.timeouts = c.timeouts.load(std::memory_order_relaxed);
+            c.latency.get(st);
+            if (st.bytes_in or st.bytes_out or st.rate_limited or st.timeouts)
+                stats.messages.emplace(typeName(i), std::move(st));
+        }
+        return stats;
+    }
+
+private:
+    static constexpr size_t TYPE_COUNT {static_cast<size_t>(MessageType::ValueDataRequest) + 1};
+
+    static const char* typeName(size_t i) {
+        static const char* const names[TYPE_COUNT] {
+            "error", "reply", "ping", "find", "get", "put", "refresh", "listen",
+            "value_data", "update", "value_data_request"
+        };
+        return names[i];
+    }
+
+    std::array<Counters, TYPE_COUNT> counters_ {};
+};
+
+}
+}
@@ -26,6 +26,10 @@
 #include "base64.h"
 #endif
 
+#ifdef OPENDHT_COMPRESSION
+#include <zstd.h>
+#endif
+
 
 namespace dht {
 
@@ -103,6 +107,50 @@ Value::size() const
     return cypher.size() + data.size() + signature.size()  + user_type.size();
 }
 
+#ifdef OPENDHT_COMPRESSION
+static constexpr int COMPRESSION_LEVEL {3};
+
+Blob
+Value::compress() const
+{
+    if (data.size() <= COMPRESSION_MIN_GAIN or data.size() > MAX_VALUE_SIZE)
+        return {};
+    Blob out(ZSTD_compressBound(data.size()));
+    auto len = ZSTD_compress(out.data(), out.size(), data.data(), data.size(), COMPRESSION_LEVEL);
+    if (ZSTD_isError(len) or len + COMPRESSION_MIN_GAIN > data.size())
+        return {};
+    out.resize(len);
+    return out;
+}
+
+static Blob
+decompress(const Blob& in, Value::Compression codec)
+{
+    if (codec != Value::Compression::Zstd)
+        throw msgpack::type_error();
+    auto size = ZSTD_getFrameContentSize(in.data(), in.size());
+    if (size == ZSTD_CONTENTSIZE_ERROR or size == ZSTD_CONTENTSIZE_UNKNOWN or size > MAX_VALUE_SIZE)
+        throw msgpack::type_error();
+    Blob out(size);
+    auto len = ZSTD_decompress(out.data(), out.size(), in.data(), in.size());
+    if (ZSTD_isError(len) or len != size)
+        throw msgpack::type_error();
+    return out;
+}
+#else
+Blob
+Value::compress() const
+{
+    return {};
+}
+
+static Blob
+decompress(const Blob&, Value::Compression)
+{
+    throw msgpack::type_error();
+}
+#endif
+
 void
 Value::msgpack_unpack(msgpack::object o)
 {
@@ -145,6 +193,9 @@ Value::msgpack_unpack_body(const msgpack::object& o)
         } else
             throw msgpack::type_error();
 
+        if (auto rz = findMapValue(*rbody, "z"))
+            data = decompress(data, static_cast<Compression>(rz->as<uint8_t>()));
+
         if (auto rtype = findMapValue(*rbody, "type")) {
             type = rtype->as<ValueType::Id>();
         } else
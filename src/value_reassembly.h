@@ -0,0 +1,148 @@
+/*
+ *  Copyright (C) 2019 Savoir-faire Linux Inc.
+ *
+ *  Author: Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "utils.h"
+
+#include <map>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+
+namespace dht {
+namespace net {
+
+/**
+ * Reassembly of the values of a message sent in several parts.
+ *
+ * Values are sent in fragments of fragmentSize bytes, at offsets that are
+ * multiples of fragmentSize. Fragments are written in place into the buffer
+ * of their value, allocated when its first fragment is received, so that
+ * sizes declared by the sender are only reserved. Received fragments are
+ * tracked with a bitmap, so that they can arrive in any order and the
+ * missing ones can be requested again.
+ */
+class ValueReassembly {
+public:
+    ValueReassembly() {}
+
+    /**
+     * @param sizes: index in the message and total size of each value
+     *        sent in parts.
+     */
+    ValueReassembly(const std::vector<std::pair<unsigned, size_t>>& sizes, size_t fragmentSize)
+     : fragment_size_(fragmentSize)
+    {
+        parts_.reserve(sizes.size());
+        for (const auto& s : sizes) {
+            auto count = (s.second + fragmentSize - 1) / fragmentSize;
+            parts_.emplace_back(Part {s.first, s.second, fragments_, count, {}});
+            size_ += s.second;
+            fragments_ += count;
+        }
+        received_.resize((fragments_ + 63) / 64);
+        missing_ = fragments_;
+    }
+
+    /**
+     * Writes a fragment of a value.
+     * @return true if the fragment is new, false if it was already received
+     *         or doesn't match a fragment of the values.
+     */
+    bool add(unsigned index, size_t offset, const uint8_t* data, size_t size) {
+        auto part = find(index);
+        if (not part or offset % fragment_size_)
+            return false;
+        auto fragment = offset / fragment_size_;
+        if (fragment >= part->count or size != std::min(fragment_size_, part->size - offset))
+            return false;
+        auto bit = part->first + fragment;
+        auto& word = received_[bit / 64];
+        uint64_t mask = uint64_t(1) << (bit % 64);
+        if (word & mask)
+            return false;
+        word |= mask;
+        if (part->data.empty())
+            part->data.resize(part->size);
+        std::memcpy(part->data.data() + offset, data, size);
+        missing_--;
+        return true;
+    }
+
+    bool complete() const { return missing_ == 0; }
+
+    /** Number of fragments not received yet */
+    size_t missing() const { return missing_; }
+
+    /** Total size of the values, as declared by the sender */
+    size_t size() const { return size_; }
+
+    /**
+     * Up to max missing fragments, as {value index -> fragment numbers},
+     * fragment n starting at offset n * fragmentSize.
+     */
+    std::map<unsigned, std::vector<unsigned>> getMissing(size_t max) const {
+        std::map<unsigned, std::vector<unsigned>> ret;
+        for (const auto& part : parts_) {
+            for (size_t f = 0; f < part.count and max; f++) {
+                auto bit = part.first + f;
+                if (not (received_[bit / 64] & (uint64_t(1) << (bit % 64)))) {
+                    ret[part.index].emplace_back(f);
+                    max--;
+                }
+            }
+        }
+        return ret;
+    }
+
+    /** Calls cb(data, size) for each value, in the order given at construction */
+    template <typename Cb>
+    void forEachValue(Cb&& cb) const {
+        for (const auto& part : parts_)
+            cb(part.data.data(), part.size);
+    }
+
+private:
+    struct Part {
+        unsigned index;
+        size_t size;
+        /* first fragment in the bitmap */
+        size_t first;
+        size_t count;
+        Blob data;
+    };
+
+    Part* find(unsigned index) {
+        for (auto& part : parts_)
+            if (part.index == index)
+                return &part;
+        return nullptr;
+    }
+
+    size_t fragment_size_ {1};
+    size_t size_ {0};
+    std::vector<Part> parts_ {};
+    std::vector<uint64_t> received_ {};
+    size_t fragments_ {0};
+    size_t missing_ {0};
+};
+
+}
+}
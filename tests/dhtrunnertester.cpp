@@ -19,6 +19,8 @@
 
 #include "dhtrunnertester.h"
 
+#include <opendht/sharded_dhtrunner.h>
+
 #include <chrono>
 #include <mutex>
 #include <condition_variable>
@@ -131,4 +133,90 @@ DhtRunnerTester::testListen() {
     node1.cancelListen(c, tokenc);
 }
 
+void
+DhtRunnerTester::testSharded() {
+    constexpr unsigned SHARDS = 4;
+    dht::SockAddr local4;
+    local4.setFamily(AF_INET);
+    local4.setAddress("127.0.0.1");
+    dht::ShardedDhtRunner sharded;
+    sharded.run(local4, {}, dht::DhtRunner::Config {}, SHARDS);
+
+    const auto& shards = sharded.getShards();
+    CPPUNIT_ASSERT_EQUAL((size_t)SHARDS, shards.size());
+    auto port = sharded.getBound().getPort();
+    CPPUNIT_ASSERT(port != 0);
+    // Peers see a single node at the shared address
+    for (const auto& shard : shards) {
+        CPPUNIT_ASSERT_EQUAL(port, shard->getBoundPort());
+        CPPUNIT_ASSERT(shard->getNodeId() == shards.front()->getNodeId());
+    }
+
+    // Keys are handled by the shard owning their first byte
+    for (unsigned i=0; i<SHARDS; i++) {
+        dht::InfoHash key;
+        key[0] = (uint8_t)(i * 256 / SHARDS);
+        CPPUNIT_ASSERT(&sharded.getShard(key) == shards[i].get());
+        key[0] = (uint8_t)((i + 1) * 256 / SHARDS - 1);
+        CPPUNIT_ASSERT(&sharded.getShard(key) == shards[i].get());
+    }
+
+    // Replies of node1 are all received by the same shard, and routed to
+    // the shard which sent the request
+    std::vector<std::future<bool>> pings;
+    for (const auto& shard : shards) {
+        auto p = std::make_shared<std::promise<bool>>();
+        pings.emplace_back(p->get_future());
+        shard->bootstrap(node1.getBound(), [p](bool ok) { p->set_value(ok); });
+    }
+    for (auto& ping : pings)
+        CPPUNIT_ASSERT(ping.get());
+
+    auto key = dht::InfoHash::get("sharded");
+    dht::Value val {"hey"};
+    auto val_data = val.data;
+    std::promise<bool> p;
+    sharded.put(key, std::make_shared<dht::Value>(std::move(val)), [&](bool ok){
+        p.set_value(ok);
+    });
+    CPPUNIT_ASSERT(p.get_future().get());
+    auto vals = node2.get(key).get();
+    CPPUNIT_ASSERT(not vals.empty());
+    CPPUNIT_ASSERT(vals.front()->data == val_data);
+    sharded.join();
+}
+
+void
+DhtRunnerTester::testDecodeThreads() {
+    dht::DhtRunner::Config config {};
+    config.decode_threads = 2;
+    dht::DhtRunner node3, node4;
+    node3.run(42242, config);
+    node4.run(42252, config);
+    node3.bootstrap(node1.getBound());
+    node4.bootstrap(node3.getBound());
+
+    // Values put through decoding nodes are seen by the others, and back
+    constexpr unsigned N = 16;
+    std::vector<std::future<bool>> puts;
+    for (unsigned i=0; i<N; i++) {
+        auto p = std::make_shared<std::promise<bool>>();
+        puts.emplace_back(p->get_future());
+        node4.put(dht::InfoHash::get("decode" + std::to_string(i)), dht::Value("v" + std::to_string(i)), [p](bool ok){
+            p->set_value(ok);
+        });
+    }
+    for (auto& f : puts)
+        CPPUNIT_ASSERT(f.get());
+    for (unsigned i=0; i<N; i++) {
+        auto key = dht::InfoHash::get("decode" + std::to_string(i));
+        auto vals = node2.get(key).get();
+        CPPUNIT_ASSERT(not vals.empty());
+        vals = node3.get(key).get();
+        CPPUNIT_ASSERT(not vals.empty());
+    }
+    node3.join();
+    node4.join();
+}
+
 }  // namespace test
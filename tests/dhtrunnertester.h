@@ -32,6 +32,8 @@ class DhtRunnerTester : public CppUnit::TestFixture {
     CPPUNIT_TEST(testConstructors);
     CPPUNIT_TEST(testGetPut);
     CPPUNIT_TEST(testListen);
+    CPPUNIT_TEST(testSharded);
+    CPPUNIT_TEST(testDecodeThreads);
     CPPUNIT_TEST_SUITE_END();
 
     dht::DhtRunner node1 {};
@@ -57,6 +59,14 @@ class DhtRunnerTester : public CppUnit::TestFixture {
      * Test listen method
      */
     void testListen();
+    /**
+     * Test ShardedDhtRunner binding and key routing
+     */
+    void testSharded();
+    /**
+     * Test nodes decoding packets on worker threads
+     */
+    void testDecodeThreads();
 };
 
 }  // namespace test
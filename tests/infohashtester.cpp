@@ -22,12 +22,92 @@
 // std
 #include <iostream>
 #include <string>
+#include <chrono>
+#include <random>
 
 // opendht
 #include "opendht/infohash.h"
 
 namespace test {
 CPPUNIT_TEST_SUITE_REGISTRATION(InfoHashTester);
+// Prints timings: run with "opendht_unit_tests simulation"
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(InfoHashBenchmark, "simulation");
+
+namespace {
+
+using clock = std::chrono::steady_clock;
+
+// Bytewise reference implementations
+int
+refLowbit(const dht::InfoHash& h)
+{
+    for (int i = h.size()-1; i >= 0; i--)
+        for (int j = 7; j >= 0; j--)
+            if (h[i] & (0x80 >> j))
+                return 8 * i + j;
+    return -1;
+}
+
+unsigned
+refCommonBits(const dht::InfoHash& a, const dht::InfoHash& b)
+{
+    for (unsigned i = 0; i < 8 * a.size(); i++)
+        if (a.getBit(i) != b.getBit(i))
+            return i;
+    return 8 * a.size();
+}
+
+int
+refXorCmp(const dht::InfoHash& t, const dht::InfoHash& a, const dht::InfoHash& b)
+{
+    for (unsigned i = 0; i < t.size(); i++)
+        if (a[i] != b[i])
+            return (a[i] ^ t[i]) < (b[i] ^ t[i]) ? -1 : 1;
+    return 0;
+}
+
+/* Random id sharing a random number of leading bytes with h */
+dht::InfoHash
+nearId(const dht::InfoHash& h, std::mt19937& rd)
+{
+    auto ret = dht::InfoHash::getRandom();
+    auto common = std::uniform_int_distribution<size_t>{0, h.size()}(rd);
+    std::copy_n(h.cbegin(), common, ret.begin());
+    return ret;
+}
+
+/* n random ids in a, each sharing leading bytes with the next in b and c */
+void
+makeIds(size_t n, std::vector<dht::InfoHash>& a, std::vector<dht::InfoHash>& b, std::vector<dht::InfoHash>& c)
+{
+    std::mt19937 rd {1};
+    for (size_t i = 0; i < n; i++) {
+        a.emplace_back(dht::InfoHash::getRandom());
+        b.emplace_back(nearId(a.back(), rd));
+        c.emplace_back(nearId(b.back(), rd));
+        // exercise lowbit over every byte
+        std::fill_n(b.back().begin() + (b.back().size() - i % 21), i % 21, 0);
+    }
+}
+
+/* Whether the closest ids are the k ids closest to t, in order */
+bool
+checkClosestIds(const dht::InfoHash& t, const std::vector<dht::InfoHash>& ids, size_t k, const std::vector<unsigned>& closest)
+{
+    auto sorted = ids;
+    std::sort(sorted.begin(), sorted.end(), [&](const dht::InfoHash& a, const dht::InfoHash& b) {
+        return refXorCmp(t, a, b) < 0;
+    });
+    sorted.resize(std::min(k, sorted.size()));
+    if (closest.size() != sorted.size())
+        return false;
+    for (size_t i = 0; i < closest.size(); i++)
+        if (ids[closest[i]] != sorted[i])
+            return false;
+    return true;
+}
+
+}
 
 void
 InfoHashTester::setUp() {
@@ -136,8 +216,118 @@ InfoHashTester::testXorCmp() {
     CPPUNIT_ASSERT_EQUAL(maxHash.xorCmp(minHash, nullHash), 1);
 }
 
+void
+InfoHashTester::testClosestIds() {
+    auto target = dht::InfoHash("0000000000000000000000000000000000000010");
+    std::vector<dht::InfoHash> ids {
+        dht::InfoHash("0100000000000000000000000000000000000000"),
+        dht::InfoHash("0000000000000000000000000000000000000011"),
+        dht::InfoHash(),
+        dht::InfoHash("0000000000000000000000000000000000000010"),
+        dht::InfoHash("8000000000000000000000000000000000000000"),
+    };
+    std::vector<unsigned> out;
+    dht::closestIds(target, ids.data(), ids.size(), 3, out);
+    CPPUNIT_ASSERT((out == std::vector<unsigned>{3, 1, 2}));
+    dht::closestIds(target, ids.data(), ids.size(), 10, out);
+    CPPUNIT_ASSERT((out == std::vector<unsigned>{3, 1, 2, 0, 4}));
+    dht::closestIds(target, ids.data(), 0, 10, out);
+    CPPUNIT_ASSERT(out.empty());
+
+    // All batch sizes, with ids differing only after their first 8 bytes
+    std::mt19937 rd {42};
+    for (size_t n = 1; n < 40; n++) {
+        ids.clear();
+        for (size_t i = 0; i < n; i++)
+            ids.emplace_back(nearId(target, rd));
+        dht::closestIds(target, ids.data(), ids.size(), 8, out);
+        CPPUNIT_ASSERT(checkClosestIds(target, ids, 8, out));
+    }
+}
+
+void
+InfoHashTester::testReference() {
+    constexpr size_t N {4096};
+    std::vector<dht::InfoHash> a, b, c;
+    makeIds(N, a, b, c);
+    for (size_t i = 0; i < N; i++) {
+        CPPUNIT_ASSERT_EQUAL(refLowbit(b[i]), b[i].lowbit());
+        CPPUNIT_ASSERT_EQUAL(refCommonBits(a[i], b[i]), dht::InfoHash::commonBits(a[i], b[i]));
+        CPPUNIT_ASSERT_EQUAL(refXorCmp(a[i], b[i], c[i]), a[i].xorCmp(b[i], c[i]));
+        CPPUNIT_ASSERT_EQUAL(refXorCmp(c[i], a[i], b[i]), c[i].xorCmp(a[i], b[i]));
+    }
+}
+
 void
 InfoHashTester::tearDown() {
 
 }
+
+void
+InfoHashBenchmark::testKernels() {
+    constexpr size_t N {4096};
+    std::vector<dht::InfoHash> a, b, c;
+    makeIds(N, a, b, c);
+
+    constexpr unsigned ROUNDS {500};
+    auto report = [](const char* name, clock::duration d, size_t ops) {
+        std::cout << name << ": "
+                  << std::chrono::duration_cast<std::chrono::duration<double, std::nano>>(d).count() / ops
+                  << " ns" << std::endl;
+    };
+    std::cout << std::endl;
+
+    long sum {0};
+    auto start = clock::now();
+    for (unsigned r = 0; r < ROUNDS; r++)
+        for (const auto& h : b)
+            sum += h.lowbit();
+    report("lowbit", clock::now() - start, ROUNDS * N);
+
+    start = clock::now();
+    for (unsigned r = 0; r < ROUNDS; r++)
+        for (size_t i = 0; i < N; i++)
+            sum += dht::InfoHash::commonBits(a[i], b[i]);
+    report("commonBits", clock::now() - start, ROUNDS * N);
+
+    start = clock::now();
+    for (unsigned r = 0; r < ROUNDS; r++)
+        for (size_t i = 0; i < N; i++)
+            sum += a[i].xorCmp(b[i], c[i]);
+    report("xorCmp", clock::now() - start, ROUNDS * N);
+
+    // k closest of n ids, as done by routing table and search lookups
+    for (size_t n : {64, 1024}) {
+        constexpr size_t K {8};
+        std::vector<unsigned> out;
+        start = clock::now();
+        for (unsigned r = 0; r < ROUNDS; r++) {
+            const auto& target = a[r % N];
+            dht::closestIds(target, c.data() + r % (N - n), n, K, out);
+            sum += out.front();
+        }
+        report(n == 64 ? "closestIds(64, 8)" : "closestIds(1024, 8)", clock::now() - start, ROUNDS);
+
+        std::vector<unsigned> ref(n);
+        start = clock::now();
+        for (unsigned r = 0; r < ROUNDS; r++) {
+            const auto& target = a[r % N];
+            const auto* ids = c.data() + r % (N - n);
+            for (unsigned i = 0; i < n; i++)
+                ref[i] = i;
+            std::partial_sort(ref.begin(), ref.begin() + K, ref.end(), [&](unsigned x, unsigned y) {
+                return target.xorCmp(ids[x], ids[y]) < 0;
+            });
+            sum += ref.front();
+        }
+        report(n == 64 ? "partial_sort(64, 8)" : "partial_sort(1024, 8)", clock::now() - start, ROUNDS);
+
+        const auto& target = a[0];
+        std::vector<dht::InfoHash> ids(c.begin(), c.begin() + n);
+        dht::closestIds(target, ids.data(), n, K, out);
+        CPPUNIT_ASSERT(checkClosestIds(target, ids, K, out));
+    }
+    CPPUNIT_ASSERT(sum != 0);
+}
+
 }  // namespace test
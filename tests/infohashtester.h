@@ -32,6 +32,8 @@ class InfoHashTester : public CppUnit::TestFixture {
     CPPUNIT_TEST(testLowBit);
     CPPUNIT_TEST(testCommonBits);
     CPPUNIT_TEST(testXorCmp);
+    CPPUNIT_TEST(testClosestIds);
+    CPPUNIT_TEST(testReference);
     CPPUNIT_TEST_SUITE_END();
 
  public:
@@ -63,7 +65,27 @@ class InfoHashTester : public CppUnit::TestFixture {
      * Test xorCmp operators
      */
     void testXorCmp();
+    /**
+     * Test the batched closest ids kernel
+     */
+    void testClosestIds();
+    /**
+     * Check lowbit, commonBits and xorCmp against bytewise implementations
+     */
+    void testReference();
+};
 
+class InfoHashBenchmark : public CppUnit::TestFixture {
+    CPPUNIT_TEST_SUITE(InfoHashBenchmark);
+    CPPUNIT_TEST(testKernels);
+    CPPUNIT_TEST_SUITE_END();
+
+ public:
+    /**
+     * Speed of lowbit, commonBits, xorCmp and closestIds, compared with
+     * bytewise implementations
+     */
+    void testKernels();
 };
 
 }  // namespace test
@@ -0,0 +1,334 @@
+/*
+ *  Copyright (C) 2019 Savoir-faire Linux Inc.
+ *
+ *  Author: Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "lookuptester.h"
+
+#include "opendht/dht.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <random>
+#include <thread>
+
+namespace test {
+// Runs in real time for about 20 seconds: not part of the default suite,
+// run with "opendht_unit_tests simulation"
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(LookupTester, "simulation");
+using clock = std::chrono::steady_clock;
+
+namespace {
+
+constexpr in_port_t BASE_PORT {10000};
+
+dht::SockAddr
+localAddr(in_port_t port)
+{
+    dht::SockAddr addr;
+    addr.setFamily(AF_INET);
+    addr.setAddress("127.0.0.1");
+    addr.setPort(port);
+    return addr;
+}
+
+class SimNetwork;
+
+/** Hands datagrams to the simulated network */
+class SimSocket : public dht::net::DatagramSocket {
+public:
+    SimSocket(SimNetwork& net, const dht::SockAddr& addr) : net(net), bound(addr) {}
+
+    int sendTo(const dht::SockAddr& dest, const uint8_t* data, size_t size, bool) override;
+    const dht::SockAddr& getBound(sa_family_t) const override { return bound; }
+    bool hasIPv4() const override { return true; }
+    bool hasIPv6() const override { return false; }
+    void stop() override {}
+private:
+    SimNetwork& net;
+    dht::SockAddr bound;
+};
+
+/**
+ * Nodes exchanging datagrams in a single thread, with a latency of a few
+ * milliseconds. Datagrams from or to offline nodes are lost.
+ *
+ * Datagrams of the tracked lookups are tagged with their hop: a request is
+ * one hop further than the last reply received by the lookup origin.
+ */
+class SimNetwork {
+public:
+    struct Lookup {
+        unsigned replied {0};   /* highest hop of the replies received */
+        unsigned hops {0};      /* highest hop of the requests sent */
+    };
+
+    struct Peer {
+        dht::SockAddr addr;
+        clock::duration latency;
+        std::unique_ptr<dht::Dht> dht;
+        clock::time_point wakeup {clock::time_point::min()};
+        bool online {true};
+        /* hop of the last request received from each lookup origin */
+        std::map<size_t, unsigned> hops {};
+    };
+
+    SimNetwork(size_t n, std::mt19937_64& rd) : peers(n) {
+        std::uniform_int_distribution<int> latency_dis(2, 20);
+        for (size_t i = 0; i < n; i++) {
+            auto& p = peers[i];
+            p.addr = localAddr(BASE_PORT + i);
+            p.latency = std::chrono::milliseconds(latency_dis(rd));
+            dht::Config config {};
+            config.node_id = dht::InfoHash::getRandom();
+            config.max_req_per_sec = 0;
+            config.max_peer_req_per_sec = 0;
+            p.dht.reset(new dht::Dht(std::unique_ptr<dht::net::DatagramSocket>(new SimSocket(*this, p.addr)), config));
+        }
+    }
+
+    ~SimNetwork() {
+        closing = true;
+    }
+
+    void send(const dht::SockAddr& from, const dht::SockAddr& to, const uint8_t* data, size_t size) {
+        if (closing)
+            return;
+        size_t src = from.getPort() - BASE_PORT, dst = to.getPort() - BASE_PORT;
+        if (dst >= peers.size() or not peers[src].online or not peers[dst].online)
+            return;
+        Packet pkt {src, dst, 0, 0, dht::Blob(data, data + size)};
+        auto l = lookups.find(src);
+        if (l != lookups.end()) {
+            pkt.request_hop = l->second.replied + 1;
+            l->second.hops = std::max(l->second.hops, pkt.request_hop);
+        }
+        if (lookups.find(dst) != lookups.end()) {
+            auto h = peers[src].hops.find(dst);
+            if (h != peers[src].hops.end())
+                pkt.reply_hop = h->second;
+        }
+        queue.emplace(clock::now() + peers[src].latency + peers[dst].latency, std::move(pkt));
+    }
+
+    /**
+     * Delivers datagrams and runs the nodes until stop returns true,
+     * or for at most max
+     */
+    void run(clock::duration max, const std::function<bool()>& stop = {}) {
+        auto end = clock::now() + max;
+        while (true) {
+            auto now = clock::now();
+            if (now >= end or (stop and stop()))
+                break;
+            while (not queue.empty() and queue.begin()->first <= now) {
+                auto pkt = std::move(queue.begin()->second);
+                queue.erase(queue.begin());
+                deliver(pkt);
+            }
+            auto next = end;
+            for (auto& p : peers) {
+                if (p.wakeup <= now)
+                    p.wakeup = p.dht->periodic(nullptr, 0, dht::SockAddr {});
+                next = std::min(next, p.wakeup);
+            }
+            if (not queue.empty())
+                next = std::min(next, queue.begin()->first);
+            std::this_thread::sleep_until(next);
+        }
+    }
+
+    std::vector<Peer> peers;
+    std::map<size_t, Lookup> lookups {};
+private:
+    struct Packet {
+        size_t src, dst;
+        unsigned request_hop, reply_hop;
+        dht::Blob data;
+    };
+
+    void deliver(const Packet& pkt) {
+        auto& d = peers[pkt.dst];
+        if (pkt.request_hop)
+            d.hops[pkt.src] = pkt.request_hop;
+        if (pkt.reply_hop) {
+            auto l = lookups.find(pkt.dst);
+            if (l != lookups.end())
+                l->second.replied = std::max(l->second.replied, pkt.reply_hop);
+        }
+        d.wakeup = d.dht->periodic(pkt.data.data(), pkt.data.size(), peers[pkt.src].addr);
+    }
+
+    std::multimap<clock::time_point, Packet> queue {};
+    bool closing {false};
+};
+
+int
+SimSocket::sendTo(const dht::SockAddr& dest, const uint8_t* data, size_t size, bool)
+{
+    net.send(bound, dest, data, size);
+    return 0;
+}
+
+/** Requests sent by a node, retransmissions included */
+uint64_t
+requestsSent(const dht::Dht& node)
+{
+    uint64_t sent {0};
+    for (const auto& m : node.getTrafficStats().messages)
+        sent += m.second.requests_out + m.second.retransmits;
+    return sent;
+}
+
+dht::LookupOptions
+lookupOptions(unsigned alpha, unsigned max_alpha, bool early_termination)
+{
+    dht::LookupOptions options;
+    options.alpha = alpha;
+    options.max_alpha = max_alpha;
+    options.early_termination = early_termination;
+    return options;
+}
+
+}
+
+void
+LookupTester::setUp() {
+
+}
+
+void
+LookupTester::testSimulation()
+{
+    constexpr size_t NODES {128};
+    constexpr size_t OFFLINE {NODES / 5};
+    constexpr size_t LOOKUPS {16};
+    constexpr size_t K {8};
+
+    std::mt19937_64 rd {42};
+    SimNetwork net(NODES, rd);
+
+    // Every node knows every other one: routing tables fill up and node
+    // response times are measured before the first lookup
+    for (auto& p : net.peers)
+        for (const auto& o : net.peers)
+            if (&p != &o)
+                p.dht->insertNode(o.dht->getNodeId(), o.addr);
+    net.run(std::chrono::seconds(5));
+
+    // Some nodes leave without notice, and time out when queried
+    std::vector<size_t> online(NODES);
+    for (size_t i = 0; i < NODES; i++)
+        online[i] = i;
+    std::shuffle(online.begin(), online.end(), rd);
+    for (size_t i = 0; i < OFFLINE; i++)
+        net.peers[online[i]].online = false;
+    online.erase(online.begin(), online.begin() + OFFLINE);
+
+    struct Scenario {
+        std::string name;
+        dht::LookupOptions options;
+    };
+    std::vector<Scenario> scenarios {
+        {"default", {}},
+        {"alpha 3", lookupOptions(3, 3, true)},
+        {"alpha 3, widening", lookupOptions(3, 0, true)},
+        {"alpha 3, widening, no early end", lookupOptions(3, 0, false)},
+        {"alpha 8", lookupOptions(8, 0, true)},
+    };
+
+    std::cout << std::endl;
+    for (const auto& s : scenarios) {
+        struct Result {
+            bool done {false}, ok {false};
+            unsigned hops {0};
+            uint64_t messages {0};
+            clock::duration time {};
+            unsigned closest {0};
+        };
+        std::vector<Result> results(LOOKUPS);
+        size_t completed {0};
+
+        std::shuffle(online.begin(), online.end(), rd);
+        for (size_t l = 0; l < LOOKUPS; l++) {
+            auto origin = online[l];
+            auto& node = *net.peers[origin].dht;
+            auto key = dht::InfoHash::getRandom();
+
+            // The closest reachable nodes, a complete lookup finds
+            std::vector<dht::InfoHash> closest;
+            for (auto i : online)
+                if (i != origin)
+                    closest.emplace_back(net.peers[i].dht->getNodeId());
+            std::sort(closest.begin(), closest.end(), [&](const dht::InfoHash& a, const dht::InfoHash& b) {
+                return key.xorCmp(a, b) < 0;
+            });
+            closest.resize(K);
+
+            net.lookups[origin] = {};
+            auto sent = requestsSent(node);
+            auto start = clock::now();
+            node.get(key, [](const std::vector<dht::Sp<dht::Value>>&) { return true; },
+                [&, l, origin, sent, start, closest](bool ok, const std::vector<dht::Sp<dht::Node>>& nodes) {
+                    auto& r = results[l];
+                    r.time = clock::now() - start;
+                    r.done = true;
+                    r.ok = ok;
+                    r.hops = net.lookups[origin].hops;
+                    r.messages = requestsSent(*net.peers[origin].dht) - sent;
+                    for (const auto& n : nodes)
+                        if (std::find(closest.begin(), closest.end(), n->id) != closest.end())
+                            r.closest++;
+                    net.lookups.erase(origin);
+                    completed++;
+                }, {}, {}, s.options);
+            net.peers[origin].wakeup = clock::time_point::min();
+        }
+        net.run(std::chrono::seconds(30), [&]{ return completed == LOOKUPS; });
+
+        double hops {0}, messages {0}, closest {0};
+        std::vector<clock::duration> times;
+        for (const auto& r : results) {
+            CPPUNIT_ASSERT(r.done);
+            CPPUNIT_ASSERT(r.ok);
+            hops += r.hops;
+            messages += r.messages;
+            closest += r.closest;
+            times.emplace_back(r.time);
+        }
+        std::sort(times.begin(), times.end());
+        auto ms = [](clock::duration d) {
+            return std::chrono::duration_cast<std::chrono::milliseconds>(d).count();
+        };
+        std::cout << std::left << std::setw(34) << s.name << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(5) << hops / LOOKUPS << " hops, "
+                  << std::setw(6) << messages / LOOKUPS << " messages, "
+                  << std::setw(5) << ms(times[LOOKUPS / 2]) << " ms (p50), "
+                  << std::setw(5) << ms(times.back()) << " ms (max), "
+                  << std::setw(4) << closest / LOOKUPS << "/" << K << " closest found" << std::endl;
+    }
+}
+
+void
+LookupTester::tearDown() {
+
+}
+
+}  // namespace test
@@ -0,0 +1,182 @@
+/*
+ *  Copyright (C) 2019 Savoir-faire Linux Inc.
+ *
+ *  Author: Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "mpscqueuetester.h"
+
+#include "opendht/mpsc_queue.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+namespace test {
+CPPUNIT_TEST_SUITE_REGISTRATION(MpscQueueTester);
+// Prints timings: run with "opendht_unit_tests simulation"
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(MpscQueueBenchmark, "simulation");
+using clock = std::chrono::steady_clock;
+
+void
+MpscQueueTester::setUp() {
+
+}
+
+void
+MpscQueueTester::testBasic()
+{
+    dht::MpscQueue<std::unique_ptr<int>> q(5);
+    CPPUNIT_ASSERT_EQUAL((size_t)8, q.capacity());
+    CPPUNIT_ASSERT(q.empty());
+
+    for (int i = 0; i < 8; i++)
+        CPPUNIT_ASSERT(q.push(std::unique_ptr<int>(new int(i))));
+    std::unique_ptr<int> extra(new int(8));
+    CPPUNIT_ASSERT(not q.push(std::move(extra)));
+    CPPUNIT_ASSERT(extra and *extra == 8);
+    CPPUNIT_ASSERT_EQUAL((size_t)8, q.size());
+
+    int expected = 0;
+    auto n = q.drain([&](std::unique_ptr<int>& v) {
+        CPPUNIT_ASSERT_EQUAL(expected++, *v);
+    }, 3);
+    CPPUNIT_ASSERT_EQUAL((size_t)3, n);
+
+    // wrap around
+    CPPUNIT_ASSERT(q.push(std::move(extra)));
+    n = q.drain([&](std::unique_ptr<int>& v) {
+        CPPUNIT_ASSERT_EQUAL(expected++, *v);
+    }, q.capacity());
+    CPPUNIT_ASSERT_EQUAL((size_t)6, n);
+    CPPUNIT_ASSERT_EQUAL(9, expected);
+    CPPUNIT_ASSERT(q.empty());
+
+    std::unique_ptr<int> v;
+    CPPUNIT_ASSERT(not q.pop(v));
+    q.push(std::unique_ptr<int>(new int(42)));
+    q.clear();
+    CPPUNIT_ASSERT(q.empty());
+}
+
+namespace {
+
+/** Baseline: the mutex protected queue previously used by DhtRunner */
+struct LockedQueue {
+    bool push(uint64_t&& v) {
+        std::lock_guard<std::mutex> lck(mtx);
+        q.emplace(v);
+        return true;
+    }
+    template <typename F>
+    size_t drain(F&& f, size_t) {
+        std::queue<uint64_t> ops;
+        {
+            std::lock_guard<std::mutex> lck(mtx);
+            ops = std::move(q);
+            q = {};
+        }
+        size_t n = ops.size();
+        for (; not ops.empty(); ops.pop())
+            f(ops.front());
+        return n;
+    }
+    std::mutex mtx;
+    std::queue<uint64_t> q;
+};
+
+template <typename Queue>
+double
+contention(Queue& q, unsigned producers, uint64_t per_producer)
+{
+    std::atomic_bool go {false};
+    std::vector<std::thread> threads;
+    threads.reserve(producers);
+    for (unsigned p = 0; p < producers; p++) {
+        threads.emplace_back([&, p]{
+            while (not go) std::this_thread::yield();
+            for (uint64_t i = 0; i < per_producer; i++) {
+                uint64_t v = ((uint64_t)p << 32) | i;
+                while (not q.push(std::move(v)))
+                    std::this_thread::yield();
+            }
+        });
+    }
+
+    // Check per-producer FIFO order and that nothing is lost
+    std::vector<uint64_t> next(producers, 0);
+    uint64_t total = producers * per_producer, received = 0;
+    bool ordered = true;
+    auto start = clock::now();
+    go = true;
+    while (received < total) {
+        auto n = q.drain([&](uint64_t& v) {
+            auto p = v >> 32;
+            if ((v & 0xffffffff) != next[p]++)
+                ordered = false;
+        }, 1024);
+        if (n == 0)
+            std::this_thread::yield();
+        received += n;
+    }
+    auto elapsed = std::chrono::duration<double>(clock::now() - start).count();
+    for (auto& t : threads)
+        t.join();
+    CPPUNIT_ASSERT(ordered);
+    CPPUNIT_ASSERT_EQUAL(total, received);
+    return total / elapsed;
+}
+
+}
+
+void
+MpscQueueTester::testProducers()
+{
+    constexpr uint64_t N = 16 * 1024;
+    unsigned hw = std::max(2u, std::thread::hardware_concurrency());
+    for (unsigned producers : {1u, 4u, hw * 2}) {
+        dht::MpscQueue<uint64_t> ring(1024);
+        contention(ring, producers, N);
+    }
+}
+
+void
+MpscQueueTester::tearDown() {
+
+}
+
+void
+MpscQueueBenchmark::testContention()
+{
+    constexpr uint64_t N = 64 * 1024;
+    unsigned hw = std::max(2u, std::thread::hardware_concurrency());
+    for (unsigned producers : {1u, 4u, hw * 2}) {
+        dht::MpscQueue<uint64_t> ring(1024);
+        LockedQueue locked;
+        auto ring_rate = contention(ring, producers, N);
+        auto locked_rate = contention(locked, producers, N);
+        std::cout << std::endl << producers << " producers: "
+                  << "mpsc ring " << (uint64_t)ring_rate << " op/s, "
+                  << "locked queue " << (uint64_t)locked_rate << " op/s" << std::endl;
+    }
+}
+
+}  // namespace test
@@ -0,0 +1,67 @@
+/*
+ *  Copyright (C) 2019 Savoir-faire Linux Inc.
+ *
+ *  Author: Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// cppunit
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+namespace test {
+
+class MpscQueueTester : public CppUnit::TestFixture {
+    CPPUNIT_TEST_SUITE(MpscQueueTester);
+    CPPUNIT_TEST(testBasic);
+    CPPUNIT_TEST(testProducers);
+    CPPUNIT_TEST_SUITE_END();
+
+ public:
+    /**
+     * Method automatically called before each test by CppUnit
+     */
+    void setUp();
+    /**
+     * Method automatically called after each test CppUnit
+     */
+    void tearDown();
+
+    /**
+     * FIFO order, full ring and batched drain
+     */
+    void testBasic();
+    /**
+     * Many producers against one consumer: nothing is lost and the order
+     * of each producer is kept
+     */
+    void testProducers();
+};
+
+class MpscQueueBenchmark : public CppUnit::TestFixture {
+    CPPUNIT_TEST_SUITE(MpscQueueBenchmark);
+    CPPUNIT_TEST(testContention);
+    CPPUNIT_TEST_SUITE_END();
+
+ public:
+    /**
+     * Many producers against one consumer, compared with a locked std::queue
+     */
+    void testContention();
+};
+
+}  // namespace test
@@ -0,0 +1,488 @@
+/*
+ *  Copyright (C) 2019 Savoir-faire Linux Inc.
+ *
+ *  Author: Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "networkenginetester.h"
+#include "allocationcounter.h"
+
+#include "opendht/network_engine.h"
+
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <thread>
+
+namespace test {
+CPPUNIT_TEST_SUITE_REGISTRATION(NetworkEngineTester);
+// Prints timings: run with "opendht_unit_tests simulation"
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(NetworkEngineBenchmark, "simulation");
+using clock = std::chrono::steady_clock;
+
+namespace {
+
+dht::SockAddr
+localAddr(in_port_t port)
+{
+    dht::SockAddr addr;
+    addr.setFamily(AF_INET);
+    addr.setAddress("127.0.0.1");
+    addr.setPort(port);
+    return addr;
+}
+
+/** Keeps the last datagram sent instead of sending it */
+class CaptureSocket : public dht::net::DatagramSocket {
+public:
+    CaptureSocket(const dht::SockAddr& addr) : bound(addr) {}
+
+    int sendTo(const dht::SockAddr&, const uint8_t* data, size_t size, bool) override {
+        if (onSend)
+            onSend();
+        last.assign(data, data + size);
+        if (keep)
+            packets.emplace_back(last);
+        sent++;
+        return error;
+    }
+    const dht::SockAddr& getBound(sa_family_t) const override { return bound; }
+    bool hasIPv4() const override { return true; }
+    bool hasIPv6() const override { return false; }
+    void stop() override {}
+
+    dht::Blob last {};
+    size_t sent {0};
+    /* keep all packets sent in packets */
+    bool keep {false};
+    std::vector<dht::Blob> packets {};
+    /* returned by sendTo */
+    int error {0};
+    /* called first by sendTo */
+    std::function<void()> onSend {};
+private:
+    dht::SockAddr bound;
+};
+
+struct Peer {
+    dht::InfoHash id;
+    dht::SockAddr addr;
+    dht::Logger logger {};
+    dht::Scheduler scheduler {};
+    CaptureSocket* socket;
+    std::unique_ptr<dht::net::NetworkEngine> engine;
+    /* called by the ping, find and get handlers once the answer is ready */
+    std::function<void()> onAnswer {};
+
+    Peer(const std::string& name, in_port_t port, const dht::net::RequestAnswer& answer)
+     : id(dht::InfoHash::get(name)), addr(localAddr(port))
+    {
+        std::unique_ptr<dht::net::DatagramSocket> sock(socket = new CaptureSocket(addr));
+        engine.reset(new dht::net::NetworkEngine(id, 0, std::move(sock), logger, scheduler,
+            [](dht::Sp<dht::net::Request>, dht::net::DhtProtocolException) {},
+            [](const dht::Sp<dht::Node>&, int) {},
+            [](const dht::InfoHash&, const dht::SockAddr&) {},
+            [this](dht::Sp<dht::Node>) {
+                if (onAnswer)
+                    onAnswer();
+                return dht::net::RequestAnswer {}; },
+            [this, &answer](dht::Sp<dht::Node>, const dht::InfoHash&, dht::want_t) {
+                auto a = answer;
+                if (onAnswer)
+                    onAnswer();
+                return a; },
+            [this, &answer](dht::Sp<dht::Node>, const dht::InfoHash&, dht::want_t, const dht::Query&) {
+                auto a = answer;
+                if (onAnswer)
+                    onAnswer();
+                return a; },
+            [](dht::Sp<dht::Node>, const dht::InfoHash&, const dht::Blob&, dht::Tid, const dht::Query&) {
+                return dht::net::RequestAnswer {}; },
+            [](dht::Sp<dht::Node>, const dht::InfoHash&, const dht::Blob&, const std::vector<dht::Sp<dht::Value>>&, const dht::time_point&) {
+                return dht::net::RequestAnswer {}; },
+            [](dht::Sp<dht::Node>, const dht::InfoHash&, const dht::Blob&, const dht::Value::Id&) {
+                return dht::net::RequestAnswer {}; }));
+        engine->setRateLimit(0, 0);
+    }
+};
+
+}
+
+void
+NetworkEngineTester::setUp() {
+
+}
+
+void
+NetworkEngineTester::testEncodeAllocations()
+{
+    // 8 close nodes (id, IPv4 address and port), packed in advance as the
+    // routing table does, a token and two small values, packed in the reply
+    dht::net::RequestAnswer answer;
+    answer.packed_nodes4 = std::make_shared<dht::Blob>(8 * (dht::HASH_LEN + 6), 0xcd);
+    answer.ntoken = dht::Blob(32, 0xab);
+    auto withValues = answer;
+    for (unsigned i = 0; i < 2; i++) {
+        auto v = std::make_shared<dht::Value>(dht::Blob(128, i));
+        v->id = i + 1;
+        withValues.values.emplace_back(std::move(v));
+    }
+
+    Peer a("a", 4222, answer), b("b", 4223, answer), c("c", 4224, withValues);
+    auto nodeB = a.engine->insertNode(b.id, b.addr);
+    auto nodeC = a.engine->insertNode(c.id, c.addr);
+    auto key = dht::InfoHash::get("key");
+
+    // Only count from the answer given by the handler to the packet sent
+    size_t allocs {0};
+    for (auto p : {&b, &c}) {
+        p->onAnswer = [] { AllocationCounter::start(); };
+        p->socket->onSend = [&] { allocs = AllocationCounter::stop(); };
+    }
+
+    struct Type {
+        std::string name;
+        std::function<dht::Sp<dht::net::Request>()> send;
+        dht::Sp<dht::Node> node;
+        Peer& replier;
+    };
+    std::vector<Type> types {
+        {"pong", [&]{ return a.engine->sendPing(nodeB, {}, {}); }, nodeB, b},
+        {"find", [&]{ return a.engine->sendFindNode(nodeB, key, -1, {}, {}); }, nodeB, b},
+        {"get (nodes)", [&]{ return a.engine->sendGetValues(nodeB, key, {}, -1, {}, {}); }, nodeB, b},
+        {"get (values)", [&]{ return a.engine->sendGetValues(nodeC, key, {}, -1, {}, {}); }, nodeC, c},
+    };
+    for (auto& t : types) {
+        t.node->cancelRequest(t.send());
+        auto request = a.socket->last;
+        // The first reply sizes the transmit buffer
+        t.replier.engine->processMessage(request.data(), request.size(), a.addr);
+        auto sent = t.replier.socket->sent;
+        allocs = -1;
+        t.replier.engine->processMessage(request.data(), request.size(), a.addr);
+        CPPUNIT_ASSERT_EQUAL(sent + 1, t.replier.socket->sent);
+        CPPUNIT_ASSERT_EQUAL_MESSAGE(t.name, (size_t)0, allocs);
+    }
+}
+
+void
+NetworkEngineTester::testValuePartsRetransmit()
+{
+    // A value too large for a single packet
+    dht::net::RequestAnswer none, answer;
+    auto v = std::make_shared<dht::Value>(dht::Blob(8 * 1024, 0xcd));
+    v->id = 42;
+    answer.values.emplace_back(v);
+
+    Peer a("a", 4222, none), b("b", 4223, answer);
+    auto nodeB = a.engine->insertNode(b.id, b.addr);
+    auto key = dht::InfoHash::get("key");
+
+    std::vector<dht::Sp<dht::Value>> received;
+    a.engine->sendGetValues(nodeB, key, {}, -1, [&](const dht::net::Request&, dht::net::RequestAnswer&& answer) {
+        received = std::move(answer.values);
+    }, {});
+    auto request = a.socket->last;
+
+    // The reply header and its fragments
+    b.socket->keep = true;
+    b.engine->processMessage(request.data(), request.size(), a.addr);
+    auto packets = std::move(b.socket->packets);
+    b.socket->packets.clear();
+    CPPUNIT_ASSERT(packets.size() > 3);
+
+    // Two fragments are lost
+    for (size_t i = 0; i < packets.size(); i++)
+        if (i != 2 and i != packets.size() - 1)
+            a.engine->processMessage(packets[i].data(), packets[i].size(), b.addr);
+    CPPUNIT_ASSERT(received.empty());
+
+    // The missing fragments are requested, without sending the request again
+    auto sent = a.socket->sent;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+    a.scheduler.run();
+    CPPUNIT_ASSERT_EQUAL(sent + 1, a.socket->sent);
+    auto missing = a.socket->last;
+
+    // Only the missing fragments are sent again
+    b.engine->processMessage(missing.data(), missing.size(), a.addr);
+    CPPUNIT_ASSERT_EQUAL((size_t)2, b.socket->packets.size());
+    for (const auto& p : b.socket->packets)
+        a.engine->processMessage(p.data(), p.size(), b.addr);
+    CPPUNIT_ASSERT_EQUAL((size_t)1, received.size());
+    CPPUNIT_ASSERT(*received[0] == *v);
+}
+
+void
+NetworkEngineTester::testLargeReply()
+{
+    // Values adding up to more than RX_PEER_MAX_SIZE
+    dht::net::RequestAnswer none, answer;
+    for (unsigned i = 0; i < 5; i++) {
+        auto v = std::make_shared<dht::Value>(dht::Blob(60 * 1024, i));
+        v->id = i + 1;
+        answer.values.emplace_back(v);
+    }
+
+    Peer a("a", 4222, none), b("b", 4223, answer);
+    auto nodeB = a.engine->insertNode(b.id, b.addr);
+    std::vector<dht::Sp<dht::Value>> received;
+    a.engine->sendGetValues(nodeB, dht::InfoHash::get("key"), {}, -1, [&](const dht::net::Request&, dht::net::RequestAnswer&& answer) {
+        received = std::move(answer.values);
+    }, {});
+    auto request = a.socket->last;
+
+    b.socket->keep = true;
+    b.engine->processMessage(request.data(), request.size(), a.addr);
+    for (const auto& p : b.socket->packets)
+        a.engine->processMessage(p.data(), p.size(), b.addr);
+    CPPUNIT_ASSERT_EQUAL(answer.values.size(), received.size());
+}
+
+void
+NetworkEngineTester::testUnexpectedReply()
+{
+    dht::net::RequestAnswer none, answer;
+    auto v = std::make_shared<dht::Value>(dht::Blob(8 * 1024, 0xcd));
+    answer.values.emplace_back(v);
+
+    Peer a("a", 4222, none), b("b", 4223, answer);
+    auto nodeB = a.engine->insertNode(b.id, b.addr);
+    auto req = a.engine->sendGetValues(nodeB, dht::InfoHash::get("key"), {}, -1, {}, {});
+    auto request = a.socket->last;
+    b.socket->keep = true;
+    b.engine->processMessage(request.data(), request.size(), a.addr);
+    auto reply = b.socket->packets.front();
+
+    // The request is over before its reply is received: no reassembly is
+    // started, so no missing fragment is ever requested.
+    nodeB->cancelRequest(req);
+    auto sent = a.socket->sent;
+    a.engine->processMessage(reply.data(), reply.size(), b.addr);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+    a.scheduler.run();
+    CPPUNIT_ASSERT_EQUAL(sent, a.socket->sent);
+}
+
+void
+NetworkEngineTester::testTxQueue()
+{
+    dht::net::RequestAnswer none;
+    Peer a("a", 4222, none), b("b", 4223, none);
+    a.engine->setTxQueue(8, std::chrono::seconds(10));
+    b.engine->setTxQueue(8, std::chrono::seconds(10));
+    auto nodeB = a.engine->insertNode(b.id, b.addr);
+
+    // Requests are sent right away
+    a.engine->sendPing(nodeB, {}, {});
+    CPPUNIT_ASSERT_EQUAL((size_t)1, a.socket->sent);
+    CPPUNIT_ASSERT_EQUAL((size_t)0, a.engine->getTxQueueSize(AF_INET));
+
+    // Replies wait in the queue until it is flushed
+    auto request = a.socket->last;
+    b.engine->processMessage(request.data(), request.size(), a.addr);
+    CPPUNIT_ASSERT_EQUAL((size_t)0, b.socket->sent);
+    CPPUNIT_ASSERT_EQUAL((size_t)1, b.engine->getTxQueueSize(AF_INET));
+    b.engine->flush();
+    CPPUNIT_ASSERT_EQUAL((size_t)1, b.socket->sent);
+    CPPUNIT_ASSERT_EQUAL((size_t)0, b.engine->getTxQueueSize(AF_INET));
+
+    // A request that can't be sent expires the node
+    a.socket->error = EHOSTUNREACH;
+    auto nodeC = a.engine->insertNode(dht::InfoHash::get("c"), localAddr(4224));
+    a.engine->sendPing(nodeC, {}, {});
+    CPPUNIT_ASSERT(nodeC->isExpired());
+    CPPUNIT_ASSERT(not nodeB->isExpired());
+}
+
+void
+NetworkEngineTester::testTrafficStats()
+{
+    dht::net::RequestAnswer none;
+    Peer a("a", 4222, none), b("b", 4223, none);
+    auto nodeB = a.engine->insertNode(b.id, b.addr);
+
+    size_t done {0};
+    a.engine->sendPing(nodeB, [&](const dht::net::Request&, dht::net::RequestAnswer&&) { done++; }, {});
+    auto request = a.socket->last;
+    b.engine->processMessage(request.data(), request.size(), a.addr);
+    auto reply = b.socket->last;
+    a.engine->processMessage(reply.data(), reply.size(), b.addr);
+    CPPUNIT_ASSERT_EQUAL((size_t)1, done);
+
+    auto sa = a.engine->getTrafficStats().messages.at("ping");
+    CPPUNIT_ASSERT_EQUAL((uint64_t)1, sa.requests_out);
+    CPPUNIT_ASSERT_EQUAL((uint64_t)request.size(), sa.bytes_out);
+    CPPUNIT_ASSERT_EQUAL((uint64_t)1, sa.replies_in);
+    CPPUNIT_ASSERT_EQUAL((uint64_t)reply.size(), sa.bytes_in);
+    CPPUNIT_ASSERT_EQUAL((uint64_t)1, sa.latency_count);
+    CPPUNIT_ASSERT_EQUAL((size_t)1, sa.latency_histogram.size());
+
+    auto sb = b.engine->getTrafficStats().messages.at("ping");
+    CPPUNIT_ASSERT_EQUAL((uint64_t)1, sb.requests_in);
+    CPPUNIT_ASSERT_EQUAL((uint64_t)request.size(), sb.bytes_in);
+    CPPUNIT_ASSERT_EQUAL((uint64_t)1, sb.replies_out);
+    CPPUNIT_ASSERT_EQUAL((uint64_t)reply.size(), sb.bytes_out);
+
+    // Requests above the rate limit are dropped and counted
+    b.engine->setRateLimit(1, 1);
+    for (unsigned i = 0; i < 4; i++)
+        b.engine->processMessage(request.data(), request.size(), a.addr);
+    sb = b.engine->getTrafficStats().messages.at("ping");
+    CPPUNIT_ASSERT(sb.rate_limited > 0);
+    CPPUNIT_ASSERT_EQUAL((uint64_t)5, sb.requests_in + sb.rate_limited);
+
+    // Percentiles of merged stats are computed from the merged histograms
+    dht::MessageTypeStats merged;
+    merged.add(sa);
+    merged.add(sa);
+    CPPUNIT_ASSERT_EQUAL((uint64_t)2, merged.latency_count);
+    CPPUNIT_ASSERT(merged.latency_p99 <= merged.latency_max);
+}
+
+void
+NetworkEngineTester::testShardRouting()
+{
+    dht::net::RequestAnswer none;
+    Peer a("a", 4222, none), b("b", 4223, none);
+    a.engine->setShard(3);
+    auto nodeB = a.engine->insertNode(b.id, b.addr);
+
+    size_t done {0};
+    a.engine->sendPing(nodeB, [&](const dht::net::Request&, dht::net::RequestAnswer&&) { done++; }, {});
+    auto request = a.socket->last;
+    b.engine->processMessage(request.data(), request.size(), a.addr);
+    auto reply = b.socket->last;
+
+    // Requests are for any shard, replies for the one which sent the request
+    CPPUNIT_ASSERT_EQUAL((uint8_t)0, dht::net::NetworkEngine::getShard(request.data(), request.size()));
+    CPPUNIT_ASSERT_EQUAL((uint8_t)3, dht::net::NetworkEngine::getShard(reply.data(), reply.size()));
+    a.engine->processMessage(reply.data(), reply.size(), b.addr);
+    CPPUNIT_ASSERT_EQUAL((size_t)1, done);
+
+    // Same with the compact encoding, using integer keys
+    a.engine->setCompactEncoding(true);
+    b.engine->setCompactEncoding(true);
+    nodeB->setCompact(true);
+    a.engine->sendPing(nodeB, [&](const dht::net::Request&, dht::net::RequestAnswer&&) { done++; }, {});
+    request = a.socket->last;
+    b.engine->processMessage(request.data(), request.size(), a.addr);
+    reply = b.socket->last;
+    CPPUNIT_ASSERT_EQUAL((uint8_t)0, dht::net::NetworkEngine::getShard(request.data(), request.size()));
+    CPPUNIT_ASSERT_EQUAL((uint8_t)3, dht::net::NetworkEngine::getShard(reply.data(), reply.size()));
+
+    // Requests are routed by their target, pings have none
+    dht::InfoHash target;
+    CPPUNIT_ASSERT(not dht::net::NetworkEngine::getTarget(request.data(), request.size(), target));
+    auto key = dht::InfoHash::get("key");
+    for (bool compact : {true, false}) {
+        a.engine->setCompactEncoding(compact);
+        nodeB->setCompact(compact);
+        a.engine->sendFindNode(nodeB, key, -1, {}, {});
+        request = a.socket->last;
+        CPPUNIT_ASSERT(dht::net::NetworkEngine::getTarget(request.data(), request.size(), target));
+        CPPUNIT_ASSERT_EQUAL(key, target);
+        a.engine->sendGetValues(nodeB, key, {}, -1, {}, {});
+        request = a.socket->last;
+        target = {};
+        CPPUNIT_ASSERT(dht::net::NetworkEngine::getTarget(request.data(), request.size(), target));
+        CPPUNIT_ASSERT_EQUAL(key, target);
+    }
+}
+
+void
+NetworkEngineTester::tearDown() {
+
+}
+
+void
+NetworkEngineBenchmark::testEncode()
+{
+    constexpr unsigned N {50 * 1000};
+
+    // What the replying node knows: 8 close nodes, a token and two values
+    dht::net::RequestAnswer answer;
+    for (unsigned i = 0; i < 8; i++)
+        answer.nodes4.emplace_back(std::make_shared<dht::Node>(dht::InfoHash::getRandom(), localAddr(5000 + i)));
+    answer.ntoken = dht::Blob(32, 0xab);
+    auto withValues = answer;
+    for (unsigned i = 0; i < 2; i++) {
+        auto v = std::make_shared<dht::Value>(dht::Blob(128, i));
+        v->id = i + 1;
+        withValues.values.emplace_back(std::move(v));
+    }
+
+    Peer a("a", 4222, answer), b("b", 4223, answer), c("c", 4224, withValues);
+    auto nodeB = a.engine->insertNode(b.id, b.addr);
+    auto nodeC = a.engine->insertNode(c.id, c.addr);
+    auto key = dht::InfoHash::get("key");
+
+    size_t done {0};
+    auto onDone = [&](const dht::net::Request&, dht::net::RequestAnswer&&) { done++; };
+
+    struct Type {
+        std::string name;
+        std::function<dht::Sp<dht::net::Request>()> send;
+        dht::Sp<dht::Node> node;
+        Peer& replier;
+    };
+    std::vector<Type> types {
+        {"ping", [&]{ return a.engine->sendPing(nodeB, onDone, {}); }, nodeB, b},
+        {"find", [&]{ return a.engine->sendFindNode(nodeB, key, -1, onDone, {}); }, nodeB, b},
+        {"get (nodes)", [&]{ return a.engine->sendGetValues(nodeB, key, {}, -1, onDone, {}); }, nodeB, b},
+        {"get (values)", [&]{ return a.engine->sendGetValues(nodeC, key, {}, -1, onDone, {}); }, nodeC, c},
+    };
+
+    auto report = [&](const std::string& what, clock::duration dt, size_t allocs) {
+        std::cout << what << ": "
+                  << std::chrono::duration_cast<std::chrono::nanoseconds>(dt).count() / N << " ns/msg, "
+                  << (double)allocs / N << " allocations/msg" << std::endl;
+    };
+
+    std::cout << std::endl;
+    for (auto& t : types) {
+        // Requests, cancelled right away so that tables don't grow
+        AllocationCounter::start();
+        auto start = clock::now();
+        for (unsigned i = 0; i < N; i++) {
+            t.node->cancelRequest(t.send());
+        }
+        auto dt = clock::now() - start;
+        report(t.name + " request", dt, AllocationCounter::stop());
+        auto request = a.socket->last;
+
+        // Replies, including the decoding of the request
+        auto sent = t.replier.socket->sent;
+        AllocationCounter::start();
+        start = clock::now();
+        for (unsigned i = 0; i < N; i++)
+            t.replier.engine->processMessage(request.data(), request.size(), a.addr);
+        dt = clock::now() - start;
+        report(t.name + " reply", dt, AllocationCounter::stop());
+        CPPUNIT_ASSERT_EQUAL(sent + N, t.replier.socket->sent);
+
+        // The last reply completes a pending request
+        done = 0;
+        t.send();
+        request = a.socket->last;
+        t.replier.engine->processMessage(request.data(), request.size(), a.addr);
+        auto reply = t.replier.socket->last;
+        a.engine->processMessage(reply.data(), reply.size(), t.replier.addr);
+        CPPUNIT_ASSERT_EQUAL((size_t)1, done);
+    }
+}
+
+}  // namespace test
@@ -0,0 +1,99 @@
+/*
+ *  Copyright (C) 2019 Savoir-faire Linux Inc.
+ *
+ *  Author: Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// cppunit
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+namespace test {
+
+class NetworkEngineTester : public CppUnit::TestFixture {
+    CPPUNIT_TEST_SUITE(NetworkEngineTester);
+    CPPUNIT_TEST(testEncodeAllocations);
+    CPPUNIT_TEST(testValuePartsRetransmit);
+    CPPUNIT_TEST(testLargeReply);
+    CPPUNIT_TEST(testUnexpectedReply);
+    CPPUNIT_TEST(testTxQueue);
+    CPPUNIT_TEST(testTrafficStats);
+    CPPUNIT_TEST(testShardRouting);
+    CPPUNIT_TEST_SUITE_END();
+
+ public:
+    /**
+     * Method automatically called before each test by CppUnit
+     */
+    void setUp();
+    /**
+     * Method automatically called after each test CppUnit
+     */
+    void tearDown();
+
+    /**
+     * Pong, find and get replies are encoded and sent without heap
+     * allocation, once the transmit buffer reached its size
+     */
+    void testEncodeAllocations();
+    /**
+     * Fragments of a large value lost on the way are requested and sent
+     * again, instead of the whole request and reply
+     */
+    void testValuePartsRetransmit();
+    /**
+     * A reply larger than the per-peer reassembly budget is received when
+     * it is the only one pending from this peer
+     */
+    void testLargeReply();
+    /**
+     * Values sent in parts are only reassembled for replies to a pending
+     * request
+     */
+    void testUnexpectedReply();
+    /**
+     * With batching, replies are queued until flushed while requests are
+     * sent immediately, and their send errors expire the node
+     */
+    void testTxQueue();
+    /**
+     * Requests, replies, their size, latency and rate limited requests
+     * are accounted by message type
+     */
+    void testTrafficStats();
+    /**
+     * Replies carry the shard of the engine which sent the request, in
+     * their transaction id
+     */
+    void testShardRouting();
+};
+
+class NetworkEngineBenchmark : public CppUnit::TestFixture {
+    CPPUNIT_TEST_SUITE(NetworkEngineBenchmark);
+    CPPUNIT_TEST(testEncode);
+    CPPUNIT_TEST_SUITE_END();
+
+ public:
+    /**
+     * Time and heap allocations to send each common message type: requests
+     * sent by a first engine, and replies of a second one to these requests
+     */
+    void testEncode();
+};
+
+}  // namespace test
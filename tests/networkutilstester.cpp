@@ -0,0 +1,411 @@
+/*
+ *  Copyright (C) 2019 Savoir-faire Linux Inc.
+ *
+ *  Author: Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "networkutilstester.h"
+
+#include "opendht/network_utils.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+namespace test {
+CPPUNIT_TEST_SUITE_REGISTRATION(NetworkUtilsTester);
+// Prints timings: run with "opendht_unit_tests simulation"
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(NetworkUtilsBenchmark, "simulation");
+using clock = std::chrono::steady_clock;
+
+void
+NetworkUtilsTester::setUp() {
+
+}
+
+/* Sends N distinct datagrams to a socket receiving in batches of batch,
+ * and checks that all are delivered, in order and intact */
+static void
+checkReceive(unsigned batch, bool sendBatch)
+{
+    dht::SockAddr local4;
+    local4.setFamily(AF_INET);
+    local4.setAddress("127.0.0.1");
+    dht::net::UdpSocket rx(local4, {}, {}, batch);
+    dht::net::UdpSocket tx(local4, {});
+
+    constexpr unsigned N = 64;
+    std::mutex lock;
+    std::condition_variable cv;
+    std::vector<dht::Blob> received;
+    unsigned calls {0};
+    rx.setOnReceive([&](dht::net::PacketList&& packets) {
+        std::lock_guard<std::mutex> lk(lock);
+        for (const auto& p : packets)
+            received.emplace_back(p.data);
+        calls++;
+        cv.notify_all();
+    });
+
+    std::vector<dht::net::OutgoingPacket> packets(N);
+    for (unsigned i=0; i<N; i++) {
+        packets[i].data = dht::Blob(200, (uint8_t)i);
+        packets[i].to = rx.getBound(AF_INET);
+    }
+    if (sendBatch) {
+        CPPUNIT_ASSERT_EQUAL((size_t)N, tx.sendBatch(packets));
+    } else {
+        for (const auto& p : packets)
+            CPPUNIT_ASSERT_EQUAL(0, tx.sendTo(p.to, p.data.data(), p.data.size(), false));
+    }
+
+    std::unique_lock<std::mutex> lk(lock);
+    cv.wait_for(lk, std::chrono::seconds(5), [&]{ return received.size() >= N; });
+    CPPUNIT_ASSERT_EQUAL((size_t)N, received.size());
+    CPPUNIT_ASSERT(calls <= N);
+    for (unsigned i=0; i<N; i++)
+        CPPUNIT_ASSERT(received[i] == packets[i].data);
+    lk.unlock();
+    rx.stop();
+    tx.stop();
+}
+
+void
+NetworkUtilsTester::testUdpReceive() {
+    checkReceive(1, false);
+}
+
+void
+NetworkUtilsTester::testUdpReceiveBatch() {
+    checkReceive(dht::net::UdpSocket::RX_BATCH_MAX, false);
+}
+
+void
+NetworkUtilsTester::testUdpSendBatch() {
+    checkReceive(dht::net::UdpSocket::RX_BATCH_MAX, true);
+}
+
+void
+NetworkUtilsTester::testPacketPool()
+{
+    constexpr size_t N = 16;
+    auto pool = std::make_shared<dht::net::PacketPool>(N);
+
+    std::vector<dht::net::PacketBuffer> buffers;
+    for (size_t i=0; i<N; i++)
+        buffers.emplace_back(pool->get(100));
+    auto stats = pool->getStats();
+    CPPUNIT_ASSERT_EQUAL(N, stats.capacity);
+    CPPUNIT_ASSERT_EQUAL(N, stats.used);
+    CPPUNIT_ASSERT_EQUAL((size_t)0, stats.exhausted);
+    CPPUNIT_ASSERT_EQUAL((size_t)100, buffers.front().size());
+
+    // Exhausted: served from the heap
+    auto extra = pool->get();
+    CPPUNIT_ASSERT(extra.capacity() >= dht::net::PacketPool::BUFFER_SIZE);
+    auto large = pool->get(dht::net::PacketPool::BUFFER_SIZE * 4);
+    CPPUNIT_ASSERT_EQUAL(dht::net::PacketPool::BUFFER_SIZE * 4, large.size());
+    stats = pool->getStats();
+    CPPUNIT_ASSERT_EQUAL((size_t)1, stats.exhausted);
+    CPPUNIT_ASSERT_EQUAL((size_t)1, stats.oversize);
+
+    // Copies share the buffer, which is released with the last handle
+    buffers.front().data()[0] = 42;
+    auto copy = buffers.front();
+    CPPUNIT_ASSERT(copy.data() == buffers.front().data());
+    buffers.erase(buffers.begin());
+    CPPUNIT_ASSERT_EQUAL(N, pool->getStats().used);
+    CPPUNIT_ASSERT_EQUAL((uint8_t)42, copy.data()[0]);
+    copy.reset();
+    CPPUNIT_ASSERT_EQUAL(N - 1, pool->getStats().used);
+    buffers.clear();
+    stats = pool->getStats();
+    CPPUNIT_ASSERT_EQUAL((size_t)0, stats.used);
+    CPPUNIT_ASSERT_EQUAL(N, stats.peak);
+
+    // Recycled list nodes are reused
+    dht::net::PacketList packets;
+    pool->addPacket(packets);
+    packets.back().data = pool->get();
+    auto node = &packets.back();
+    pool->recycle(std::move(packets));
+    CPPUNIT_ASSERT_EQUAL((size_t)0, pool->getStats().used);
+    dht::net::PacketList packets2;
+    pool->addPacket(packets2);
+    CPPUNIT_ASSERT(&packets2.back() == node);
+    CPPUNIT_ASSERT(packets2.back().data.empty());
+
+    // Packets can still be filled and read as a Blob
+    dht::Blob blob {1, 2, 3};
+    dht::net::ReceivedPacket pkt;
+    pkt.data = {blob.begin(), blob.end()};
+    CPPUNIT_ASSERT(blob == dht::Blob(pkt.data));
+    pkt.data = std::move(blob);
+    dht::Blob copy = pkt.data;
+    CPPUNIT_ASSERT_EQUAL((size_t)3, copy.size());
+    CPPUNIT_ASSERT_EQUAL((uint8_t)3, copy[2]);
+}
+
+#ifdef __linux__
+void
+NetworkUtilsTester::testEpollSocket()
+{
+    dht::SockAddr local4;
+    local4.setFamily(AF_INET);
+    local4.setAddress("127.0.0.1");
+    auto loop = std::make_shared<dht::net::EpollLoop>();
+
+    constexpr unsigned SOCKETS = 8;
+    constexpr unsigned N = 256;
+    std::vector<std::unique_ptr<dht::net::EpollUdpSocket>> sockets;
+    std::vector<std::atomic_uint> counts(SOCKETS);
+    for (unsigned i=0; i<SOCKETS; i++) {
+        counts[i] = 0;
+        sockets.emplace_back(new dht::net::EpollUdpSocket(local4, {}, {}, loop, i % 2 ? dht::net::UdpSocket::RX_BATCH_MAX : 1));
+        auto& count = counts[i];
+        sockets.back()->setOnReceive([&count](dht::net::PacketList&& packets) {
+            count += packets.size();
+        });
+    }
+
+    dht::net::UdpSocket tx(local4, {});
+    std::vector<uint8_t> data(200, 0x42);
+    for (unsigned n=0; n<N; n++)
+        for (const auto& sock : sockets)
+            tx.sendTo(sock->getBound(AF_INET), data.data(), data.size(), false);
+
+    auto received = [&]{
+        unsigned total = 0;
+        for (const auto& c : counts)
+            total += c.load();
+        return total;
+    };
+    auto start = clock::now();
+    while (received() < N * SOCKETS && clock::now() - start < std::chrono::seconds(5))
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    sockets.clear();
+    tx.stop();
+    for (const auto& c : counts)
+        CPPUNIT_ASSERT_EQUAL(N, c.load());
+
+    // The last reference to the loop can be released from a callback
+    int fds[2];
+    CPPUNIT_ASSERT_EQUAL(0, pipe(fds));
+    std::atomic_bool released {false};
+    loop->add(fds[0], [&] {
+        loop.reset();
+        released = true;
+    });
+    CPPUNIT_ASSERT_EQUAL((ssize_t)1, write(fds[1], "", 1));
+    start = clock::now();
+    while (not released && clock::now() - start < std::chrono::seconds(5))
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    CPPUNIT_ASSERT(released);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+#endif
+
+void
+NetworkUtilsTester::tearDown() {
+}
+
+void
+NetworkUtilsBenchmark::receiveBench(unsigned batch)
+{
+    dht::SockAddr local4;
+    local4.setFamily(AF_INET);
+    local4.setAddress("127.0.0.1");
+    dht::net::UdpSocket rx(local4, {}, {}, batch);
+    dht::net::UdpSocket tx(local4, {});
+
+    std::atomic_uint count {0};
+    std::atomic_uint calls {0};
+    rx.setOnReceive([&](dht::net::PacketList&& packets) {
+        count += packets.size();
+        calls++;
+    });
+
+    constexpr unsigned N = 64 * 1024;
+    constexpr unsigned BURST = 256;
+    std::vector<uint8_t> data(200, 0x42);
+    auto dest = rx.getBound(AF_INET);
+
+    auto start = clock::now();
+    for (unsigned i=0; i<N; i++) {
+        tx.sendTo(dest, data.data(), data.size(), false);
+        // Leave some time to the receiver so that the kernel buffer doesn't overflow
+        if (i % BURST == BURST - 1) {
+            auto wait = clock::now();
+            while (i + 1 > count.load() + BURST && clock::now() - wait < std::chrono::milliseconds(5))
+                std::this_thread::yield();
+        }
+    }
+    while (count.load() < N && clock::now() - start < std::chrono::seconds(10)) {
+        auto c = count.load();
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        if (c == count.load())
+            break; // remaining packets were lost
+    }
+    auto end = clock::now();
+    rx.stop();
+    tx.stop();
+
+    auto received = count.load();
+    auto dt = std::chrono::duration_cast<std::chrono::duration<double>>(end - start).count();
+    std::cout << std::endl << "UDP receive (batch " << batch << "): " << received << "/" << N
+              << " packets in " << calls.load() << " calls, "
+              << (unsigned)(received / dt) << " packets/s" << std::endl;
+}
+
+void
+NetworkUtilsBenchmark::testUdpReceive() {
+    receiveBench(1);
+}
+
+void
+NetworkUtilsBenchmark::testUdpReceiveBatch() {
+    receiveBench(dht::net::UdpSocket::RX_BATCH_MAX);
+}
+
+void
+NetworkUtilsBenchmark::testUdpSendBatch()
+{
+    dht::SockAddr local4;
+    local4.setFamily(AF_INET);
+    local4.setAddress("127.0.0.1");
+    dht::net::UdpSocket rx(local4, {});
+    dht::net::UdpSocket tx(local4, {});
+
+    std::atomic_uint count {0};
+    rx.setOnReceive([&](dht::net::PacketList&& packets) {
+        count += packets.size();
+    });
+
+    constexpr unsigned N = 16 * 1024;
+    constexpr unsigned BATCH = 64;
+    std::vector<dht::net::OutgoingPacket> batch(BATCH);
+    for (auto& p : batch) {
+        p.data = dht::Blob(200, 0x42);
+        p.to = rx.getBound(AF_INET);
+    }
+
+    auto waitReceived = [&](unsigned expected) {
+        auto start = clock::now();
+        while (count.load() < expected && clock::now() - start < std::chrono::milliseconds(5))
+            std::this_thread::yield();
+    };
+
+    // one system call per datagram
+    auto start = clock::now();
+    for (unsigned i=0; i<N; i += BATCH) {
+        for (const auto& p : batch)
+            tx.sendTo(p.to, p.data.data(), p.data.size(), false);
+        waitReceived(i);
+    }
+    auto dtSingle = std::chrono::duration_cast<std::chrono::duration<double>>(clock::now() - start).count();
+
+    // batched
+    size_t sent = 0;
+    start = clock::now();
+    for (unsigned i=0; i<N; i += BATCH) {
+        sent += tx.sendBatch(batch);
+        waitReceived(N + i);
+    }
+    auto dtBatch = std::chrono::duration_cast<std::chrono::duration<double>>(clock::now() - start).count();
+
+    waitReceived(2 * N);
+    rx.stop();
+    tx.stop();
+
+    std::cout << std::endl << "UDP send: " << (unsigned)(N / dtSingle) << " packets/s with sendTo, "
+              << (unsigned)(N / dtBatch) << " packets/s with sendBatch, "
+              << count.load() << "/" << 2 * N << " received" << std::endl;
+    CPPUNIT_ASSERT_EQUAL((size_t)N, sent);
+}
+
+#ifdef __linux__
+void
+NetworkUtilsBenchmark::testWakeupLatency()
+{
+    dht::SockAddr local4;
+    local4.setFamily(AF_INET);
+    local4.setAddress("127.0.0.1");
+
+    dht::net::UdpSocket tx(local4, {});
+    std::vector<uint8_t> data(200, 0x42);
+
+    auto measure = [&](dht::net::DatagramSocket& rx) {
+        constexpr unsigned N = 2000;
+        std::mutex mtx;
+        std::condition_variable cv;
+        bool received {false};
+        clock::time_point rxTime;
+        rx.setOnReceive([&](dht::net::PacketList&&) {
+            auto now = clock::now();
+            std::lock_guard<std::mutex> lk(mtx);
+            rxTime = now;
+            received = true;
+            cv.notify_one();
+        });
+
+        std::vector<double> latencies;
+        latencies.reserve(N);
+        for (unsigned i=0; i<N; i++) {
+            std::unique_lock<std::mutex> lk(mtx);
+            received = false;
+            auto start = clock::now();
+            tx.sendTo(rx.getBound(AF_INET), data.data(), data.size(), false);
+            if (not cv.wait_for(lk, std::chrono::seconds(1), [&]{ return received; }))
+                continue;
+            latencies.emplace_back(std::chrono::duration<double, std::micro>(rxTime - start).count());
+        }
+        rx.setOnReceive({});
+        std::sort(latencies.begin(), latencies.end());
+        return latencies;
+    };
+
+    auto report = [](const char* name, const std::vector<double>& l) {
+        std::cout << name << ": median " << l[l.size() / 2] << " us, p99 " << l[l.size() * 99 / 100] << " us" << std::endl;
+    };
+
+    dht::net::UdpSocket selectSock(local4, {});
+    auto selectLatencies = measure(selectSock);
+    selectSock.stop();
+
+    dht::net::EpollUdpSocket epollSock(local4, {});
+    auto epollLatencies = measure(epollSock);
+    epollSock.stop();
+    tx.stop();
+
+    CPPUNIT_ASSERT(not selectLatencies.empty());
+    CPPUNIT_ASSERT(not epollLatencies.empty());
+    std::cout << std::endl;
+    report("select wakeup latency", selectLatencies);
+    report("epoll wakeup latency", epollLatencies);
+}
+#endif
+
+}  // namespace test
@@ -0,0 +1,108 @@
+/*
+ *  Copyright (C) 2019 Savoir-faire Linux Inc.
+ *
+ *  Author: Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// cppunit
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+namespace test {
+
+class NetworkUtilsTester : public CppUnit::TestFixture {
+    CPPUNIT_TEST_SUITE(NetworkUtilsTester);
+    CPPUNIT_TEST(testUdpReceive);
+    CPPUNIT_TEST(testUdpReceiveBatch);
+    CPPUNIT_TEST(testUdpSendBatch);
+    CPPUNIT_TEST(testPacketPool);
+#ifdef __linux__
+    CPPUNIT_TEST(testEpollSocket);
+#endif
+    CPPUNIT_TEST_SUITE_END();
+
+ public:
+    /**
+     * Method automatically called before each test by CppUnit
+     */
+    void setUp();
+    /**
+     * Method automatically called after each test CppUnit
+     */
+    void tearDown();
+
+    /**
+     * Datagrams are received intact and in order, one per system call
+     */
+    void testUdpReceive();
+    /**
+     * Datagrams are received intact and in order with recvmmsg batches
+     */
+    void testUdpReceiveBatch();
+    /**
+     * Datagrams sent with sendBatch (sendmmsg) are all received
+     */
+    void testUdpSendBatch();
+    /**
+     * Packet buffer pool occupancy, exhaustion and recycling
+     */
+    void testPacketPool();
+#ifdef __linux__
+    /**
+     * Several EpollUdpSocket sharing one EpollLoop, released from its
+     * own thread
+     */
+    void testEpollSocket();
+#endif
+};
+
+class NetworkUtilsBenchmark : public CppUnit::TestFixture {
+    CPPUNIT_TEST_SUITE(NetworkUtilsBenchmark);
+    CPPUNIT_TEST(testUdpReceive);
+    CPPUNIT_TEST(testUdpReceiveBatch);
+    CPPUNIT_TEST(testUdpSendBatch);
+#ifdef __linux__
+    CPPUNIT_TEST(testWakeupLatency);
+#endif
+    CPPUNIT_TEST_SUITE_END();
+
+ public:
+    /**
+     * Receive throughput with one system call per datagram
+     */
+    void testUdpReceive();
+    /**
+     * Receive throughput with recvmmsg batches
+     */
+    void testUdpReceiveBatch();
+    /**
+     * Send throughput of sendTo compared with sendBatch (sendmmsg)
+     */
+    void testUdpSendBatch();
+#ifdef __linux__
+    /**
+     * Wakeup latency of the epoll loop compared with the select loop
+     */
+    void testWakeupLatency();
+#endif
+
+ private:
+    void receiveBench(unsigned batch);
+};
+
+}  // namespace test
@@ -0,0 +1,561 @@
+/*
+ *  Copyright (C) 2019 Savoir-faire Linux Inc.
+ *
+ *  Author: Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "parsedmessagetester.h"
+
+#include "../src/parsed_message.h"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <vector>
+
+namespace test {
+CPPUNIT_TEST_SUITE_REGISTRATION(ParsedMessageTester);
+// Prints timings: run with "opendht_unit_tests simulation"
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(ParsedMessageBenchmark, "simulation");
+using clock = std::chrono::steady_clock;
+
+namespace {
+
+using Packer = dht::net::MessagePacker<msgpack::sbuffer>;
+
+dht::Blob
+randomBlob(std::mt19937& rd, size_t size)
+{
+    std::uniform_int_distribution<int> dist(0, 255);
+    dht::Blob b(size);
+    for (auto& c : b)
+        c = dist(rd);
+    return b;
+}
+
+void
+packBin(Packer& pk, const dht::Blob& b)
+{
+    pk.pack_bin(b.size());
+    pk.pack_bin_body((const char*)b.data(), b.size());
+}
+
+void
+packTid(Packer& pk, dht::Tid tid)
+{
+    uint32_t t = htonl(tid);
+    pk.pack(dht::net::KEY_TID);
+    pk.pack_bin(sizeof(t));
+    pk.pack_bin_body((const char*)&t, sizeof(t));
+}
+
+/** Common trailer of every message, as packed by NetworkEngine */
+void
+packHeader(Packer& pk, dht::Tid tid, const dht::net::WireKey& y, dht::NetId network = 0)
+{
+    packTid(pk, tid);
+    pk.pack(dht::net::KEY_Y); pk.pack(y);
+    pk.pack(dht::net::KEY_UA); pk.pack(std::string(pk.compact() ? "RNG2" : "RNG1"));
+    if (network) {
+        pk.pack(dht::net::KEY_NETID); pk.pack(network);
+    }
+}
+
+dht::Blob
+toBlob(const msgpack::sbuffer& buffer)
+{
+    return {buffer.data(), buffer.data() + buffer.size()};
+}
+
+/**
+ * Synthetic corpus covering every message type sent by NetworkEngine,
+ * packed the same way, with the default or the compact encoding.
+ */
+std::vector<dht::Blob>
+makeCorpus(bool compact = false)
+{
+    using namespace dht::net;
+    std::mt19937 rd(42);
+    std::vector<dht::Blob> corpus;
+    auto id = dht::InfoHash::get("node");
+    auto h = dht::InfoHash::get("key");
+    auto token = randomBlob(rd, 32);
+    auto sa4 = randomBlob(rd, 4);
+    auto sa6 = randomBlob(rd, 16);
+    dht::Tid tid = 1;
+
+    std::vector<dht::Sp<dht::Value>> values;
+    for (unsigned i = 0; i < 3; i++) {
+        auto v = std::make_shared<dht::Value>(randomBlob(rd, 64 << i));
+        v->id = rd();
+        v->user_type = "text/plain";
+        values.emplace_back(std::move(v));
+    }
+    dht::Query query {dht::Select().field(dht::Value::Field::Id), dht::Where().id(values[0]->id)};
+
+    // ping
+    {
+        msgpack::sbuffer buffer;
+        Packer pk(&buffer, compact);
+        pk.pack_map(6);
+        pk.pack(KEY_A); pk.pack_map(1);
+          pk.pack(KEY_REQ_ID); pk.pack(id);
+        pk.pack(KEY_Q); pk.pack(QUERY_PING);
+        packHeader(pk, tid++, KEY_Q, 7);
+        corpus.emplace_back(toBlob(buffer));
+    }
+    // pong
+    {
+        msgpack::sbuffer buffer;
+        Packer pk(&buffer, compact);
+        pk.pack_map(4);
+        pk.pack(KEY_R); pk.pack_map(2);
+          pk.pack(KEY_REQ_ID); pk.pack(id);
+          pk.pack(KEY_REQ_ADDRESS); packBin(pk, sa4);
+        packHeader(pk, tid++, KEY_R);
+        corpus.emplace_back(toBlob(buffer));
+    }
+    // find
+    {
+        msgpack::sbuffer buffer;
+        Packer pk(&buffer, compact);
+        pk.pack_map(6);
+        pk.pack(KEY_A); pk.pack_map(3);
+          pk.pack(KEY_REQ_ID); pk.pack(id);
+          pk.pack(KEY_REQ_TARGET); pk.pack(h);
+          pk.pack(KEY_REQ_WANT); pk.pack_array(2); pk.pack(AF_INET); pk.pack(AF_INET6);
+        pk.pack(KEY_Q); pk.pack(QUERY_FIND);
+        pk.pack(KEY_ISCLIENT); pk.pack(true);
+        packHeader(pk, tid++, KEY_Q);
+        corpus.emplace_back(toBlob(buffer));
+    }
+    // nodes reply
+    {
+        msgpack::sbuffer buffer;
+        Packer pk(&buffer, compact);
+        pk.pack_map(4);
+        pk.pack(KEY_R); pk.pack_map(5);
+          pk.pack(KEY_REQ_ID); pk.pack(id);
+          pk.pack(KEY_REQ_NODES4); packBin(pk, randomBlob(rd, 26 * 8));
+          pk.pack(KEY_REQ_NODES6); packBin(pk, randomBlob(rd, 38 * 8));
+          pk.pack(KEY_REQ_TOKEN); packBin(pk, token);
+          pk.pack(KEY_REQ_ADDRESS); packBin(pk, sa6);
+        packHeader(pk, tid++, KEY_R);
+        corpus.emplace_back(toBlob(buffer));
+    }
+    // get
+    {
+        msgpack::sbuffer buffer;
+        Packer pk(&buffer, compact);
+        pk.pack_map(5);
+        pk.pack(KEY_A); pk.pack_map(4);
+          pk.pack(KEY_REQ_ID); pk.pack(id);
+          pk.pack(KEY_REQ_H); pk.pack(h);
+          pk.pack(KEY_REQ_QUERY); pk.pack(query);
+          pk.pack(KEY_REQ_WANT); pk.pack_array(1); pk.pack(AF_INET);
+        pk.pack(KEY_Q); pk.pack(QUERY_GET);
+        packHeader(pk, tid++, KEY_Q);
+        corpus.emplace_back(toBlob(buffer));
+    }
+    // values reply, the last one announced for a partial transfer
+    {
+        msgpack::sbuffer buffer;
+        Packer pk(&buffer, compact);
+        pk.pack_map(4);
+        pk.pack(KEY_R); pk.pack_map(4);
+          pk.pack(KEY_REQ_ID); pk.pack(id);
+          pk.pack(KEY_REQ_TOKEN); packBin(pk, token);
+          pk.pack(KEY_REQ_ADDRESS); packBin(pk, sa4);
+          pk.pack(KEY_REQ_VALUES); pk.pack_array(values.size() + 1);
+          for (const auto& v : values)
+              pk.pack(*v);
+          pk.pack(20000);
+        packHeader(pk, tid++, KEY_R);
+        corpus.emplace_back(toBlob(buffer));
+    }
+    // fields reply
+    {
+        std::set<dht::Value::Field> fields {dht::Value::Field::Id, dht::Value::Field::SeqNum};
+        msgpack::sbuffer buffer;
+        Packer pk(&buffer, compact);
+        pk.pack_map(4);
+        pk.pack(KEY_R); pk.pack_map(2);
+          pk.pack(KEY_REQ_ID); pk.pack(id);
+          pk.pack(KEY_REQ_FIELDS); pk.pack_map(2);
+            pk.pack(std::string("f")); pk.pack(fields);
+            pk.pack(std::string("v")); pk.pack_array(values.size() * fields.size());
+            for (const auto& v : values)
+                v->msgpack_pack_fields(fields, pk);
+        packHeader(pk, tid++, KEY_R);
+        corpus.emplace_back(toBlob(buffer));
+    }
+    // listen
+    {
+        msgpack::sbuffer buffer;
+        Packer pk(&buffer, compact);
+        pk.pack_map(5);
+        pk.pack(KEY_A); pk.pack_map(5);
+          pk.pack(KEY_REQ_ID); pk.pack(id);
+          pk.pack(KEY_REQ_H); pk.pack(h);
+          pk.pack(KEY_REQ_TOKEN); packBin(pk, token);
+          pk.pack(KEY_REQ_SID); pk.pack(tid + 100);
+          pk.pack(KEY_REQ_QUERY); pk.pack(query);
+        pk.pack(KEY_Q); pk.pack(QUERY_LISTEN);
+        packHeader(pk, tid++, KEY_Q);
+        corpus.emplace_back(toBlob(buffer));
+    }
+    // put
+    {
+        msgpack::sbuffer buffer;
+        Packer pk(&buffer, compact);
+        pk.pack_map(5);
+        pk.pack(KEY_A); pk.pack_map(5);
+          pk.pack(KEY_REQ_ID); pk.pack(id);
+          pk.pack(KEY_REQ_H); pk.pack(h);
+          pk.pack(KEY_REQ_VALUES); pk.pack_array(1); pk.pack(*values[1]);
+          pk.pack(KEY_REQ_CREATION); pk.pack(1546300800);
+          pk.pack(KEY_REQ_TOKEN); packBin(pk, token);
+        pk.pack(KEY_Q); pk.pack(QUERY_PUT);
+        packHeader(pk, tid++, KEY_Q);
+        corpus.emplace_back(toBlob(buffer));
+    }
+    // refresh
+    {
+        msgpack::sbuffer buffer;
+        Packer pk(&buffer, compact);
+        pk.pack_map(5);
+        pk.pack(KEY_A); pk.pack_map(4);
+          pk.pack(KEY_REQ_ID); pk.pack(id);
+          pk.pack(KEY_REQ_H); pk.pack(h);
+          pk.pack(KEY_REQ_VALUE_ID); pk.pack(values[2]->id);
+          pk.pack(KEY_REQ_TOKEN); packBin(pk, token);
+        pk.pack(KEY_Q); pk.pack(QUERY_REFRESH);
+        packHeader(pk, tid++, KEY_Q);
+        corpus.emplace_back(toBlob(buffer));
+    }
+    // value updates
+    {
+        msgpack::sbuffer buffer;
+        Packer pk(&buffer, compact);
+        pk.pack_map(4);
+        pk.pack(KEY_U); pk.pack_map(5);
+          pk.pack(KEY_REQ_SID); pk.pack(tid + 100);
+          pk.pack(KEY_REQ_ID); pk.pack(id);
+          pk.pack(KEY_REQ_H); pk.pack(h);
+          pk.pack(KEY_REQ_EXPIRED); pk.pack(std::vector<dht::Value::Id> {values[0]->id, values[1]->id});
+          pk.pack(KEY_REQ_REFRESHED); pk.pack(std::vector<dht::Value::Id> {values[2]->id});
+        packHeader(pk, tid++, KEY_R);
+        corpus.emplace_back(toBlob(buffer));
+    }
+    // error
+    {
+        msgpack::sbuffer buffer;
+        Packer pk(&buffer, compact);
+        pk.pack_map(5);
+        pk.pack(KEY_E); pk.pack_array(2);
+          pk.pack(401); pk.pack(std::string("Unauthorized"));
+        pk.pack(KEY_R); pk.pack_map(2);
+          pk.pack(KEY_REQ_ID); pk.pack(id);
+          pk.pack(KEY_REQ_TOKEN); packBin(pk, token);
+        packHeader(pk, tid++, KEY_E);
+        corpus.emplace_back(toBlob(buffer));
+    }
+    // value data
+    {
+        msgpack::sbuffer buffer;
+        Packer pk(&buffer, compact);
+        pk.pack_map(3);
+        pk.pack(KEY_V); pk.pack_map(1);
+          pk.pack(2); pk.pack_map(2);
+            pk.pack(std::string("o")); pk.pack(1024);
+            pk.pack(std::string("d")); packBin(pk, randomBlob(rd, 1024));
+        packTid(pk, tid++);
+        pk.pack(KEY_Y); pk.pack(KEY_UA);
+        corpus.emplace_back(toBlob(buffer));
+    }
+    // request for missing value parts
+    {
+        msgpack::sbuffer buffer;
+        Packer pk(&buffer, compact);
+        pk.pack_map(4);
+        pk.pack(KEY_NETID); pk.pack(7);
+        pk.pack(KEY_Y); pk.pack(KEY_M);
+        packTid(pk, tid++);
+        pk.pack(KEY_M); pk.pack(std::map<unsigned, std::vector<unsigned>> {{0, {1, 3}}, {2, {0}}});
+        corpus.emplace_back(toBlob(buffer));
+    }
+    return corpus;
+}
+
+/** Decode with the generic msgpack object path only */
+bool
+decodeGeneric(const dht::Blob& b, dht::net::ParsedMessage& msg, msgpack::zone& zone)
+{
+    try {
+        zone.clear();
+        msg.msgpack_unpack(msgpack::unpack(zone, (const char*)b.data(), b.size(), dht::net::detail::referenceBuffer));
+        return true;
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+/** Decode with the fast decoder, falling back to the generic path */
+bool
+decode(const dht::Blob& b, dht::net::ParsedMessage& msg, msgpack::zone& zone)
+{
+    try {
+        zone.clear();
+        msg.unpack(b.data(), b.size(), zone);
+        return true;
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+void
+checkSame(dht::net::ParsedMessage& a, dht::net::ParsedMessage& b)
+{
+    CPPUNIT_ASSERT(a.type == b.type);
+    CPPUNIT_ASSERT_EQUAL(a.tid, b.tid);
+    CPPUNIT_ASSERT_EQUAL(a.ua, b.ua);
+    CPPUNIT_ASSERT_EQUAL(a.network, b.network);
+    CPPUNIT_ASSERT_EQUAL(a.is_client, b.is_client);
+    CPPUNIT_ASSERT(a.value_parts == b.value_parts);
+    CPPUNIT_ASSERT(a.missing_parts == b.missing_parts);
+    if (a.type == dht::net::MessageType::ValueData or a.type == dht::net::MessageType::ValueDataRequest)
+        return;
+    if (a.type == dht::net::MessageType::Error)
+        CPPUNIT_ASSERT_EQUAL(a.error_code, b.error_code);
+    CPPUNIT_ASSERT(a.id == b.id);
+    CPPUNIT_ASSERT(a.info_hash == b.info_hash);
+    CPPUNIT_ASSERT(a.target == b.target);
+    CPPUNIT_ASSERT_EQUAL(a.socket_id, b.socket_id);
+    CPPUNIT_ASSERT(a.token == b.token);
+    CPPUNIT_ASSERT_EQUAL(a.value_id, b.value_id);
+    CPPUNIT_ASSERT(a.created == b.created);
+    CPPUNIT_ASSERT(a.nodes4_raw == b.nodes4_raw);
+    CPPUNIT_ASSERT(a.nodes6_raw == b.nodes6_raw);
+    CPPUNIT_ASSERT(a.expired_values == b.expired_values);
+    CPPUNIT_ASSERT(a.refreshed_values == b.refreshed_values);
+    CPPUNIT_ASSERT_EQUAL(a.want, b.want);
+    CPPUNIT_ASSERT(a.addr == b.addr);
+    CPPUNIT_ASSERT(dht::packMsg(a.query) == dht::packMsg(b.query));
+    CPPUNIT_ASSERT_EQUAL(a.values.size(), b.values.size());
+    for (size_t i = 0; i < a.values.size(); i++)
+        CPPUNIT_ASSERT(*a.values[i] == *b.values[i]);
+    CPPUNIT_ASSERT_EQUAL(a.fields.size(), b.fields.size());
+    for (size_t i = 0; i < a.fields.size(); i++)
+        CPPUNIT_ASSERT(a.fields[i]->containedIn(*b.fields[i]) and b.fields[i]->containedIn(*a.fields[i]));
+}
+
+}
+
+void
+ParsedMessageTester::setUp() {
+
+}
+
+void
+ParsedMessageTester::testEquivalence()
+{
+    auto corpus = makeCorpus();
+    auto compact = makeCorpus(true);
+    corpus.insert(corpus.end(), compact.begin(), compact.end());
+    msgpack::zone zone;
+
+    // Every message sent by NetworkEngine takes the fast path
+    for (const auto& p : corpus) {
+        dht::net::ParsedMessage fast {}, generic {};
+        zone.clear();
+        CPPUNIT_ASSERT(fast.unpackFast((const char*)p.data(), p.size(), zone));
+        CPPUNIT_ASSERT(decodeGeneric(p, generic, zone));
+        checkSame(generic, fast);
+    }
+
+    // Mutated packets: both decoders must agree on success and content
+    std::mt19937 rd(1234);
+    std::uniform_int_distribution<int> byte(0, 255);
+    constexpr unsigned ITERATIONS {50 * 1000};
+    unsigned ok {0};
+    for (unsigned i = 0; i < ITERATIONS; i++) {
+        auto p = corpus[rd() % corpus.size()];
+        auto mutations = 1 + rd() % 3;
+        for (unsigned m = 0; m < mutations and not p.empty(); m++) {
+            if (rd() % 8 == 0)
+                p.resize(rd() % p.size());
+            else
+                p[rd() % p.size()] = byte(rd);
+        }
+        dht::net::ParsedMessage fast {}, generic {};
+        auto genericOk = decodeGeneric(p, generic, zone);
+        auto fastOk = decode(p, fast, zone);
+        CPPUNIT_ASSERT_EQUAL(genericOk, fastOk);
+        if (genericOk) {
+            checkSame(generic, fast);
+            ok++;
+        }
+    }
+    std::cout << std::endl << ok << "/" << ITERATIONS << " mutated packets decoded" << std::endl;
+}
+
+void
+ParsedMessageTester::testCompactEncoding()
+{
+    auto corpus = makeCorpus();
+    auto compact = makeCorpus(true);
+    CPPUNIT_ASSERT_EQUAL(corpus.size(), compact.size());
+    msgpack::zone zone;
+
+    for (size_t i = 0; i < corpus.size(); i++) {
+        dht::net::ParsedMessage msg {}, compactMsg {};
+        CPPUNIT_ASSERT(decode(corpus[i], msg, zone));
+        CPPUNIT_ASSERT(decode(compact[i], compactMsg, zone));
+        CPPUNIT_ASSERT(compactMsg.ua == "RNG2" or compactMsg.type == dht::net::MessageType::ValueData
+                                              or compactMsg.type == dht::net::MessageType::ValueDataRequest);
+        compactMsg.ua = msg.ua;
+        checkSame(msg, compactMsg);
+        CPPUNIT_ASSERT(compact[i].size() < corpus[i].size());
+    }
+}
+
+void
+ParsedMessageTester::testValueReassembly()
+{
+    constexpr size_t FRAGMENT {1280};
+    std::mt19937 rd(42);
+    std::vector<dht::Value> values;
+    std::vector<dht::Blob> packed;
+    std::vector<std::pair<unsigned, size_t>> sizes;
+    for (unsigned i = 0; i < 3; i++) {
+        values.emplace_back(randomBlob(rd, 3000 * i + 100));
+        values.back().id = i + 1;
+        packed.emplace_back(dht::packMsg(values.back()));
+        // values 0 and 2 are sent in parts
+        if (i != 1)
+            sizes.emplace_back(i, packed.back().size());
+    }
+    dht::net::ValueReassembly parts(sizes, FRAGMENT);
+    CPPUNIT_ASSERT_EQUAL(packed[0].size() + packed[2].size(), parts.size());
+
+    std::vector<std::pair<unsigned, size_t>> fragments;
+    for (auto i : {0u, 2u})
+        for (size_t o = 0; o < packed[i].size(); o += FRAGMENT)
+            fragments.emplace_back(i, o);
+    std::shuffle(fragments.begin(), fragments.end(), rd);
+    auto add = [&](const std::pair<unsigned, size_t>& f) {
+        const auto& p = packed[f.first];
+        auto len = std::min(FRAGMENT, p.size() - f.second);
+        return parts.add(f.first, f.second, p.data() + f.second, len);
+    };
+
+    // Invalid fragments are ignored
+    CPPUNIT_ASSERT(not parts.add(1, 0, packed[1].data(), packed[1].size()));
+    CPPUNIT_ASSERT(not parts.add(2, 10, packed[2].data() + 10, FRAGMENT));
+    CPPUNIT_ASSERT(not parts.add(2, 0, packed[2].data(), 10));
+    CPPUNIT_ASSERT(not parts.add(2, packed[2].size() + FRAGMENT, packed[2].data(), 1));
+
+    // All but the last fragment, in random order, some twice
+    for (size_t i = 0; i + 1 < fragments.size(); i++) {
+        CPPUNIT_ASSERT(add(fragments[i]));
+        CPPUNIT_ASSERT(not add(fragments[rd() % (i + 1)]));
+    }
+    CPPUNIT_ASSERT(not parts.complete());
+    CPPUNIT_ASSERT_EQUAL((size_t)1, parts.missing());
+    auto missing = parts.getMissing(64);
+    CPPUNIT_ASSERT_EQUAL((size_t)1, missing.size());
+    CPPUNIT_ASSERT_EQUAL(fragments.back().first, missing.begin()->first);
+    CPPUNIT_ASSERT(missing.begin()->second == std::vector<unsigned>{(unsigned)(fragments.back().second / FRAGMENT)});
+
+    CPPUNIT_ASSERT(add(fragments.back()));
+    CPPUNIT_ASSERT(parts.complete());
+    CPPUNIT_ASSERT(parts.getMissing(64).empty());
+
+    dht::net::ParsedMessage msg {};
+    msg.complete(parts);
+    CPPUNIT_ASSERT_EQUAL((size_t)2, msg.values.size());
+    CPPUNIT_ASSERT(*msg.values[0] == values[0]);
+    CPPUNIT_ASSERT(*msg.values[1] == values[2]);
+}
+
+void
+ParsedMessageTester::tearDown() {
+
+}
+
+void
+ParsedMessageBenchmark::testDecode()
+{
+    auto corpus = makeCorpus();
+    msgpack::zone zone;
+    constexpr unsigned ROUNDS {20 * 1000};
+
+    auto bench = [&](const std::function<bool(const dht::Blob&, dht::net::ParsedMessage&)>& dec) {
+        auto start = clock::now();
+        for (unsigned r = 0; r < ROUNDS; r++)
+            for (const auto& p : corpus) {
+                dht::net::ParsedMessage msg {};
+                CPPUNIT_ASSERT(dec(p, msg));
+            }
+        return std::chrono::duration_cast<std::chrono::duration<double>>(clock::now() - start).count();
+    };
+
+    auto tGeneric = bench([&](const dht::Blob& p, dht::net::ParsedMessage& msg) {
+        return decodeGeneric(p, msg, zone);
+    });
+    auto tFast = bench([&](const dht::Blob& p, dht::net::ParsedMessage& msg) {
+        return decode(p, msg, zone);
+    });
+    auto n = ROUNDS * corpus.size();
+    std::cout << std::endl
+              << "generic decoder: " << n / tGeneric << " msg/s" << std::endl
+              << "fast decoder:    " << n / tFast << " msg/s" << std::endl;
+}
+
+void
+ParsedMessageBenchmark::testCompactDecode()
+{
+    auto corpus = makeCorpus();
+    auto compact = makeCorpus(true);
+    msgpack::zone zone;
+
+    size_t bytes {0}, compactBytes {0};
+    for (size_t i = 0; i < corpus.size(); i++) {
+        bytes += corpus[i].size();
+        compactBytes += compact[i].size();
+    }
+
+    constexpr unsigned ROUNDS {20 * 1000};
+    auto bench = [&](const std::vector<dht::Blob>& packets) {
+        auto start = clock::now();
+        for (unsigned r = 0; r < ROUNDS; r++)
+            for (const auto& p : packets) {
+                dht::net::ParsedMessage msg {};
+                CPPUNIT_ASSERT(decode(p, msg, zone));
+            }
+        return std::chrono::duration_cast<std::chrono::duration<double>>(clock::now() - start).count();
+    };
+    auto t = bench(corpus);
+    auto tCompact = bench(compact);
+    auto n = ROUNDS * corpus.size();
+    std::cout << std::endl
+              << "default encoding: " << bytes / corpus.size() << " bytes/msg, " << n / t << " msg/s" << std::endl
+              << "compact encoding: " << compactBytes / compact.size() << " bytes/msg, " << n / tCompact << " msg/s" << std::endl;
+}
+
+}  // namespace test
@@ -0,0 +1,79 @@
+/*
+ *  Copyright (C) 2019 Savoir-faire Linux Inc.
+ *
+ *  Author: Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// cppunit
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+namespace test {
+
+class ParsedMessageTester : public CppUnit::TestFixture {
+    CPPUNIT_TEST_SUITE(ParsedMessageTester);
+    CPPUNIT_TEST(testEquivalence);
+    CPPUNIT_TEST(testCompactEncoding);
+    CPPUNIT_TEST(testValueReassembly);
+    CPPUNIT_TEST_SUITE_END();
+
+ public:
+    /**
+     * Method automatically called before each test by CppUnit
+     */
+    void setUp();
+    /**
+     * Method automatically called after each test CppUnit
+     */
+    void tearDown();
+
+    /**
+     * Randomly mutated and truncated packets decode to the same message,
+     * or fail, with the fast decoder and with the generic one
+     */
+    void testEquivalence();
+    /**
+     * Messages with the compact encoding decode to the same content, and
+     * are smaller
+     */
+    void testCompactEncoding();
+    /**
+     * Values sent in parts are rebuilt from fragments received in any
+     * order, missing fragments being listed until the values are complete
+     */
+    void testValueReassembly();
+};
+
+class ParsedMessageBenchmark : public CppUnit::TestFixture {
+    CPPUNIT_TEST_SUITE(ParsedMessageBenchmark);
+    CPPUNIT_TEST(testDecode);
+    CPPUNIT_TEST(testCompactDecode);
+    CPPUNIT_TEST_SUITE_END();
+
+ public:
+    /**
+     * Decoding time of the packet corpus with both decoders
+     */
+    void testDecode();
+    /**
+     * Size and decoding time of the packet corpus with both encodings
+     */
+    void testCompactDecode();
+};
+
+}  // namespace test
@@ -0,0 +1,201 @@
+/*
+ *  Copyright (C) 2019 Savoir-faire Linux Inc.
+ *
+ *  Author: Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "ratelimitertester.h"
+
+#include "opendht/rate_limiter.h"
+
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace test {
+CPPUNIT_TEST_SUITE_REGISTRATION(RateLimiterTester);
+// Prints timings: run with "opendht_unit_tests simulation"
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(RateLimiterBenchmark, "simulation");
+using clock = std::chrono::steady_clock;
+
+void
+RateLimiterTester::setUp() {
+
+}
+
+namespace {
+
+dht::SockAddr
+makeAddr(sa_family_t af, const char* ip, in_port_t port = 4222)
+{
+    dht::SockAddr addr;
+    addr.setFamily(af);
+    addr.setAddress(ip);
+    addr.setPort(port);
+    return addr;
+}
+
+dht::SockAddr
+randomAddr(std::mt19937& rd)
+{
+    sockaddr_in sin {};
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(4222);
+    sin.sin_addr.s_addr = rd();
+    return dht::SockAddr((const sockaddr*)&sin, sizeof(sin));
+}
+
+}
+
+void
+RateLimiterTester::testTokenBucket()
+{
+    dht::TokenBucket::Quota quota {10};
+    dht::TokenBucket bucket;
+    dht::time_point now = dht::clock::now();
+    CPPUNIT_ASSERT(bucket.idle(now));
+
+    // A full bucket accepts a burst of the quota
+    for (unsigned i = 0; i < 10; i++)
+        CPPUNIT_ASSERT(bucket.limit(now, quota));
+    CPPUNIT_ASSERT(not bucket.limit(now, quota));
+    CPPUNIT_ASSERT(not bucket.idle(now));
+
+    // One token is refilled every 100ms
+    now += std::chrono::milliseconds(99);
+    CPPUNIT_ASSERT(not bucket.limit(now, quota));
+    now += std::chrono::milliseconds(1);
+    CPPUNIT_ASSERT(bucket.limit(now, quota));
+    CPPUNIT_ASSERT(not bucket.limit(now, quota));
+
+    // Sustained rate at the quota is accepted
+    for (unsigned i = 0; i < 100; i++) {
+        now += std::chrono::milliseconds(100);
+        CPPUNIT_ASSERT(bucket.limit(now, quota));
+    }
+
+    // Refilled after one period
+    now += std::chrono::seconds(1);
+    CPPUNIT_ASSERT(bucket.idle(now));
+    for (unsigned i = 0; i < 10; i++)
+        CPPUNIT_ASSERT(bucket.limit(now, quota));
+    CPPUNIT_ASSERT(not bucket.limit(now, quota));
+
+    dht::TokenBucket::Quota unlimited {0};
+    CPPUNIT_ASSERT(unlimited.unlimited());
+    for (unsigned i = 0; i < 1000; i++)
+        CPPUNIT_ASSERT(bucket.limit(now, unlimited));
+}
+
+void
+RateLimiterTester::testIpRateLimiter()
+{
+    dht::IpRateLimiter limiter({2}, 4);
+    auto now = dht::clock::now();
+    auto a4 = makeAddr(AF_INET, "192.168.0.1");
+    auto a4_port = makeAddr(AF_INET, "192.168.0.1", 4223);
+    auto b4 = makeAddr(AF_INET, "192.168.0.2");
+    auto a6 = makeAddr(AF_INET6, "2001:db8::1");
+    auto a6_prefix = makeAddr(AF_INET6, "2001:db8::2");
+
+    CPPUNIT_ASSERT(limiter.limit(a4, now));
+    CPPUNIT_ASSERT(limiter.limit(a4_port, now));
+    CPPUNIT_ASSERT(not limiter.limit(a4, now));
+    CPPUNIT_ASSERT(limiter.limit(b4, now));
+    // Same /64 prefix
+    CPPUNIT_ASSERT(limiter.limit(a6, now));
+    CPPUNIT_ASSERT(limiter.limit(a6_prefix, now));
+    CPPUNIT_ASSERT(not limiter.limit(a6, now));
+    CPPUNIT_ASSERT_EQUAL((size_t)3, limiter.size());
+
+    // Keep a4 recently seen, then fill the table: b4 is forgotten first
+    CPPUNIT_ASSERT(not limiter.limit(a4, now));
+    for (unsigned i = 0; i < 2; i++)
+        CPPUNIT_ASSERT(limiter.limit(makeAddr(AF_INET, ("10.0.0." + std::to_string(i)).c_str()), now));
+    CPPUNIT_ASSERT_EQUAL((size_t)4, limiter.size());
+    CPPUNIT_ASSERT(not limiter.limit(a4, now));
+    CPPUNIT_ASSERT(limiter.limit(b4, now));
+    CPPUNIT_ASSERT(limiter.limit(b4, now));
+    CPPUNIT_ASSERT(not limiter.limit(b4, now));
+    CPPUNIT_ASSERT_EQUAL((size_t)4, limiter.size());
+
+    // Quota can be changed at runtime
+    limiter.setQuota({0});
+    CPPUNIT_ASSERT(limiter.limit(a4, now));
+    limiter.setQuota({4});
+    CPPUNIT_ASSERT(limiter.limit(a4, now + std::chrono::seconds(1)));
+}
+
+void
+RateLimiterTester::testSpoofed()
+{
+    std::mt19937 rd(42);
+    // The same random address might come twice
+    dht::IpRateLimiter limiter({2}, 1024);
+    auto now = dht::clock::now();
+    for (size_t i = 0; i < 4 * limiter.capacity(); i++)
+        CPPUNIT_ASSERT(limiter.limit(randomAddr(rd), now));
+    CPPUNIT_ASSERT_EQUAL(limiter.capacity(), limiter.size());
+}
+
+void
+RateLimiterTester::tearDown() {
+
+}
+
+void
+RateLimiterBenchmark::testFlood()
+{
+    constexpr size_t N = 500 * 1000;
+    constexpr size_t QUOTA = 200;
+    std::mt19937 rd(42);
+    std::vector<dht::SockAddr> addrs;
+    addrs.reserve(N);
+    for (size_t i = 0; i < N; i++)
+        addrs.emplace_back(randomAddr(rd));
+    // Spread over one second
+    auto start_time = dht::clock::now();
+    auto step = std::chrono::seconds(1) / N;
+
+    // Previous implementation: a queue of records per address
+    using IpLimiter = dht::RateLimiter<QUOTA>;
+    std::map<dht::SockAddr, IpLimiter, dht::SockAddr::ipCmp> map_limiter;
+    size_t map_accepted = 0;
+    auto start = clock::now();
+    for (size_t i = 0; i < N; i++)
+        map_accepted += map_limiter[addrs[i]].limit(start_time + i * step);
+    auto map_time = std::chrono::duration<double>(clock::now() - start).count();
+
+    dht::IpRateLimiter limiter {dht::TokenBucket::Quota {QUOTA}};
+    size_t accepted = 0;
+    start = clock::now();
+    for (size_t i = 0; i < N; i++)
+        accepted += limiter.limit(addrs[i], start_time + i * step);
+    auto time = std::chrono::duration<double>(clock::now() - start).count();
+
+    // Memory stays bounded by the table capacity
+    CPPUNIT_ASSERT_EQUAL(limiter.capacity(), limiter.size());
+    CPPUNIT_ASSERT_EQUAL(N, map_accepted);
+    CPPUNIT_ASSERT_EQUAL(N, accepted);
+    std::cout << std::endl << N << " requests from random addresses: "
+              << "map of queues " << (uint64_t)(N / map_time) << " req/s with " << map_limiter.size() << " entries, "
+              << "hashed token buckets " << (uint64_t)(N / time) << " req/s with " << limiter.size() << " entries" << std::endl;
+}
+
+}  // namespace test
@@ -0,0 +1,73 @@
+/*
+ *  Copyright (C) 2019 Savoir-faire Linux Inc.
+ *
+ *  Author: Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// cppunit
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+namespace test {
+
+class RateLimiterTester : public CppUnit::TestFixture {
+    CPPUNIT_TEST_SUITE(RateLimiterTester);
+    CPPUNIT_TEST(testTokenBucket);
+    CPPUNIT_TEST(testIpRateLimiter);
+    CPPUNIT_TEST(testSpoofed);
+    CPPUNIT_TEST_SUITE_END();
+
+ public:
+    /**
+     * Method automatically called before each test by CppUnit
+     */
+    void setUp();
+    /**
+     * Method automatically called after each test CppUnit
+     */
+    void tearDown();
+
+    /**
+     * Burst, refill and disabled quota
+     */
+    void testTokenBucket();
+    /**
+     * Per address limits, IPv6 prefixes and eviction of old addresses
+     */
+    void testIpRateLimiter();
+    /**
+     * Requests from many spoofed addresses are accepted, and the table
+     * stays within its capacity
+     */
+    void testSpoofed();
+};
+
+class RateLimiterBenchmark : public CppUnit::TestFixture {
+    CPPUNIT_TEST_SUITE(RateLimiterBenchmark);
+    CPPUNIT_TEST(testFlood);
+    CPPUNIT_TEST_SUITE_END();
+
+ public:
+    /**
+     * Requests from many spoofed addresses, compared with the previous
+     * map of record queues
+     */
+    void testFlood();
+};
+
+}  // namespace test
@@ -0,0 +1,437 @@
+/*
+ *  Copyright (C) 2019 Savoir-faire Linux Inc.
+ *
+ *  Author: Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "routingtabletester.h"
+
+#include "opendht/routing_table.h"
+#include "opendht/network_engine.h"
+#include "../src/request.h"
+
+#include <chrono>
+#include <iostream>
+#include <random>
+
+namespace test {
+CPPUNIT_TEST_SUITE_REGISTRATION(RoutingTableTester);
+// Prints timings: run with "opendht_unit_tests simulation"
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(RoutingTableBenchmark, "simulation");
+using clock = std::chrono::steady_clock;
+
+namespace {
+
+/* size of a packed IPv4 node */
+constexpr size_t NODE4_LEN {HASH_LEN + sizeof(in_addr) + sizeof(in_port_t)};
+
+/** A node that just replied to us */
+dht::Sp<dht::Node>
+goodNode(const dht::time_point& now, in_port_t port, const dht::InfoHash& id = dht::InfoHash::getRandom())
+{
+    dht::SockAddr addr;
+    addr.setFamily(AF_INET);
+    addr.setAddress("127.0.0.1");
+    addr.setPort(port);
+    auto node = std::make_shared<dht::Node>(id, addr);
+    node->received(now, std::make_shared<dht::net::Request>());
+    return node;
+}
+
+dht::Blob
+packClosest(const dht::RoutingTable& table, const dht::InfoHash& id, const dht::time_point& now)
+{
+    auto nodes = table.findClosestNodes(id, now);
+    dht::Blob packed;
+    dht::net::NetworkEngine::packNodes(AF_INET, id, nodes, packed);
+    return packed;
+}
+
+}
+
+void
+RoutingTableTester::setUp() {
+
+}
+
+void
+RoutingTableTester::testPackedNodesCache()
+{
+    dht::Logger logger {};
+    dht::Scheduler scheduler {};
+    dht::net::NetworkEngine engine(logger, scheduler, {});
+    auto now = scheduler.time();
+    auto myid = dht::InfoHash::getRandom();
+    auto target = dht::InfoHash::getRandom();
+
+    dht::RoutingTable table {dht::Bucket {AF_INET}};
+    for (unsigned i = 0; i < 4; i++)
+        table.onNewNode(goodNode(now, 5000 + i), 2, now, myid, engine);
+
+    auto packed = table.findClosestNodesPacked(target, now);
+    CPPUNIT_ASSERT_EQUAL((size_t)4 * NODE4_LEN, packed->size());
+    CPPUNIT_ASSERT(packClosest(table, target, now) == *packed);
+
+    // Cache hit
+    CPPUNIT_ASSERT(table.findClosestNodesPacked(target, now) == packed);
+
+    // A new node in the bucket
+    table.onNewNode(goodNode(now, 5004), 2, now, myid, engine);
+    auto packed2 = table.findClosestNodesPacked(target, now);
+    CPPUNIT_ASSERT(packed2 != packed);
+    CPPUNIT_ASSERT_EQUAL((size_t)5 * NODE4_LEN, packed2->size());
+    CPPUNIT_ASSERT(packClosest(table, target, now) == *packed2);
+    CPPUNIT_ASSERT(table.findClosestNodesPacked(target, now) == packed2);
+
+    // A node removed from the bucket
+    auto& bucket = *table.findBucket(target);
+    bucket.nodes.pop_back();
+    table.touch(bucket);
+    auto packed3 = table.findClosestNodesPacked(target, now);
+    CPPUNIT_ASSERT_EQUAL((size_t)4 * NODE4_LEN, packed3->size());
+    CPPUNIT_ASSERT(packClosest(table, target, now) == *packed3);
+
+    // Node liveness depends on time: answers expire
+    auto later = now + dht::RoutingTable::PACKED_NODES_TTL;
+    CPPUNIT_ASSERT(table.findClosestNodesPacked(target, later) != packed3);
+
+    // Grow the table around our id, splitting buckets
+    for (unsigned i = 0; i < 256; i++)
+        table.onNewNode(goodNode(now, 6000 + i), 2, now, myid, engine);
+    CPPUNIT_ASSERT(table.size() > 1);
+    std::vector<dht::InfoHash> targets {myid};
+    for (unsigned i = 0; i < 64; i++)
+        targets.emplace_back(dht::InfoHash::getRandom());
+    for (const auto& t : targets)
+        CPPUNIT_ASSERT(packClosest(table, t, now) == *table.findClosestNodesPacked(t, now));
+
+    // Splitting the bucket of our id invalidates answers using it
+    auto mine = table.findClosestNodesPacked(myid, now);
+    auto b = table.findBucket(myid);
+    table.split(b);
+    CPPUNIT_ASSERT(table.findClosestNodesPacked(myid, now) != mine);
+    CPPUNIT_ASSERT(packClosest(table, myid, now) == *table.findClosestNodesPacked(myid, now));
+}
+
+void
+RoutingTableTester::testNodeRtt() {
+    using namespace std::chrono;
+    auto now = clock::now();
+    auto node = goodNode(now, 4222);
+    CPPUNIT_ASSERT(not node->hasRtt());
+    CPPUNIT_ASSERT(node->getResponseTime() == dht::Node::MAX_RESPONSE_TIME);
+
+    // Fast and stable: the timeout converges to the lower bound
+    for (unsigned i = 0; i < 32; i++)
+        node->rttSample(milliseconds(20));
+    CPPUNIT_ASSERT(node->hasRtt());
+    CPPUNIT_ASSERT(node->getSrtt() == milliseconds(20));
+    CPPUNIT_ASSERT(node->getRttVar() < milliseconds(1));
+    CPPUNIT_ASSERT(node->getResponseTime() == dht::Node::MIN_RESPONSE_TIME);
+
+    // Timeouts double the timeout, up to the upper bound
+    node->rttTimeout();
+    CPPUNIT_ASSERT(node->getResponseTime() == 2 * dht::Node::MIN_RESPONSE_TIME);
+    for (unsigned i = 0; i < 8; i++)
+        node->rttTimeout();
+    CPPUNIT_ASSERT(node->getResponseTime() == dht::Node::MAX_RESPONSE_BACKOFF);
+
+    // A new measure resets the backoff
+    node->rttSample(milliseconds(20));
+    CPPUNIT_ASSERT(node->getResponseTime() == dht::Node::MIN_RESPONSE_TIME);
+
+    // Slow and jittery: srtt + 4 * rttvar
+    auto far = goodNode(now, 4223);
+    for (unsigned i = 0; i < 64; i++)
+        far->rttSample(milliseconds(i % 2 ? 300 : 500));
+    auto srtt = duration_cast<milliseconds>(far->getSrtt()).count();
+    auto rttvar = duration_cast<milliseconds>(far->getRttVar()).count();
+    CPPUNIT_ASSERT(srtt > 350 and srtt < 450);
+    CPPUNIT_ASSERT(rttvar > 50 and rttvar < 150);
+    CPPUNIT_ASSERT(far->getResponseTime() == far->getSrtt() + 4 * far->getRttVar());
+    CPPUNIT_ASSERT(far->getResponseTime() > node->getResponseTime());
+}
+
+void
+RoutingTableTester::testReplacementCache()
+{
+    using namespace std::chrono;
+    dht::Logger logger {};
+    dht::Scheduler scheduler {};
+    dht::net::NetworkEngine engine(logger, scheduler, {});
+    auto now = scheduler.time();
+
+    // Candidates are ranked by liveness, then round-trip time
+    dht::Bucket bucket {AF_INET};
+    auto slow = goodNode(now, 4000);
+    slow->rttSample(milliseconds(300));
+    auto fast = goodNode(now, 4001);
+    fast->rttSample(milliseconds(20));
+    auto unmeasured = goodNode(now, 4002);
+    auto dubious = std::make_shared<dht::Node>(dht::InfoHash::getRandom(), slow->getAddr());
+    for (const auto& n : {dubious, unmeasured, slow, fast, slow})
+        bucket.cacheNode(n, now);
+    CPPUNIT_ASSERT((bucket.cache == std::vector<dht::Sp<dht::Node>> {fast, slow, unmeasured, dubious}));
+
+    // Bounded, dropping the least likely to be good, and expired nodes
+    for (unsigned i = 0; i < 2 * dht::Bucket::REPLACEMENT_CACHE_SIZE; i++)
+        bucket.cacheNode(goodNode(now, 4100 + i), now);
+    CPPUNIT_ASSERT_EQUAL(dht::Bucket::REPLACEMENT_CACHE_SIZE, bucket.cache.size());
+    CPPUNIT_ASSERT(bucket.cache.front() == fast);
+    CPPUNIT_ASSERT(std::find(bucket.cache.begin(), bucket.cache.end(), dubious) == bucket.cache.end());
+    fast->setExpired();
+    bucket.cacheNode(goodNode(now, 4200), now);
+    CPPUNIT_ASSERT(bucket.cache.front() == slow);
+
+    // A full bucket away from our id caches new nodes
+    auto myid = dht::InfoHash::getRandom();
+    dht::RoutingTable table {dht::Bucket {AF_INET}};
+    for (unsigned i = 0; i < 256; i++)
+        table.onNewNode(goodNode(now, 5000 + i), 2, now, myid, engine);
+    auto full = std::find_if(table.begin(), table.end(), [&](const dht::Bucket& b) {
+        return b.nodes.size() == dht::TARGET_NODES and not table.contains(table.findBucket(b.first), myid);
+    });
+    CPPUNIT_ASSERT(full != table.end());
+    auto first = full->first;
+    auto candidate = goodNode(now, 6000, table.randomId(full));
+    CPPUNIT_ASSERT(table.onNewNode(candidate, 2, now, myid, engine));
+    full = table.findBucket(first);
+    CPPUNIT_ASSERT_EQUAL((size_t)dht::TARGET_NODES, full->nodes.size());
+    CPPUNIT_ASSERT(std::find(full->cache.begin(), full->cache.end(), candidate) != full->cache.end());
+
+    // Live nodes need no refresh, and candidates have no free slot
+    CPPUNIT_ASSERT_EQUAL(0u, full->refresh(engine, now, 4));
+
+    // The candidate replaces an expired node
+    full->nodes.back()->setExpired();
+    CPPUNIT_ASSERT(table.onNewNode(candidate, 2, now, myid, engine));
+    CPPUNIT_ASSERT(full->nodes.back() == candidate);
+    CPPUNIT_ASSERT(std::find(full->cache.begin(), full->cache.end(), candidate) == full->cache.end());
+}
+
+void
+RoutingTableTester::testNodeCache()
+{
+    auto now = clock::now();
+    dht::SockAddr addr;
+    addr.setFamily(AF_INET);
+    addr.setAddress("127.0.0.1");
+    addr.setPort(4222);
+
+    constexpr size_t MAX_NODES {1024};
+    dht::NodeCache cache {MAX_NODES};
+    auto id = dht::InfoHash::getRandom();
+    auto node = cache.getNode(id, addr, now, true);
+    CPPUNIT_ASSERT(cache.getNode(id, addr, now, true) == node);
+    CPPUNIT_ASSERT(cache.getNode(id, AF_INET) == node);
+    CPPUNIT_ASSERT(not cache.getNode(id, AF_INET6));
+
+    // Nodes not used anymore are forgotten
+    node.reset();
+    CPPUNIT_ASSERT(not cache.getNode(id, AF_INET));
+    std::vector<dht::Sp<dht::Node>> used;
+    for (unsigned i = 0; i < MAX_NODES / 2; i++) {
+        used.emplace_back(cache.getNode(dht::InfoHash::getRandom(), addr, now, true));
+        cache.getNode(dht::InfoHash::getRandom(), addr, now, true);
+    }
+    CPPUNIT_ASSERT_EQUAL(MAX_NODES, cache.size());
+    for (unsigned i = 0; i < 256; i++)
+        cache.compact();
+    CPPUNIT_ASSERT_EQUAL(used.size(), cache.size());
+
+    // The closest used nodes, sorted
+    for (unsigned i = 0; i < 16; i++) {
+        auto target = dht::InfoHash::getRandom();
+        auto closest = cache.getCachedNodes(target, AF_INET, dht::TARGET_NODES);
+        auto expected = used;
+        std::sort(expected.begin(), expected.end(), [&](const dht::Sp<dht::Node>& a, const dht::Sp<dht::Node>& b) {
+            return target.xorCmp(a->id, b->id) < 0;
+        });
+        expected.resize(dht::TARGET_NODES);
+        CPPUNIT_ASSERT(closest == expected);
+    }
+
+    // Full of used nodes: new nodes are refused
+    while (used.size() < MAX_NODES)
+        used.emplace_back(cache.getNode(dht::InfoHash::getRandom(), addr, now, true));
+    id = dht::InfoHash::getRandom();
+    CPPUNIT_ASSERT(not cache.getNode(id, addr, now, true));
+    CPPUNIT_ASSERT(not cache.getNode(id, AF_INET));
+    used.resize(MAX_NODES / 2);
+    node = cache.getNode(id, addr, now, true);
+    CPPUNIT_ASSERT(node);
+    CPPUNIT_ASSERT(cache.getNode(id, AF_INET) == node);
+    CPPUNIT_ASSERT(cache.size() <= MAX_NODES);
+
+    // A long running node meeting many peers stays within bounds
+    constexpr unsigned N {16 * MAX_NODES};
+    std::mt19937_64 rd {42};
+    for (unsigned i = 0; i < N; i++) {
+        uint64_t words[3] {rd(), rd(), rd()};
+        cache.getNode(dht::InfoHash((const uint8_t*)words, HASH_LEN), addr, now, true);
+        cache.compact();
+        CPPUNIT_ASSERT(cache.size() <= MAX_NODES);
+    }
+    for (const auto& n : used)
+        CPPUNIT_ASSERT(cache.getNode(n->id, AF_INET) == n);
+}
+
+void
+RoutingTableTester::testClosestNodes()
+{
+    dht::Logger logger {};
+    dht::Scheduler scheduler {};
+    dht::net::NetworkEngine engine(logger, scheduler, {});
+    auto now = scheduler.time();
+    auto myid = dht::InfoHash::getRandom();
+
+    dht::RoutingTable table {dht::Bucket {AF_INET}};
+    for (unsigned i = 0; i < 5000; i++)
+        table.onNewNode(goodNode(now, 1024 + i), 2, now, myid, engine);
+    CPPUNIT_ASSERT(table.size() > 8);
+
+    std::vector<dht::InfoHash> targets;
+    for (unsigned i = 0; i < 256; i++)
+        targets.emplace_back(dht::InfoHash::getRandom());
+    targets.emplace_back(myid);
+    for (const auto& t : targets) {
+        auto closest = table.findClosestNodes(t, now);
+        CPPUNIT_ASSERT_EQUAL((size_t)dht::TARGET_NODES, closest.size());
+        for (size_t i = 1; i < closest.size(); i++)
+            CPPUNIT_ASSERT(t.xorCmp(closest[i-1]->id, closest[i]->id) < 0);
+    }
+}
+
+void
+RoutingTableTester::tearDown() {
+
+}
+
+void
+RoutingTableBenchmark::testTable()
+{
+    dht::Logger logger {};
+    dht::Scheduler scheduler {};
+    dht::net::NetworkEngine engine(logger, scheduler, {});
+    auto now = scheduler.time();
+    auto myid = dht::InfoHash::getRandom();
+
+    constexpr unsigned NODES {50 * 1000};
+    std::vector<dht::Sp<dht::Node>> nodes;
+    nodes.reserve(NODES);
+    for (unsigned i = 0; i < NODES; i++)
+        nodes.emplace_back(goodNode(now, 1024 + i % 60000));
+
+    // Most nodes are discovered once the buckets around our id are full
+    dht::RoutingTable table {dht::Bucket {AF_INET}};
+    auto start = clock::now();
+    for (const auto& n : nodes)
+        table.onNewNode(n, 2, now, myid, engine);
+    auto insertTime = clock::now() - start;
+    size_t known {0};
+    for (const auto& b : table)
+        known += b.nodes.size();
+    CPPUNIT_ASSERT(table.size() > 8);
+
+    std::vector<dht::InfoHash> targets;
+    for (unsigned i = 0; i < 1024; i++)
+        targets.emplace_back(dht::InfoHash::getRandom());
+    targets.emplace_back(myid);
+
+    constexpr unsigned N {200 * 1000};
+    size_t found {0};
+    start = clock::now();
+    for (unsigned i = 0; i < N; i++)
+        found += table.findClosestNodes(targets[i % targets.size()], now).size();
+    auto findTime = clock::now() - start;
+    CPPUNIT_ASSERT_EQUAL((size_t)N * dht::TARGET_NODES, found);
+
+    // Results are sorted by distance to the target
+    for (const auto& t : targets) {
+        auto closest = table.findClosestNodes(t, now);
+        for (size_t i = 1; i < closest.size(); i++)
+            CPPUNIT_ASSERT(t.xorCmp(closest[i-1]->id, closest[i]->id) < 0);
+    }
+
+    std::cout << std::endl << "routing table: " << table.size() << " buckets, " << known << " nodes; "
+              << std::chrono::duration_cast<std::chrono::nanoseconds>(insertTime).count() / NODES << " ns/onNewNode, "
+              << std::chrono::duration_cast<std::chrono::nanoseconds>(findTime).count() / N << " ns/findClosestNodes" << std::endl;
+}
+
+void
+RoutingTableBenchmark::testPackedNodes()
+{
+    dht::Logger logger {};
+    dht::Scheduler scheduler {};
+    dht::net::NetworkEngine engine(logger, scheduler, {});
+    auto now = scheduler.time();
+    auto myid = dht::InfoHash::getRandom();
+
+    dht::RoutingTable table {dht::Bucket {AF_INET}};
+    for (unsigned i = 0; i < 256; i++)
+        table.onNewNode(goodNode(now, 6000 + i), 2, now, myid, engine);
+    std::vector<dht::InfoHash> targets {myid};
+    for (unsigned i = 0; i < 64; i++)
+        targets.emplace_back(dht::InfoHash::getRandom());
+
+    // Repeated lookups, packed each time or served from the cache
+    constexpr unsigned N {100 * 1000};
+    size_t bytes {0};
+    auto start = clock::now();
+    for (unsigned i = 0; i < N; i++)
+        bytes += packClosest(table, targets[i % targets.size()], now).size();
+    auto packTime = clock::now() - start;
+    start = clock::now();
+    for (unsigned i = 0; i < N; i++)
+        bytes -= table.findClosestNodesPacked(targets[i % targets.size()], now)->size();
+    auto cachedTime = clock::now() - start;
+    CPPUNIT_ASSERT_EQUAL((size_t)0, bytes);
+    std::cout << std::endl << "closest nodes: "
+              << std::chrono::duration_cast<std::chrono::nanoseconds>(packTime).count() / N << " ns packed, "
+              << std::chrono::duration_cast<std::chrono::nanoseconds>(cachedTime).count() / N << " ns cached" << std::endl;
+}
+
+void
+RoutingTableBenchmark::testNodeCache()
+{
+    auto now = clock::now();
+    dht::SockAddr addr;
+    addr.setFamily(AF_INET);
+    addr.setAddress("127.0.0.1");
+    addr.setPort(4222);
+
+    // Half full of used nodes, meeting many peers
+    constexpr size_t MAX_NODES {1024};
+    dht::NodeCache cache {MAX_NODES};
+    std::vector<dht::Sp<dht::Node>> used;
+    for (unsigned i = 0; i < MAX_NODES / 2; i++)
+        used.emplace_back(cache.getNode(dht::InfoHash::getRandom(), addr, now, true));
+
+    constexpr unsigned N {1000 * 1000};
+    std::mt19937_64 rd {42};
+    auto start = clock::now();
+    for (unsigned i = 0; i < N; i++) {
+        uint64_t words[3] {rd(), rd(), rd()};
+        cache.getNode(dht::InfoHash((const uint8_t*)words, HASH_LEN), addr, now, true);
+        cache.compact();
+    }
+    auto runTime = clock::now() - start;
+    CPPUNIT_ASSERT(cache.size() <= MAX_NODES);
+    std::cout << std::endl << "node cache: " << cache.size() << " nodes after " << N << " new nodes, "
+              << std::chrono::duration_cast<std::chrono::nanoseconds>(runTime).count() / N << " ns/getNode" << std::endl;
+}
+
+}  // namespace test
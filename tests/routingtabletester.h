@@ -0,0 +1,98 @@
+/*
+ *  Copyright (C) 2019 Savoir-faire Linux Inc.
+ *
+ *  Author: Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// cppunit
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+namespace test {
+
+class RoutingTableTester : public CppUnit::TestFixture {
+    CPPUNIT_TEST_SUITE(RoutingTableTester);
+    CPPUNIT_TEST(testPackedNodesCache);
+    CPPUNIT_TEST(testNodeRtt);
+    CPPUNIT_TEST(testReplacementCache);
+    CPPUNIT_TEST(testNodeCache);
+    CPPUNIT_TEST(testClosestNodes);
+    CPPUNIT_TEST_SUITE_END();
+
+ public:
+    /**
+     * Method automatically called before each test by CppUnit
+     */
+    void setUp();
+    /**
+     * Method automatically called after each test CppUnit
+     */
+    void tearDown();
+
+    /**
+     * Packed closest nodes are reused until a bucket they come from changes
+     * or they get too old, and match what findClosestNodes gives
+     */
+    void testPackedNodesCache();
+    /**
+     * Request timeouts follow the measured round-trip time of a node,
+     * back off on timeouts, and stay within bounds
+     */
+    void testNodeRtt();
+    /**
+     * Full buckets keep a bounded cache of replacement candidates,
+     * best first, from which expired nodes are replaced
+     */
+    void testReplacementCache();
+    /**
+     * The node cache gives a single node per id while it is used, finds
+     * the closest used nodes, and stays within its size through compaction
+     */
+    void testNodeCache();
+    /**
+     * findClosestNodes gives TARGET_NODES nodes sorted by distance to the
+     * target, from a table with many buckets
+     */
+    void testClosestNodes();
+};
+
+class RoutingTableBenchmark : public CppUnit::TestFixture {
+    CPPUNIT_TEST_SUITE(RoutingTableBenchmark);
+    CPPUNIT_TEST(testTable);
+    CPPUNIT_TEST(testPackedNodes);
+    CPPUNIT_TEST(testNodeCache);
+    CPPUNIT_TEST_SUITE_END();
+
+ public:
+    /**
+     * Time of onNewNode and findClosestNodes with a table as filled by
+     * a node of a large network
+     */
+    void testTable();
+    /**
+     * Time of closest nodes lookups packed each time, compared with the
+     * packed nodes cache
+     */
+    void testPackedNodes();
+    /**
+     * Time of getNode and compact for a node cache meeting many peers
+     */
+    void testNodeCache();
+};
+
+}  // namespace test
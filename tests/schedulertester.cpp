@@ -0,0 +1,260 @@
+/*
+ *  Copyright (C) 2019 Savoir-faire Linux Inc.
+ *
+ *  Author: Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "schedulertester.h"
+
+#include "opendht/scheduler.h"
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <vector>
+
+namespace test {
+CPPUNIT_TEST_SUITE_REGISTRATION(SchedulerTester);
+// Prints timings: run with "opendht_unit_tests simulation"
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(SchedulerBenchmark, "simulation");
+
+using namespace std::chrono_literals;
+using Backend = dht::Scheduler::Backend;
+
+static const Backend BACKENDS[] {Backend::Map, Backend::Wheel};
+
+void
+SchedulerTester::setUp() {
+
+}
+
+void
+SchedulerTester::testBasic()
+{
+    for (auto backend : BACKENDS) {
+        dht::Scheduler scheduler(backend);
+        CPPUNIT_ASSERT(scheduler.getBackend() == backend);
+        CPPUNIT_ASSERT(scheduler.getNextJobTime() == dht::time_point::max());
+
+        std::vector<int> done;
+        auto now = scheduler.syncTime();
+        scheduler.add(now - 1s, [&]{ done.emplace_back(0); });
+        scheduler.add(now, [&]{ done.emplace_back(1); });
+        auto later = now + 20ms;
+        scheduler.add(later, [&]{ done.emplace_back(2); });
+        scheduler.add(dht::time_point::max(), [&]{ done.emplace_back(3); });
+
+        auto next = scheduler.run();
+        CPPUNIT_ASSERT_EQUAL((size_t)2, done.size());
+        CPPUNIT_ASSERT(next <= later);
+        CPPUNIT_ASSERT(next > scheduler.time());
+
+        std::this_thread::sleep_until(later);
+        CPPUNIT_ASSERT(scheduler.run() == dht::time_point::max());
+        CPPUNIT_ASSERT_EQUAL((size_t)3, done.size());
+        CPPUNIT_ASSERT_EQUAL(2, done.back());
+    }
+}
+
+void
+SchedulerTester::testCancel()
+{
+    for (auto backend : BACKENDS) {
+        dht::Scheduler scheduler(backend);
+        unsigned runs {0};
+        auto now = scheduler.syncTime();
+
+        auto cancelled = scheduler.add(now, [&]{ runs += 100; });
+        cancelled->cancel();
+
+        // A job rescheduling itself once
+        dht::Sp<dht::Scheduler::Job> self;
+        self = scheduler.add(now, [&]{
+            if (++runs == 1)
+                scheduler.edit(self, scheduler.time());
+        });
+
+        // A job cancelling another one due at the same time
+        dht::Sp<dht::Scheduler::Job> victim;
+        scheduler.add(now, [&]{ victim->cancel(); });
+        victim = scheduler.add(now, [&]{ runs += 1000; });
+
+        // Edit moves a job to the past or to the future
+        auto moved = scheduler.add(now + 1h, [&]{ runs += 10; });
+        auto ref = moved;
+        scheduler.edit(moved, now);
+        CPPUNIT_ASSERT(moved == ref);
+        auto postponed = scheduler.add(now, [&]{ runs += 10000; });
+        scheduler.edit(postponed, now + 1h);
+
+        // Another reference to an edited job still cancels it
+        auto edited = scheduler.add(now + 1h, [&]{ runs += 100000; });
+        auto handle = edited;
+        scheduler.edit(edited, now);
+        handle->cancel();
+
+        scheduler.run();
+        CPPUNIT_ASSERT_EQUAL(12u, runs);
+        if (backend == Backend::Wheel) {
+            // True removal: nothing left but the postponed job
+            postponed->cancel();
+            CPPUNIT_ASSERT(scheduler.getNextJobTime() == dht::time_point::max());
+        }
+    }
+}
+
+void
+SchedulerTester::testCascade()
+{
+    dht::Scheduler scheduler(Backend::Wheel);
+    auto start = scheduler.syncTime();
+
+    // Jobs across the first three wheel levels, added in reverse order
+    std::vector<dht::time_point> times;
+    for (auto d : {5000ms, 4100ms, 300ms, 130ms, 64ms, 63ms, 10ms, 1ms, 0ms})
+        times.emplace_back(start + d);
+    std::vector<dht::time_point> ran;
+    for (const auto& t : times)
+        scheduler.add(t, [&, t]{
+            CPPUNIT_ASSERT(scheduler.time() >= t);
+            ran.emplace_back(t);
+        });
+
+    auto next = scheduler.run();
+    while (next != dht::time_point::max()) {
+        // Never later than the next due job
+        CPPUNIT_ASSERT(next <= times[times.size() - ran.size() - 1]);
+        std::this_thread::sleep_until(next);
+        next = scheduler.run();
+    }
+    CPPUNIT_ASSERT_EQUAL(times.size(), ran.size());
+    for (size_t i = 1; i < ran.size(); i++)
+        CPPUNIT_ASSERT(ran[i - 1] <= ran[i]);
+}
+
+namespace {
+
+/**
+ * One operation of a scheduler trace, as done by a busy node:
+ * search steps rescheduled for now, listen and announce refresh,
+ * storage maintenance and expiration, with some cancellations.
+ */
+struct TraceOp {
+    enum class Type { Add, Edit, Cancel, Run } type;
+    size_t job;
+    std::chrono::milliseconds delay;
+};
+
+std::vector<TraceOp>
+makeTrace(size_t jobs, size_t ops)
+{
+    std::mt19937_64 rd {42};
+    std::uniform_int_distribution<size_t> jobDist(0, jobs - 1);
+    std::uniform_int_distribution<unsigned> kind(0, 99);
+    std::uniform_int_distribution<long> refresh(10 * 1000, 10 * 60 * 1000);
+    std::uniform_int_distribution<long> maintenance(10 * 60 * 1000, 2 * 3600 * 1000);
+
+    std::vector<TraceOp> trace;
+    trace.reserve(jobs + ops);
+    for (size_t i = 0; i < jobs; i++)
+        trace.push_back({TraceOp::Type::Add, i, std::chrono::milliseconds(maintenance(rd))});
+    for (size_t i = 0; i < ops; i++) {
+        auto k = kind(rd);
+        if (k < 45)         // search step
+            trace.push_back({TraceOp::Type::Edit, jobDist(rd), 0ms});
+        else if (k < 75)    // listen/announce refresh
+            trace.push_back({TraceOp::Type::Edit, jobDist(rd), std::chrono::milliseconds(refresh(rd))});
+        else if (k < 85)    // storage maintenance
+            trace.push_back({TraceOp::Type::Edit, jobDist(rd), std::chrono::milliseconds(maintenance(rd))});
+        else if (k < 95)
+            trace.push_back({TraceOp::Type::Cancel, jobDist(rd), 0ms});
+        else
+            trace.push_back({TraceOp::Type::Run, 0, 0ms});
+    }
+    return trace;
+}
+
+/** @return the number of jobs which ran */
+size_t
+replay(Backend backend, const std::vector<TraceOp>& trace, size_t jobCount)
+{
+    dht::Scheduler scheduler(backend);
+    std::vector<dht::Sp<dht::Scheduler::Job>> jobs(jobCount);
+    size_t ran {0};
+    for (const auto& op : trace) {
+        auto& job = jobs[op.job];
+        switch (op.type) {
+        case TraceOp::Type::Add:
+            job = scheduler.add(scheduler.time() + op.delay, [&]{ ran++; });
+            break;
+        case TraceOp::Type::Edit:
+            scheduler.edit(job, scheduler.time() + op.delay);
+            break;
+        case TraceOp::Type::Cancel:
+            job->cancel();
+            break;
+        case TraceOp::Type::Run:
+            scheduler.run();
+            break;
+        }
+    }
+    scheduler.run();
+    return ran;
+}
+
+}
+
+void
+SchedulerTester::testTrace()
+{
+    constexpr size_t JOBS {5 * 1000};
+    constexpr size_t OPS {100 * 1000};
+    auto trace = makeTrace(JOBS, OPS);
+
+    // Both backends run the same jobs
+    auto ran = replay(Backend::Map, trace, JOBS);
+    CPPUNIT_ASSERT(ran > 0);
+    CPPUNIT_ASSERT_EQUAL(ran, replay(Backend::Wheel, trace, JOBS));
+}
+
+void
+SchedulerTester::tearDown() {
+
+}
+
+void
+SchedulerBenchmark::testTraceReplay()
+{
+    constexpr size_t JOBS {50 * 1000};
+    constexpr size_t OPS {1000 * 1000};
+    auto trace = makeTrace(JOBS, OPS);
+
+    std::vector<size_t> runs;
+    for (auto backend : BACKENDS) {
+        auto start = std::chrono::steady_clock::now();
+        runs.emplace_back(replay(backend, trace, JOBS));
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << std::endl << (backend == Backend::Map ? "map" : "wheel") << " scheduler: "
+                  << trace.size() << " operations in "
+                  << std::chrono::duration<double, std::milli>(elapsed).count() << " ms" << std::endl;
+    }
+    // Both backends ran the same jobs
+    CPPUNIT_ASSERT_EQUAL(runs.front(), runs.back());
+    CPPUNIT_ASSERT(runs.front() > 0);
+}
+
+}  // namespace test
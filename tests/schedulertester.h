@@ -0,0 +1,76 @@
+/*
+ *  Copyright (C) 2019 Savoir-faire Linux Inc.
+ *
+ *  Author: Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// cppunit
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+namespace test {
+
+class SchedulerTester : public CppUnit::TestFixture {
+    CPPUNIT_TEST_SUITE(SchedulerTester);
+    CPPUNIT_TEST(testBasic);
+    CPPUNIT_TEST(testCancel);
+    CPPUNIT_TEST(testCascade);
+    CPPUNIT_TEST(testTrace);
+    CPPUNIT_TEST_SUITE_END();
+
+ public:
+    /**
+     * Method automatically called before each test by CppUnit
+     */
+    void setUp();
+    /**
+     * Method automatically called after each test CppUnit
+     */
+    void tearDown();
+
+    /**
+     * Due jobs run, future jobs wait, with both backends
+     */
+    void testBasic();
+    /**
+     * Cancel and edit, including from running jobs
+     */
+    void testCancel();
+    /**
+     * Timing wheel jobs spanning several levels run in tick order
+     */
+    void testCascade();
+    /**
+     * Both backends run the same jobs of a trace
+     */
+    void testTrace();
+};
+
+class SchedulerBenchmark : public CppUnit::TestFixture {
+    CPPUNIT_TEST_SUITE(SchedulerBenchmark);
+    CPPUNIT_TEST(testTraceReplay);
+    CPPUNIT_TEST_SUITE_END();
+
+ public:
+    /**
+     * Replay of a job trace against both backends
+     */
+    void testTraceReplay();
+};
+
+}  // namespace test
@@ -21,8 +21,12 @@
 #include <cppunit/CompilerOutputter.h>
 #include <iostream>
 
-int main(int /*argc*/, char** /*argv*/) {
-    CppUnit::TestFactoryRegistry &registry = CppUnit::TestFactoryRegistry::getRegistry();
+int main(int argc, char** argv) {
+    // Suites registered under a name, such as "simulation", only run when
+    // that name is given
+    CppUnit::TestFactoryRegistry &registry = argc > 1
+        ? CppUnit::TestFactoryRegistry::getRegistry(argv[1])
+        : CppUnit::TestFactoryRegistry::getRegistry();
     CppUnit::Test *suite = registry.makeTest();
     if (suite->countTestCases() == 0) {
         std::cout << "No test cases specified for suite" << std::endl;
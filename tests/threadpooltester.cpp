@@ -18,12 +18,22 @@
  */
 
 #include "threadpooltester.h"
+#include "allocationcounter.h"
 
 #include "opendht/thread_pool.h"
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <mutex>
+#include <string>
+#include <iostream>
+#include <thread>
+#include <vector>
 
 namespace test {
 CPPUNIT_TEST_SUITE_REGISTRATION(ThreadPoolTester);
+// Prints timings: run with "opendht_unit_tests simulation"
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(ThreadPoolBenchmark, "simulation");
 using clock = std::chrono::steady_clock;
 
 void
@@ -81,10 +91,296 @@ ThreadPoolTester::testExecutor()
     CPPUNIT_ASSERT_EQUAL(N, count1.load());
     CPPUNIT_ASSERT_EQUAL(N, count4.load());
     CPPUNIT_ASSERT_EQUAL(N, count8.load());
+
+    // A task handed to the pool still runs if its executor is gone
+    std::atomic_bool ran {false};
+    dht::ThreadPool single(1);
+    std::mutex block;
+    std::unique_lock<std::mutex> blocked(block);
+    single.run([&] { std::lock_guard<std::mutex> l(block); });
+    auto executor = std::make_shared<dht::Executor>(single, 1);
+    executor->run([&] { ran = true; });
+    executor.reset();
+    blocked.unlock();
+    start = clock::now();
+    while (not ran.load() && clock::now() - start < std::chrono::seconds(5))
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    CPPUNIT_ASSERT(ran.load());
+}
+
+void
+ThreadPoolTester::testExecutorAllocations()
+{
+    dht::ThreadPool pool(1);
+    auto executor = std::make_shared<dht::Executor>(pool, 1);
+
+    // The first task holds the others in the executor queue, so that
+    // both rounds reach the same queue size
+    constexpr unsigned N = 1024;
+    std::atomic_bool hold {true}, holding {false};
+    std::atomic_uint count {0};
+    auto round = [&] {
+        count = 0;
+        hold = true;
+        holding = false;
+        executor->run([&] {
+            holding = true;
+            while (hold)
+                std::this_thread::yield();
+        });
+        while (not holding)
+            std::this_thread::yield();
+        for (unsigned i=0; i<N; i++)
+            executor->run([&] { count++; });
+        hold = false;
+        auto start = clock::now();
+        while (count.load() != N && clock::now() - start < std::chrono::seconds(10))
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    };
+
+    round();
+    CPPUNIT_ASSERT_EQUAL(N, count.load());
+
+    AllocationCounter::start();
+    round();
+    auto allocs = AllocationCounter::stop();
+    CPPUNIT_ASSERT_EQUAL(N, count.load());
+    CPPUNIT_ASSERT_EQUAL((size_t)0, allocs);
+    pool.join();
+}
+
+void
+ThreadPoolTester::testTask()
+{
+    // Move-only captures
+    std::unique_ptr<int> value(new int(42));
+    int result {0};
+    dht::Task task([&result, v = std::move(value)] { result = *v; });
+    CPPUNIT_ASSERT(task);
+    dht::Task moved(std::move(task));
+    CPPUNIT_ASSERT(not task);
+    moved();
+    CPPUNIT_ASSERT_EQUAL(42, result);
+
+    // Small captures are stored inline, large ones on the heap
+    CPPUNIT_ASSERT(sizeof(dht::Task) <= 64);
+    std::shared_ptr<int> sp;
+    auto small = [sp, &result] { result++; };
+    CPPUNIT_ASSERT(dht::Task::fitsInline<decltype(small)>());
+    std::array<char, 128> big_buf {};
+    auto big = [big_buf, &result] { result += big_buf[0] + 1; };
+    CPPUNIT_ASSERT(not dht::Task::fitsInline<decltype(big)>());
+    dht::Task t1(small), t2(big);
+    std::swap(t1, t2);
+    t1();
+    t2();
+    CPPUNIT_ASSERT_EQUAL(44, result);
+
+    // Empty std::function gives an empty task
+    CPPUNIT_ASSERT(not dht::Task(std::function<void()>{}));
+}
+
+void
+ThreadPoolTester::testSubmit()
+{
+    dht::ThreadPool pool(4, dht::ThreadPool::Mode::WorkStealing);
+    auto f1 = pool.submit([]{ return 42; });
+    auto f2 = pool.submit([]{ return std::string("value"); });
+    auto f3 = pool.submit([]() -> int { throw std::runtime_error("error"); });
+    std::atomic_bool done {false};
+    auto f4 = pool.submit([&]{ done = true; });
+    CPPUNIT_ASSERT_EQUAL(42, f1.get());
+    CPPUNIT_ASSERT(not f1.valid());
+    CPPUNIT_ASSERT_EQUAL(std::string("value"), f2.get());
+    CPPUNIT_ASSERT_THROW(f3.get(), std::runtime_error);
+    f4.get();
+    CPPUNIT_ASSERT(done);
+
+    // std::future API
+    auto f5 = pool.get<int>([]{ return 7; });
+    CPPUNIT_ASSERT_EQUAL(7, f5.get());
+
+    // Many pending results, with both paths
+    constexpr unsigned N = 1024;
+    std::vector<dht::TaskFuture<unsigned>> futures;
+    std::vector<std::future<unsigned>> std_futures;
+    for (unsigned i=0; i<N; i++) {
+        futures.emplace_back(pool.submit([i]{ return i; }));
+        std_futures.emplace_back(pool.get<unsigned>([i]{ return i; }));
+    }
+    for (unsigned i=0; i<N; i++) {
+        CPPUNIT_ASSERT_EQUAL(i, futures[i].get());
+        CPPUNIT_ASSERT_EQUAL(i, std_futures[i].get());
+    }
+
+    // Tasks dropped by a stopped pool don't leave the future hanging
+    pool.join();
+    auto dropped = pool.submit([]{ return 0; });
+    CPPUNIT_ASSERT_THROW(dropped.get(), std::future_error);
+}
+
+void
+ThreadPoolTester::testWorkStealing()
+{
+    dht::ThreadPool pool(4, dht::ThreadPool::Mode::WorkStealing, true);
+    CPPUNIT_ASSERT(pool.getMode() == dht::ThreadPool::Mode::WorkStealing);
+
+    // Tasks queued from workers, stolen by the others
+    constexpr unsigned N = 256;
+    std::atomic_uint count {0};
+    for (unsigned i=0; i<N; i++)
+        pool.run([&] {
+            for (unsigned j=0; j<N; j++)
+                pool.run([&] { count++; });
+        });
+
+    // Batch submission
+    std::vector<dht::Task> batch;
+    for (unsigned i=0; i<N; i++)
+        batch.emplace_back([&] { count++; });
+    pool.run(std::move(batch));
+
+    auto start = clock::now();
+    while (count.load() != N * N + N && clock::now() - start < std::chrono::seconds(10))
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    pool.join();
+    CPPUNIT_ASSERT_EQUAL(N * N + N, count.load());
+
+    // Stopped pool doesn't accept tasks
+    pool.run([&] { count++; });
+    CPPUNIT_ASSERT_EQUAL(N * N + N, count.load());
+}
+
+namespace {
+
+const char*
+modeName(dht::ThreadPool::Mode mode)
+{
+    return mode == dht::ThreadPool::Mode::Shared ? "shared queue" : "work stealing";
+}
+
+/** Stand-in for a signature check: a few microseconds of computation */
+uint64_t
+burn(uint64_t seed)
+{
+    for (unsigned i=0; i<2000; i++)
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+    return seed;
+}
+
 }
 
 void
 ThreadPoolTester::tearDown() {
 }
 
+void
+ThreadPoolBenchmark::testThroughput()
+{
+    const unsigned threads = std::max(std::thread::hardware_concurrency(), 2u);
+    for (auto mode : {dht::ThreadPool::Mode::Shared, dht::ThreadPool::Mode::WorkStealing}) {
+        dht::ThreadPool pool(threads, mode);
+
+        // Tiny tasks from several producers
+        constexpr unsigned PRODUCERS = 4;
+        constexpr unsigned N = 64 * 1024;
+        std::atomic_uint count {0};
+        auto start = clock::now();
+        std::vector<std::thread> producers;
+        for (unsigned p=0; p<PRODUCERS; p++)
+            producers.emplace_back([&] {
+                for (unsigned i=0; i<N; i++)
+                    pool.run([&] { count++; });
+            });
+        for (auto& p : producers)
+            p.join();
+        while (count.load() != N * PRODUCERS && clock::now() - start < std::chrono::seconds(20))
+            std::this_thread::yield();
+        auto tiny = std::chrono::duration<double>(clock::now() - start).count();
+        CPPUNIT_ASSERT_EQUAL(N * PRODUCERS, count.load());
+
+        // Burst of CPU-bound tasks, like verifying the values of a get
+        constexpr unsigned BURST = 4096;
+        std::atomic_uint done {0};
+        std::atomic<uint64_t> sink {0};
+        start = clock::now();
+        std::vector<dht::Task> burst;
+        burst.reserve(BURST);
+        for (unsigned i=0; i<BURST; i++)
+            burst.emplace_back([&, i] {
+                sink += burn(i);
+                done++;
+            });
+        pool.run(std::move(burst));
+        while (done.load() != BURST && clock::now() - start < std::chrono::seconds(20))
+            std::this_thread::yield();
+        auto cpu = std::chrono::duration<double>(clock::now() - start).count();
+        CPPUNIT_ASSERT_EQUAL(BURST, done.load());
+        pool.join();
+
+        std::cout << std::endl << modeName(mode) << ", " << threads << " threads: "
+                  << (uint64_t)(N * PRODUCERS / tiny) << " tiny tasks/s, "
+                  << (uint64_t)(BURST / cpu) << " cpu tasks/s" << std::endl;
+    }
+}
+
+void
+ThreadPoolBenchmark::testLatency()
+{
+    constexpr unsigned N = 2000;
+    for (auto mode : {dht::ThreadPool::Mode::Shared, dht::ThreadPool::Mode::WorkStealing}) {
+        dht::ThreadPool pool(4, mode);
+        std::vector<double> latencies;
+        latencies.reserve(N);
+        for (unsigned i=0; i<N; i++) {
+            std::mutex lock;
+            std::condition_variable cv;
+            bool ran {false};
+            clock::time_point started;
+            auto submitted = clock::now();
+            pool.run([&] {
+                std::lock_guard<std::mutex> l(lock);
+                started = clock::now();
+                ran = true;
+                cv.notify_one();
+            });
+            std::unique_lock<std::mutex> l(lock);
+            CPPUNIT_ASSERT(cv.wait_for(l, std::chrono::seconds(5), [&]{ return ran; }));
+            latencies.emplace_back(std::chrono::duration<double, std::micro>(started - submitted).count());
+        }
+        pool.join();
+        std::sort(latencies.begin(), latencies.end());
+        std::cout << std::endl << modeName(mode) << " latency: "
+                  << "p50 " << latencies[N / 2] << " us, "
+                  << "p99 " << latencies[N * 99 / 100] << " us" << std::endl;
+    }
+}
+
+void
+ThreadPoolBenchmark::testSubmit()
+{
+    dht::ThreadPool pool(4, dht::ThreadPool::Mode::WorkStealing);
+
+    constexpr unsigned N = 64 * 1024;
+    std::vector<dht::TaskFuture<unsigned>> futures;
+    futures.reserve(N);
+    auto start = clock::now();
+    for (unsigned i=0; i<N; i++)
+        futures.emplace_back(pool.submit([i]{ return i; }));
+    for (unsigned i=0; i<N; i++)
+        CPPUNIT_ASSERT_EQUAL(i, futures[i].get());
+    auto pooled = std::chrono::duration<double>(clock::now() - start).count();
+
+    std::vector<std::future<unsigned>> std_futures;
+    std_futures.reserve(N);
+    start = clock::now();
+    for (unsigned i=0; i<N; i++)
+        std_futures.emplace_back(pool.get<unsigned>([i]{ return i; }));
+    for (unsigned i=0; i<N; i++)
+        CPPUNIT_ASSERT_EQUAL(i, std_futures[i].get());
+    auto promise = std::chrono::duration<double>(clock::now() - start).count();
+    std::cout << std::endl << "submit: " << (uint64_t)(N / pooled) << " tasks/s, "
+              << "get: " << (uint64_t)(N / promise) << " tasks/s" << std::endl;
+}
+
 }  // namespace test
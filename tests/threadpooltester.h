@@ -29,6 +29,10 @@ class ThreadPoolTester : public CppUnit::TestFixture {
     CPPUNIT_TEST_SUITE(ThreadPoolTester);
     CPPUNIT_TEST(testThreadPool);
     CPPUNIT_TEST(testExecutor);
+    CPPUNIT_TEST(testExecutorAllocations);
+    CPPUNIT_TEST(testTask);
+    CPPUNIT_TEST(testSubmit);
+    CPPUNIT_TEST(testWorkStealing);
     CPPUNIT_TEST_SUITE_END();
 
  public:
@@ -43,6 +47,47 @@ class ThreadPoolTester : public CppUnit::TestFixture {
 
     void testThreadPool();
     void testExecutor();
+    /**
+     * Tasks small enough to be stored inline are scheduled and run without
+     * heap allocation, once the queues reached their size
+     */
+    void testExecutorAllocations();
+    /**
+     * Move-only task storage
+     */
+    void testTask();
+    /**
+     * Results and exceptions through pooled shared states and std::future
+     */
+    void testSubmit();
+    /**
+     * Nested and batched tasks in a work-stealing pool
+     */
+    void testWorkStealing();
+};
+
+class ThreadPoolBenchmark : public CppUnit::TestFixture {
+    CPPUNIT_TEST_SUITE(ThreadPoolBenchmark);
+    CPPUNIT_TEST(testThroughput);
+    CPPUNIT_TEST(testLatency);
+    CPPUNIT_TEST(testSubmit);
+    CPPUNIT_TEST_SUITE_END();
+
+ public:
+    /**
+     * Tiny tasks from several producers, and a burst of CPU-bound tasks,
+     * with both pool modes
+     */
+    void testThroughput();
+    /**
+     * Delay between submission and execution with an idle pool
+     */
+    void testLatency();
+    /**
+     * Throughput of submit with pooled shared states, compared with get
+     * and std::future
+     */
+    void testSubmit();
 };
 
 }  // namespace test
@@ -0,0 +1,217 @@
+/*
+ *  Copyright (C) 2019 Savoir-faire Linux Inc.
+ *
+ *  Author: Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "tidmaptester.h"
+
+#include "opendht/tid_map.h"
+#include "opendht/pool_allocator.h"
+
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace test {
+CPPUNIT_TEST_SUITE_REGISTRATION(TidMapTester);
+// Prints timings: run with "opendht_unit_tests simulation"
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TidMapBenchmark, "simulation");
+using clock = std::chrono::steady_clock;
+
+void
+TidMapTester::setUp() {
+
+}
+
+void
+TidMapTester::testBasic()
+{
+    dht::TidMap<std::string> map;
+    CPPUNIT_ASSERT(map.empty());
+    CPPUNIT_ASSERT_EQUAL((size_t)0, map.capacity());
+    CPPUNIT_ASSERT(map.find(0) == map.end());
+    CPPUNIT_ASSERT(map.begin() == map.end());
+
+    // Sequential ids, as given by a node
+    constexpr dht::Tid N = 1000;
+    for (dht::Tid i = 1; i <= N; i++)
+        CPPUNIT_ASSERT(map.emplace(i, std::to_string(i)).second);
+    CPPUNIT_ASSERT_EQUAL((size_t)N, map.size());
+    CPPUNIT_ASSERT(map.capacity() >= 2 * N);
+
+    // Existing keys are not replaced
+    auto e = map.emplace(42, std::string("other"));
+    CPPUNIT_ASSERT(not e.second);
+    CPPUNIT_ASSERT_EQUAL(std::string("42"), e.first->second);
+
+    for (dht::Tid i = 1; i <= N; i++) {
+        auto it = map.find(i);
+        CPPUNIT_ASSERT(it != map.end());
+        CPPUNIT_ASSERT_EQUAL(i, it->first);
+        CPPUNIT_ASSERT_EQUAL(std::to_string(i), it->second);
+    }
+    CPPUNIT_ASSERT(map.find(0) == map.end());
+    CPPUNIT_ASSERT(map.find(N + 1) == map.end());
+
+    size_t n = 0;
+    uint64_t sum = 0;
+    for (const auto& kv : map) {
+        n++;
+        sum += kv.first;
+    }
+    CPPUNIT_ASSERT_EQUAL((size_t)N, n);
+    CPPUNIT_ASSERT_EQUAL((uint64_t)N * (N + 1) / 2, sum);
+
+    map[7] = "seven";
+    CPPUNIT_ASSERT_EQUAL(std::string("seven"), map.find(7)->second);
+    map[N + 1] = "new";
+    CPPUNIT_ASSERT_EQUAL((size_t)N + 1, map.size());
+
+    auto moved = std::move(map);
+    CPPUNIT_ASSERT(map.empty());
+    CPPUNIT_ASSERT(map.find(7) == map.end());
+    CPPUNIT_ASSERT_EQUAL((size_t)N + 1, moved.size());
+    auto cap = moved.capacity();
+    moved.clear();
+    CPPUNIT_ASSERT(moved.empty());
+    CPPUNIT_ASSERT_EQUAL(cap, moved.capacity());
+    CPPUNIT_ASSERT(moved.find(7) == moved.end());
+}
+
+void
+TidMapTester::testErase()
+{
+    dht::TidMap<std::unique_ptr<dht::Tid>> map;
+    std::map<dht::Tid, dht::Tid> ref;
+    std::mt19937 rd(42);
+    // Small key range: many collisions and probe chains to shift back
+    std::uniform_int_distribution<dht::Tid> keys(0, 512);
+    for (unsigned i = 0; i < 100000; i++) {
+        auto k = keys(rd);
+        if (rd() % 2) {
+            auto r = ref.emplace(k, k);
+            auto e = map.emplace(k, std::unique_ptr<dht::Tid>(new dht::Tid(k)));
+            CPPUNIT_ASSERT_EQUAL(r.second, e.second);
+        } else {
+            CPPUNIT_ASSERT_EQUAL(ref.erase(k), map.erase(k));
+        }
+        CPPUNIT_ASSERT_EQUAL(ref.size(), map.size());
+    }
+    for (const auto& r : ref) {
+        auto it = map.find(r.first);
+        CPPUNIT_ASSERT(it != map.end());
+        CPPUNIT_ASSERT_EQUAL(r.second, *it->second);
+    }
+    for (dht::Tid k = 0; k <= 512; k++)
+        CPPUNIT_ASSERT_EQUAL(ref.count(k), map.count(k));
+
+    while (map.begin() != map.end())
+        map.erase(map.begin());
+    CPPUNIT_ASSERT(map.empty());
+}
+
+namespace {
+
+/** Stand-in for net::Request: callbacks and a serialized message */
+struct FakeRequest {
+    FakeRequest(dht::Tid tid) : tid(tid), msg(64) {}
+    dht::Tid tid;
+    std::function<void()> on_done {};
+    std::vector<uint8_t> msg;
+};
+
+/**
+ * Keep `outstanding` requests in flight, and answer them in random order:
+ * each reply is matched, the request released and a new one sent.
+ */
+template <typename Map, typename Make>
+double
+replyStorm(Make&& make, size_t outstanding, size_t replies)
+{
+    Map map;
+    std::vector<dht::Tid> inflight;
+    inflight.reserve(outstanding);
+    std::mt19937 rd(1234);
+    dht::Tid next = rd();
+    for (size_t i = 0; i < outstanding; i++) {
+        auto tid = ++next;
+        map.emplace(tid, make(tid));
+        inflight.emplace_back(tid);
+    }
+    size_t matched = 0;
+    auto start = clock::now();
+    for (size_t i = 0; i < replies; i++) {
+        auto slot = rd() % outstanding;
+        auto it = map.find(inflight[slot]);
+        if (it != map.end() and it->second->tid == inflight[slot]) {
+            matched++;
+            map.erase(it);
+        }
+        auto tid = ++next;
+        map.emplace(tid, make(tid));
+        inflight[slot] = tid;
+    }
+    auto elapsed = std::chrono::duration<double>(clock::now() - start).count();
+    CPPUNIT_ASSERT_EQUAL(replies, matched);
+    CPPUNIT_ASSERT_EQUAL(outstanding, map.size());
+    return replies / elapsed;
+}
+
+}
+
+void
+TidMapTester::testReplies()
+{
+    using Sp = std::shared_ptr<FakeRequest>;
+    auto pool = std::make_shared<dht::BlockPool>();
+    replyStorm<dht::TidMap<Sp>>([&](dht::Tid tid) {
+        return std::allocate_shared<FakeRequest>(dht::PoolAllocator<FakeRequest>(pool), tid);
+    }, 4096, 100 * 1000);
+    CPPUNIT_ASSERT(pool->freeCount() > 0);
+}
+
+void
+TidMapTester::tearDown() {
+
+}
+
+void
+TidMapBenchmark::testReplyStorm()
+{
+    using Sp = std::shared_ptr<FakeRequest>;
+    constexpr size_t REPLIES = 1000 * 1000;
+    auto pool = std::make_shared<dht::BlockPool>();
+    for (size_t outstanding : {64, 4096, 65536}) {
+        auto map_rate = replyStorm<std::map<dht::Tid, Sp>>([](dht::Tid tid) {
+            return std::make_shared<FakeRequest>(tid);
+        }, outstanding, REPLIES);
+        auto tidmap_rate = replyStorm<dht::TidMap<Sp>>([&](dht::Tid tid) {
+            return std::allocate_shared<FakeRequest>(dht::PoolAllocator<FakeRequest>(pool), tid);
+        }, outstanding, REPLIES);
+        std::cout << std::endl << outstanding << " outstanding requests: "
+                  << "std::map " << (uint64_t)map_rate << " replies/s, "
+                  << "pooled TidMap " << (uint64_t)tidmap_rate << " replies/s" << std::endl;
+    }
+    CPPUNIT_ASSERT(pool->freeCount() > 0);
+}
+
+}  // namespace test
@@ -0,0 +1,73 @@
+/*
+ *  Copyright (C) 2019 Savoir-faire Linux Inc.
+ *
+ *  Author: Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// cppunit
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+namespace test {
+
+class TidMapTester : public CppUnit::TestFixture {
+    CPPUNIT_TEST_SUITE(TidMapTester);
+    CPPUNIT_TEST(testBasic);
+    CPPUNIT_TEST(testErase);
+    CPPUNIT_TEST(testReplies);
+    CPPUNIT_TEST_SUITE_END();
+
+ public:
+    /**
+     * Method automatically called before each test by CppUnit
+     */
+    void setUp();
+    /**
+     * Method automatically called after each test CppUnit
+     */
+    void tearDown();
+
+    /**
+     * Insertion, lookup, growth, iteration and move
+     */
+    void testBasic();
+    /**
+     * Random insertions and deletions checked against std::map
+     */
+    void testErase();
+    /**
+     * Outstanding pooled requests matched by replies in random order, and
+     * released to the pool
+     */
+    void testReplies();
+};
+
+class TidMapBenchmark : public CppUnit::TestFixture {
+    CPPUNIT_TEST_SUITE(TidMapBenchmark);
+    CPPUNIT_TEST(testReplyStorm);
+    CPPUNIT_TEST_SUITE_END();
+
+ public:
+    /**
+     * Outstanding requests answered by a burst of replies: pooled requests
+     * in a TidMap, compared with std::make_shared and std::map
+     */
+    void testReplyStorm();
+};
+
+}  // namespace test
@@ -24,6 +24,7 @@
 
 // opendht
 #include "opendht/value.h"
+#include "opendht/crypto.h"
 
 namespace test {
 CPPUNIT_TEST_SUITE_REGISTRATION(ValueTester);
@@ -76,6 +77,40 @@ ValueTester::testFilter()
     CPPUNIT_ASSERT(isBoth(value3));
 }
 
+void
+ValueTester::testCompression()
+{
+    auto key = dht::crypto::PrivateKey::generate();
+    auto pk = key.getPublicKey();
+
+    std::string text;
+    for (unsigned i = 0; i < 256; i++)
+        text += "{\"cats\":" + std::to_string(i % 4) + "}";
+    dht::Value value {(const uint8_t*)text.data(), text.size()};
+    auto encrypted = value.encrypt(key, pk);
+    CPPUNIT_ASSERT(encrypted.isEncrypted());
+
+    auto decrypted = key.decrypt(encrypted.cypher);
+#ifdef OPENDHT_COMPRESSION
+    CPPUNIT_ASSERT(decrypted.size() < text.size());
+#endif
+    auto msg = msgpack::unpack((const char*)decrypted.data(), decrypted.size());
+    dht::Value received {encrypted.id};
+    received.msgpack_unpack_body(msg.get());
+    CPPUNIT_ASSERT(received.data == value.data);
+    CPPUNIT_ASSERT(received.recipient == pk.getId());
+    CPPUNIT_ASSERT(received.checkSignature());
+    CPPUNIT_ASSERT(received.signature == value.signature);
+
+    // The encrypted value is left signed, its data packed as is
+    CPPUNIT_ASSERT(value.checkSignature());
+    auto packed = value.getPacked();
+    dht::Value copy;
+    copy.msgpack_unpack(msgpack::unpack((const char*)packed.data(), packed.size()).get());
+    CPPUNIT_ASSERT(copy.data == value.data);
+    CPPUNIT_ASSERT(copy.checkSignature());
+}
+
 void
 ValueTester::tearDown() {
 
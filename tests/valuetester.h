@@ -29,6 +29,7 @@ class ValueTester : public CppUnit::TestFixture {
     CPPUNIT_TEST_SUITE(ValueTester);
     CPPUNIT_TEST(testConstructors);
     CPPUNIT_TEST(testFilter);
+    CPPUNIT_TEST(testCompression);
     CPPUNIT_TEST_SUITE_END();
 
  public:
@@ -48,6 +49,11 @@ class ValueTester : public CppUnit::TestFixture {
      * Test compare operators
      */
     void testFilter();
+    /**
+     * Test that encrypted values survive compression and keep a valid
+     * signature, without changing the value encrypted
+     */
+    void testCompression();
 };
 
 }  // namespace test
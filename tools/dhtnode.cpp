@@ -157,6 +157,8 @@ void cmd_loop(std::shared_ptr<DhtRunner>& node, dht_params& params
             std::cout << node->getNodesStats(AF_INET).toString() << std::endl;
             std::cout << "IPv6 stats:" << std::endl;
             std::cout << node->getNodesStats(AF_INET6).toString() << std::endl;
+            std::cout << "Traffic:" << std::endl;
+            std::cout << node->getTrafficStats().toString() << std::endl;
 #ifdef OPENDHT_PROXY_SERVER
             for (const auto& proxy : proxies) {
                 std::cout << "Stats for proxy on port " << proxy.first << std::endl;